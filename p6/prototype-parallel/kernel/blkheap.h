@@ -0,0 +1,123 @@
+/**
+ * Indexed binary min-heap of flash blocks keyed by erase count, used by the
+ * block allocator. Plain C with no kernel dependency so that the user-space
+ * microbenchmark (user/testbench_alloc.c) runs the very same code. Callers
+ * do the locking and provide the memory.
+ */
+
+#ifndef LKP_KV_BLKHEAP_H
+#define LKP_KV_BLKHEAP_H
+
+struct blk_heap_ent {
+	int key;		/* erase count of the block */
+	int blk;
+};
+
+struct blk_heap {
+	struct blk_heap_ent *ent;	/* ent[0] has the smallest key */
+	int *pos;		/* pos[blk - base]: index of blk in ent[], -1 if
+				 * absent */
+	int base;		/* first block of the heap */
+	int nb;
+};
+
+/* blk_heap_init( h, ent, pos, base, nb_blocks)
+ * Empty heap for blocks base..base+nb_blocks-1, ent and pos hold nb_blocks
+ * entries
+ */
+static inline void blk_heap_init(struct blk_heap *h, struct blk_heap_ent *ent,
+				 int *pos, int base, int nb_blocks)
+{
+	int i;
+
+	h->ent = ent;
+	h->pos = pos;
+	h->base = base;
+	h->nb = 0;
+	for (i = 0; i < nb_blocks; i++)
+		pos[i] = -1;
+}
+
+static inline void blk_heap_set(struct blk_heap *h, int i, struct blk_heap_ent e)
+{
+	h->ent[i] = e;
+	h->pos[e.blk - h->base] = i;
+}
+
+static inline void blk_heap_up(struct blk_heap *h, int i)
+{
+	struct blk_heap_ent e = h->ent[i];
+
+	while (i > 0 && h->ent[(i - 1) / 2].key > e.key) {
+		blk_heap_set(h, i, h->ent[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	blk_heap_set(h, i, e);
+}
+
+static inline void blk_heap_down(struct blk_heap *h, int i)
+{
+	struct blk_heap_ent e = h->ent[i];
+	int c;
+
+	while ((c = 2 * i + 1) < h->nb) {
+		if (c + 1 < h->nb && h->ent[c + 1].key < h->ent[c].key)
+			c++;
+		if (h->ent[c].key >= e.key)
+			break;
+		blk_heap_set(h, i, h->ent[c]);
+		i = c;
+	}
+	blk_heap_set(h, i, e);
+}
+
+static inline int blk_heap_has(const struct blk_heap *h, int blk)
+{
+	return h->pos[blk - h->base] >= 0;
+}
+
+/* blk_heap_top( h)
+ * Block with the smallest key, -1 if the heap is empty
+ */
+static inline int blk_heap_top(const struct blk_heap *h)
+{
+	return h->nb ? h->ent[0].blk : -1;
+}
+
+/* blk_heap_update( h, blk, key)
+ * Insert blk, or move it to its place after its key changed
+ */
+static inline void blk_heap_update(struct blk_heap *h, int blk, int key)
+{
+	int i = h->pos[blk - h->base];
+
+	if (i < 0) {
+		i = h->nb++;
+		h->ent[i].blk = blk;
+	}
+	h->ent[i].key = key;
+	h->pos[blk - h->base] = i;
+	blk_heap_up(h, i);
+	blk_heap_down(h, h->pos[blk - h->base]);
+}
+
+/* blk_heap_remove( h, blk)
+ * Take blk out of the heap if it is in it
+ */
+static inline void blk_heap_remove(struct blk_heap *h, int blk)
+{
+	int i = h->pos[blk - h->base], last;
+
+	if (i < 0)
+		return;
+	h->pos[blk - h->base] = -1;
+	if (i == --h->nb)
+		return;
+	/* the last entry fills the hole, up or down from there */
+	last = h->ent[h->nb].blk;
+	blk_heap_set(h, i, h->ent[h->nb]);
+	blk_heap_up(h, i);
+	blk_heap_down(h, h->pos[last - h->base]);
+}
+
+#endif /* LKP_KV_BLKHEAP_H */
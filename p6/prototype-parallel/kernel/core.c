@@ -10,16 +10,27 @@
 #include <linux/slab.h>
 #include <linux/spinlock_types.h>
 #include <linux/hrtimer.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/workqueue.h>
+#include <linux/bitops.h>
+#include <linux/seqlock.h>
 #include <asm/atomic.h>
 
 #include <linux/delay.h>
+#include <linux/sort.h>
+#include <linux/crc32.h>
 #include "core.h"
 #include "device.h"
 #include "hash.h"
+#include "hashfn.h"
+#include "blkheap.h"
+#include "slotpage.h"
+#include "vcache.h"
+#include "oindex.h"
 
 /* Thresholds */
 #define INVALID_THRESHOLD 20
-#define FLUSH_THRESHOLD 100
 
 /* Debug */
 #define DEBUG_P6 0
@@ -41,7 +52,6 @@ unsigned long delay = 1000L*1e6L; //1 second
 //GC Delay check interval
 unsigned long w_delay = 100L*1e6L; //10 mili-sec
 #define INVALID_THRESHOLD2 50
-#define FLUSH_THRESHOLD2 1000
 
 /* other features */
 #define MERGE 1
@@ -54,24 +64,97 @@ unsigned long w_delay = 100L*1e6L; //10 mili-sec
 #define NAND_DATA 123
 #define NAND_META_DATA 456
 
+/* Metadata log, see flush_metadata(): every page of the log starts with a
+ * meta_rec. META_LOG_SLACK log blocks are kept on top of the ones the whole
+ * image needs before the oldest ones get cleaned */
+#define META_LOG_MAGIC "LKPMLOG"
+#define META_REC_CHUNK 1
+#define META_REC_CKPT 2
+#define META_REC_JOURNAL 3
+#define META_LOG_SLACK 2
+struct meta_rec {
+	char magic[8];
+	unsigned int type;	/* META_REC_CHUNK, META_REC_CKPT or META_REC_JOURNAL */
+	unsigned int no;	/* chunk number, page of the checkpoint, or
+				 * number of journal records */
+	unsigned int nb;	/* checkpoint: number of pages */
+	unsigned int nb_chunks;	/* chunks in the image */
+	unsigned long long gen;	/* generation of the checkpoint */
+	unsigned int seq;	/* checkpoint: last journal record it covers */
+	unsigned int pad;
+};
+
+/* Superblock, see sb_write(): on the metadata partition, SB_NB_SLOTS erase
+ * blocks used in turn. Records are appended to the pages of the current one,
+ * the next one is erased and takes over when it is full. A record says where
+ * the log and its last checkpoint are, and which data blocks may have been
+ * written or erased since the checkpoint, so that the mount reads neither
+ * the first page of every block nor the log backward. Without a usable
+ * superblock the mount scans the partition as it used to */
+#define SB_MAGIC "LKPSUPB"
+#define SB_NB_SLOTS 2
+struct sb_rec {
+	char magic[8];
+	unsigned long long gen;	/* bumped by every record */
+	unsigned int crc;	/* crc32 of the page, with this field at 0 */
+	unsigned int nb_chunks;	/* chunks in the image */
+	int nb_blocks;		/* blocks of the data partitions */
+	int ckpt_pg;		/* last page of the checkpoint, -1: none */
+	int log_seq;		/* header number of the next log block */
+	int nb_log;		/* log blocks, oldest first, at the start of blk[] */
+	int nb_dirty;		/* data blocks changed since the checkpoint,
+				 * after them, -1: any of them may have */
+	int nb_parts;		/* data partitions, 0 stands for 1 */
+	int blk[];
+};
+
+/* Operation journal, see journal_append(): the index updates made since the
+ * last checkpoint, replayed at mount. A record is identified by its key
+ * hash and location(s) (LOC(page, slot)), the key itself is on the data
+ * page */
+#define JREC_SET 1	/* key of hash moved from location old (-1: new) to page */
+#define JREC_DEL 2	/* key of hash at location old deleted */
+#define JREC_ERASE 3	/* data block page erased */
+#define JREC_SET_EXT 4	/* JREC_SET of a multi-page couple (BKT_EXT) */
+struct journal_rec {
+	unsigned int seq;
+	unsigned int type;
+	unsigned int hash;
+	int page;
+	int old;
+};
+
 /* prototypes */
-int init_config(int mtd_index, int meta_index);
+int init_config(const int *mtd_index, int nb_parts, int meta_index);
 void destroy_config(void);
 void print_config(void);
 void print_meta_config(void);
 int write_page(int page_index, const char *buf);
+static int __write_page(int page_index, const char *buf);
 int write_meta_page(int page_index, const char *buf);
 int read_page(int page_index, char *buf);
 int read_meta_page(int page_index, char *buf);
 void format_callback(struct erase_info *e);
-int get_next_block_to_write(void);
-int get_healthy_block(void);
+struct kv_part;
+struct frontier;
+int get_next_page_to_write(struct frontier *fr);
+int get_healthy_block(struct kv_part *p);
 int init_scan(void);
 int flush_metadata(bool force);
 void gc(void);
+static void gc_part(struct kv_part *p);
+static void __gc_part(struct kv_part *p, int wear);
 void print_hash(void);
 int meta_on_disk_format(void);
 int is_read_only(void);
+static int meta_log_init(void);
+static void inv_update(int blk);
+static void inv_rebuild(void);
+static void blk_class(int blk);
+static void blk_class_all(void);
+static int meta_erase(int first, int nb);
+static void sb_write(int nb_release);
+static void sb_changing(int blk);
 
 /* Timer Interrupt Prototypes & Globals */
 static int init_flush_timer(void);
@@ -84,12 +167,228 @@ static void clear_wear_timer(void);
 static enum hrtimer_restart wear_timer_callback( struct hrtimer *w_timer);
 static struct hrtimer w_timer;
 
-/* locks & atomic variables */
-atomic_t is_gb;
-atomic_t is_flush;
-spinlock_t one_lock;
-spinlock_t list_lock;
-spinlock_t erase_lock;
+/* the timers and the write path only kick these: flush and GC erase and
+ * write whole blocks, they run on kv_wq, an unbound workqueue, so neither
+ * the interrupted CPU nor the writer that crossed a threshold pays for it.
+ * The GC of each data partition has its own work (kv_part.gc_work), the
+ * passes of different partitions run at the same time */
+static void flush_work_fn(struct work_struct *work);
+static void gc_work_fn(struct work_struct *work);
+static void wl_work_fn(struct work_struct *work);
+static DECLARE_WORK(meta_flush_work, flush_work_fn);
+static struct workqueue_struct *kv_wq;
+
+/* time the store was held by checkpoints (kv_sem held for writing), and a
+ * partition by its GC passes (kv_part.gc_time, its sem held for writing),
+ * see get_core_stats(). Updated under the lock they hold */
+struct bg_time {
+	unsigned long long nb, us, max_us;
+};
+static struct bg_time ckpt_time;
+
+/* locks & atomic variables
+ * kv_sem: read side taken by set/del for the whole operation and by GC
+ *         passes, write side by whatever needs a consistent snapshot of the
+ *         metadata or every partition quiet (format, flush, key arena
+ *         compaction)
+ * kv_part.sem: read side taken by set/del of the keys of the partition
+ *              (after kv_sem), write side by its GC pass, which erases one
+ *              of its blocks
+ * kv_part.gc_mutex: a single GC pass at a time in a partition
+ * kv_part.alloc_mutex: opening a new block of the partition (for one of
+ *                      its frontiers, a GC victim, a metadata log block
+ *                      taken from it)
+ * kv_part.fr[i].lock: appends to the open page of frontier i and the
+ *                     switch to its next block, taken before alloc_mutex
+ *                     and the hash segment locks, after journal_mutex
+ * blk_lock[i]: fields of blocks[i]
+ * kv_part.inv_lock: the GC buckets of the partition, taken after blk_lock[i]
+ * kv_part.heap_lock: its block allocator (free_heap, open_heap), taken
+ *                    after blk_lock[i]
+ * hashtable segments: see hash_write_lock(), lookups are lockless
+ * blk_seq[i]: bumped around every erase of block i, lets lockless readers
+ *             notice that the page they read was erased under them
+ * kv_part.ext_seq: bumped around the erase of a GC target of the partition
+ *          (until its couples are rewritten when in place) and format: the
+ *          extents of a multi-page couple may be erased while its head
+ *          stays put, its readers start again
+ * No flash I/O is done under a spinlock */
+struct rw_semaphore kv_sem;
+spinlock_t *blk_lock;
+seqcount_t *blk_seq;
+
+/* one bit per data page slot, indexed by location: set when the slot
+ * holds the current version of a key */
+unsigned long *valid_map;
+
+/* Write frontier: couples are appended to an open page kept in RAM, which
+ * is programmed once full, or before the journal records pointing into it
+ * are written (journal_write()) and before a checkpoint or a GC pass.
+ * Lockless readers copy it from RAM (frontier_read()) while it is open.
+ * Its pages are taken from a block it owns (blk), the next one is only
+ * allocated once blk is full: a partition has one frontier per CPU
+ * (FRONTIERS), the sets running on different CPUs append to different
+ * pages of different blocks. GC_TIERS more frontiers follow them, the
+ * relocation streams of GC: they only own the block the couples a GC pass
+ * moves are written to, their tier is that of the couples (blk_tier).
+ * The counters are the couples appended to data pages, the data pages
+ * programmed and the sets that overwrote their key in the open page
+ * instead, see get_core_stats(). Updated under lock, or the sem of the
+ * partition held for writing */
+struct frontier {
+	struct mutex lock;	/* appends to buf */
+	seqcount_t seq;		/* page switches, for the lockless readers */
+	int pg;			/* the open page, -1 if none */
+	char *buf;		/* its RAM image */
+	struct slot_ext *ext;	/* extent list of the multi-page couple
+				 * being written */
+	struct kv_part *part;	/* the partition its pages are taken from */
+	int no;			/* its index in part->fr */
+	int blk;		/* the block it owns, -1 if none */
+	int tier;		/* 0: user writes, 1 to GC_TIERS: relocations */
+	unsigned long long nb_recs, nb_data_pgs, nb_coalesced;
+};
+static int frontier_flush(struct frontier *fr);
+static int frontier_flush_all(void);
+
+/* page image of the block headers, see write_hdr() */
+static char *hdr_buf;
+static DEFINE_MUTEX(hdr_mutex);
+static void mark_extents(int loc, int valid, struct kv_scratch *s);
+
+/* GC victims: the inv_bkt[n] of a partition lists its blocks
+ * (inv_node[blk]) that have n dead pages (blk_dead_pages()), inv_max is at
+ * least the highest non empty bucket. Whatever changes
+ * blocks[blk].nb_invalid or nb_records calls inv_update(blk) */
+static struct list_head *inv_node;
+
+/* Block allocation: a data block is free (erased), open (partly written),
+ * owned (open and the block of a frontier, blk_fr[blk] gives which one, -1
+ * otherwise) or full, log blocks are none of them. The free_heap and
+ * open_heap of a partition hold its free and its open blocks, least worn
+ * first, nb_free_blks and nb_full_blks count its free and full ones.
+ * Whatever changes the state, offset, owner or erase count of a block calls
+ * blk_class(blk) */
+enum { BLK_C_NONE, BLK_C_FREE, BLK_C_OPEN, BLK_C_FULL, BLK_C_OWNED };
+static unsigned char *blk_cls;
+static short *blk_fr;
+
+/* Age of the couples of a block: 0 for user writes, t when a relocation
+ * stream of tier t wrote them. A GC pass moves the couples of a block of
+ * tier t to the stream of tier t + 1 (GC_TIERS at most), so that couples
+ * that survived GC are not mixed with fresh user writes, nor those that
+ * survived it again with those. Kept in RAM only: every block is of tier 0
+ * after a mount */
+static unsigned char *blk_tier;
+
+/* Data partitions: the store is striped on config.nb_parts MTD partitions
+ * (MTD_INDEX), blocks first_blk to first_blk + nb_blocks - 1 being those
+ * of parts[i]. Page and block numbers, locations and the metadata are
+ * store-wide, only the flash I/O looks at the partition (part_addr()).
+ * A key lives in the partition of its hashtable segment (hash_part()):
+ * its couples, its extent pages and the buckets its insertion or deletion
+ * moves all belong to that partition, so that each partition has its own
+ * write frontiers, block allocator, GC and locks, and the writes (and the
+ * GC passes) of different partitions go to their chips at the same time.
+ * A batch of sets is split by partition, each part handed to the worker of
+ * its partition (wq), see mset_keyval() */
+struct kv_part {
+	int no;
+	struct mtd_info *mtd;
+	int mtd_index;
+	int first_blk, nb_blocks;
+	struct rw_semaphore sem;
+	struct mutex gc_mutex;
+	struct mutex alloc_mutex;
+	struct frontier *fr;	/* nb_fr write frontiers, then the GC_TIERS
+				 * relocation streams */
+	int nb_fr;
+	seqcount_t ext_seq;
+	struct list_head *inv_bkt;
+	int inv_max;
+	spinlock_t inv_lock;
+	struct blk_heap free_heap, open_heap;
+	int nb_free_blks, nb_full_blks;
+	spinlock_t heap_lock;
+	struct work_struct gc_work;
+	struct bg_time gc_time;
+	struct work_struct wl_work;
+	unsigned long wl_next;	/* jiffies the wear leveler waits for */
+	struct bg_time wl_time;	/* its passes, that moved a cold block */
+	unsigned long long nb_wl_recs, nb_wl_pgs;	/* what they wrote */
+	struct workqueue_struct *wq;
+	struct kv_scratch scratch;	/* buffers of the sets wq runs */
+	int format_done;	/* set by the erase callback */
+	struct completion erase_done;
+};
+static struct kv_part parts[KV_PARTS_MAX];
+
+/* blk_part( blk)
+ * Partition of block blk
+ */
+static inline struct kv_part *blk_part(int blk)
+{
+	int i = config.nb_parts - 1;
+
+	while (i > 0 && blk < parts[i].first_blk)
+		i--;
+	return &parts[i];
+}
+
+/* hash_part( h)
+ * Partition of the keys of hash h: the segments are dealt to the
+ * partitions in turn
+ */
+static inline struct kv_part *hash_part(unsigned int h)
+{
+	return &parts[hash_seg(h) % config.nb_parts];
+}
+
+/* part_addr( page, addr)
+ * Partition of data page page, *addr receives the address of the page in
+ * it
+ */
+static inline struct kv_part *part_addr(int page, uint64_t *addr)
+{
+	struct kv_part *p = blk_part(page / config.pages_per_block);
+
+	*addr = ((uint64_t) (page - p->first_blk * config.pages_per_block)) *
+		((uint64_t) config.page_size);
+	return p;
+}
+
+/* key_part( key)
+ * Partition of key (the first one for a NULL key, refused later)
+ */
+static inline struct kv_part *key_part(const char *key)
+{
+	return key ? hash_part(hash(key)) : &parts[0];
+}
+
+/* part_lock( p) / part_unlock( p)
+ * Locks of a set or a del of a key of partition p
+ */
+static inline void part_lock(struct kv_part *p)
+{
+	down_read(&kv_sem);
+	down_read(&p->sem);
+}
+
+static inline void part_unlock(struct kv_part *p)
+{
+	up_read(&p->sem);
+	up_read(&kv_sem);
+}
+
+/* part_frontier( p)
+ * Write frontier of partition p for the sets of the current CPU. The
+ * writer may be moved to another CPU meanwhile, the frontier lock is what
+ * makes its appends safe
+ */
+static inline struct frontier *part_frontier(struct kv_part *p)
+{
+	return &p->fr[raw_smp_processor_id() % p->nb_fr];
+}
 
 /* Global Config Variables */
 lkp_kv_cfg config;
@@ -97,30 +396,118 @@ lkp_meta_cfg meta_config;
 
 bucket* hashtable;
 int HASH_SIZE;
+int HASH_SEG_SIZE;
+
+/* keys of the hashtable entries, KEY_ARENA_SIZE bytes of them */
+struct key_arena *key_arena;
+int KEY_ARENA_SIZE;
 
-//Specify ordering of metadata blocks
-#define MAX_META_BLK 100
+//Specify ordering of metadata blocks: the blocks of the metadata log,
+//oldest first
+#define MAX_META_BLK 256
 int meta_blkordr[MAX_META_BLK];
 
-/* The module tases one parameter which is the index of the target flash
+/* The module tases the indexes of the target flash partitions (one, or
+ * several to stripe the store on, MTD_INDEX=3,4) and of the metadata
  * partition */
-int MTD_INDEX = -1;
+int MTD_INDEX[KV_PARTS_MAX] = { -1 };
+static int nb_mtd_index;
 int META_INDEX = -2;
-module_param(MTD_INDEX, int, 0);
+module_param_array(MTD_INDEX, int, &nb_mtd_index, 0);
 module_param(META_INDEX, int, 0);
-MODULE_PARM_DESC(MTD_INDEX, "Index of target mtd partition");
+MODULE_PARM_DESC(MTD_INDEX, "Indexes of the data mtd partitions, comma separated");
 MODULE_PARM_DESC(META_INDEX, "Index of metadata partition");
+
+/* room kept in the key arena per bucket, keys longer than this on average
+ * make sets fail with -6 once the arena is full of live keys */
+int KEY_ARENA_AVG = 16;
+module_param(KEY_ARENA_AVG, int, 0);
+MODULE_PARM_DESC(KEY_ARENA_AVG, "Average key length the key arena is sized for");
+
+/* couples per data page the index is sized for: a page holds as many
+ * small couples as fit in it, the hashtable bounds the number of keys */
+int KEYS_PER_PAGE_AVG = 4;
+module_param(KEYS_PER_PAGE_AVG, int, 0);
+MODULE_PARM_DESC(KEYS_PER_PAGE_AVG, "Average number of couples per flash page the index is sized for");
+
+/* journal pages written before a checkpoint is taken, bounds the mount time
+ * (replay) and the room the journal takes in the metadata log */
+int JOURNAL_MAX_PAGES = 32;
+module_param(JOURNAL_MAX_PAGES, int, 0);
+MODULE_PARM_DESC(JOURNAL_MAX_PAGES, "Journal pages between two metadata checkpoints");
+
+/* write frontiers per data partition, each appending into a block of its
+ * own (0: one per CPU) */
+#define FRONTIERS_MAX 64
+/* relocation streams of GC per data partition, see blk_tier */
+#define GC_TIERS 2
+int FRONTIERS = 0;
+module_param(FRONTIERS, int, 0);
+MODULE_PARM_DESC(FRONTIERS, "Write frontiers per data partition (0: one per CPU)");
+
+/* run GC and checkpoints in the context of the writer that crosses their
+ * threshold, as the prototype used to, instead of kicking kv_wq. For
+ * latency comparisons, can be changed at runtime */
+int GC_FOREGROUND = 0;
+module_param(GC_FOREGROUND, int, 0644);
+MODULE_PARM_DESC(GC_FOREGROUND, "Run GC and checkpoints in the writer's context");
+
+/* GC moves the couples it keeps to the relocation stream of their tier
+ * (blk_tier) instead of any block with room, user writes included. For
+ * write amplification comparisons, can be changed at runtime */
+int GC_STREAMS = 1;
+module_param(GC_STREAMS, int, 0644);
+MODULE_PARM_DESC(GC_STREAMS, "Separate the couples moved by GC from user writes");
+
+/* static wear leveling: once the most worn block of a partition was erased
+ * more than WEAR_DELTA times more than its least worn block holding data,
+ * the couples of that block are moved to a free block erased more, at most
+ * one block per partition every WEAR_INTERVAL_MS (0: off), see wl_work_fn().
+ * Can be changed at runtime */
+int WEAR_DELTA = 64;
+module_param(WEAR_DELTA, int, 0644);
+MODULE_PARM_DESC(WEAR_DELTA, "Erase count spread that makes the wear leveler move a cold block");
+int WEAR_INTERVAL_MS = 1000;
+module_param(WEAR_INTERVAL_MS, int, 0644);
+MODULE_PARM_DESC(WEAR_INTERVAL_MS, "Least time between two cold block moves in a partition (0: no wear leveling)");
+
+/* budget of the DRAM value cache, in KB (0: no cache), see vcache.h. Can be
+ * changed at runtime, the cache shrinks at once */
+int VCACHE_KB = 1024;
+
+static int vcache_kb_set(const char *val, const struct kernel_param *kp)
+{
+	int kb, ret;
+
+	ret = kstrtoint(val, 0, &kb);
+	if (ret)
+		return ret;
+	if (kb < 0)
+		return -EINVAL;
+	VCACHE_KB = kb;
+	vcache_resize((long)kb * 1024);
+	return 0;
+}
+
+static struct kernel_param_ops vcache_kb_ops = {
+	.set = vcache_kb_set,
+	.get = param_get_int,
+};
+module_param_cb(VCACHE_KB, &vcache_kb_ops, &VCACHE_KB, 0644);
+MODULE_PARM_DESC(VCACHE_KB, "Budget of the DRAM value cache, in KB (0: off)");
 /**
  * Module initialization function
  */
 static int __init lkp_kv_init(void)
 {
-	int i, s_meta_blkordr;
+	int i, ret, s_meta_blkordr;
 	printk(PRINT_PREF "Loading... \n");
 	
-    spin_lock_init(&one_lock);
-	spin_lock_init(&list_lock);
-	spin_lock_init(&erase_lock);
+	init_rwsem(&kv_sem);
+	hash_init();
+	oindex_init();
+	vcache_init();
+	vcache_resize((long)VCACHE_KB * 1024);
 
     /*Initialize array for holding metadata block index's */
 	s_meta_blkordr = sizeof(meta_blkordr)/sizeof(int);
@@ -129,33 +516,57 @@ static int __init lkp_kv_init(void)
 		meta_blkordr[i] = -1;
 	}
 
-	if (init_config(MTD_INDEX, META_INDEX) != 0) {
+	/* before the device exists: every ioctl may queue work on it */
+	kv_wq = alloc_workqueue("lkp_kv", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!kv_wq) {
+		printk(KERN_ERR "Flush/GC workqueue creation Error\n");
+		return -5;
+	}
+
+	if (init_config(MTD_INDEX, nb_mtd_index, META_INDEX) != 0) {
 		printk(PRINT_PREF "Initialization error\n");
+		destroy_workqueue(kv_wq);
 		return -1;
 	}
 
+	meta_config.recent_update.counter = 0;
+
 	if (device_init() != 0) {
 		printk(PRINT_PREF "Virtual device creation error\n");
+		destroy_config();
+		destroy_workqueue(kv_wq);
 		return -2;
 	}
-
-	is_gb.counter = 0;
-	is_flush.counter = 0;
-	meta_config.recent_update.counter = 0;
 	
     // Initialize Periodic flushing of RAM metadata to disk //
     if( init_flush_timer() != 0){
 		printk(KERN_ERR "Metadata flush-to-disk interrupt creation Error\n");
-		return -3;
+		ret = -3;
+		goto err_flush;
 	}
 
 	// Initialize Periodic Wear Leveling shuffling interrupt //
 	if( init_wear_timer() != 0){
 		printk(KERN_ERR "Wear leveling interrupt creation Error\n");
-		return -4;
+		clear_wear_timer();
+		ret = -4;
+		goto err_flush;
 	}
     printk("----- Program start!!!!!!!!!!!!! (Don't put printk below if u r geting perf data) -----\n");
     return 0;
+
+err_flush:
+	clear_flush_timer();
+	/* the device may already have queued works: wait for them */
+	device_exit();
+	cancel_work_sync(&meta_flush_work);
+	for (i = 0; i < config.nb_parts; i++) {
+		cancel_work_sync(&parts[i].gc_work);
+		cancel_work_sync(&parts[i].wl_work);
+	}
+	destroy_config();
+	destroy_workqueue(kv_wq);
+	return ret;
 }
 
 /**
@@ -163,6 +574,8 @@ static int __init lkp_kv_init(void)
  */
 static void __exit lkp_kv_exit(void)
 {
+	int i;
+
 	/* TODO */
 
 	printk(PRINT_PREF "Exiting ... \n");
@@ -172,6 +585,13 @@ static void __exit lkp_kv_exit(void)
 	clear_flush_timer();
 	//Disable wear leveling timer interrupt
 	clear_wear_timer();
+	//Wait for the works the timers and writers may have queued
+	cancel_work_sync(&meta_flush_work);
+	for (i = 0; i < config.nb_parts; i++) {
+		cancel_work_sync(&parts[i].gc_work);
+		cancel_work_sync(&parts[i].wl_work);
+	}
+	destroy_workqueue(kv_wq);
 	//Device Drive exit Virtual Device
 	
 	//Flush metadata to disk one last time before exit
@@ -187,24 +607,30 @@ static void __exit lkp_kv_exit(void)
 
 /**
  * Global state initialization
- * Both data and metadata
+ * Both data and metadata. The store is striped on the nb_parts data
+ * partitions of mtd_index, which must have the same block and page sizes
  *
  * Return 
  *  0: OK
  * -1: Data Config Error
  * -2: Metadata Config Error
  */
-int init_config(int mtd_index, int meta_index)
+int init_config(const int *mtd_index, int nb_parts, int meta_index)
 {
 	uint64_t tmp_blk_num;
     int blk_info_roundup;
     int hdr_per_blk = 1;
-    int jack_size, i;
+    int jack_size, arena_size, i, n, nb_fr;
+	struct blk_heap_ent *heap_ent;
+	int *heap_pos;
+	struct list_head *inv_bkt;
+	struct kv_part *p;
 	
-	if (mtd_index == -1) {
+	if (nb_parts < 1 || nb_parts > KV_PARTS_MAX || mtd_index[0] == -1) {
 		printk(PRINT_PREF
 		       "Error, flash partition index missing, should be"
-		       " indicated for example like this: MTD_INDEX=5\n");
+		       " indicated for example like this: MTD_INDEX=5"
+		       " (MTD_INDEX=3,4 to stripe the store on two partitions)\n");
 		return -1;
 	}
 
@@ -217,45 +643,56 @@ int init_config(int mtd_index, int meta_index)
 	}
 
 	//Disk Config
-	config.format_done = 0;
 	config.read_only = 0;
-	config.mtd_index = mtd_index;
+	config.nb_parts = nb_parts;
+	config.nb_blocks = 0;
 
 	//Metadata Config
 	meta_config.format_done = 0;
 	meta_config.read_only = 0;
 	meta_config.mtd_index = meta_index;
 
-	/* The flash partition is manipulated by calling the driver, through the
-	 * mtd_info object. There is one of these object per flash partition */
-	config.mtd = get_mtd_device(NULL, mtd_index);
+	/* The flash partitions are manipulated by calling the driver, through
+	 * the mtd_info object. There is one of these object per flash partition.
+	 * The blocks of the data partitions are numbered one after the other */
+	for (i = 0; i < nb_parts; i++) {
+		p = &parts[i];
+		p->no = i;
+		p->mtd_index = mtd_index[i];
+		p->mtd = get_mtd_device(NULL, mtd_index[i]);
+		if (p->mtd == NULL)
+			return -1;
+		if (p->mtd->erasesize != parts[0].mtd->erasesize ||
+		    p->mtd->writesize != parts[0].mtd->writesize) {
+			printk(PRINT_PREF "Error, mtd %d and mtd %d have different"
+			       " block or page sizes\n", mtd_index[0], mtd_index[i]);
+			return -1;
+		}
+		tmp_blk_num = p->mtd->size;
+		do_div(tmp_blk_num, (uint64_t) p->mtd->erasesize);
+		p->first_blk = config.nb_blocks;
+		p->nb_blocks = (int)tmp_blk_num; //Defined by flash simulator
+		config.nb_blocks += p->nb_blocks;
+	}
 	meta_config.mtd = get_mtd_device(NULL, meta_index);
 
-	if (config.mtd == NULL)
-		return -1;
-
 	if (meta_config.mtd == NULL)
 		return -2;
 
-	config.block_size = config.mtd->erasesize;
-	config.page_size = config.mtd->writesize;
+	config.block_size = parts[0].mtd->erasesize;
+	config.page_size = parts[0].mtd->writesize;
 	config.pages_per_block = config.block_size / config.page_size;
 
 	meta_config.block_size = meta_config.mtd->erasesize;
 	meta_config.page_size = meta_config.mtd->writesize;
 	meta_config.pages_per_block = meta_config.block_size / meta_config.page_size;
 
-	tmp_blk_num = config.mtd->size;
-	do_div(tmp_blk_num, (uint64_t) config.mtd->erasesize);
-	config.nb_blocks = (int)tmp_blk_num; //Defined by flash simulator
-
 	tmp_blk_num = meta_config.mtd->size;
 	do_div(tmp_blk_num, (uint64_t) meta_config.mtd->erasesize);
 	meta_config.nb_blocks = (int)tmp_blk_num; //Defined by flash simulator
 
-	/* Semaphore initialized to 1 (available) */
-	sema_init(&config.format_lock, 1);
-	sema_init(&meta_config.format_lock, 1);
+	/* erases sleep until the driver calls back */
+	init_completion(&meta_config.erase_done);
 
 	//Allocates a chunk of memory according to size of disk config
     blk_info_roundup =(( sizeof(blk_info)*config.nb_blocks /config.page_size)+1) * config.page_size;
@@ -268,26 +705,104 @@ int init_config(int mtd_index, int meta_index)
         BUG();
 	config.blocks = meta_config.blocks;
     
-    HASH_SIZE = (config.pages_per_block - hdr_per_blk)*config.nb_blocks;
-    printk("HASH_SIZE = max_buckets %d \n", HASH_SIZE);
+	blk_lock = kmalloc(config.nb_blocks * sizeof(spinlock_t), GFP_KERNEL);
+	valid_map = vzalloc(BITS_TO_LONGS(LOC(config.nb_blocks * config.pages_per_block, 0))
+			    * sizeof(unsigned long));
+	blk_seq = kmalloc(config.nb_blocks * sizeof(seqcount_t), GFP_KERNEL);
+	inv_bkt = kmalloc(nb_parts * (config.pages_per_block + 1) * sizeof(struct list_head), GFP_KERNEL);
+	inv_node = kmalloc(config.nb_blocks * sizeof(struct list_head), GFP_KERNEL);
+	blk_cls = kzalloc(config.nb_blocks, GFP_KERNEL);
+	blk_fr = kmalloc(config.nb_blocks * sizeof(short), GFP_KERNEL);
+	blk_tier = kzalloc(config.nb_blocks, GFP_KERNEL);
+	/* the heaps of a partition hold its blocks, and are indexed by block
+	 * from its first one */
+	heap_ent = kmalloc(2 * config.nb_blocks * sizeof(struct blk_heap_ent), GFP_KERNEL);
+	heap_pos = kmalloc(2 * config.nb_blocks * sizeof(int), GFP_KERNEL);
+	hdr_buf = kmalloc(max(config.page_size, meta_config.page_size), GFP_KERNEL);
+	if (!blk_lock || !valid_map || !blk_seq || !inv_bkt || !inv_node ||
+	    !blk_cls || !blk_fr || !blk_tier || !heap_ent || !heap_pos || !hdr_buf)
+		BUG();
+	nb_fr = (FRONTIERS > 0) ? FRONTIERS : num_online_cpus();
+	nb_fr = min(nb_fr, FRONTIERS_MAX);
+	for (i = 0; i < nb_parts; i++) {
+		p = &parts[i];
+		init_rwsem(&p->sem);
+		mutex_init(&p->gc_mutex);
+		mutex_init(&p->alloc_mutex);
+		p->nb_fr = nb_fr;
+		p->fr = kcalloc(nb_fr + GC_TIERS, sizeof(struct frontier),
+				GFP_KERNEL);
+		p->wq = alloc_workqueue("lkp_kv_part%d", WQ_UNBOUND, 1, i);
+		if (!p->fr || !p->wq || kv_scratch_init(&p->scratch) != 0)
+			BUG();
+		for (n = 0; n < nb_fr + GC_TIERS; n++) {
+			struct frontier *fr = &p->fr[n];
+
+			fr->buf = kmalloc(config.page_size, GFP_KERNEL);
+			fr->ext = kmalloc(slot_ext_size(EXT_MAX), GFP_KERNEL);
+			if (!fr->buf || !fr->ext)
+				BUG();
+			mutex_init(&fr->lock);
+			seqcount_init(&fr->seq);
+			fr->pg = -1;
+			fr->part = p;
+			fr->no = n;
+			fr->blk = -1;
+			fr->tier = max(n - nb_fr + 1, 0);
+		}
+		seqcount_init(&p->ext_seq);
+		p->inv_bkt = inv_bkt + i * (config.pages_per_block + 1);
+		for (n = 0; n <= config.pages_per_block; n++)
+			INIT_LIST_HEAD(&p->inv_bkt[n]);
+		p->inv_max = 0;
+		spin_lock_init(&p->inv_lock);
+		blk_heap_init(&p->free_heap, heap_ent, heap_pos, p->first_blk,
+			      p->nb_blocks);
+		blk_heap_init(&p->open_heap, heap_ent + p->nb_blocks,
+			      heap_pos + p->nb_blocks, p->first_blk, p->nb_blocks);
+		heap_ent += 2 * p->nb_blocks;
+		heap_pos += 2 * p->nb_blocks;
+		spin_lock_init(&p->heap_lock);
+		INIT_WORK(&p->gc_work, gc_work_fn);
+		INIT_WORK(&p->wl_work, wl_work_fn);
+		init_completion(&p->erase_done);
+	}
+	for (i = 0; i < config.nb_blocks; i++) {
+		spin_lock_init(&blk_lock[i]);
+		seqcount_init(&blk_seq[i]);
+		INIT_LIST_HEAD(&inv_node[i]);
+		blk_fr[i] = -1;
+	}
+    
+	/* KEYS_PER_PAGE_AVG buckets per data page, rounded up to whole
+	 * segments of whole control groups */
+	if (KEYS_PER_PAGE_AVG < 1)
+		KEYS_PER_PAGE_AVG = 1;
+    HASH_SEG_SIZE = roundup(DIV_ROUND_UP((config.pages_per_block - hdr_per_blk)*config.nb_blocks*KEYS_PER_PAGE_AVG, HASH_SEGS), CTRL_GROUP);
+    HASH_SIZE = HASH_SEG_SIZE * HASH_SEGS;
+    printk("HASH_SIZE = max_buckets %d (%d segments of %d)\n", HASH_SIZE, HASH_SEGS, HASH_SEG_SIZE);
     
     jack_size =(((sizeof(bucket) * HASH_SIZE)/config.page_size)+1) * config.page_size;
     printk("hash original size lu rounded-up size %lu %d pgs %d\n", 
             (sizeof(bucket) * HASH_SIZE),
             jack_size, jack_size/config.page_size);
 
+    arena_size = ((sizeof(struct key_arena) + HASH_SIZE * KEY_ARENA_AVG) / config.page_size + 1) * config.page_size;
+    KEY_ARENA_SIZE = arena_size - sizeof(struct key_arena);
+    printk("key arena size %d %d pgs\n", arena_size, arena_size/config.page_size);
+
     hashtable = kzalloc(jack_size, GFP_KERNEL);
-    if(!hashtable)
+    key_arena = vzalloc(arena_size);
+    if(!hashtable || !key_arena || hash_ctrl_init() != 0)
         BUG();
-    for(i=0; i<HASH_SIZE; i++) {
-        hashtable[i].index = -1;
-        hashtable[i].p_state = PG_FREE;
-        hashtable[i].key[0] = '\0';
-    }
+    hash_reset(hashtable);
 
 	meta_config.hashtable_size =  jack_size;
+	meta_config.key_arena_size = arena_size;
 	meta_config.block_info_size = blk_info_roundup;
-	meta_config.metadata_size = meta_config.hashtable_size + meta_config.block_info_size;
+	meta_config.metadata_size = meta_config.hashtable_size + meta_config.key_arena_size + meta_config.block_info_size;
+	if (meta_log_init() != 0)
+		return -2;
 
 	/* Flash scan for metadata creation: which flash blocks and pages are 
 	 * free/occupied */
@@ -305,630 +820,2676 @@ int init_config(int mtd_index, int meta_index)
 	return 0;
 }
 
-/**
- * Launch time metadata creation: flash is scanned to determine which flash 
- * blocs and pages are free/occupied. 
+/*****************************************************************************/
+/* Metadata log                                                              */
+/*****************************************************************************/
+
+/* The RAM metadata (block info, hashtable, key arena) is seen as one image
+ * cut in chunks of meta_chunk bytes. Whatever modifies it calls meta_dirty()
+ * and a flush appends the dirty chunks only to the metadata log, a list of
+ * flash blocks (meta_blkordr[0..meta_nb_log[), followed by a checkpoint: the
+ * flash page of every chunk. At mount the newest complete checkpoint is
+ * loaded. When the log reaches meta_log_cap blocks, its oldest blocks are
+ * cleaned: their live chunks are appended again and they are erased once the
+ * next checkpoint is on flash.
+ *
+ * In between two checkpoints, the index updates are journaled: records
+ * (key hash, page, sequence number) are gathered in journal_buf and
+ * appended to the log a page at a time, by the flush timer or when the page
+ * is full. At mount the records that follow the checkpoint are replayed,
+ * and a checkpoint is only taken once JOURNAL_MAX_PAGES journal pages have
+ * been written */
+static struct {
+	void *base;
+	int size;
+} meta_regions[3];
+static int meta_image_size;
+static int meta_chunk;			/* payload bytes of a log page */
+static int meta_nb_chunks;
+static int meta_ckpt_pages;		/* pages of a checkpoint */
+static unsigned long *meta_dirty_map;	/* one bit per chunk */
+static int *meta_map;			/* flash page of each chunk, -1: none */
+static int meta_nb_log;			/* blocks in the log */
+static unsigned long *meta_blk_map;	/* one bit per block of the log */
+static int meta_blkno[MAX_META_BLK];	/* header number of the log blocks */
+static int meta_log_seq;		/* header number of the next log block */
+static int meta_log_cap;		/* log blocks kept before cleaning */
+static int meta_cur_blk = -1;		/* log block being appended to */
+static unsigned long long meta_gen;	/* generation of the last checkpoint */
+static unsigned int meta_ckpt_seq;	/* last journal record it covers */
+static int meta_ckpt_pg = -1;		/* last page of the last checkpoint */
+
+/* records are numbered under the hash segment lock of their key, so the
+ * records of a key are in the order its updates were published. They may
+ * reach the log slightly out of order, the replay sorts them */
+static DEFINE_MUTEX(journal_mutex);	/* journal_buf and the counters below */
+static atomic_t journal_seq = ATOMIC_INIT(0);	/* last number handed out */
+static char *journal_buf;		/* page being filled, after a meta_rec */
+static int journal_nb;			/* records in journal_buf */
+static int journal_per_pg;		/* records per journal page */
+static int journal_pages;		/* journal pages since the checkpoint */
+static int journal_lost;		/* a journal page could not be written */
+
+/* superblock, see sb_write(). sb_dirty_map lists the data blocks that may
+ * differ on flash from the image of the last checkpoint (sb_nb_dirty of
+ * them), sb_all says that any of them may. Under sb_mutex */
+static DEFINE_MUTEX(sb_mutex);
+static int sb_on;			/* the metadata partition can hold it */
+static int sb_slot = -1;		/* slot being appended to, -1: none */
+static int sb_next;			/* its next page */
+static unsigned long long sb_gen;	/* generation of the last record */
+static char *sb_buf;			/* page of a record */
+static unsigned long *sb_dirty_map;
+static int sb_nb_dirty;
+static int sb_all = 1;
+
+/* meta_dirty( p, len)
+ * Record that the len bytes of RAM metadata at p changed, they will be part
+ * of the next flush. Pointers outside of the metadata are ignored.
  *
  * Return
- *  0: OK
- * -1: Error
+ * VOID
  */
-int init_scan()
+void meta_dirty(const void *p, size_t len)
 {
-	char *buf, *tmp;
-	unsigned long eflags;
-    int nb_meta_pages, nb_meta_blocks;
-	int blk_pgs, hs_pgs;
-    int i, jack_ofs = 0;
-    int head = 1, total_ram_pg_cnt = 0;
-    
-    spin_lock_irqsave(&erase_lock, eflags);
-    JDBG("\n\n\n\n\n\n\n\n\n\n\n");
+	int i, ofs = 0, first, last;
+
+	for (i = 0; i < ARRAY_SIZE(meta_regions); i++) {
+		const char *base = meta_regions[i].base;
+
+		if (base && (const char *)p >= base &&
+		    (const char *)p < base + meta_regions[i].size) {
+			first = (ofs + ((const char *)p - base)) / meta_chunk;
+			last = (ofs + ((const char *)p - base) + len - 1) / meta_chunk;
+			for (; first <= last && first < meta_nb_chunks; first++)
+				set_bit(first, meta_dirty_map);
+			return;
+		}
+		ofs += meta_regions[i].size;
+	}
+}
 
-	//Set more metadata sizes
-	nb_meta_pages = (meta_config.metadata_size / meta_config.page_size);
-    nb_meta_blocks = (nb_meta_pages / config.pages_per_block) + 1;
+static inline void blk_dirty(int blk)
+{
+	meta_dirty(&meta_config.blocks[blk], sizeof(blk_info));
+}
 
-    for(i=0;i<10;i++) {
-        JDBG("%s(): meta_total_size %d  meta_block_info_size %d meta_hashtable_size %d\n",
-                __func__, meta_config.metadata_size,
-                meta_config.block_info_size, meta_config.hashtable_size);
-    }
+/* meta_image_copy( buf, ofs, len, to_ram)
+ * Copy len bytes at offset ofs of the metadata image from RAM into buf, or
+ * from buf into RAM
+ */
+static void meta_image_copy(char *buf, int ofs, int len, int to_ram)
+{
+	int i, n;
 
-	//buf = vmalloc(meta_config.page_size);
-	buf = kzalloc(meta_config.page_size, GFP_KERNEL);
-    if(!buf)
-        BUG();
+	for (i = 0; i < ARRAY_SIZE(meta_regions) && len > 0; i++) {
+		if (ofs >= meta_regions[i].size) {
+			ofs -= meta_regions[i].size;
+			continue;
+		}
+		n = min(len, meta_regions[i].size - ofs);
+		if (to_ram)
+			memcpy(meta_regions[i].base + ofs, buf, n);
+		else
+			memcpy(buf, meta_regions[i].base + ofs, n);
+		buf += n;
+		len -= n;
+		ofs = 0;
+	}
+}
 
-    meta_config.metadata_size = meta_config.hashtable_size + meta_config.block_info_size;
-	blk_pgs = (meta_config.block_info_size / meta_config.page_size);
-    hs_pgs = (meta_config.hashtable_size / meta_config.page_size);
-    JDBG("blk_pgs %d hs_pgs %d\n", blk_pgs, hs_pgs);
+/* meta_log_init( void)
+ * Set the metadata image up once the RAM structures are allocated
+ *
+ * Return
+ * 0: Success
+ * -1: allocation failure or metadata too large for the log
+ */
+static int meta_log_init(void)
+{
+	int i, image_blks;
+
+	meta_regions[0].base = meta_config.blocks;
+	meta_regions[0].size = meta_config.block_info_size;
+	meta_regions[1].base = hashtable;
+	meta_regions[1].size = meta_config.hashtable_size;
+	meta_regions[2].base = key_arena;
+	meta_regions[2].size = meta_config.key_arena_size;
+	meta_image_size = meta_config.metadata_size;
+
+	meta_chunk = config.page_size - sizeof(struct meta_rec);
+	meta_nb_chunks = DIV_ROUND_UP(meta_image_size, meta_chunk);
+	meta_ckpt_pages = DIV_ROUND_UP(meta_nb_chunks * sizeof(int), meta_chunk);
+
+	journal_per_pg = meta_chunk / sizeof(struct journal_rec);
+
+	/* the whole image and a full journal, plus room for the incremental
+	 * flushes, and as much again while the oldest blocks are being
+	 * cleaned */
+	image_blks = DIV_ROUND_UP(meta_nb_chunks + meta_ckpt_pages + JOURNAL_MAX_PAGES,
+				  config.pages_per_block - 1);
+	meta_log_cap = image_blks + META_LOG_SLACK;
+	if (2 * meta_log_cap > MAX_META_BLK ||
+	    meta_ckpt_pages > config.pages_per_block - RESERVED_PG_CNT) {
+		printk(KERN_ERR "%s(): metadata needs %d log blocks, max %d\n",
+		       __func__, 2 * meta_log_cap, MAX_META_BLK);
+		return -1;
+	}
 
-    for (i = 0; i < config.nb_blocks; i++) {
-        int j, idx_num = -1;
-        
-        if ( read_page(i*config.pages_per_block, buf) !=0 ) {
-            printk(KERN_ERR "%s(): read_page failed\n", __func__);
-            BUG();
-        } 
+	meta_dirty_map = kzalloc(BITS_TO_LONGS(meta_nb_chunks) * sizeof(unsigned long), GFP_KERNEL);
+	meta_map = kmalloc(meta_nb_chunks * sizeof(int), GFP_KERNEL);
+	journal_buf = kzalloc(config.page_size, GFP_KERNEL);
+	meta_blk_map = kzalloc(BITS_TO_LONGS(config.nb_blocks) * sizeof(unsigned long), GFP_KERNEL);
+	sb_buf = kmalloc(meta_config.page_size, GFP_KERNEL);
+	sb_dirty_map = kzalloc(BITS_TO_LONGS(config.nb_blocks) * sizeof(unsigned long), GFP_KERNEL);
+	if (!meta_dirty_map || !meta_map || !journal_buf || !meta_blk_map ||
+	    !sb_buf || !sb_dirty_map)
+		return -1;
+	/* the superblock needs its slots, and a page that can list every log
+	 * block */
+	sb_on = meta_config.nb_blocks >= SB_NB_SLOTS &&
+		meta_config.page_size >= sizeof(struct sb_rec) + MAX_META_BLK * sizeof(int);
+	if (!sb_on)
+		printk(PRINT_PREF "metadata partition too small for the superblock\n");
+	for (i = 0; i < meta_nb_chunks; i++)
+		meta_map[i] = -1;
+	bitmap_fill(meta_dirty_map, meta_nb_chunks);
+	return 0;
+}
 
-        if (memcmp(buf, &META_HDR_BASE, (size_t)strlen((char*)&META_HDR_BASE))) {
-            //JDBG("%s(); block %d: DATA block\n", __func__, i);
-            continue;
-        }
-        JDBG("\n\n%s(); block %d: MEDA_DATA block\n", __func__, i);
-        tmp = kzalloc(sizeof(char)*100, GFP_KERNEL); // TODO: page_size
-        JDBG("strlen buf %d strlen hdr %d\n", strlen(buf), (size_t)strlen((char*)&META_HDR_BASE));
-        for (j = 0; j < strlen(buf)-(size_t)strlen((char*)&META_HDR_BASE); j++) {
-            *(tmp + j) = *(buf + (size_t)strlen((char*)&META_HDR_BASE) + j);
-        }
-        idx_num = simple_strtol(tmp, NULL, 10);
-        JDBG2("%s(); idx_num %d\n", __func__, idx_num);
-        kfree(tmp);
-        meta_blkordr[idx_num] = i;
-        
-        for(j=1; j<config.pages_per_block; j++) {
-            total_ram_pg_cnt++;
-            if( total_ram_pg_cnt > hs_pgs + blk_pgs)
-                goto construct_done;
-            
-            // from DISK
-            JDBG2("%s(): read pg_idx(DISK) %d\n", __func__, (i*config.pages_per_block) + j);
-            if ( read_page((i*config.pages_per_block) + j, buf) !=0 ) {
-                printk(KERN_ERR "%s(): read_page failed\n", __func__);
-                BUG(); //vfree(buf);
-            }
-            
-            // to RAM// idx_num (0~3)
-            if( (idx_num*config.pages_per_block) + (j - (head)) < blk_pgs ) { //blkinfo
-                JDBG2("%s():\tBLK_INFO ofs %d (0~%d)\n", __func__, (idx_num*config.pages_per_block + (j - head)), blk_pgs-1);
-                memcpy(((void*)meta_config.blocks) + ( (idx_num*config.pages_per_block + (j - head)) * meta_config.page_size),
-                        buf, meta_config.page_size);
-            } else { //hash
-                JDBG2("%s():\tHASH ofs %d (0~%d) JJ\n", __func__, jack_ofs, hs_pgs-1);
-                memcpy( ((void*)hashtable) + ( jack_ofs * meta_config.page_size), 
-                                                    buf, meta_config.page_size);
-                        jack_ofs++;
-            }
-        } // a blk done 
-    } // all victm done
-    // if ( total_ram_pg_cnt <= hs_pgs+ blk_pgs)
-    //      ; // the very first time
-construct_done:
+static void meta_log_exit(void)
+{
+	kfree(meta_dirty_map);
+	kfree(meta_map);
+	kfree(journal_buf);
+	kfree(meta_blk_map);
+	kfree(sb_buf);
+	kfree(sb_dirty_map);
+}
 
-	kfree(buf);
+/* is_meta_blk( blk)
+ * Does flash block blk belong to the metadata log?
+ */
+static inline int is_meta_blk(int blk)
+{
+	return test_bit(blk, meta_blk_map);
+}
 
-    //current victims
-    for (i = 0 ; i < nb_meta_blocks+3 ; ++i) {
-        JDBG("current victims: %d blk %d\n", i, meta_blkordr[i]);
-    }
-   
-	//For all config blocks
-	for (i = 0; i < config.nb_blocks; i++)
-	{
-		meta_config.blocks[i].list = (struct list_head *)vmalloc(sizeof(struct list_head));
-		INIT_LIST_HEAD(meta_config.blocks[i].list);
+/* meta_log_reset( void)
+ * Forget the log after its blocks were erased (format): the next flush
+ * writes the whole image
+ */
+static void meta_log_reset(void)
+{
+	int i;
 
-		//If block is empty
-		if(meta_config.blocks[i].state == 0xFFFFFFFF) // very first time
-		{
-			meta_config.blocks[i].state = BLK_FREE;
-			meta_config.blocks[i].worn = 0;
-			meta_config.blocks[i].nb_invalid = 0;
-			meta_config.blocks[i].current_page_offset = 0;
-		}
-		
-		//TODO What if block is full from last time and not formated yet?
-	}
+	meta_nb_log = 0;
+	bitmap_zero(meta_blk_map, config.nb_blocks);
+	meta_cur_blk = -1;
+	meta_ckpt_pg = -1;
+	for (i = 0; i < meta_nb_chunks; i++)
+		meta_map[i] = -1;
+	bitmap_fill(meta_dirty_map, meta_nb_chunks);
+	journal_nb = 0;
+	journal_pages = 0;
+	journal_lost = 0;
+	memset(journal_buf, 0, config.page_size);
+}
 
-	//For all hashtable entries
-	for (i = 0; i < HASH_SIZE; i++)
-	{
-		//if hashtable entry is valid add to that block's LL
-		if (hashtable[i].p_state == PG_VALID)
-			list_add(&hashtable[i].p_list, meta_config.blocks[hashtable[i].index / config.pages_per_block].list); 
-	}
+/* meta_new_block( void)
+ * Add a free flash block (the least worn one) at the end of the log
+ *
+ * Return
+ * 0: Success
+ * -1: no free block, or write error
+ */
+static int meta_new_block(void)
+{
+	struct kv_part *p = &parts[0];
+	int i, blk, no;
 
-    // TODO: Jack list_lock
-    
-	if (is_read_only())
-	{
-		//No healthy blocks left!
-		printk(PRINT_PREF "read only mode\n");
+	if (meta_nb_log >= MAX_META_BLK)
+		return -1;
 
-		//Switch Disk to READ-ONLY
-		config.read_only = 1;
-		meta_config.read_only = 1;
+	/* from the partition that has the most free blocks */
+	for (i = 1; i < config.nb_parts; i++)
+		if (ACCESS_ONCE(parts[i].nb_free_blks) > ACCESS_ONCE(p->nb_free_blks))
+			p = &parts[i];
+	mutex_lock(&p->alloc_mutex);
+	spin_lock(&p->heap_lock);
+	blk = blk_heap_top(&p->free_heap);
+	spin_unlock(&p->heap_lock);
+	if (blk == -1) {
+		mutex_unlock(&p->alloc_mutex);
+		return -1;
 	}
- 
-    spin_unlock_irqrestore(&erase_lock, eflags);
-	return 0;
+	/* journal writers only hold kv_sem for reading: the block must be
+	 * known as a log block before get_healthy_block() can look at it */
+	set_bit(blk, meta_blk_map);
+	spin_lock(&blk_lock[blk]);
+	meta_config.blocks[blk].state = BLK_USED;
+	meta_config.blocks[blk].current_page_offset = RESERVED_PG_CNT;
+	blk_class(blk);
+	spin_unlock(&blk_lock[blk]);
+	blk_dirty(blk);
+	/* the other partitions write superblock records meanwhile */
+	mutex_lock(&sb_mutex);
+	meta_blkordr[meta_nb_log] = blk;
+	no = meta_blkno[meta_nb_log] = meta_log_seq++;
+	meta_nb_log++;
+	mutex_unlock(&sb_mutex);
+	/* the mount finds the log from the superblock */
+	sb_write(0);
+	mutex_unlock(&p->alloc_mutex);
+
+	meta_cur_blk = blk;
+	JDBG("%s(): log blk %d (#%d)\n", __func__, blk, no);
+	return write_hdr(blk * config.pages_per_block, NAND_META_DATA, no) ? -1 : 0;
 }
 
+/* meta_log_page( nb)
+ * Reserve nb consecutive pages at the end of the log
+ *
+ * Return
+ * the flash page index of the first one
+ * -1: no room left
+ */
+static int meta_log_page(int nb)
+{
+	int pg;
+
+	if (meta_cur_blk >= 0 &&
+	    meta_config.blocks[meta_cur_blk].current_page_offset + nb <= config.pages_per_block) {
+		spin_lock(&blk_lock[meta_cur_blk]);
+		pg = meta_cur_blk * config.pages_per_block +
+			meta_config.blocks[meta_cur_blk].current_page_offset;
+		meta_config.blocks[meta_cur_blk].current_page_offset += nb;
+		spin_unlock(&blk_lock[meta_cur_blk]);
+		blk_dirty(meta_cur_blk);
+		return pg;
+	}
+	if (nb > config.pages_per_block - RESERVED_PG_CNT || meta_new_block() != 0)
+		return -1;
+	return meta_log_page(nb);
+}
 
+/* meta_log_room( nb_release)
+ * Log pages that can be written before the log has meta_log_cap blocks,
+ * not counting the nb_release oldest blocks about to be cleaned
+ */
+static int meta_log_room(int nb_release)
+{
+	int room = 0, blks;
+
+	if (meta_cur_blk >= 0)
+		room = config.pages_per_block - meta_config.blocks[meta_cur_blk].current_page_offset;
+	blks = meta_log_cap + nb_release - meta_nb_log;
+	if (blks > 0)
+		room += blks * (config.pages_per_block - RESERVED_PG_CNT);
+	return room;
+}
 
-/* flush_metadata
- * Flushes Metadata partition from RAM-to-disk
+/* meta_write_rec( pg, type, no, buffer)
+ * Write one page of the log, buffer holds the payload after the room for
+ * the record header
  *
- * Return
- * 0  : Success
- * -2 : meta_on_disk_format failed
- * -1 : write_meta_page failed
+ * Return: see write_page()
  */
-int flush_metadata(bool force)
+static int meta_write_rec(int pg, int type, int no, char *buffer)
 {
-	char *buffer;
-    static int cnt = 0;
-	int nb_pages, nb_blocks, buffer_size;
-	int enough_blocks = 0, i, ret = 0;
-	int blk_pgs, hs_pgs, jack_ofs = 0, head = 1;
-	unsigned long lflags;
-    int meta_blkordr_pre[MAX_META_BLK];
-	//unsigned long lflags, eflags;
-	
-    if(force)
-        goto force_flush;
-    if(!atomic_cmpxchg(&is_flush, 0, 1)) // succ new 1, fail old 0
-        goto flush_meta_exit2;
-    if (cnt++ < FLUSH_THRESHOLD)
-        goto  flush_meta_exit2;
-    cnt = 0;
-    
-force_flush:
-    if(!spin_trylock(&erase_lock)) {
-        if(force)
-            goto force_flush;
-        else
-            goto flush_meta_exit2;
-    }
-    
-    JDBG("%s(): FLUSH: FLUSH: FLUSH: FLUSH: FLUSH\n", __func__);
-    JDBG("%s(): FLUSH: FLUSH: FLUSH: FLUSH: FLUSH\n", __func__);
-    JDBG("%s(): FLUSH: FLUSH: FLUSH: FLUSH: FLUSH\n", __func__);
-    JDBG("%s(): FLUSH: FLUSH: FLUSH: FLUSH: FLUSH\n", __func__);
-    JDBG("%s(): FLUSH: FLUSH: FLUSH: FLUSH: FLUSH\n", __func__);
+	struct meta_rec *rec = (struct meta_rec *)buffer;
+
+	memcpy(rec->magic, META_LOG_MAGIC, sizeof(rec->magic));
+	rec->type = type;
+	rec->no = no;
+	rec->nb = (type == META_REC_CKPT) ? meta_ckpt_pages : 0;
+	rec->nb_chunks = meta_nb_chunks;
+	rec->gen = meta_gen + 1;
+	rec->seq = atomic_read(&journal_seq);
+	return write_page(pg, buffer);
+}
 
-	//Can be more than 64
-	//TODO need to remove all instances of meta_config (merge into config)
-    nb_pages = (meta_config.metadata_size / meta_config.page_size);
-	nb_blocks = (nb_pages / config.pages_per_block) + 1;
+/* sb_valid( pg, buf)
+ * Read page pg of the metadata partition into buf (a page of it): does it
+ * hold a superblock record?
+ */
+static int sb_valid(int pg, char *buf)
+{
+	struct sb_rec *sb = (struct sb_rec *)buf;
+	unsigned int crc;
 
-#if DEBUG_P6
-    JDBG("nb_pages %d nb_blocks %d\n", nb_pages, nb_blocks);
-    for (i = 0 ; i < nb_blocks+3 ; ++i) {
-        JDBG("previous victims: %d blk %d\n", i, meta_blkordr[i]);
-    }
-#endif
+	if (read_meta_page(pg, buf) != 0 ||
+	    memcmp(sb->magic, SB_MAGIC, sizeof(sb->magic)))
+		return 0;
+	crc = sb->crc;
+	sb->crc = 0;
+	if (crc32(~0, buf, meta_config.page_size) != crc)
+		return 0;
+	sb->crc = crc;
+	return 1;
+}
 
-    //Find If we have enough free blocks to update
-    for(i = 0 ; i < nb_blocks ; ++i) {
-        if( meta_blkordr[i] != -1 ) {
-            ; //format_single(meta_blkordr[i]);
-        }
-        JDBG("cmp1: old of victims: %d blk %d\n", i, meta_blkordr[i]);
-    }
-   
-    memcpy(meta_blkordr_pre, meta_blkordr, sizeof(int)*MAX_META_BLK);
-    
-    for(i=0; i<nb_blocks; i++) {
-       meta_blkordr[i]=-2;
-    }
-    
-	for(i = 0 ; i < config.nb_blocks ; ++i){
-        int dd, is_used1=0;
-        for(dd=0; dd<nb_blocks; dd++)
-        //for(dd=0; dd<enough_blocks; dd++)
-            if( i == meta_blkordr[dd])
-                is_used1=1;
-        if(is_used1==1)
-            continue;
-        is_used1=0;
-        for(dd=0; dd<nb_blocks; dd++)
-        //for(dd=0; dd<enough_blocks; dd++)
-            if( i==meta_blkordr_pre[dd])
-                is_used1=1;
-        if(is_used1==1)
-            continue;
+/* sb_forget( void)
+ * Back to the state of a mount without superblock: the partition is
+ * scanned, and the next record starts from erased slots
+ */
+static void sb_forget(void)
+{
+	meta_nb_log = 0;
+	bitmap_zero(meta_blk_map, config.nb_blocks);
+	meta_log_seq = 0;
+	meta_ckpt_pg = -1;
+	sb_slot = -1;
+	sb_all = 1;
+	bitmap_zero(sb_dirty_map, config.nb_blocks);
+	sb_nb_dirty = 0;
+}
 
-        if( meta_config.blocks[i].current_page_offset == 0 && meta_config.blocks[i].state == BLK_FREE) {
-            int z, winner = -1;
-            for(z=i+1; z < config.nb_blocks; z++) {// look til to end, find the least number // wear leveling
-                int ee, is_used2;
-                if( meta_config.blocks[z].current_page_offset != 0 || meta_config.blocks[z].state != BLK_FREE)
-                    continue;
-                is_used2=0;
-                for(ee=0; ee<nb_blocks; ee++)
-                //for(ee=0; ee<enough_blocks; ee++)
-                    if( z == meta_blkordr[ee])
-                        is_used2=1;
-                if(is_used2==1)
-                    continue;
-                is_used2=0;
-                for(ee=0; ee<nb_blocks; ee++)
-                //for(ee=0; ee<enough_blocks; ee++)
-                    if(z == meta_blkordr_pre[ee])
-                        is_used2=1;
-                if(is_used2==1)
-                    continue;
-                
-                if( winner == -1)
-                    winner = z;
-                else if (meta_config.blocks[z].worn < meta_config.blocks[winner].worn)
-                    winner = z;
-            }
-            if(winner == -1) // not found a good pg after i
-                winner = i;
-            meta_config.blocks[winner].state = BLK_USED;
-		    JDBG("flush previous META victim %d, new META victim is %d\n", meta_blkordr_pre[enough_blocks], i);
-			if(meta_blkordr_pre[enough_blocks] != -1)
-                format_single(meta_blkordr_pre[enough_blocks]);
-			meta_blkordr[enough_blocks] = winner;
-			++enough_blocks;
-            if(enough_blocks >= nb_blocks) 
-                break;
+/* sb_load( buf)
+ * Find the newest superblock record and take the log blocks, the last
+ * checkpoint and the changed blocks from it: the first page of each slot
+ * and a binary search of the current one. buf is a page of the metadata
+ * partition.
+ *
+ * Return
+ * 0: Success
+ * -1: no usable record, see sb_forget()
+ */
+static int sb_load(char *buf)
+{
+	struct sb_rec *sb = (struct sb_rec *)buf;
+	unsigned long long gen = 0;
+	int i, blk, slot = -1, lo, hi, mid, ppb = meta_config.pages_per_block;
+
+	if (!sb_on)
+		return -1;
+	/* the slot in use holds the newest first record */
+	for (i = 0; i < SB_NB_SLOTS; i++)
+		if (sb_valid(i * ppb, buf) && (slot < 0 || sb->gen > gen)) {
+			slot = i;
+			gen = sb->gen;
 		}
+	if (slot < 0)
+		return -1;
+
+	/* records fill the pages of a slot in order, the last programmed
+	 * one may be torn */
+	lo = 0;
+	hi = ppb;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (read_meta_page(slot * ppb + mid, buf) == 0 &&
+		    !memchr_inv(buf, 0xff, meta_config.page_size))
+			hi = mid;
+		else
+			lo = mid;
 	}
-	JDBG("enough_blocks %d >=? nb_blocks %d break\n", enough_blocks, nb_blocks);
-	
-    for (i = 0 ; i < nb_blocks ; ++i) {
-        JDBG("cmp2: parts of victims: %d blk %d\n", i, meta_blkordr[i]);
-    }
-    
-	while(enough_blocks < nb_blocks){
-        JDBG("enough_blocks %d nb_blocks %d\n", enough_blocks, nb_blocks);
-		if(meta_blkordr_pre[enough_blocks] != -1) { // - recycle - //
-            JDBG("%s(): flush meta_blkordr[%d] META blk %d\n",
-                    __func__, enough_blocks, meta_blkordr_pre[enough_blocks]);
-			format_single(meta_blkordr_pre[enough_blocks]);
-            meta_config.blocks[meta_blkordr_pre[enough_blocks]].state = BLK_USED;
-			++enough_blocks;
-		}
-		else {
-		    printk(KERN_ERR "%s(): WRONG CALCULATION\n", __func__);
-			BUG();
-        }
+	sb_slot = slot;
+	sb_next = lo + 1;
+	while (!sb_valid(slot * ppb + lo, buf))
+		lo--;
+
+	/* a store striped otherwise has its keys in other partitions */
+	if (sb->nb_chunks != meta_nb_chunks || sb->nb_blocks != config.nb_blocks ||
+	    max(sb->nb_parts, 1) != config.nb_parts || sb->ckpt_pg < 0 ||
+	    sb->nb_log <= 0 || sb->nb_log > MAX_META_BLK ||
+	    sb->nb_dirty > config.nb_blocks)
+		goto unusable;
+	sb_gen = sb->gen;
+	meta_nb_log = sb->nb_log;
+	meta_log_seq = sb->log_seq;
+	meta_ckpt_pg = sb->ckpt_pg;
+	for (i = 0; i < sb->nb_log; i++) {
+		blk = sb->blk[i];
+		if (blk < 0 || blk >= config.nb_blocks)
+			goto unusable;
+		meta_blkordr[i] = blk;
+		meta_blkno[i] = sb->log_seq - sb->nb_log + i;
+		set_bit(blk, meta_blk_map);
 	}
-
-	//Have enough blocks now, keep going
-	buffer_size = meta_config.page_size;
-	buffer = kzalloc(buffer_size, GFP_ATOMIC);
-	if(!buffer) {
-		printk(KERN_ERR "kmalloc failed\n");
-		BUG();
+	sb_all = sb->nb_dirty < 0;
+	for (i = 0; i < sb->nb_dirty; i++) {
+		blk = sb->blk[sb->nb_log + i];
+		if (blk < 0 || blk >= config.nb_blocks)
+			goto unusable;
+		if (!test_and_set_bit(blk, sb_dirty_map))
+			sb_nb_dirty++;
 	}
+	return 0;
 
-    // current victims
-    spin_lock_irqsave(&list_lock, lflags);
-    for (i = 0 ; i < nb_blocks ; ++i) {
-        meta_config.blocks[meta_blkordr[i]].state = BLK_USED;
-        JDBG("current victims: %d blk %d\n", i, meta_blkordr[i]);
-    }
-    spin_unlock_irqrestore(&list_lock, lflags);
-
-#if DEBUG_P6
-	JDBG("#blk meta pages %d\n", (meta_config.block_info_size/meta_config.page_size)+1);
-	JDBG("#hash meta pages %d\n", (meta_config.hashtable_size/meta_config.page_size)+1);
-#endif
-
-    /* flush to DISK*/
-    meta_config.metadata_size = meta_config.hashtable_size + meta_config.block_info_size;
-	blk_pgs = (meta_config.block_info_size / meta_config.page_size);
-    hs_pgs = (meta_config.hashtable_size / meta_config.page_size);
-    JDBG2("blk_pgs %d hs_pgs %d\n", blk_pgs, hs_pgs);
-
-	for (i = 0; i < nb_pages; i++) {
-        JDBG2("%s(): Global_RAM pg_num (i) %d/%d (0~max) jack_ofs %d\n", __func__, i, nb_pages-1, jack_ofs);
-    
-        // Read from RAM and compose data
-        if( i <= ((meta_config.block_info_size/meta_config.page_size)-1) ) { // only 0
-            memcpy( buffer,
-                    ((void*)meta_config.blocks) + (i*meta_config.page_size),
-                    meta_config.page_size);
-#if 0
-            if(meta_config.block_info_size!= meta_config.page_size) BUG(); //sef-test
-#endif       
-            JDBG2("%s(); JJ BLK_INFO (i) %d/%d (0~max)\n", __func__,  i, blk_pgs-1);
-            
-        } else { // hash
-            memcpy(buffer, 
-                        ((void*)hashtable) + ((i-blk_pgs) * meta_config.page_size), 
-                        meta_config.page_size);
-            JDBG2("%s(): JJ HASH (i-blk_pgs) %d/%d (0~max)\n", __func__, i-blk_pgs, hs_pgs-1);
-        } 
-        
-        if( (i%(config.pages_per_block-1)) == 0) { // i=0, i=63, i=63*n
-		    JDBG2("\n\n%s(): ||| write_hdr(META) |||  ### pg_idx %d #### blk %d (\% 64 == 0)\n", __func__, 
-                            (meta_blkordr[jack_ofs]*config.pages_per_block), meta_blkordr[jack_ofs]);
-            ret = write_hdr(meta_blkordr[jack_ofs]*config.pages_per_block, NAND_META_DATA, jack_ofs);
-			jack_ofs++;
-		}
-        JDBG2("%s(): write_data(META) ### pg_idx %d ### = disk_base_ofs %d + ram %d + head %d\n\n", __func__,
-                    (meta_blkordr[jack_ofs-1] * config.pages_per_block) + (i%(config.pages_per_block-1)) + (head),
-                    (meta_blkordr[jack_ofs-1] * config.pages_per_block) , (i%(config.pages_per_block-1)) , (head));
-        // head: manually offset
-        if(write_page((meta_blkordr[jack_ofs-1]*config.pages_per_block) 
-                                    + (i%(config.pages_per_block-1)) + (head),
-                                                                buffer ) != 0){
-            printk(KERN_ERR "%s(): ERR ERR ERR\n", __func__);
-            BUG(); //ret = -1;
-		}
-	}
-    
-	kfree(buffer);
-	//spin_unlock_irqrestore(&erase_lock, eflags);
-	spin_unlock(&erase_lock);
-flush_meta_exit2:
-    atomic_set(&meta_config.recent_update, 0);
-    atomic_set(&is_flush, 0);
-	return ret;
+unusable:
+	printk(PRINT_PREF "unusable superblock, ignored\n");
+	sb_forget();
+	return -1;
 }
 
-/**
- * Freeing structures on exit of module
+/* sb_write( nb_release)
+ * Append a superblock record: the log without its nb_release oldest blocks
+ * (about to be erased), its last checkpoint and the blocks changed since.
+ * The log grows under sb_mutex (meta_new_block()) and shrinks with kv_sem
+ * held for writing, it does not change meanwhile. A superblock that cannot
+ * be written is erased, the next mount scans the partition
+ *
+ * Return
+ * VOID
  */
-void destroy_config(void)
+static void sb_write(int nb_release)
 {
-	//Free all meta_config blocks & hashtable
-	kfree(meta_config.blocks);
-    kfree(hashtable);
-
-	//Unlock config
-	put_mtd_device(config.mtd);
-	//Unlock meta_config
-	put_mtd_device(meta_config.mtd);
+	struct sb_rec *sb = (struct sb_rec *)sb_buf;
+	int i, n, ppb = meta_config.pages_per_block;
+	int room = (meta_config.page_size - sizeof(*sb)) / sizeof(int);
+
+	mutex_lock(&sb_mutex);
+	n = meta_nb_log - nb_release;
+	if (!sb_on)
+		goto out;
+	if (meta_config.read_only)
+		goto drop;
+
+	memset(sb_buf, 0, meta_config.page_size);
+	memcpy(sb->magic, SB_MAGIC, sizeof(sb->magic));
+	sb->gen = sb_gen + 1;
+	sb->nb_chunks = meta_nb_chunks;
+	sb->nb_blocks = config.nb_blocks;
+	sb->nb_parts = config.nb_parts;
+	sb->ckpt_pg = meta_ckpt_pg;
+	sb->log_seq = meta_log_seq;
+	sb->nb_log = n;
+	memcpy(sb->blk, meta_blkordr + nb_release, n * sizeof(int));
+	if (sb_all || n + sb_nb_dirty > room)
+		sb->nb_dirty = -1;
+	else
+		for_each_set_bit(i, sb_dirty_map, config.nb_blocks)
+			sb->blk[n + sb->nb_dirty++] = i;
+	sb->crc = crc32(~0, sb_buf, meta_config.page_size);
+
+	/* the next slot once this one is full. The first record starts from
+	 * erased slots, no older record may look newer */
+	if (sb_slot < 0 || sb_next == ppb) {
+		if (sb_slot < 0 ? meta_erase(0, SB_NB_SLOTS) :
+		    meta_erase((sb_slot + 1) % SB_NB_SLOTS, 1))
+			goto drop;
+		sb_slot = (sb_slot + 1) % SB_NB_SLOTS;
+		sb_next = 0;
+	}
+	if (write_meta_page(sb_slot * ppb + sb_next, sb_buf) != 0)
+		goto drop;
+	sb_next++;
+	sb_gen++;
+out:
+	mutex_unlock(&sb_mutex);
+	return;
+
+drop:
+	printk(KERN_ERR "%s(): superblock dropped, the next mount scans\n", __func__);
+	sb_on = 0;
+	meta_erase(0, SB_NB_SLOTS);
+	mutex_unlock(&sb_mutex);
 }
 
-/* invalid_pg( int hashtable_index)
- * Takes a hashtable index and updates page data at index to be INVALIDATED
+/* sb_changing( blk)
+ * Data block blk is about to be written or erased: the superblock lists it
+ * first, unless it does already. Same locking as sb_write()
  *
  * Return
  * VOID
  */
-void invalid_pg(int hash_idx)
+static void sb_changing(int blk)
 {
-    int pg_idx;
-    
-    hashtable[hash_idx].p_state = PG_FREE;
-    pg_idx = hashtable[hash_idx].index;
-	JDBG("%s(): hash_idx %d pg_idx %d\n", __func__, hash_idx, pg_idx);
-    //meta_config.blocks[pg_idx/config.pages_per_block].nb_invalid++;
-    config.blocks[pg_idx/config.pages_per_block].nb_invalid++;
-	/* delete the page metadata from the valid-page-list */
-    list_del(&hashtable[hash_idx].p_list);
-    
-	JDBG("invalidated a page in blk %d\n", pg_idx/config.pages_per_block);
+	int listed;
+
+	mutex_lock(&sb_mutex);
+	listed = !sb_on || sb_all || test_and_set_bit(blk, sb_dirty_map);
+	if (!listed)
+		sb_nb_dirty++;
+	mutex_unlock(&sb_mutex);
+	if (!listed)
+		sb_write(0);
 }
 
-/* gc_check( void)
- * If too many invalid pages, don't wait until timmer interrupt handler
+/* sb_checkpoint( nb_release)
+ * A checkpoint is on flash: from now on the changed blocks are the open
+ * ones and the nb_release oldest log blocks, about to be erased. Called
+ * with kv_sem held for writing
  *
  * Return
  * VOID
  */
-void gc_check(void)
+static void sb_checkpoint(int nb_release)
 {
-    int i;
-    static int write_cnt = 0;
+	int i;
+
+	mutex_lock(&sb_mutex);
+	bitmap_zero(sb_dirty_map, config.nb_blocks);
+	sb_nb_dirty = 0;
+	sb_all = 0;
+	for (i = 0; i < config.nb_blocks; i++)
+		if (blk_cls[i] == BLK_C_OPEN || blk_cls[i] == BLK_C_OWNED) {
+			set_bit(i, sb_dirty_map);
+			sb_nb_dirty++;
+		}
+	for (i = 0; i < nb_release; i++)
+		if (!test_and_set_bit(meta_blkordr[i], sb_dirty_map))
+			sb_nb_dirty++;
+	mutex_unlock(&sb_mutex);
+	sb_write(nb_release);
+}
+
+/* bg_account( t, start)
+ * Account a GC pass or a checkpoint that started at start
+ */
+static void bg_account(struct bg_time *t, ktime_t start)
+{
+	unsigned long long us = ktime_us_delta(ktime_get(), start);
+
+	t->nb++;
+	t->us += us;
+	if (us > t->max_us)
+		t->max_us = us;
+}
+
+/* journal_write( void)
+ * Append journal_buf to the log, called with journal_mutex held and kv_sem
+ * held. The open data page is programmed first, the records may point into
+ * it. If the page cannot be written, its records are only on flash once
+ * the next checkpoint is, which journal_lost asks for.
+ *
+ * Return
+ * VOID
+ */
+static void journal_write(void)
+{
+	int pg;
+
+	if (journal_nb == 0)
+		return;
+	frontier_flush_all();
+	/* a late checkpoint must still find the room it needs */
+	pg = meta_log_room(0) > 0 ? meta_log_page(1) : -1;
+	if (pg < 0 || meta_write_rec(pg, META_REC_JOURNAL, journal_nb, journal_buf) != 0) {
+		printk(KERN_ERR "%s(): %d records wait for the next checkpoint\n",
+		       __func__, journal_nb);
+		journal_lost = 1;
+	} else
+		journal_pages++;
+	journal_nb = 0;
+	memset(journal_buf, 0, config.page_size);
+}
+
+/* journal_rec_init( r, type, h, page, old)
+ * Fill a journal record and give it the next sequence number. Called with
+ * the hash segment lock of the key held, see journal_seq.
+ */
+static inline void journal_rec_init(struct journal_rec *r, int type,
+				    unsigned int h, int page, int old)
+{
+	r->seq = atomic_inc_return(&journal_seq);
+	r->type = type;
+	r->hash = h;
+	r->page = page;
+	r->old = old;
+}
+
+/* journal_append( r)
+ * Add record r to the journal, the page is written to the log once full.
+ * Called with kv_sem held, may sleep.
+ *
+ * Return
+ * VOID
+ */
+static void journal_append(const struct journal_rec *r)
+{
+	mutex_lock(&journal_mutex);
+	memcpy(journal_buf + sizeof(struct meta_rec) + journal_nb * sizeof(*r),
+	       r, sizeof(*r));
+	if (++journal_nb == journal_per_pg)
+		journal_write();
+	mutex_unlock(&journal_mutex);
+	atomic_set(&meta_config.recent_update, 1);
+}
+
+/* __journal_commit( void)
+ * Write the records gathered so far, called with kv_sem held
+ */
+static void __journal_commit(void)
+{
+	mutex_lock(&journal_mutex);
+	journal_write();
+	mutex_unlock(&journal_mutex);
+}
+
+/* journal_commit( void)
+ * Make every index update made so far durable: a single journal page is
+ * written for all of them. When the checkpoint is late and the log has no
+ * room left for it, the checkpoint is taken here
+ *
+ * Return
+ * VOID
+ */
+static void journal_commit(void)
+{
+	down_read(&kv_sem);
+	__journal_commit();
+	up_read(&kv_sem);
+	if (ACCESS_ONCE(journal_lost))
+		flush_metadata(true);
+}
+
+/* kv_sync( void)
+ * IOCTL_SYNC, and every set/del of a KV_OPT_SYNC session: make the updates
+ * made so far durable, the open page included, without waiting for the
+ * flush timer
+ *
+ * Return
+ * 0: Success
+ * -4: the journal page (and then the checkpoint) could not be written
+ */
+int kv_sync(void)
+{
+	journal_commit();
+	return ACCESS_ONCE(journal_lost) ? -4 : 0;
+}
+
+/* journal_full( void)
+ * Is it time for a checkpoint?
+ */
+static inline int journal_full(void)
+{
+	return ACCESS_ONCE(journal_pages) >= JOURNAL_MAX_PAGES ||
+		ACCESS_ONCE(journal_lost);
+}
+
+/* __flush_metadata( void)
+ * Body of flush_metadata(), called with kv_sem held for writing: the
+ * snapshot must be consistent, the journal quiet and log blocks get erased
+ *
+ * Return: see flush_metadata()
+ */
+static int __flush_metadata(void)
+{
+	char *buffer;
+	int i, c, pg, nb_dirty, nb_release = 0, ret = 0;
+	struct journal_rec r;
+	ktime_t start;
+
+	/* the index may point into the open page */
+	if (frontier_flush_all() != 0)
+		return -1;
+	nb_dirty = bitmap_weight(meta_dirty_map, meta_nb_chunks);
+	if (nb_dirty == 0 && !journal_lost)
+		return 0;
+	start = ktime_get();
+
+	buffer = kmalloc(config.page_size, GFP_KERNEL);
+	if(!buffer) {
+		printk(KERN_ERR "kmalloc failed\n");
+		return -1;
+	}
+
+	/* clean the oldest log blocks until the new chunks and the checkpoint
+	 * fit: their chunks that are still current are appended again */
+	while (meta_log_room(nb_release) < nb_dirty + 2 * meta_ckpt_pages &&
+	       nb_release < meta_nb_log && meta_blkordr[nb_release] != meta_cur_blk) {
+		int blk = meta_blkordr[nb_release++];
+
+		for (c = 0; c < meta_nb_chunks; c++)
+			if (meta_map[c] / config.pages_per_block == blk &&
+			    !test_and_set_bit(c, meta_dirty_map))
+				nb_dirty++;
+	}
+	JDBG("%s(): %d dirty chunks, %d log blocks cleaned\n", __func__, nb_dirty, nb_release);
+
+	for_each_set_bit(c, meta_dirty_map, meta_nb_chunks) {
+		int len = min(meta_chunk, meta_image_size - c * meta_chunk);
+
+		pg = meta_log_page(1);
+		if (pg < 0) {
+			ret = -1;
+			goto flush_meta_free;
+		}
+		memset(buffer, 0, config.page_size);
+		meta_image_copy(buffer + sizeof(struct meta_rec), c * meta_chunk, len, 0);
+		if (meta_write_rec(pg, META_REC_CHUNK, c, buffer) != 0) {
+			printk(KERN_ERR "%s(): write of chunk %d failed\n", __func__, c);
+			ret = -1;
+			goto flush_meta_free;
+		}
+		meta_map[c] = pg;
+	}
+
+	/* the checkpoint pages are contiguous, which is how the mount finds
+	 * them. The block info written above may lag behind the log pages
+	 * reserved since, the mount knows about it */
+	pg = meta_log_page(meta_ckpt_pages);
+	if (pg < 0) {
+		ret = -1;
+		goto flush_meta_free;
+	}
+	for (i = 0; i < meta_ckpt_pages; i++) {
+		int per_pg = meta_chunk / sizeof(int);
+		int nb = min(per_pg, meta_nb_chunks - i * per_pg);
+
+		memset(buffer, 0, config.page_size);
+		memcpy(buffer + sizeof(struct meta_rec), meta_map + i * per_pg,
+		       nb * sizeof(int));
+		if (meta_write_rec(pg + i, META_REC_CKPT, i, buffer) != 0) {
+			ret = -1;
+			goto flush_meta_free;
+		}
+	}
+	meta_gen++;
+	meta_ckpt_seq = atomic_read(&journal_seq);
+	meta_ckpt_pg = pg + meta_ckpt_pages - 1;
+	bitmap_zero(meta_dirty_map, meta_nb_chunks);
+
+	/* the checkpoint covers the journal, including what is still in
+	 * journal_buf (kv_sem keeps the journal writers out) */
+	journal_nb = 0;
+	journal_pages = 0;
+	journal_lost = 0;
+	memset(journal_buf, 0, config.page_size);
+
+	/* the superblock points to the new checkpoint before the blocks the
+	 * previous one needed are erased */
+	sb_checkpoint(nb_release);
+
+	/* the cleaned blocks are not referenced anymore, their erase is
+	 * journaled for their erase count */
+	for (i = 0; i < nb_release; i++) {
+		JDBG("%s(): release log blk %d\n", __func__, meta_blkordr[i]);
+		clear_bit(meta_blkordr[i], meta_blk_map);
+		format_single(meta_blkordr[i]);
+		blk_dirty(meta_blkordr[i]);
+		journal_rec_init(&r, JREC_ERASE, 0, meta_blkordr[i], -1);
+		journal_append(&r);
+	}
+	meta_nb_log -= nb_release;
+	memmove(meta_blkordr, meta_blkordr + nb_release, meta_nb_log * sizeof(int));
+	memmove(meta_blkno, meta_blkno + nb_release, meta_nb_log * sizeof(int));
+	bg_account(&ckpt_time, start);
+	
+flush_meta_free:
+	kfree(buffer);
+	return ret;
+}
+
+/* flush_metadata( force)
+ * Checkpoint: flushes the dirty metadata from RAM to the metadata log, then
+ * writes the checkpoint itself. Without force, only done once the journal
+ * reached JOURNAL_MAX_PAGES pages.
+ *
+ * Return
+ * 0  : Success
+ * -1 : write failure, or no free block for the log (the dirty chunks stay
+ *      dirty and are written by the next flush)
+ */
+int flush_metadata(bool force)
+{
+	int ret;
+
+	if (!force && !journal_full())
+		return 0;
+
+	down_write(&kv_sem);
+	ret = __flush_metadata();
+	up_write(&kv_sem);
+	return ret;
+}
+
+/* meta_load_ckpt( buf, last)
+ * Load the metadata image of the checkpoint that ends at log page last.
+ * buf is a page sized buffer.
+ *
+ * Return
+ * 0: Success
+ * 1: no complete checkpoint ends at last
+ * -1: a chunk of the image is lost
+ */
+static int meta_load_ckpt(char *buf, int last)
+{
+	struct meta_rec *rec = (struct meta_rec *)buf;
+	int k, pg, per_pg = meta_chunk / sizeof(int);
+	unsigned long long gen;
+	unsigned int seq;
+
+	if (read_page(last, buf) != 0 ||
+	    memcmp(rec->magic, META_LOG_MAGIC, sizeof(rec->magic)) ||
+	    rec->type != META_REC_CKPT ||
+	    rec->no != rec->nb - 1 || rec->nb != meta_ckpt_pages ||
+	    rec->nb_chunks != meta_nb_chunks ||
+	    last % config.pages_per_block - (rec->nb - 1) < RESERVED_PG_CNT)
+		return 1;
+
+	gen = rec->gen;
+	seq = rec->seq;
+	pg = last - (rec->nb - 1);
+	for (k = 0; k < meta_ckpt_pages; k++) {
+		if (read_page(pg + k, buf) != 0 ||
+		    memcmp(rec->magic, META_LOG_MAGIC, sizeof(rec->magic)) ||
+		    rec->type != META_REC_CKPT || rec->no != k ||
+		    rec->gen != gen)
+			return 1;
+		memcpy(meta_map + k * per_pg, buf + sizeof(*rec),
+		       min(per_pg, meta_nb_chunks - k * per_pg) * sizeof(int));
+	}
+
+	JDBG("%s(): checkpoint gen %llu at pg %d\n", __func__, gen, pg);
+	for (k = 0; k < meta_nb_chunks; k++) {
+		int len = min(meta_chunk, meta_image_size - k * meta_chunk);
+
+		if (meta_map[k] < 0)
+			continue;
+		if (read_page(meta_map[k], buf) != 0 ||
+		    memcmp(rec->magic, META_LOG_MAGIC, sizeof(rec->magic)) ||
+		    rec->type != META_REC_CHUNK || rec->no != k) {
+			printk(KERN_ERR "%s(): chunk %d lost (pg %d)\n", __func__, k, meta_map[k]);
+			return -1;
+		}
+		meta_image_copy(buf + sizeof(*rec), k * meta_chunk, len, 1);
+	}
+	meta_gen = gen;
+	meta_ckpt_seq = seq;
+	meta_ckpt_pg = last;
+	atomic_set(&journal_seq, seq);
+	return 0;
+}
+
+/* meta_load( buf)
+ * Find the newest complete checkpoint in the log and load the metadata
+ * image it describes, when the superblock did not say where it is. buf is
+ * a page sized buffer.
+ *
+ * Return
+ * 0: Success
+ * -1: no usable checkpoint
+ */
+static int meta_load(char *buf)
+{
+	int i, j, ret;
+
+	/* walk the log backward: the last page of a checkpoint ends it */
+	for (i = meta_nb_log - 1; i >= 0; i--)
+		for (j = config.pages_per_block - 1; j >= RESERVED_PG_CNT; j--) {
+			ret = meta_load_ckpt(buf, meta_blkordr[i] * config.pages_per_block + j);
+			if (ret <= 0)
+				return ret;
+		}
+	return -1;
+}
+
+/* compare two journal records by sequence number, see journal_replay() */
+static int cmp_jrec_seq(const void *a, const void *b)
+{
+	const struct journal_rec *ra = a, *rb = b;
+
+	return (int)(ra->seq - rb->seq);
+}
+
+/* journal_apply( r, buf)
+ * Replay journal record r on the RAM metadata. Entries are found from the
+ * hash and location of the record, the key is read from the data page (buf,
+ * a page sized buffer) only when the entry is not in the table: a new key,
+ * or a key whose previous records were skipped. A slot that does not hold a
+ * key of the right hash was erased and reused since, the later records of
+ * that key say where it went. A couple that made it to the index counts in
+ * the nb_records of its block.
+ *
+ * Return
+ * VOID
+ */
+static void journal_apply(const struct journal_rec *r, char *buf)
+{
+	const struct slot_rec *rec;
+	int idx, key_len;
+	blk_info *blk;
+
+	switch (r->type) {
+	case JREC_ERASE:
+		if (r->page < 0 || r->page >= config.nb_blocks)
+			return;
+		blk = &meta_config.blocks[r->page];
+		blk->state = BLK_FREE;
+		blk->nb_invalid = 0;
+		blk->nb_records = 0;
+		blk->current_page_offset = 0;
+		blk->worn++;
+		blk_dirty(r->page);
+		return;
+
+	case JREC_DEL:
+		idx = hash_search_index(hashtable, r->hash, r->old);
+		if (idx >= 0)
+			hash_del(hashtable, idx);
+		return;
+
+	case JREC_SET:
+	case JREC_SET_EXT:
+		if (r->page < 0 || LOC_PAGE(r->page) >= config.nb_blocks * config.pages_per_block)
+			return;
+		blk = &meta_config.blocks[LOC_PAGE(r->page) / config.pages_per_block];
+		if (r->old >= 0) {
+			idx = hash_search_index(hashtable, r->hash, r->old);
+			if (idx >= 0)
+				goto found;
+		}
+		if (read_page(LOC_PAGE(r->page), buf) != 0)
+			return;
+		rec = slot_page_rec(buf, config.page_size, LOC_SLOT(r->page));
+		if (!rec || rec->key_len == 0)
+			return;
+		key_len = rec->key_len;
+		memmove(buf, rec->data, key_len);
+		buf[key_len] = '\0';
+		if (hash(buf) != r->hash)
+			return;
+		idx = hash_search(hashtable, buf, r->hash);
+		if (idx < 0) {
+			idx = hash_add(hashtable, buf, r->hash, r->page);
+			if (idx == -2 && key_arena_compact(hashtable) > 0)
+				idx = hash_add(hashtable, buf, r->hash, r->page);
+		}
+		if (idx < 0) {
+			printk(KERN_ERR "%s(): no room for key %s\n", __func__, buf);
+			return;
+		}
+	found:
+		hashtable[idx].index = r->page;
+		hashtable[idx].flags = (r->type == JREC_SET_EXT) ? BKT_EXT : 0;
+		meta_dirty(&hashtable[idx], sizeof(bucket));
+		/* the extent pages written since the checkpoint are counted by
+		 * init_scan(), from the live ones */
+		blk->nb_records++;
+		blk_dirty(blk - meta_config.blocks);
+		return;
+	}
+}
+
+/* journal_replay( buf)
+ * Replay the journal records written after the checkpoint loaded by
+ * meta_load(), in sequence number order up to the first missing one (a
+ * journal page that did not make it to flash). buf is a page sized buffer.
+ *
+ * Return
+ * the number of journal pages found after the checkpoint
+ * -1: allocation failure
+ */
+static int journal_replay(char *buf)
+{
+	struct meta_rec *rec = (struct meta_rec *)buf;
+	struct journal_rec *recs;
+	int *pages, nb_pages = 0, nb = 0, cap, i, j, first, pg, ppb = config.pages_per_block;
+	unsigned int seq = meta_ckpt_seq;
+
+	for (first = 0; first < meta_nb_log; first++)
+		if (meta_blkordr[first] == meta_ckpt_pg / ppb)
+			break;
+	if (first == meta_nb_log)
+		return 0;
+	pages = kmalloc((meta_nb_log - first) * ppb * sizeof(int), GFP_KERNEL);
+	if (!pages)
+		return -1;
+
+	/* 1. the journal pages follow the checkpoint in the log, the pages
+	 * of a log block are written in order */
+	for (i = first; i < meta_nb_log; i++) {
+		j = (i == first) ? meta_ckpt_pg % ppb + 1 : RESERVED_PG_CNT;
+		for (; j < ppb; j++) {
+			pg = meta_blkordr[i] * ppb + j;
+			if (read_page(pg, buf) != 0)
+				continue;
+			if (!memchr_inv(buf, 0xff, config.page_size))
+				break;
+			if (memcmp(rec->magic, META_LOG_MAGIC, sizeof(rec->magic)) ||
+			    rec->type != META_REC_JOURNAL || rec->no > journal_per_pg)
+				continue;
+			pages[nb_pages++] = pg;
+			nb += rec->no;
+		}
+	}
+
+	cap = nb;
+	recs = vmalloc(max(cap, 1) * sizeof(*recs));
+	if (!recs) {
+		kfree(pages);
+		return -1;
+	}
+	for (i = 0, nb = 0; i < nb_pages; i++) {
+		if (read_page(pages[i], buf) != 0 || nb + rec->no > cap)
+			continue;
+		memcpy(recs + nb, buf + sizeof(*rec), rec->no * sizeof(*recs));
+		nb += rec->no;
+	}
+	kfree(pages);
+
+	/* 2. apply them in order */
+	sort(recs, nb, sizeof(*recs), cmp_jrec_seq, NULL);
+	for (i = 0; i < nb; i++) {
+		if ((int)(recs[i].seq - seq) <= 0)
+			continue;
+		if (recs[i].seq != seq + 1)
+			break;
+		journal_apply(&recs[i], buf);
+		seq++;
+	}
+	vfree(recs);
+
+	printk(PRINT_PREF "%u journal records replayed (%d pages) after checkpoint %llu\n",
+	       seq - meta_ckpt_seq, nb_pages, meta_gen);
+	atomic_set(&journal_seq, seq);
+	return nb_pages;
+}
+
+/* hash_parts_ok( void)
+ * Check that every key of the loaded index lives in its partition
+ * (hash_part()): not the case when the image comes from a store striped
+ * on another number of partitions
+ *
+ * Return
+ * 1: the index matches the partitions
+ * 0: it does not
+ */
+static int hash_parts_ok(void)
+{
+	int i;
+
+	for (i = 0; i < HASH_SIZE; i++)
+		if (hashtable[i].p_state == PG_VALID &&
+		    blk_part(LOC_PAGE(hashtable[i].index) /
+			     config.pages_per_block) != hash_part(hashtable[i].hash))
+			return 0;
+	return 1;
+}
+
+/**
+ * Launch time metadata creation: flash is scanned to determine which flash 
+ * blocs and pages are free/occupied. 
+ *
+ * Return
+ *  0: OK
+ * -1: Error
+ */
+int init_scan()
+{
+	char *buf;
+	int i, j, no, sb, loaded, nb_journal = 0, nb_looked = 0;
+	int hdr_len = strlen(META_HDR_BASE);
+	unsigned long *erased, *looked;
+    
+	/* called at module load, nobody else is running yet */
+	buf = kzalloc(max(config.page_size, meta_config.page_size), GFP_KERNEL);
+	erased = kzalloc(BITS_TO_LONGS(config.nb_blocks) * sizeof(unsigned long), GFP_KERNEL);
+	looked = kzalloc(BITS_TO_LONGS(config.nb_blocks) * sizeof(unsigned long), GFP_KERNEL);
+    if(!buf || !erased || !looked)
+        BUG();
+
+	/* the superblock says where the log and its checkpoint are, and which
+	 * blocks may have changed since: only those are looked at */
+	sb = sb_load(buf) == 0;
+	if (sb && meta_load_ckpt(buf, meta_ckpt_pg) != 0) {
+		printk(PRINT_PREF "checkpoint of the superblock not found, scanning\n");
+		sb_forget();
+		sb = 0;
+	}
+	if (sb) {
+		if (sb_all)
+			bitmap_fill(looked, config.nb_blocks);
+		else
+			bitmap_copy(looked, sb_dirty_map, config.nb_blocks);
+		for_each_set_bit(i, looked, config.nb_blocks) {
+			if (is_meta_blk(i))
+				continue;
+			if (read_page(i * config.pages_per_block, buf) != 0) {
+				printk(KERN_ERR "%s(): read_page failed\n", __func__);
+				BUG();
+			}
+			if (!memchr_inv(buf, 0xff, config.page_size))
+				set_bit(i, erased);
+			nb_looked++;
+		}
+		goto image;
+	}
+	bitmap_fill(looked, config.nb_blocks);
+	nb_looked = config.nb_blocks;
+
+	/* the first page of a block tells what it is: erased (free), data
+	 * header or metadata log header. Log blocks are kept in header
+	 * number order */
     for (i = 0; i < config.nb_blocks; i++) {
-        if(meta_config.blocks[i].nb_invalid >= INVALID_THRESHOLD2) {
-            gc();
-            //print_hash();
+        if ( read_page(i*config.pages_per_block, buf) !=0 ) {
+            printk(KERN_ERR "%s(): read_page failed\n", __func__);
+            BUG();
+        } 
+
+		if (!memchr_inv(buf, 0xff, config.page_size)) {
+			set_bit(i, erased);
+			continue;
+		}
+        if (memcmp(buf, META_HDR_BASE, hdr_len))
+            continue;
+        if (meta_nb_log >= MAX_META_BLK) {
+            printk(KERN_ERR "%s(): too many log blocks\n", __func__);
             break;
         }
+        no = simple_strtol(buf + hdr_len, NULL, 10);
+        for (j = meta_nb_log; j > 0 && meta_blkno[j - 1] > no; j--) {
+            meta_blkordr[j] = meta_blkordr[j - 1];
+            meta_blkno[j] = meta_blkno[j - 1];
+        }
+        meta_blkordr[j] = i;
+        meta_blkno[j] = no;
+        meta_nb_log++;
+        set_bit(i, meta_blk_map);
+        if (no >= meta_log_seq)
+            meta_log_seq = no + 1;
+    }
+    JDBG("%s(): %d log blocks\n", __func__, meta_nb_log);
+
+	loaded = meta_nb_log && meta_load(buf) == 0;
+image:
+	if (sb || loaded) {
+		loaded = 1;
+		bitmap_zero(meta_dirty_map, meta_nb_chunks);
+	} else {
+		printk(PRINT_PREF "no metadata checkpoint found\n");
+		for (i = 0; i < meta_nb_chunks; i++)
+			meta_map[i] = -1;
+		memset(meta_config.blocks, 0xff, meta_config.block_info_size);
+		hash_reset(hashtable);
+		bitmap_fill(meta_dirty_map, meta_nb_chunks);
+	}
+	/* appends go to a new block, the last one may have half written pages */
+	meta_cur_blk = -1;
+
+	if (hash_recount(hashtable) != 0 || !hash_parts_ok()) {
+		/* e.g. metadata written with another hashtable layout, or
+		 * striped on other partitions */
+		printk(PRINT_PREF "inconsistent hashtable metadata, starting with an empty index (format needed)\n");
+		hash_reset(hashtable);
+		loaded = 0;
+	}
+
+	/* the index updates made after the checkpoint */
+	if (loaded)
+		nb_journal = journal_replay(buf);
+   
+	//For all config blocks
+	for (i = 0; i < config.nb_blocks; i++)
+	{
+		blk_info *blk = &meta_config.blocks[i], old = *blk;
+
+		/* the image may predate the last changes of the log itself */
+		if (is_meta_blk(i)) {
+			blk->state = BLK_USED;
+			blk->nb_invalid = 0;
+			blk->nb_records = 0;
+			blk->current_page_offset = config.pages_per_block;
+			continue;
+		}
+		//If block is empty
+		if(blk->state == 0xFFFFFFFF || test_bit(i, erased)) // very first time
+		{
+			blk->state = BLK_FREE;
+			if (blk->worn == 0xFFFFFFFF)
+				blk->worn = 0;
+			blk->nb_invalid = 0;
+			blk->nb_records = 0;
+			blk->current_page_offset = 0;
+		}
+		/* pages written since the checkpoint: the offset moves past the
+		 * pages that are programmed already, never to write them again */
+		if (test_bit(i, looked) && !test_bit(i, erased)) {
+			while (blk->current_page_offset < config.pages_per_block) {
+				if (read_page(i * config.pages_per_block + blk->current_page_offset, buf) == 0 &&
+				    !memchr_inv(buf, 0xff, config.page_size))
+					break;
+				blk->current_page_offset++;
+			}
+			if (blk->current_page_offset > 0)
+				blk->state = BLK_USED;
+		}
+		if (memcmp(&old, blk, sizeof(old)))
+			blk_dirty(i);
+	}
+	kfree(erased);
+	kfree(looked);
+	kfree(buf);
+	printk(PRINT_PREF "mounted %s superblock, %d blocks looked at\n",
+	       sb ? "from the" : "without", nb_looked);
+
+	//For all hashtable entries
+	for (i = 0; i < HASH_SIZE; i++)
+	{
+		//if hashtable entry is valid mark its slot live
+		if (hashtable[i].p_state == PG_VALID &&
+		    LOC_PAGE(hashtable[i].index) < config.nb_blocks * config.pages_per_block) {
+			set_bit(hashtable[i].index, valid_map);
+			/* and the extent pages of a multi-page couple, the
+			 * workers do not run yet */
+			if (hashtable[i].flags & BKT_EXT)
+				mark_extents(hashtable[i].index, 1,
+					     &hash_part(hashtable[i].hash)->scratch);
+		}
+	}
+
+	/* the ordered index is not on flash, it comes from the hashtable */
+	oindex_clear();
+	for (i = 0; i < HASH_SIZE; i++) {
+		struct oi_node *node;
+
+		if (hashtable[i].p_state != PG_VALID)
+			continue;
+		node = oindex_node(bucket_key(&hashtable[i]),
+				   hashtable[i].key_len, hashtable[i].hash,
+				   GFP_KERNEL);
+		if (!node) {
+			printk(KERN_ERR "%s(): no memory for the ordered index\n", __func__);
+			return -1;
+		}
+		oindex_insert(node);
 	}
-    if(write_cnt++ >= FLUSH_THRESHOLD2) {
-        write_cnt=0;
-        flush_metadata(true);
+
+	/* a couple written in a data block that is not the current one of a
+	 * key is invalid */
+	for (i = 0; i < config.nb_blocks; i++) {
+		blk_info *blk = &meta_config.blocks[i];
+		int first = LOC(i * config.pages_per_block, 0);
+		int end = LOC((i + 1) * config.pages_per_block, 0);
+		int nb_live = 0, nb_records = blk->nb_records;
+
+		if (is_meta_blk(i) || blk->state != BLK_USED)
+			continue;
+		for (j = first; (j = find_next_bit(valid_map, end, j)) < end; j++)
+			nb_live++;
+		if (nb_records < nb_live)
+			nb_records = nb_live;
+		if (blk->nb_invalid != nb_records - nb_live ||
+		    blk->nb_records != nb_records) {
+			blk->nb_invalid = nb_records - nb_live;
+			blk->nb_records = nb_records;
+			blk_dirty(i);
+		}
+	}
+	inv_rebuild();
+	blk_class_all();
+    
+	if (is_read_only())
+	{
+		//No healthy blocks left!
+		printk(PRINT_PREF "read only mode\n");
+
+		//Switch Disk to READ-ONLY
+		config.read_only = 1;
+		meta_config.read_only = 1;
+	}
+
+	/* the journal starts afresh from a checkpoint: what follows a record
+	 * that could not be replayed must not be mixed with the new ones */
+	if (nb_journal != 0 && flush_metadata(true) != 0)
+		printk(KERN_ERR "%s(): checkpoint after replay failed\n", __func__);
+ 
+	return 0;
+}
+
+/**
+ * Freeing structures on exit of module
+ */
+void destroy_config(void)
+{
+	int i, n;
+
+	//Free all meta_config blocks & hashtable
+	kfree(meta_config.blocks);
+    kfree(hashtable);
+	vfree(key_arena);
+	hash_ctrl_exit();
+	meta_log_exit();
+	kfree(blk_lock);
+	kfree(blk_seq);
+	vfree(valid_map);
+	kfree(hdr_buf);
+	kfree(inv_node);
+	kfree(blk_cls);
+	kfree(blk_fr);
+	kfree(blk_tier);
+	/* the first partition has the start of the shared arrays */
+	kfree(parts[0].inv_bkt);
+	kfree(parts[0].free_heap.ent);
+	kfree(parts[0].free_heap.pos);
+	vcache_clear();
+	oindex_clear();
+
+	for (i = 0; i < config.nb_parts; i++) {
+		destroy_workqueue(parts[i].wq);
+		kv_scratch_free(&parts[i].scratch);
+		for (n = 0; n < parts[i].nb_fr + GC_TIERS; n++) {
+			kfree(parts[i].fr[n].buf);
+			kfree(parts[i].fr[n].ext);
+		}
+		kfree(parts[i].fr);
+		//Unlock config
+		put_mtd_device(parts[i].mtd);
+	}
+	//Unlock meta_config
+	put_mtd_device(meta_config.mtd);
+}
+
+/* invalid_page( int loc)
+ * Account the couple at location loc as not live anymore: the slot leaves
+ * valid_map and its block gets one more invalid couple for the GC.
+ *
+ * Return
+ * VOID
+ */
+void invalid_page(int loc)
+{
+	int blk = LOC_PAGE(loc) / config.pages_per_block;
+
+	clear_bit(loc, valid_map);
+	vcache_inval(loc);
+	spin_lock(&blk_lock[blk]);
+	meta_config.blocks[blk].nb_invalid++;
+	inv_update(blk);
+	spin_unlock(&blk_lock[blk]);
+	blk_dirty(blk);
+	JDBG("invalidated a page in blk %d\n", blk);
+}
+
+/* blk_dead_pages( blk)
+ * Pages of blk that a GC pass would give back: its written pages, times
+ * the share of its couples that are invalid. A page holds couples of about
+ * the same size on average, and written pages without any couple are dead
+ * (a crash lost their journal records)
+ *
+ * Return
+ * the number of pages
+ */
+static int blk_dead_pages(int blk)
+{
+	blk_info *b = &meta_config.blocks[blk];
+	int used = b->current_page_offset - RESERVED_PG_CNT, live;
+
+	if (is_meta_blk(blk) || used <= 0)
+		return 0;
+	if (b->nb_records <= 0)
+		return used;
+	live = clamp(b->nb_records - b->nb_invalid, 0, b->nb_records);
+	return used - DIV_ROUND_UP(live * used, b->nb_records);
+}
+
+/* inv_update( blk)
+ * Move blk to the GC bucket of its current number of dead pages, in its
+ * partition, called with blk_lock[blk] held
+ *
+ * Return
+ * VOID
+ */
+static void inv_update(int blk)
+{
+	struct kv_part *p = blk_part(blk);
+	int n = blk_dead_pages(blk);
+
+	n = clamp(n, 0, config.pages_per_block);
+	spin_lock(&p->inv_lock);
+	list_move(&inv_node[blk], &p->inv_bkt[n]);
+	if (n > p->inv_max)
+		p->inv_max = n;
+	spin_unlock(&p->inv_lock);
+}
+
+/* inv_rebuild( void)
+ * Sort every block in the GC buckets, after the block info was loaded or
+ * reset as a whole
+ *
+ * Return
+ * VOID
+ */
+static void inv_rebuild(void)
+{
+	int i;
+
+	for (i = 0; i < config.nb_blocks; i++) {
+		spin_lock(&blk_lock[i]);
+		inv_update(i);
+		spin_unlock(&blk_lock[i]);
+	}
+}
+
+/* inv_top( p, min, blk)
+ * Highest number of invalid pages of a block of partition p, if it is at
+ * least min. The buckets above it are empty, inv_max only goes down on the
+ * way, so the search is O(1) amortized
+ *
+ * Return
+ * the number of invalid pages, blk is set to the block
+ * -1: no block has min invalid pages
+ */
+static int inv_top(struct kv_part *p, int min, int *blk)
+{
+	int n;
+
+	spin_lock(&p->inv_lock);
+	while (p->inv_max > 0 && list_empty(&p->inv_bkt[p->inv_max]))
+		p->inv_max--;
+	n = p->inv_max;
+	if (n < min || list_empty(&p->inv_bkt[n]))
+		n = -1;
+	else if (blk)
+		*blk = p->inv_bkt[n].next - inv_node;
+	spin_unlock(&p->inv_lock);
+	return n;
+}
+
+/* invalid_pg( int hashtable_index)
+ * Takes a hashtable index, removes the key from the hashtable and marks its
+ * page INVALIDATED, called with the segment lock of the bucket held
+ *
+ * Return
+ * VOID
+ */
+void invalid_pg(int hash_idx)
+{
+    int pg_idx;
+    
+    pg_idx = hashtable[hash_idx].index;
+	JDBG("%s(): hash_idx %d pg_idx %d\n", __func__, hash_idx, pg_idx);
+	oindex_del(bucket_key(&hashtable[hash_idx]), hashtable[hash_idx].key_len,
+		   hashtable[hash_idx].hash);
+	hash_del(hashtable, hash_idx);
+	invalid_page(pg_idx);
+}
+
+/* gc_check( void)
+ * If too many invalid pages, don't wait until timmer interrupt handler:
+ * kick the GC work of the partition. Same for the checkpoint once the
+ * journal is full. Constant time (per partition), called after every write
+ *
+ * Return
+ * VOID
+ */
+void gc_check(void)
+{
+    int i;
+
+    for (i = 0; i < config.nb_parts; i++) {
+        if (inv_top(&parts[i], INVALID_THRESHOLD2, NULL) < 0)
+            continue;
+        if (GC_FOREGROUND)
+            gc_part(&parts[i]);
+        else
+            queue_work(kv_wq, &parts[i].gc_work);
     }
+    if (!journal_full())
+        return;
+    if (GC_FOREGROUND)
+        flush_metadata(false);
+    else
+        queue_work(kv_wq, &meta_flush_work);
+}
+
+/* gc_fallback( p)
+ * Partition p is full, its background GC did not keep up: wait for a pass
+ * that may be running on kv_wq, then run one in the writer's context
+ *
+ * Return
+ * 0: a block may have been freed, the write can be retried
+ * -3: still read-only
+ */
+static int gc_fallback(struct kv_part *p)
+{
+	flush_work(&p->gc_work);
+	gc_part(p);
+	return config.read_only ? -3 : 0;
+}
+
+/* blk_add_records( blk, nb)
+ * Account nb more couples written in blk
+ *
+ * Return
+ * VOID
+ */
+static void blk_add_records(int blk, int nb)
+{
+	spin_lock(&blk_lock[blk]);
+	meta_config.blocks[blk].nb_records += nb;
+	inv_update(blk);
+	spin_unlock(&blk_lock[blk]);
+	blk_dirty(blk);
+}
+
+/* frontier_program( fr)
+ * Program the open page of fr, called with fr->lock held. The page was
+ * reserved before, it is written even if the store went read-only since
+ *
+ * Return
+ * 0: Success
+ * -2: write error
+ */
+static int frontier_program(struct frontier *fr)
+{
+	int ret;
+
+	ret = __write_page(fr->pg, fr->buf);
+	fr->nb_data_pgs++;
+	/* readers of the page go to flash from now on */
+	write_seqcount_begin(&fr->seq);
+	fr->pg = -1;
+	write_seqcount_end(&fr->seq);
+	return ret;
+}
+
+/* frontier_add( fr, key, key_len, val, val_len, loc)
+ * Body of frontier_append(), called with fr->lock held
+ */
+static int frontier_add(struct frontier *fr, const char *key, int key_len,
+			const char *val, int val_len, int *loc)
+{
+	int pg, slot;
+
+	if (fr->pg >= 0 && !slot_page_room(fr->buf, key_len, val_len) &&
+	    frontier_program(fr) != 0)
+		return -4;
+	if (fr->pg < 0) {
+		pg = get_next_page_to_write(fr);
+		if (pg < 0)
+			return -3;
+		write_seqcount_begin(&fr->seq);
+		memset(fr->buf, 0, config.page_size);
+		slot_page_init(fr->buf, config.page_size);
+		fr->pg = pg;
+		write_seqcount_end(&fr->seq);
+	}
+	slot = slot_page_add(fr->buf, key, key_len, val, val_len);
+	*loc = LOC(fr->pg, slot);
+	fr->nb_recs++;
+	blk_add_records(fr->pg / config.pages_per_block, 1);
+	return 0;
+}
+
+/* frontier_append( fr, key, key_len, val, val_len, loc)
+ * Append a couple to the open page of fr, after programming it if the
+ * couple does not fit anymore, or to a new page. *loc receives the location
+ * of the couple.
+ *
+ * Return
+ * 0: Success
+ * -3: no free page
+ * -4: write error
+ */
+static int frontier_append(struct frontier *fr, const char *key, int key_len,
+			   const char *val, int val_len, int *loc)
+{
+	int ret;
+
+	mutex_lock(&fr->lock);
+	ret = frontier_add(fr, key, key_len, val, val_len, loc);
+	mutex_unlock(&fr->lock);
+	return ret;
+}
+
+/* frontier_append_ext( fr, key, key_len, val, val_len, loc)
+ * Write a value too large for a page: its extent pages first, each with
+ * the key in its header, then the head (the key and the extent list) is
+ * appended like any couple. The open page is programmed before, pages of a
+ * block are programmed in order, and its buffer builds the extent pages.
+ * The extent pages are live from the start, the sem of the partition keeps
+ * its GC out until the head is published. *loc receives the location of
+ * the head.
+ *
+ * Return
+ * 0: Success
+ * -1: the free pages are too scattered for EXT_MAX extents
+ * -3: no free page
+ * -4: write error
+ */
+static int frontier_append_ext(struct frontier *fr, const char *key,
+			       int key_len, const char *val, int val_len,
+			       int *loc)
+{
+	struct ext_page *p = (struct ext_page *)fr->buf;
+	struct slot_ext *e = fr->ext;
+	int per_pg = ext_page_data(config.page_size, key_len);
+	int max_ext = (slot_max_data(config.page_size) - key_len -
+		       (int)sizeof(struct slot_ext)) / (int)sizeof(struct slot_extent);
+	int ofs, len, pg, n, i, ret = 0;
+
+	max_ext = min(max_ext, EXT_MAX);
+	mutex_lock(&fr->lock);
+	e->val_len = val_len;
+	e->nb_ext = 0;
+	if (fr->pg >= 0 && frontier_program(fr) != 0) {
+		ret = -4;
+		goto out;
+	}
+
+	for (ofs = 0; ofs < val_len; ofs += len) {
+		len = min(per_pg, val_len - ofs);
+		pg = get_next_page_to_write(fr);
+		if (pg < 0) {
+			ret = -3;
+			goto drop;
+		}
+		/* an extent is a run of pages of a single block */
+		n = e->nb_ext;
+		if (n == 0 || e->ext[n - 1].page + e->ext[n - 1].nb != pg ||
+		    pg % config.pages_per_block == 0) {
+			if (n == max_ext) {
+				ret = -1;
+				goto drop;
+			}
+			e->ext[n].page = pg;
+			e->ext[n].nb = 0;
+			e->nb_ext++;
+		}
+
+		memset(fr->buf, 0, config.page_size);
+		p->magic = EXT_MAGIC;
+		p->key_len = key_len;
+		p->data_len = len;
+		memcpy(p->data, key, key_len);
+		memcpy(p->data + key_len, val + ofs, len);
+		if (__write_page(pg, fr->buf) != 0) {
+			ret = -4;
+			goto drop;
+		}
+		fr->nb_data_pgs++;
+		e->ext[e->nb_ext - 1].nb++;
+		set_bit(LOC(pg, 0), valid_map);
+		blk_add_records(pg / config.pages_per_block, 1);
+	}
+
+	ret = frontier_add(fr, key, key_len, (const char *)e,
+			   SLOT_EXT | slot_ext_size(e->nb_ext), loc);
+	if (ret == 0)
+		goto out;
+drop:
+	/* the extent pages written so far are dead */
+	for (n = 0; n < e->nb_ext; n++)
+		for (i = 0; i < e->ext[n].nb; i++)
+			invalid_page(LOC(e->ext[n].page + i, 0));
+out:
+	mutex_unlock(&fr->lock);
+	return ret;
+}
+
+/* frontier_coalesce( fr, key, h, key_len, val, val_len)
+ * Overwrite the couple of key in the open page of fr, when its current
+ * version is still there: the set costs no slot, no journal record and no
+ * index update. Nothing pointing into the open page is on flash yet (it is
+ * programmed first), so the page can change until then.
+ *
+ * Return
+ * 1: key was overwritten
+ * 0: key is not in the open page (or the new couple does not fit)
+ */
+static int frontier_coalesce(struct frontier *fr, const char *key,
+			     unsigned int h, int key_len, const char *val,
+			     int val_len)
+{
+	int hash_idx, loc, ret = 0;
+
+	if (ACCESS_ONCE(fr->pg) < 0)
+		return 0;
+	mutex_lock(&fr->lock);
+	if (fr->pg < 0)
+		goto out;
+	/* the location must stay current while the couple is rewritten */
+	hash_write_lock(h);
+	hash_idx = hash_search(hashtable, key, h);
+	if (hash_idx >= 0) {
+		loc = hashtable[hash_idx].index;
+		/* the head of a multi-page couple owns extent pages */
+		if (LOC_PAGE(loc) == fr->pg &&
+		    !(hashtable[hash_idx].flags & BKT_EXT)) {
+			write_seqcount_begin(&fr->seq);
+			ret = slot_page_replace(fr->buf, config.page_size,
+						LOC_SLOT(loc), key, key_len,
+						val, val_len) == 0;
+			write_seqcount_end(&fr->seq);
+			if (ret)
+				vcache_inval(loc);
+		}
+	}
+	hash_write_unlock(h);
+	if (ret)
+		fr->nb_coalesced++;
+out:
+	mutex_unlock(&fr->lock);
+	return ret;
+}
+
+/* frontier_flush( fr)
+ * Program the open page of fr if there is one, the couples in it go to
+ * flash before what points to them (journal, checkpoint) does
+ *
+ * Return
+ * 0: Success
+ * -2: write error
+ */
+static int frontier_flush(struct frontier *fr)
+{
+	int ret = 0;
+
+	mutex_lock(&fr->lock);
+	if (fr->pg >= 0)
+		ret = frontier_program(fr);
+	mutex_unlock(&fr->lock);
+	return ret;
 }
 
-/**
- * Adding a key-value couple. Returns -1 when ok and a negative value on error:
- * -1 when the size to write is too big
- * -2 when the key already exists
- * -3 when we are in read-only mode
- * -4 when the MTD driver returns an error
- * -5 NULL pointer exception
+/* frontier_flush_part( p)
+ * frontier_flush() of every frontier of partition p
+ *
+ * Return
+ * 0: Success
+ * -2: write error
  */
-int set_keyval(const char *key, const char *val)
+static int frontier_flush_part(struct kv_part *p)
 {
-	char *buffer;
-	unsigned long eflags, lflags;
-	int target_block, key_len, val_len, ret, ret2, index, hash_idx;
-	spin_lock_irqsave(&erase_lock, eflags);
+	int i, ret = 0;
 
-	key_len = strlen(key);
-	val_len = strlen(val);
+	for (i = 0; i < p->nb_fr; i++)
+		if (frontier_flush(&p->fr[i]) != 0)
+			ret = -2;
+	return ret;
+}
+
+/* frontier_flush_all( void)
+ * frontier_flush_part() of every partition
+ *
+ * Return
+ * 0: Success
+ * -2: write error
+ */
+static int frontier_flush_all(void)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < config.nb_parts; i++)
+		if (frontier_flush_part(&parts[i]) != 0)
+			ret = -2;
+	return ret;
+}
+
+/* frontier_read( fr, page, buffer)
+ * Copy page in buffer if it is the open page of fr. No lock is taken, a
+ * page switch meanwhile makes the copy start again
+ *
+ * Return
+ * 1: page is open, buffer holds it
+ * 0: page is on flash
+ */
+static int frontier_read(struct frontier *fr, int page, char *buffer)
+{
+	unsigned int seq;
+	int hit;
+
+	do {
+		seq = read_seqcount_begin(&fr->seq);
+		hit = (ACCESS_ONCE(fr->pg) == page);
+		if (hit)
+			memcpy(buffer, fr->buf, config.page_size);
+	} while (read_seqcount_retry(&fr->seq, seq));
+	return hit;
+}
+
+/* read_data_page( page, buffer)
+ * Read data page page from RAM if it is still open, from flash otherwise.
+ * Only the frontier that owns its block may have it open, and it programs
+ * it before it gives the block back
+ *
+ * Return
+ * 0: Success
+ * anything else: MTD read error
+ */
+static int read_data_page(int page, char *buffer)
+{
+	int blk = page / config.pages_per_block, n = ACCESS_ONCE(blk_fr[blk]);
+
+	if (n >= 0 && frontier_read(&blk_part(blk)->fr[n], page, buffer))
+		return 0;
+	return read_page(page, buffer);
+}
+
+/* read_pages( page, nb, buffer)
+ * Read nb consecutive data pages (extent pages, never open) with a single
+ * MTD read
+ *
+ * Return
+ * 0: Success
+ * anything else: MTD read error
+ */
+static int read_pages(int page, int nb, char *buffer)
+{
+	uint64_t addr;
+	struct kv_part *p = part_addr(page, &addr);
+	size_t retlen;
+
+	return p->mtd->_read(p->mtd, addr, (size_t)nb * config.page_size,
+			     &retlen, buffer);
+}
+
+/* head_extents( loc, buffer, e)
+ * Copy to e the extent list of the multi-page couple whose head is at loc,
+ * buffer is a page sized scratch buffer
+ *
+ * Return
+ * 0: Success
+ * -1: read error, or loc is not the head of a multi-page couple
+ */
+static int head_extents(int loc, char *buffer, struct slot_ext *e)
+{
+	const struct slot_rec *rec;
+
+	if (read_data_page(LOC_PAGE(loc), buffer) != 0)
+		return -1;
+	rec = slot_page_rec(buffer, config.page_size, LOC_SLOT(loc));
+	return rec ? slot_rec_ext(rec, e) : -1;
+}
+
+/* mark_extents( loc, valid, s)
+ * Mark the extent pages of the multi-page couple whose head is at loc live
+ * (valid, at mount) or invalidate them (its head was), see invalid_page().
+ * An extent page has no slot, LOC(page, 0) stands for it in valid_map. The
+ * head is read to s->page, its extent list to s->ext
+ *
+ * Return
+ * VOID
+ */
+static void mark_extents(int loc, int valid, struct kv_scratch *s)
+{
+	int nb_pages = config.nb_blocks * config.pages_per_block;
+	struct slot_ext *e = s->ext;
+	int i, pg;
+
+	if (head_extents(loc, s->page, e) != 0) {
+		printk(KERN_ERR "%s(): no extent list at %d\n", __func__, loc);
+		return;
+	}
+	for (i = 0; i < e->nb_ext; i++)
+		for (pg = max(e->ext[i].page, 0);
+		     pg < e->ext[i].page + e->ext[i].nb && pg < nb_pages; pg++) {
+			if (valid)
+				set_bit(LOC(pg, 0), valid_map);
+			else
+				invalid_page(LOC(pg, 0));
+		}
+}
 
-	if (!key)
+/* __set_keyval( key, val, noreplace, s)
+ * Body of set_keyval(), called with kv_sem and the sem of the partition of
+ * key (key_part()) held for reading.
+ *
+ * The couple is appended to the open page of the write frontier (in RAM),
+ * or overwrites the previous version of the key if that one is still in the
+ * open page. A value too large for a page is written to extent pages and
+ * only its head goes to the open page. The hash segment of the key is only
+ * locked to check for the key and to publish the new location.
+ *
+ * Return: see set_keyval()
+ */
+static int __set_keyval(const char *key, const char *val, int noreplace,
+			struct kv_scratch *s)
+{
+	unsigned int h, seq;
+	int key_len, val_len, ret, ret2, index, hash_idx, old_index = -1;
+	int large, old_ext = 0;
+	struct journal_rec r;
+	struct oi_node *node = NULL;
+	struct frontier *fr;
+
+	if (!key || !val)
 	{
 		printk("NULL pointer execption\n");
 		return -5;
 	}
 
-	if ((key_len + val_len + 2 * sizeof(int)) > config.page_size) {
+	key_len = strlen(key);
+	val_len = strlen(val);
+
+	large = key_len + val_len > slot_max_data(config.page_size);
+	if (large && (val_len > KV_VAL_MAX || key_len > config.page_size / 2)) {
 		/* size to write is too big */
 		printk(KERN_INFO ">> ERROR: DATA size too big!\n");
 		return -1;
 	}
 
-	
 	if (config.read_only) {
 		printk(KERN_INFO ">> ERROR: Disk in READ-ONLY MODE!\n");
-		ret = -3;
-		goto set_exit;
+		return -3;
 	}
-	
-	/* the buffer that we are going to write on flash */
-	buffer = (char *)kzalloc(config.page_size * sizeof(char), GFP_ATOMIC);
-	if(!buffer) {
-		printk(KERN_ERR "kmalloc failed\n");
-		BUG();
+
+	h = hash(key);
+	fr = part_frontier(hash_part(h));
+
+	/* do not burn a flash page for a couple that will be refused, nor for
+	 * a new key that has no room in the key arena */
+	if (noreplace || !key_arena_room(key_len)) {
+		do {
+			seq = hash_read_begin(h);
+			hash_idx = hash_search(hashtable, key, h);
+		} while (hash_read_retry(h, seq));
+		if (hash_idx >= 0 && noreplace)
+			return -2;
+		if (hash_idx < 0 && !key_arena_room(key_len))
+			return -6;
+	}
+
+	/* overwrites of a key written since the open page was started stay
+	 * in RAM */
+	if (!noreplace && !large &&
+	    frontier_coalesce(fr, key, h, key_len, val, val_len)) {
+		atomic_set(&meta_config.recent_update, 1);
+		return 0;
+	}
+
+	if (large)
+		ret = frontier_append_ext(fr, key, key_len, val, val_len,
+					  &index);
+	else
+		ret = frontier_append(fr, key, key_len, val, val_len,
+				      &index);
+	if (ret != 0)
+		return ret;
+
+	/* a new key also goes to the ordered index, its node is allocated
+	 * before the segment lock is taken */
+	do {
+		seq = hash_read_begin(h);
+		hash_idx = hash_search(hashtable, key, h);
+	} while (hash_read_retry(h, seq));
+	if (hash_idx < 0)
+		node = oindex_node(key, key_len, h, GFP_KERNEL);
+
+	/* publish the new location: if the key already exists, its old couple
+	 * is invalidated, otherwise the key is added to the RAM hashtable */
+	hash_write_lock(h);
+	hash_idx = hash_search(hashtable, key, h);
+	if (hash_idx >= 0 && noreplace) {
+		/* another writer won the race */
+		hash_write_unlock(h);
+		oindex_free(node);
+		if (large)
+			mark_extents(index, 0, s);
+		invalid_page(index);
+		return -2;
 	}
-	
-	/* if the key already exists: Invalidate curr page, & write new one!! */
-    spin_lock_irqsave(&list_lock, lflags);
-	hash_idx = hash_search(hashtable, key);
 	if (hash_idx >= 0) {
-		JDBG(PRINT_PREF "Key \"%s\" already exists in page %d. Replacing it\n", key, hashtable[hash_idx].index);
-		invalid_pg(hash_idx);
+		JDBG(PRINT_PREF "Key \"%s\" already exists at %d. Replacing it\n", key, hashtable[hash_idx].index);
+		old_index = hashtable[hash_idx].index;
+		old_ext = hashtable[hash_idx].flags & BKT_EXT;
+		hashtable[hash_idx].index = index;
+		hashtable[hash_idx].flags = large ? BKT_EXT : 0;
+		meta_dirty(&hashtable[hash_idx], sizeof(bucket));
+		ret2 = hash_idx;
+	} else {
+		/* deleted since the lookup above */
+		if (!node)
+			node = oindex_node(key, key_len, h, GFP_ATOMIC);
+		ret2 = node ? hash_add(hashtable, key, h, index) : -1;
+		if (ret2 >= 0) {
+			oindex_insert(node);
+			node = NULL;
+		}
+		if (ret2 >= 0 && large) {
+			hashtable[ret2].flags = BKT_EXT;
+			meta_dirty(&hashtable[ret2], sizeof(bucket));
+		}
+	}
+	if (ret2 >= 0) {
+		set_bit(index, valid_map);
+		journal_rec_init(&r, large ? JREC_SET_EXT : JREC_SET, h, index,
+				 old_index);
+	}
+	hash_write_unlock(h);
+	/* added meanwhile by another writer */
+	oindex_free(node);
+
+	if (ret2 >= 0)
+		journal_append(&r);
+	if (old_index >= 0) {
+		/* the head is read for its extent list before it may die */
+		if (old_ext)
+			mark_extents(old_index, 0, s);
+		invalid_page(old_index);
+	}
+
+	/* Metadata Update Flag */
+    atomic_set(&meta_config.recent_update, 1);
+
+	if (ret2 < 0) {
+		if (large)
+			mark_extents(index, 0, s);
+		invalid_page(index);
+		return (ret2 == -2) ? -6 : -5; /* hash_add error */
+	}
+
+	return 0;
+}
+
+/* compact_keys( void)
+ * Reclaim the space of the deleted keys in the key arena, called without
+ * kv_sem nor a partition sem held when a set found the arena full
+ *
+ * Return
+ * the number of bytes reclaimed (0: the arena is full of live keys)
+ */
+static int compact_keys(void)
+{
+	int ret;
+
+	down_write(&kv_sem);
+	ret = key_arena_compact(hashtable);
+	up_write(&kv_sem);
+	if (ret > 0)
+		atomic_set(&meta_config.recent_update, 1);
+	JDBG("%s(): %d bytes reclaimed\n", __func__, ret);
+	return ret;
+}
+
+/**
+ * Adding a key-value couple. Returns 0 when ok and a negative value on error:
+ * -1 when the size to write is too big
+ * -2 when the key already exists
+ * -3 when we are in read-only mode
+ * -4 when the MTD driver returns an error
+ * -5 NULL pointer exception
+ * -6 when the key arena is full (even after compaction)
+ *
+ * noreplace: if set, an existing key is not overwritten and -2 is returned
+ * s: the buffers of the caller, see kv_scratch_init()
+ */
+int set_keyval(const char *key, const char *val, int noreplace,
+	       struct kv_scratch *s)
+{
+	struct kv_part *p = key_part(key);
+	int ret;
+
+	part_lock(p);
+	ret = __set_keyval(key, val, noreplace, s);
+	part_unlock(p);
+
+	if (ret == -6 && compact_keys() > 0) {
+		part_lock(p);
+		ret = __set_keyval(key, val, noreplace, s);
+		part_unlock(p);
+	}
+
+	/* no free page left in p: GC did not keep up, do it here. The erase
+	 * of the victim leaves read-only mode */
+	if (ret == -3 && gc_fallback(p) == 0) {
+		part_lock(p);
+		ret = __set_keyval(key, val, noreplace, s);
+		part_unlock(p);
+	}
+
+	gc_check();
+	return ret;
+}
+
+/* mset_part( p, items, nr, noreplace, s)
+ * The sets of mset_keyval() that go to partition p, under a single
+ * acquisition of its locks, with the buffers s
+ *
+ * Return
+ * the number of couples successfully written
+ */
+static int mset_part(struct kv_part *p, struct kv_item *items, int nr,
+		     int noreplace, struct kv_scratch *s)
+{
+	int i, ok = 0;
+
+	part_lock(p);
+	for (i = 0; i < nr; i++) {
+		if (items[i].part != p->no)
+			continue;
+		items[i].status = __set_keyval(items[i].key, items[i].val,
+					       noreplace, s);
+		if (items[i].status == -6) {
+			part_unlock(p);
+			if (compact_keys() > 0) {
+				part_lock(p);
+				items[i].status = __set_keyval(items[i].key,
+						items[i].val, noreplace, s);
+			} else
+				part_lock(p);
+		}
+		if (items[i].status == -3) {
+			/* see set_keyval() */
+			part_unlock(p);
+			if (gc_fallback(p) == 0) {
+				part_lock(p);
+				items[i].status = __set_keyval(items[i].key,
+						items[i].val, noreplace, s);
+			} else
+				part_lock(p);
+		}
+		if (items[i].status == 0)
+			ok++;
+	}
+	part_unlock(p);
+	return ok;
+}
+
+/* the share of a batch of sets handed to the worker of a partition */
+struct mset_work {
+	struct work_struct work;
+	struct kv_part *p;
+	struct kv_item *items;
+	int nr, noreplace, ok;
+};
+
+static void mset_work_fn(struct work_struct *work)
+{
+	struct mset_work *w = container_of(work, struct mset_work, work);
+
+	/* the works of wq run one at a time */
+	w->ok = mset_part(w->p, w->items, w->nr, w->noreplace, &w->p->scratch);
+}
+
+/* mset_keyval( items, nr, noreplace, s)
+ * Batched set_keyval(): the couples are split by partition, those of a
+ * partition are written under a single acquisition of its locks, and the
+ * partitions are written at the same time: all but the first one by their
+ * worker (kv_part.wq), the first one by the caller. items[i].status
+ * receives the set_keyval() return code of each couple. The caller's part
+ * uses its buffers s, those of the workers the partition ones.
+ *
+ * Return
+ * the number of couples successfully written
+ */
+int mset_keyval(struct kv_item *items, int nr, int noreplace,
+		struct kv_scratch *s)
+{
+	struct mset_work w[KV_PARTS_MAX];
+	int i, n, first = -1, ok = 0;
+	unsigned int used = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (!items[i].key || !items[i].val) {
+			items[i].part = -1;
+			items[i].status = -5;
+			continue;
+		}
+		items[i].part = key_part(items[i].key)->no;
+		used |= 1U << items[i].part;
+	}
+
+	for (n = 0; n < config.nb_parts; n++) {
+		if (!(used & (1U << n)))
+			continue;
+		if (first < 0) {
+			first = n;
+			continue;
+		}
+		w[n] = (struct mset_work) {
+			.p = &parts[n], .items = items, .nr = nr,
+			.noreplace = noreplace,
+		};
+		INIT_WORK_ONSTACK(&w[n].work, mset_work_fn);
+		queue_work(parts[n].wq, &w[n].work);
+	}
+	if (first >= 0)
+		ok = mset_part(&parts[first], items, nr, noreplace, s);
+	for (n = first + 1; first >= 0 && n < config.nb_parts; n++) {
+		if (!(used & (1U << n)))
+			continue;
+		flush_work(&w[n].work);
+		destroy_work_on_stack(&w[n].work);
+		ok += w[n].ok;
+	}
+
+	gc_check();
+	return ok;
+}
+
+/* loc_blk( loc)
+ * Block of location loc
+ */
+static inline int loc_blk(int loc)
+{
+	return LOC_PAGE(loc) / config.pages_per_block;
+}
+
+/* __lookup_page( key, seq)
+ * Find the location of key. No lock is taken: the hashtable segment is read
+ * inside a seqcount section, and *seq receives the erase sequence of the
+ * block of the location, see page_erased().
+ *
+ * Return
+ * the location, LOC(page, slot)
+ * -1: key not found
+ */
+static int __lookup_page(const char *key, unsigned int *seq)
+{
+	unsigned int h = hash(key), s;
+	int hash_index, loc;
+
+	do {
+		s = hash_read_begin(h);
+		loc = -1;
+		hash_index = hash_search(hashtable, key, h);
+		if (hash_index >= 0 && hashtable[hash_index].p_state == PG_VALID) {
+			loc = hashtable[hash_index].index;
+			/* sampled before the index can be moved away from the
+			 * block, so a later erase of it is always noticed */
+			*seq = read_seqcount_begin(&blk_seq[loc_blk(loc)]);
+		}
+	} while (hash_read_retry(h, s));
+
+	if (loc < 0) {
+        JDBG("JACK: key %s not found\n", key);
+		return -1;
+	}
+	if (meta_config.blocks[loc_blk(loc)].state != BLK_USED)
+		return -1;
+
+	return loc;
+}
+
+/* page_erased( loc, seq)
+ * Tell whether the block of loc was erased since __lookup_page() returned
+ * seq, in which case what was read from the page is garbage and the lookup
+ * must be done again
+ */
+static inline int page_erased(int loc, unsigned int seq)
+{
+	return read_seqcount_retry(&blk_seq[loc_blk(loc)], seq);
+}
+
+/* slot_keyval( buffer, loc, key, val, val_size)
+ * Copy the value of the couple in slot LOC_SLOT(loc) of the page image in
+ * buffer to val (val_size bytes, including the terminating NUL)
+ *
+ * Return
+ * the page index on success
+ * -1: the slot does not hold key
+ * -3: the value does not fit in val_size bytes
+ * -8: multi-page couple, see __get_stream()
+ */
+static int slot_keyval(const char *buffer, int loc, const char *key,
+		       char *val, int val_size)
+{
+	const struct slot_rec *rec;
+
+	rec = slot_page_rec(buffer, config.page_size, LOC_SLOT(loc));
+	if (!rec || rec->key_len != strlen(key) ||
+	    strncmp(rec->data, key, rec->key_len))
+		return -1;
+
+	if (rec->val_len & SLOT_EXT)
+		return -8;
+	if (rec->val_len + 1 > val_size)
+		return -3;
+
+	memcpy(val, rec->data + rec->key_len, rec->val_len);
+	val[rec->val_len] = '\0';
+	return LOC_PAGE(loc);
+}
+
+/* __read_keyval( loc, key, val, val_size, buffer)
+ * Read the couple stored at location loc and copy its value in val
+ * (val_size bytes, including the terminating NUL). buffer is a scratch
+ * buffer of config.page_size bytes. The page may be erased under us, the
+ * caller checks page_erased() before trusting the result.
+ *
+ * Return
+ * the page index on success
+ * -1: the slot does not hold key
+ * -2: MTD read error
+ * -3: the value does not fit in val_size bytes
+ */
+static int __read_keyval(int loc, const char *key, char *val,
+			 int val_size, char *buffer)
+{
+	if (read_data_page(LOC_PAGE(loc), buffer) != 0) 
+	{
+        printk("pg idx %d blk %d\n", LOC_PAGE(loc), loc_blk(loc));
+		return -2;
+	}
+
+	return slot_keyval(buffer, loc, key, val, val_size);
+}
+
+#define EXT_READ_PGS 8	/* extent pages read by a single MTD read */
+
+/* ext_stream( e, key, key_len, fn, arg, bounce)
+ * Pass the value held by the extent pages of e to fn, in order. Each
+ * extent is read EXT_READ_PGS pages at a time into bounce. The pages may be
+ * erased under us, the caller checks the ext_seq of the partition of key
+ * before trusting the result.
+ *
+ * Return
+ * 0: Success
+ * -2: MTD read error, or an extent page that does not belong to key
+ * anything else: the error of fn
+ */
+static int ext_stream(const struct slot_ext *e, const char *key, int key_len,
+		      kv_chunk_fn fn, void *arg, char *bounce)
+{
+	int nb_pages = config.nb_blocks * config.pages_per_block;
+	int per_pg = ext_page_data(config.page_size, key_len);
+	const struct ext_page *p;
+	int i, j, pg, end, nb, ofs = 0, ret;
+
+	for (i = 0; i < e->nb_ext; i++) {
+		end = e->ext[i].page + e->ext[i].nb;
+		if (e->ext[i].page < 0 || e->ext[i].nb < 1 || end > nb_pages)
+			return -2;
+		for (pg = e->ext[i].page; pg < end; pg += nb) {
+			nb = min(EXT_READ_PGS, end - pg);
+			if (read_pages(pg, nb, bounce) != 0)
+				return -2;
+			for (j = 0; j < nb; j++) {
+				p = (const struct ext_page *)(bounce +
+							      j * config.page_size);
+				if (p->magic != EXT_MAGIC || p->key_len != key_len ||
+				    memcmp(p->data, key, key_len) ||
+				    p->data_len > per_pg ||
+				    ofs + p->data_len > e->val_len)
+					return -2;
+				ret = fn(arg, ofs, p->data + key_len, p->data_len);
+				if (ret != 0)
+					return ret;
+				ofs += p->data_len;
+			}
+		}
+	}
+	return (ofs == e->val_len) ? 0 : -2;
+}
+
+/* __get_stream( key, val_size, fn, arg, len, s)
+ * Lockless lookup + read of key, the value is passed to fn in chunks (a
+ * single one unless it is a multi-page couple). Retried while the page we
+ * read from gets erased (GC relocation, format), and for a multi-page couple
+ * while a GC pass or a format ran meanwhile: its extents may have moved.
+ * *len receives the value length. s holds the buffers of the read, see
+ * kv_scratch_init().
+ *
+ * Return
+ * the page index of the couple (of its head) on success
+ * -1: key not found
+ * -2: MTD read error, or a broken multi-page couple
+ * -3: the value does not fit in val_size bytes, including the NUL
+ * anything else: the error of fn
+ */
+static int __get_stream(const char *key, int val_size, kv_chunk_fn fn,
+			void *arg, int *len, struct kv_scratch *s)
+{
+	const struct slot_rec *rec;
+	struct slot_ext *e = s->ext;
+	char *buffer = s->page, *bounce = s->bounce;
+	seqcount_t *ext_seq = &hash_part(hash(key))->ext_seq;
+	unsigned int seq, es, gen;
+	int loc, ret, worn;
+
+	while (1) {
+		es = read_seqcount_begin(ext_seq);
+		loc = __lookup_page(key, &seq);
+		if (loc < 0) {
+			ret = -1;
+			break;
+		}
+		/* a cached value needs no read, only a current lookup */
+		worn = ACCESS_ONCE(meta_config.blocks[loc_blk(loc)].worn);
+		ret = vcache_get(loc, worn, buffer, config.page_size);
+		if (ret >= 0) {
+			*len = ret;
+			if (*len + 1 > val_size)
+				ret = -3;
+			else
+				ret = fn(arg, 0, buffer, *len);
+			goto check;
+		}
+		gen = vcache_gen(loc);
+		if (read_data_page(LOC_PAGE(loc), buffer) != 0) {
+			ret = -2;
+			goto check;
+		}
+		rec = slot_page_rec(buffer, config.page_size, LOC_SLOT(loc));
+		if (!rec || rec->key_len != strlen(key) ||
+		    strncmp(rec->data, key, rec->key_len)) {
+			ret = -1;
+			goto check;
+		}
+
+		if (!(rec->val_len & SLOT_EXT)) {
+			*len = rec->val_len;
+			if (*len + 1 > val_size)
+				ret = -3;
+			else
+				ret = fn(arg, 0, rec->data + rec->key_len, *len);
+			if (ret == 0 && !page_erased(loc, seq))
+				vcache_put(loc, worn, gen, rec->data + rec->key_len,
+					   *len);
+			goto check;
+		}
+
+		/* multi-page couple */
+		if (slot_rec_ext(rec, e) != 0)
+			ret = -2;
+		else {
+			*len = e->val_len;
+			if (*len + 1 > val_size)
+				ret = -3;
+			else
+				ret = ext_stream(e, key, rec->key_len, fn, arg,
+						 bounce);
+		}
+		if (read_seqcount_retry(ext_seq, es))
+			continue;
+check:
+		if (!page_erased(loc, seq))
+			break;
 	}
-    spin_unlock_irqrestore(&list_lock, lflags);
 
-	/* key size ... */
-	memcpy(buffer, &key_len, sizeof(int));
-	/* ... value size ... */
-	memcpy(buffer + sizeof(int), &val_len, sizeof(int));
-	/* ... the key itself ... */
-	memcpy(buffer + 2 * sizeof(int), key, key_len);
-	/* ... then the value itself. */
-	memcpy(buffer + 2 * sizeof(int) + key_len, val, val_len);
+	return (ret == 0) ? LOC_PAGE(loc) : ret;
+}
+
+/* chunk_to_buf( arg, ofs, data, len)
+ * kv_chunk_fn copying the value to the buffer at arg
+ */
+static int chunk_to_buf(void *arg, int ofs, const char *data, int len)
+{
+	memcpy((char *)arg + ofs, data, len);
+	return 0;
+}
+
+/* __get_keyval( key, val, val_size, s)
+ * Lockless lookup + read of key to val (val_size bytes, including the
+ * terminating NUL), see __get_stream()
+ *
+ * Return: see __get_stream()
+ */
+static int __get_keyval(const char *key, char *val, int val_size,
+			struct kv_scratch *s)
+{
+	int len, ret;
 
-	target_block = get_next_block_to_write();
+	ret = __get_stream(key, val_size, chunk_to_buf, val, &len, s);
+	if (ret >= 0)
+		val[len] = '\0';
+	return ret;
+}
 
-    if(target_block == -1)
-        return -3;
-	//Get Index of page we are writing to
-	index = target_block * config.pages_per_block + meta_config.blocks[target_block].current_page_offset;
+/* get_keyval_stream( key, val_size, fn, arg, len, s)
+ * __get_keyval() for values of any size: the value is passed to fn in chunks
+ * of at most a page, in order, so that it can be copied to its destination
+ * (a user buffer) with no bounce buffer of the value size. val_size is the
+ * room at the destination, the terminating NUL included, *len receives the
+ * value length. fn may be called again from offset 0 if a GC pass moved the
+ * value meanwhile. s holds the buffers of the read, see kv_scratch_init()
+ *
+ * Return: see __get_stream()
+ */
+int get_keyval_stream(const char *key, int val_size, kv_chunk_fn fn,
+		      void *arg, int *len, struct kv_scratch *s)
+{
+	return __get_stream(key, val_size, fn, arg, len, s);
+}
 
-	/* actual write on flash */
-	ret = write_page(index, buffer);
-    
-	//Add Key value to RAM hashtable
-	spin_lock_irqsave(&list_lock, lflags);
-	ret2 = hash_add(hashtable, key, index);
-	/* add page metadata to the valid-page-list */
-	list_add(&hashtable[ret2].p_list, meta_config.blocks[target_block].list); 
-	spin_unlock_irqrestore(&list_lock, lflags);
-	kfree(buffer);
+/* kv_scratch_init( s)
+ * Allocate the buffers of s at once: a page, the EXT_READ_PGS pages of a
+ * multi-page read, an extent list and the order of a batch
+ *
+ * Return
+ * 0: Success
+ * -1: allocation failure
+ */
+int kv_scratch_init(struct kv_scratch *s)
+{
+	char *p;
 
-	spin_unlock_irqrestore(&erase_lock, eflags);
-	
-	/* Metadata Update Flag */
-    atomic_set(&meta_config.recent_update, 1);
+	p = vmalloc(config.page_size * (1 + EXT_READ_PGS) +
+		    slot_ext_size(EXT_MAX) + KV_BATCH_MAX * sizeof(*s->order));
+	if (!p)
+		return -1;
+	s->page = p;
+	s->bounce = p + config.page_size;
+	s->ext = s->bounce + EXT_READ_PGS * config.page_size;
+	s->order = (struct kv_item **)((char *)s->ext + slot_ext_size(EXT_MAX));
+	return 0;
+}
 
-	gc_check();
-	if (ret == -1)		/* read-only */
-		return -3;
-	else if (ret == -2)	/* write error */
-		return -4;
+/* kv_scratch_free( s)
+ * Free the buffers of s
+ */
+void kv_scratch_free(struct kv_scratch *s)
+{
+	vfree(s->page);
+	s->page = NULL;
+}
 
-	if (ret2 < 0)
-		return -5; /* hash_add error */
+/* compare two batch items by location, see mget_keyval() */
+static int cmp_item_page(const void *a, const void *b)
+{
+	const struct kv_item *ia = *(const struct kv_item **)a;
+	const struct kv_item *ib = *(const struct kv_item **)b;
 
-	return 0;
-set_exit:
-    spin_unlock_irqrestore(&erase_lock, eflags);
-    return ret;
+	return ia->page - ib->page;
 }
 
-/**
- * Getting a value from a key.
- * Returns the index of the page containing the key/value couple on success,
- * and a negative number on error:
- * -1 when the key is not found
- * -2 on MTD read error
+/* mget_keyval( items, nr, s)
+ * Batched __get_keyval(): all the keys are looked up first, then the flash
+ * pages are read in increasing page index order, once for all the keys
+ * that share a page. items[i].val receives the value (items[i].val_size
+ * bytes at most) and items[i].status the __get_keyval() return code, or -3
+ * if the value does not fit. nr is KV_BATCH_MAX at most, the buffers come
+ * from s.
+ *
+ * Return
+ * the number of keys found
  */
-int get_keyval(const char *key, char *val)
+int mget_keyval(struct kv_item *items, int nr, struct kv_scratch *s)
 {
-	//int i, j;
-	char *buffer;
-	int key_len, val_len;
-	char *cur_key, *cur_val;
-	unsigned long eflags, lflags;
-	int page_index = -1;
-	int hash_index, ret = -3;
-   
-    buffer = (char *)kmalloc(config.page_size * sizeof(char), GFP_KERNEL);
-	if(!buffer) {
-		printk(KERN_ERR "kmalloc failed\n");
-		BUG();
+	char *buffer = s->page;
+	struct kv_item **order = s->order;
+	int i, nb_found = 0, ok = 0, cur_pg = -1;
+
+	/* 1. resolve every key to its location */
+	for (i = 0; i < nr; i++) {
+		items[i].page = __lookup_page(items[i].key, &items[i].seq);
+		if (items[i].page < 0)
+			items[i].status = -1;
+		else
+			order[nb_found++] = &items[i];
 	}
-	
-    spin_lock_irqsave(&erase_lock, eflags);
-    
-    spin_lock_irqsave(&list_lock, lflags);
-	hash_index = hash_search(hashtable, key);
-	if (hash_index >= 0)
-	{		
-		page_index = hashtable[hash_index].index; 
-		if(meta_config.blocks[page_index / config.pages_per_block].state == BLK_USED)
-		{
-			if (hashtable[hash_index].p_state == PG_FREE)
-			{
-				ret = -1;
-                printk(KERN_ERR "%s(): ERR ERR ERR\n", __func__);
-                goto get_exit;
-			}
 
-			if (read_page(page_index, buffer) != 0) 
-			{
-				ret = -2;
-                printk("pg idx %d blk %d\n", page_index, page_index/config.pages_per_block);
-                BUG();
-                goto get_exit;
-			}
-
-			memcpy(&key_len, buffer, sizeof(int));
-			memcpy(&val_len, buffer + sizeof(int), sizeof(int));
-
-			cur_key = buffer + 2 * sizeof(int);
-			cur_val = buffer + 2 * sizeof(int) + key_len;
-			if (!strncmp(cur_key, key, strlen(key)))
-			{
-				memcpy(val, cur_val, val_len);
-				val[val_len] = '\0';
-				ret = page_index;
-                goto get_exit;
-			}
+	/* 2. read the pages in flash order, a key whose block got erased
+	 * meanwhile is looked up again on its own */
+	sort(order, nb_found, sizeof(struct kv_item *), cmp_item_page, NULL);
+	for (i = 0; i < nb_found; i++) {
+		if (LOC_PAGE(order[i]->page) == cur_pg)
+			order[i]->status = slot_keyval(buffer, order[i]->page,
+						       order[i]->key, order[i]->val,
+						       order[i]->val_size);
+		else {
+			order[i]->status = __read_keyval(order[i]->page, order[i]->key,
+							 order[i]->val, order[i]->val_size,
+							 buffer);
+			cur_pg = (order[i]->status == -2) ? -1 : LOC_PAGE(order[i]->page);
 		}
-	} else {
-        JDBG("JACK: key %s not found\n", key);
-        ret = -1; // **** the reason is... check kvlib.c in userspace
-    }
+		/* multi-page couples are read on their own */
+		if (order[i]->status == -8 ||
+		    page_erased(order[i]->page, order[i]->seq)) {
+			order[i]->status = __get_keyval(order[i]->key,
+							order[i]->val,
+							order[i]->val_size, s);
+			cur_pg = -1;
+		}
+		if (order[i]->status >= 0)
+			ok++;
+	}
 
+	return ok;
+}
 
+/* scan_end( arg, key, len)
+ * oi_fn of scan_keyval(): whether key is past the end of the range arg
+ */
+static int scan_end(void *arg, const char *key, int len)
+{
+	const struct kv_scan *sc = arg;
 
-get_exit:
-	spin_unlock_irqrestore(&list_lock, lflags);
-    spin_unlock_irqrestore(&erase_lock, eflags); 
-	/* key not found */
-	kfree(buffer);
-	return ret;
+	if (sc->prefix && (len < sc->prefix_len ||
+			   memcmp(key, sc->prefix, sc->prefix_len)))
+		return 1;
+	return sc->to && oindex_cmp(key, len, sc->to, sc->to_len) >= 0;
 }
 
-/* del_key( const char *key)
- * Searches hashtable for given key, deletes and returns index of key deleted
+/* scan_keyval( sc, items, nr, keys, keys_size, values, s)
+ * The next keys of the range sc in key order, from the ordered index: at
+ * most nr of them, copied to keys (keys_size bytes) and given in
+ * items[i].key. With values set, their values are then read as
+ * mget_keyval() does, one flash read per page in page order, into the
+ * items[i].val buffers the caller set up
  *
  * Return
- * -1: Key not found in hashtable OR deleting empty Key
- * 0 < x < MAX_HASH_INDEX: returns hashtable index of key that was deleted
+ * the number of keys (0: end of the range)
+ * -2: allocation failure
  */
-int del_key(const char *key)
+int scan_keyval(const struct kv_scan *sc, struct kv_item *items, int nr,
+		char *keys, int keys_size, int values, struct kv_scratch *s)
 {
-	int hash_index, page_index = -1, ret;
-	unsigned long eflags, lflags;
+	int i, n, ret;
+
+	n = oindex_scan(sc->from, sc->from_len, sc->after, scan_end,
+			(void *)sc, nr, keys, keys_size);
+	if (n < 0)
+		return n;
+	for (i = 0; i < n; i++) {
+		items[i].key = keys;
+		keys += strlen(keys) + 1;
+	}
+	if (values && n > 0) {
+		ret = mget_keyval(items, n, s);
+		if (ret < 0)
+			return ret;
+	}
+	return n;
+}
 
-    spin_lock_irqsave(&erase_lock, eflags);
+/* __del_key( key, s)
+ * Body of del_key(), called with kv_sem and the sem of the partition of key
+ * held for reading
+ *
+ * Return: see del_key()
+ */
+static int __del_key(const char *key, struct kv_scratch *s)
+{
+	unsigned int h = hash(key);
+	int hash_index, loc = -1, ret, ext = 0;
+	struct journal_rec r;
 
-	spin_lock_irqsave(&list_lock, lflags);
-	hash_index = hash_search(hashtable, key);
+	hash_write_lock(h);
+	hash_index = hash_search(hashtable, key, h);
 	if (hash_index >= 0) {
-		page_index = hashtable[hash_index].index;
-		if(meta_config.blocks[page_index/config.pages_per_block].state == BLK_USED) {
-			if (hashtable[hash_index].p_state == PG_FREE) {
-				//If we reach here, that means we ran invalid_pg on it
-				//but still hasnt been garbage collected
-				//GC is nondeterministic so this is safety
-
-				printk("tryed to delete a PG_FREE key\n");
-				ret = -1;
-				goto out;
-			}
+		loc = hashtable[hash_index].index;
+		if(meta_config.blocks[loc_blk(loc)].state == BLK_USED) {
+			ext = hashtable[hash_index].flags & BKT_EXT;
 			invalid_pg(hash_index);
+			journal_rec_init(&r, JREC_DEL, h, -1, loc);
 			//printk("deleting key \"%s\"\n", key);
-			ret = page_index;
+			ret = LOC_PAGE(loc);
 			goto out;
 		}
 	}
@@ -937,14 +3498,65 @@ int del_key(const char *key)
 	JDBG("%s(): key not found\n", __func__);
 
 out:
-	spin_unlock_irqrestore(&list_lock, lflags);
-	spin_unlock_irqrestore(&erase_lock, eflags);
+	hash_write_unlock(h);
+	if (ret >= 0)
+		journal_append(&r);
+	/* the dead head still names its extents, the GC of the partition
+	 * waits for its sem */
+	if (ext)
+		mark_extents(loc, 0, s);
+	return ret;
+}
+
+/* del_key( key, s)
+ * Searches hashtable for given key, deletes and returns index of key deleted.
+ * s: the buffers of the caller, see kv_scratch_init()
+ *
+ * Return
+ * -1: Key not found in hashtable OR deleting empty Key
+ * 0 < x < MAX_HASH_INDEX: returns hashtable index of key that was deleted
+ */
+int del_key(const char *key, struct kv_scratch *s)
+{
+	struct kv_part *p = key_part(key);
+	int ret;
+
+	part_lock(p);
+	ret = __del_key(key, s);
+	part_unlock(p);
 	return ret;
 }
 
+/* mdel_key( items, nr, s)
+ * Batched del_key(): the keys of a partition are deleted under a single
+ * acquisition of its locks, items[i].status receives the del_key() return
+ * code
+ *
+ * Return
+ * the number of keys deleted
+ */
+int mdel_key(struct kv_item *items, int nr, struct kv_scratch *s)
+{
+	int i, n, ok = 0;
+
+	for (i = 0; i < nr; i++)
+		items[i].part = key_part(items[i].key)->no;
+	for (n = 0; n < config.nb_parts; n++) {
+		part_lock(&parts[n]);
+		for (i = 0; i < nr; i++) {
+			if (items[i].part != n)
+				continue;
+			items[i].status = __del_key(items[i].key, s);
+			if (items[i].status >= 0)
+				ok++;
+		}
+		part_unlock(&parts[n]);
+	}
+	return ok;
+}
+
 /* is_read_only( void)
- * Iterates through DISK and checks if all blocks and pages therein are Valid
- * and NOT_FREE
+ * Checks if all data blocks are full, from the count kept by blk_class()
  *
  * Return
  * 1: IS READ-ONLY, All blocks used
@@ -954,18 +3566,12 @@ out:
  */
 int is_read_only()
 {
-	int ret = 0;
-	int i;
-    int nb_pages = (meta_config.metadata_size / meta_config.page_size);
-	int nb_blocks = (nb_pages / config.pages_per_block) + 1;
+	int i, nb_full = 0;
 
-	for (i = 0; i < config.nb_blocks; i++)
-	{
-		if (meta_config.blocks[i].current_page_offset >= config.pages_per_block)
-			ret++;
-	}
-
-	if (ret >= (config.nb_blocks-(nb_blocks-1)))
+	for (i = 0; i < config.nb_parts; i++)
+		nb_full += ACCESS_ONCE(parts[i].nb_full_blks);
+	/* full data blocks, the metadata log keeps the room it can grow to */
+	if (nb_full >= (config.nb_blocks - meta_log_cap))
 		return 1;
 	else
 		return 0;
@@ -989,15 +3595,16 @@ int is_read_only()
 int write_hdr(int pg_idx, int data, int meta_blk_num)
 {
 	int ret;
-	char *buf, *tmp;
+	char *buf = hdr_buf, tmp[10];
     
 	if (meta_config.read_only) {
 		return -1;
 	}
 
-	buf = kzalloc(meta_config.page_size, GFP_ATOMIC);
-	if(!buf)
-		BUG();
+	/* data blocks are opened under the alloc_mutex of their partition,
+	 * log blocks under journal_mutex: the page buffer has its own lock */
+	mutex_lock(&hdr_mutex);
+	memset(buf, 0, meta_config.page_size);
     
     if(data == NAND_DATA) {
 #if DEBUG_P6
@@ -1012,7 +3619,6 @@ int write_hdr(int pg_idx, int data, int meta_blk_num)
         ret = write_page(pg_idx, buf);
     }
     else if(data == NAND_META_DATA) {
-        tmp = kzalloc(sizeof(char)*10, GFP_ATOMIC);
         memcpy(buf, &META_HDR_BASE, (size_t)strlen((char*)&META_HDR_BASE));
 #if DEBUG_P6
         JDBG("META: strlen(META_HDR_BASE)\n", strlen(META_HDR_BASE));
@@ -1024,116 +3630,253 @@ int write_hdr(int pg_idx, int data, int meta_blk_num)
 		JDBG("%s(): (META): 2 pg_idx %d blk %d\n", __func__, pg_idx, pg_idx/config.pages_per_block);
         JDBG("%s(): (META): @@@@@ META hdr %s @@@@@\n",__func__, buf);
         ret = write_page(pg_idx, buf);
-        kfree(tmp);
     }
     else {
         printk(KERN_ERR "WRONG!\n");
     }
 
-//	spin_lock_irqsave(&list_lock, lflags);
+	spin_lock(&blk_lock[pg_idx/config.pages_per_block]);
 	meta_config.blocks[pg_idx/config.pages_per_block].state = BLK_USED;
-//	spin_unlock_irqrestore(&list_lock, lflags);
+	spin_unlock(&blk_lock[pg_idx/config.pages_per_block]);
+	blk_dirty(pg_idx/config.pages_per_block);
 
-	kfree(buf);
+	mutex_unlock(&hdr_mutex);
     return ret;
 }
 
+/* reserve_page( int blk)
+ * Claim the next free page of the (already opened) block blk
+ *
+ * Return
+ * the flash page index
+ * -1: blk is full
+ */
+static int reserve_page(int blk)
+{
+	int pg_idx = -1;
+
+	spin_lock(&blk_lock[blk]);
+	if (meta_config.blocks[blk].current_page_offset < config.pages_per_block) {
+		pg_idx = blk * config.pages_per_block +
+			meta_config.blocks[blk].current_page_offset++;
+		if (meta_config.blocks[blk].current_page_offset == config.pages_per_block)
+			blk_class(blk);
+	}
+	spin_unlock(&blk_lock[blk]);
+	if (pg_idx >= 0)
+		blk_dirty(blk);
+	return pg_idx;
+}
+
+/* open_block( int blk)
+ * Turn blk into a data block: a block that was never written receives the
+ * data header in its first page. Called with the alloc_mutex of its
+ * partition held.
+ *
+ * Return
+ * 0: Success
+ * -1: read-only or write error
+ */
+static int open_block(int blk)
+{
+	int fresh;
+
+	spin_lock(&blk_lock[blk]);
+	meta_config.blocks[blk].state = BLK_USED;
+	fresh = meta_config.blocks[blk].current_page_offset < RESERVED_PG_CNT;
+	if (fresh)
+		meta_config.blocks[blk].current_page_offset = RESERVED_PG_CNT;
+	blk_class(blk);
+	spin_unlock(&blk_lock[blk]);
+	blk_dirty(blk);
+	sb_changing(blk);
+
+	if (!fresh)
+		return 0;
+	//Specify flag that this block is data block
+	JDBG("write_hdr(open_block) blk %d\n", blk);
+	return write_hdr(blk * config.pages_per_block, NAND_DATA, 0) ? -1 : 0;
+}
+
+/* frontier_disown( fr)
+ * Give the block of fr back to its partition, an open block goes back to
+ * the open heap. Called with the alloc_mutex of the partition held, and
+ * fr->lock or the sem of the partition held for writing. A relocation
+ * stream only needs alloc_mutex: GC alone writes to its block, with the
+ * sem held for writing
+ *
+ * Return
+ * VOID
+ */
+static void frontier_disown(struct frontier *fr)
+{
+	int blk = fr->blk;
+
+	if (blk < 0)
+		return;
+	spin_lock(&blk_lock[blk]);
+	blk_fr[blk] = -1;
+	blk_class(blk);
+	spin_unlock(&blk_lock[blk]);
+	fr->blk = -1;
+}
+
+/* frontier_own( fr, blk)
+ * Make blk, free or open, the block of fr: it leaves the heaps, nobody
+ * else appends to it until it is full or disowned. Called like
+ * frontier_disown()
+ *
+ * Return
+ * 0: Success
+ * -1: read-only or write error
+ */
+static int frontier_own(struct frontier *fr, int blk)
+{
+	spin_lock(&blk_lock[blk]);
+	blk_fr[blk] = fr->no;
+	blk_tier[blk] = fr->tier;
+	spin_unlock(&blk_lock[blk]);
+	fr->blk = blk;
+	/* classifies it as owned */
+	return open_block(blk);
+}
+
 /**
- * After an insertion, determine which is the flash page that will receive the 
- * next insertion.
+ * Before an insertion, reserve the flash page of frontier fr that will
+ * receive it, from the block it owns. Only when that one is full does it
+ * serialize with the other frontiers of its partition (on alloc_mutex) to
+ * take the next one. Called with fr->lock held.
  *
  * Return 
- * the correspondign flash page index
- * -1: if the flash is full
- *
- *  Jack TODO: concurrency problem
+ * the corresponding flash page index
+ * -1: if the partition is full
  */
-int get_next_block_to_write() // TODO: change name to next_page
+int get_next_page_to_write(struct frontier *fr)
 {
-	int target_block, pg_idx;
-    unsigned long lflags;
-    
-	//Returns block index
-	spin_lock_irqsave(&list_lock, lflags);
-	target_block = get_healthy_block();
-	spin_unlock_irqrestore(&list_lock, lflags);
+	struct kv_part *p = fr->part;
+	int i, blk, pg_idx;
+
+	if (fr->blk >= 0) {
+		pg_idx = reserve_page(fr->blk);
+		if (pg_idx >= 0)
+			return pg_idx;
+	}
 
-	if (target_block == -1)
+	mutex_lock(&p->alloc_mutex);
+	frontier_disown(fr);
+	blk = get_healthy_block(p);
+	if (blk == -1) {
+		/* the room left in the blocks of the relocation streams goes
+		 * to the writers rather than failing */
+		for (i = p->nb_fr; i < p->nb_fr + GC_TIERS; i++)
+			frontier_disown(&p->fr[i]);
+		blk = get_healthy_block(p);
+	}
+	if (blk == -1 || frontier_own(fr, blk) != 0) {
+		mutex_unlock(&p->alloc_mutex);
 		return -1;
+	}
+	mutex_unlock(&p->alloc_mutex);
+	return reserve_page(blk);
+}
 
-	//Set block flag to used if not already set
-	meta_config.blocks[target_block].state = BLK_USED;
+/* nb_free_all( void)
+ * Free data blocks of all the partitions
+ */
+static int nb_free_all(void)
+{
+	int i, nb = 0;
 
-	//If current_page_offset = 0, need to reserve to first page for Metadata flag
-	if (meta_config.blocks[target_block].current_page_offset < RESERVED_PG_CNT) {
-		pg_idx = (target_block*config.pages_per_block) + 
-				meta_config.blocks[target_block].current_page_offset;
-		//Specify flag that this block is data block
-        JDBG("write_hdr(get_next_block_to_write) pg_idx %d blk %d (pg should \% 64 == 0)\n", 
-                            pg_idx, pg_idx/config.pages_per_block);
-		return write_hdr(pg_idx, NAND_DATA, 0);
-	}
-	
-	return target_block;
+	for (i = 0; i < config.nb_parts; i++)
+		nb += ACCESS_ONCE(parts[i].nb_free_blks);
+	return nb;
 }
 
-/* get_healthy_block(void)
- * Iterates through disk blocks looking for healthy, free block to use.
+/* get_healthy_block( p)
+ * Block of partition p for one of its write frontiers: the least worn of
+ * its open blocks (no frontier owns them) and of its free ones, O(1).
+ * Called with p->alloc_mutex held.
  * Return
  * 0<x< config.nb_blocks: Index of healthy, free block to use
- * -1: No healthy, free blocks available, Disk is now in READ-ONLY Mode
+ * -1: No healthy, free blocks available in p
  */
-int get_healthy_block()
+int get_healthy_block(struct kv_part *p)
 {
-	int i, j;
-	int ret = -1;
-	int minimum = 0x7FFFFFFF;
-    int nb_pages = (meta_config.metadata_size / meta_config.page_size) + 1;
-	int nb_blocks = (nb_pages / config.pages_per_block) + 1;
-	
-    //For all blocks on disk
-	for (i = 0; i < config.nb_blocks; i++) {
-jack:		
-        //If offset is not at the end of the block
-        for (j = 0 ; j < nb_blocks ; ++j) {
-            if(i == meta_blkordr[j]) {
-                //JDBG("%s(): This is a blk %d in victim[%d]\n", __func__, i, j);
-                i++;
-                if (i >=config.nb_blocks) {
-                    return ret;
-                } else {
-                    goto jack;
-                }
-            }
-        }
-        
-        if (meta_config.blocks[i].current_page_offset < config.pages_per_block) {
-			//If block worn threshhold is within limits
-			if (meta_config.blocks[i].worn < minimum) {
-				minimum = meta_config.blocks[i].worn;
-				ret = i;
-				//TODO shouldn't return be here??
-			}
-            //JDBG("%s(): blk %d is not full\n", __func__, i);
-		}
-        else { 
-            //JDBG("%s(): blk %d is full\n", __func__, i);
-        }
-	}//END for
-	
-	/* If we get there, no free block left... */
-	//if (minimum == config.pages_per_block - 1)
-	//	return -1;
+	int ret, blk, nb_free = nb_free_all();
+
+	spin_lock(&p->heap_lock);
+	ret = blk_heap_top(&p->open_heap);
+	/* a checkpoint may grow the metadata log up to twice meta_log_cap
+	 * blocks before it cleans it, from any partition: keep the free
+	 * blocks it needs, the writer runs GC when it cannot get a page */
+	blk = blk_heap_top(&p->free_heap);
+	if (blk >= 0 && nb_free > 2 * meta_log_cap - meta_nb_log &&
+	    (ret < 0 || p->free_heap.ent[0].key < p->open_heap.ent[0].key))
+		ret = blk;
+	spin_unlock(&p->heap_lock);
+	return ret;
+}
 
-    /*
-    JDBG("%s(): return %d\n", __func__, ret);
-    JDBG(PRINT_PREF "%d: state: %d, worn: %d, nb_invalid: %d, current_page_offset: %d\n",
-                                ret, config.blocks[ret].state,
-                                config.blocks[ret].worn,
-                                config.blocks[ret].nb_invalid,
-                                config.blocks[ret].current_page_offset);
-    */
-    return ret;
+/* blk_class( blk)
+ * File blk as a free, open or full data block (or none of them, for a log
+ * block) after its blk_info changed, called with blk_lock[blk] held
+ *
+ * Return
+ * VOID
+ */
+static void blk_class(int blk)
+{
+	blk_info *b = &meta_config.blocks[blk];
+	struct kv_part *p = blk_part(blk);
+	int cls;
+
+	if (is_meta_blk(blk))
+		cls = BLK_C_NONE;
+	else if (b->current_page_offset >= config.pages_per_block)
+		cls = BLK_C_FULL;
+	else if (blk_fr[blk] >= 0)
+		cls = BLK_C_OWNED;
+	else if (b->state == BLK_FREE && b->current_page_offset == 0)
+		cls = BLK_C_FREE;
+	else
+		cls = BLK_C_OPEN;
+
+	spin_lock(&p->heap_lock);
+	if (blk_cls[blk] == BLK_C_FREE)
+		p->nb_free_blks--;
+	else if (blk_cls[blk] == BLK_C_FULL)
+		p->nb_full_blks--;
+	if (cls != BLK_C_FREE)
+		blk_heap_remove(&p->free_heap, blk);
+	if (cls != BLK_C_OPEN)
+		blk_heap_remove(&p->open_heap, blk);
+
+	if (cls == BLK_C_FREE) {
+		blk_heap_update(&p->free_heap, blk, b->worn);
+		p->nb_free_blks++;
+	} else if (cls == BLK_C_OPEN)
+		blk_heap_update(&p->open_heap, blk, b->worn);
+	else if (cls == BLK_C_FULL)
+		p->nb_full_blks++;
+	blk_cls[blk] = cls;
+	spin_unlock(&p->heap_lock);
+}
+
+/* blk_class_all( void)
+ * File every block, after the block info was loaded or reset as a whole
+ *
+ * Return
+ * VOID
+ */
+static void blk_class_all(void)
+{
+	int i;
+
+	for (i = 0; i < config.nb_blocks; i++) {
+		spin_lock(&blk_lock[i]);
+		blk_class(i);
+		spin_unlock(&blk_lock[i]);
+	}
 }
 
 /**
@@ -1141,17 +3884,14 @@ jack:
  */
 void format_callback(struct erase_info *e)
 {
+	struct kv_part *p = (struct kv_part *)e->priv;
+
 	if (e->state != MTD_ERASE_DONE) {
 		printk(PRINT_PREF "Format error...");
-		down(&config.format_lock);
-		config.format_done = -1;
-		up(&config.format_lock);
-		return;
-	}
-
-	down(&config.format_lock);
-	config.format_done = 1;
-	up(&config.format_lock);
+		p->format_done = -1;
+	} else
+		p->format_done = 1;
+	complete(&p->erase_done);
 }
 
 /**
@@ -1162,15 +3902,10 @@ void meta_format_callback(struct erase_info *e)
 {
 	if (e->state != MTD_ERASE_DONE) {
 		printk(PRINT_PREF "Format error...");
-		down(&meta_config.format_lock);
 		meta_config.format_done = -1;
-		up(&meta_config.format_lock);
-		return;
-	}
-
-	down(&meta_config.format_lock);
-	meta_config.format_done = 1;
-	up(&meta_config.format_lock);
+	} else
+		meta_config.format_done = 1;
+	complete(&meta_config.erase_done);
 }
 
 
@@ -1201,25 +3936,14 @@ int meta_on_disk_format()
 
 	//Reset format_done flag
 	meta_config.format_done = 0;
+	reinit_completion(&meta_config.erase_done);
 
 	/* Call the MTD driver  */
 	if (meta_config.mtd->_erase(meta_config.mtd, &mei) != 0)
 		return -1;
 
-	while (1){
-		//attempt semaphore loc
-		if (!down_trylock(&meta_config.format_lock)) {
-			//semaphore acquired 
-			if (meta_config.format_done) {
-				//format of metadata completed
-				//release semaphore, get out of infinite loop
-				up(&meta_config.format_lock);
-				break;
-			}
-			//release semaphore
-			up(&meta_config.format_lock);
-		}
-	}//END while
+	//sleep until meta_format_callback() is called
+	wait_for_completion(&meta_config.erase_done);
 
 	//some kind of formating error
 	if (meta_config.format_done == -1)
@@ -1228,67 +3952,104 @@ int meta_on_disk_format()
 	return 0;
 }
 
-/* format_single( int index)
- * Function erases a single block within disk at index and resets metadata 
- * info about given block
+/* meta_erase( first, nb)
+ * Erase nb blocks of the metadata partition, from block first
+ *
+ * Return: see meta_on_disk_format()
+ */
+static int meta_erase(int first, int nb)
+{
+	struct erase_info mei;
+
+	memset(&mei, 0, sizeof(mei));
+	mei.mtd = meta_config.mtd;
+	mei.addr = ((uint64_t) meta_config.block_size) * first;
+	mei.len = ((uint64_t) meta_config.block_size) * nb;
+	mei.callback = meta_format_callback;
+
+	meta_config.format_done = 0;
+	reinit_completion(&meta_config.erase_done);
+	if (meta_config.mtd->_erase(meta_config.mtd, &mei) != 0)
+		return -1;
+	wait_for_completion(&meta_config.erase_done);
+	if (meta_config.format_done == -1)
+		return -2;
+	return 0;
+}
+
+/* part_erase( p, first, nb)
+ * Erase nb blocks of partition p from its block first (numbered in the
+ * partition), sleeps until the driver is done. The erases of a partition
+ * are serialized by its sem held for writing or by kv_sem
  *
  * Return
  * 0: Success
- * -1: Failed to erase 1 block, Error with Driver _erase
+ * -1: driver error
  */
-int format_single(int idx)
+static int part_erase(struct kv_part *p, int first, int nb)
 {
-	unsigned long lflags;
 	struct erase_info ei;
-	bucket *current_page, *next;
 
-    if(idx < 0) {
-        //JDBG(KERN_WARNING "FLUSH -1\n");
-        return -1;
-    }
+	memset(&ei, 0, sizeof(ei));
 	//Block Location & length
-	ei.mtd = config.mtd;
-	ei.len = ((uint64_t) config.block_size);
-	ei.addr = idx * ((uint64_t) config.block_size);
-
+	ei.mtd = p->mtd;
+	ei.len = ((uint64_t) config.block_size) * nb;
+	ei.addr = ((uint64_t) config.block_size) * first;
+	/* the erase operation is made aysnchronously and a callback function
+	 * will be executed when the operation is done */
 	ei.callback = format_callback;
-	config.format_done = 0;
+	ei.priv = (u_long)p;
+
+	p->format_done = 0;
+	reinit_completion(&p->erase_done);
 
 	/* Call the MTD driver  */
-	if (config.mtd->_erase(config.mtd, &ei) != 0)
+	if (p->mtd->_erase(p->mtd, &ei) != 0)
 		return -1;
-	
-	//Wait while _erase happens
-	while (1) {
-		//Get lock for formating disk
-		if (!down_trylock(&config.format_lock)) {
-			//TODO Not sure, but think we also need -1, according to format_callback
-			//if (config.format_done || (config.format_done == -1)) {
-			if (config.format_done) {
-				up(&config.format_lock);
-				break;
-			}
-			up(&config.format_lock);
-        	}
+
+	//Sleep while _erase happens, format_callback() wakes us up
+	wait_for_completion(&p->erase_done);
+
+	return p->format_done == -1 ? -1 : 0;
+}
+
+/* __format_single( int index)
+ * Body of format_single(), for callers that already hold blk_seq[idx] for
+ * writing
+ */
+static int __format_single(int idx)
+{
+	struct kv_part *p;
+	int ret = 0;
+
+    if(idx < 0) {
+        //JDBG(KERN_WARNING "FLUSH -1\n");
+        return -1;
+    }
+	/* the mount must look at it */
+	sb_changing(idx);
+
+	p = blk_part(idx);
+	if (part_erase(p, idx - p->first_blk, 1) != 0) {
+		ret = -1;
+		goto out;
 	}
-	
-	if (config.format_done == -1)
-		return -1;
 
 	//Reset target block metadata state info
+	spin_lock(&blk_lock[idx]);
 	meta_config.blocks[idx].state = BLK_FREE;
 	meta_config.blocks[idx].nb_invalid = 0;
+	meta_config.blocks[idx].nb_records = 0;
 	meta_config.blocks[idx].current_page_offset = 0;
 	meta_config.blocks[idx].worn++;
+	inv_update(idx);
+	blk_class(idx);
+	spin_unlock(&blk_lock[idx]);
+	blk_dirty(idx);
 	
-    //Clear all valid pages associated from target block
-	spin_lock_irqsave(&list_lock, lflags);
-	list_for_each_entry_safe(current_page, next, meta_config.blocks[idx].list, p_list) {
-		if(current_page) {
-			list_del(&current_page->p_list);
-		}
-	}
-    spin_unlock_irqrestore(&list_lock, lflags);
+    //Clear all valid slots associated from target block
+	bitmap_clear(valid_map, LOC(idx * config.pages_per_block, 0),
+		     LOC(config.pages_per_block, 0));
 
 	JDBG(PRINT_PREF "Formating blk %d done\n", idx);
 
@@ -1301,7 +4062,31 @@ int format_single(int idx)
 	//if (meta_on_disk_format() != 0)
 	//	return -1;
 
-	return 0;
+out:
+	return ret;
+}
+
+/* format_single( int index)
+ * Function erases a single block within disk at index and resets metadata 
+ * info about given block. Called with kv_sem held for writing, or the sem
+ * of the partition of the block, which serializes the erases.
+ *
+ * Return
+ * 0: Success
+ * -1: Failed to erase 1 block, Error with Driver _erase
+ */
+int format_single(int idx)
+{
+	int ret;
+
+	if (idx < 0)
+		return -1;
+
+	/* lockless readers of this block retry from now on */
+	write_seqcount_begin(&blk_seq[idx]);
+	ret = __format_single(idx);
+	write_seqcount_end(&blk_seq[idx]);
+	return ret;
 }
 
 
@@ -1310,118 +4095,123 @@ int format_single(int idx)
  */
 int format()
 {
-	int i;
-	unsigned long lflags;
-	struct erase_info ei;
-	bucket *current_page, *next;
-    unsigned long eflags;
+	int i, n;
+	struct kv_part *p;
     int ret=0;
 
-    spin_lock_irqsave(&erase_lock, eflags);
+	down_write(&kv_sem);
     JDBG("%s():\n\n\n\n\n", __func__);
 
-	/* erasing one or several flash blocks is made through the use of an 
-	 * erase_info structure passed to the MTD NAND driver */
-	ei.mtd = config.mtd;
-	ei.len = ((uint64_t) config.block_size) * ((uint64_t) config.nb_blocks);
-	ei.addr = 0x0;
-	
-	/* the erase operation is made aysnchronously and a callback function will
-	 * be executed when the operation is done */
-	ei.callback = format_callback;
-
-	config.format_done = 0;
-
-	/* Call the MTD driver  */
-	if (config.mtd->_erase(config.mtd, &ei) != 0) {
-        printk(KERN_ERR "%s(): _erase\n", __func__);
-		ret = -1;
-        BUG();
-        goto format_exit;
-    }
-
-	/* on attend la fin effective de l'operation avec un spinlock. 
+	/* whole partitions: every lockless reader retries (raw_ variants, the
+	 * blk_seq[] are all of the same lockdep class) */
+	for (i = 0; i < config.nb_blocks; i++)
+		raw_write_seqcount_begin(&blk_seq[i]);
+	for (i = 0; i < config.nb_parts; i++)
+		raw_write_seqcount_begin(&parts[i].ext_seq);
+
+	/* on attend la fin effective de l'operation en dormant.
 	 * C'est la fonction callback qui mettra format_done a 1 */
-	/* TODO change to a condwait here */
-	while (1)
-		if (!down_trylock(&config.format_lock)) {
-			//if (config.format_done || (config.format_done == -1)) {
-			if (config.format_done) {
-				up(&config.format_lock);
-				break;
-			}
-			up(&config.format_lock);
+	for (i = 0; i < config.nb_parts; i++) {
+		p = &parts[i];
+		if (part_erase(p, 0, p->nb_blocks) != 0) {
+			printk(KERN_ERR "%s(): erase of mtd %d failed\n",
+			       __func__, p->mtd_index);
+			ret = -1;
+			BUG();
+			goto format_exit;
 		}
-
-	/* was there a driver issue related to the erase oepration? */
-	if (config.format_done == -1) {
-        printk(KERN_ERR "%s(): erase not done\n", __func__);
-		ret = -1;
-        BUG();
-        goto format_exit;
-    }
+	}
 
 	config.read_only = 0;
 
-    spin_lock_irqsave(&list_lock, lflags); //TODO
-	/* format metadata in the memory */
+	/* format metadata in the memory, kv_sem keeps everybody out. The
+	 * erase counts are kept, with the erase of the format: the first
+	 * checkpoint below writes them */
 	for (i = 0; i < config.nb_blocks; i++) {
-
-        // remove valid list elements
-		list_for_each_entry_safe(current_page, next, meta_config.blocks[i].list, p_list) {
-			if(current_page) {
-				list_del(&current_page->p_list);
-			}
-		}
-
 		meta_config.blocks[i].state = BLK_FREE;
-		meta_config.blocks[i].worn = 0;
+		meta_config.blocks[i].worn++;
 		meta_config.blocks[i].nb_invalid = 0;
+		meta_config.blocks[i].nb_records = 0;
 		meta_config.blocks[i].current_page_offset = 0;
 	}
-    spin_unlock_irqrestore(&list_lock, lflags); // TODO
-
-	for (i = 0; i < HASH_SIZE; i++)
-	{
-		hashtable[i].p_state = PG_FREE;
-		hashtable[i].dirty = 0;
+	inv_rebuild();
+	bitmap_zero(valid_map, LOC(config.nb_blocks * config.pages_per_block, 0));
+	/* the open pages and the blocks of the frontiers were erased with
+	 * the rest */
+	for (i = 0; i < config.nb_parts; i++) {
+		p = &parts[i];
+		for (n = 0; n < p->nb_fr + GC_TIERS; n++) {
+			mutex_lock(&p->fr[n].lock);
+			write_seqcount_begin(&p->fr[n].seq);
+			p->fr[n].pg = -1;
+			p->fr[n].blk = -1;
+			write_seqcount_end(&p->fr[n].seq);
+			mutex_unlock(&p->fr[n].lock);
+		}
+	}
+	for (i = 0; i < config.nb_blocks; i++) {
+		blk_fr[i] = -1;
+		blk_tier[i] = 0;
 	}
+
+	hash_reset(hashtable);
+	oindex_clear();
+	vcache_clear();
+	/* the log was erased too: a first checkpoint of the whole image, the
+	 * journal needs one to start from */
+	meta_log_reset();
+	blk_class_all();
     
 	meta_config.read_only = 0;
+	if (__flush_metadata() != 0)
+		printk(KERN_ERR "%s(): first checkpoint failed\n", __func__);
 
 	JDBG(PRINT_PREF "Format done\n");
 
 format_exit:
-    spin_unlock_irqrestore(&erase_lock, eflags);
+	for (i = 0; i < config.nb_parts; i++)
+		raw_write_seqcount_end(&parts[i].ext_seq);
+	for (i = 0; i < config.nb_blocks; i++)
+		raw_write_seqcount_end(&blk_seq[i]);
+	up_write(&kv_sem);
 	return ret;
 }
 
 /**
  * Write the flash page with index page_index, data to write is in buf. 
+ * The page must have been reserved with get_next_page_to_write() (or be a
+ * block header), the block offsets are accounted at reservation time.
  * Returns:
  * 0 on success
  * -1 if we are in read-only mode
  * -2 when a write error occurs
  */
 int write_page(int page_index, const char *buf)
+{
+	/* if the flash partition is full, dont write */
+	if (config.read_only)
+		return -1;
+	return __write_page(page_index, buf);
+}
+
+/* __write_page( page_index, buf)
+ * Body of write_page(), for a page reserved before the store went
+ * read-only (open page of a write frontier, GC relocation)
+ *
+ * Return: see write_page()
+ */
+static int __write_page(int page_index, const char *buf)
 {
 	int ret = 0;
 	uint64_t addr;
 	size_t retlen;
-	unsigned long flags, lflags;
+	struct kv_part *p;
 
-	spin_lock_irqsave(&one_lock, flags);
-    
-	/* if the flash partition is full, dont write */
-	if (config.read_only) {
-		ret = -1;
-		goto exit;
-	}
-	/* compute the flash target address in bytes */
-	addr = ((uint64_t) page_index) * ((uint64_t) config.page_size);
+	/* compute the flash target address in bytes, in its partition */
+	p = part_addr(page_index, &addr);
 
 	/* call the NAND driver MTD to perform the write operation */
-	if (config.mtd->_write(config.mtd, addr, config.page_size, &retlen, buf) != 0){
+	if (p->mtd->_write(p->mtd, addr, config.page_size, &retlen, buf) != 0){
 		ret = -2;
         BUG();
 		goto exit;
@@ -1430,28 +4220,15 @@ int write_page(int page_index, const char *buf)
     if( retlen != config.page_size) //self-check
         BUG();
 #endif
-//
-	spin_lock_irqsave(&list_lock, lflags);
-	meta_config.blocks[page_index/config.pages_per_block].current_page_offset++;
-#if 0
-    if( meta_config.blocks[page_index/config.pages_per_block].current_page_offset > config.pages_per_block) //self-check
-        printk(KERN_ERR "ERROR: Over a single page offset in blk %d pg %d cnt %d!!!!!!!!!!!!!!!\n",
-                            page_index/config.pages_per_block, page_index,
-                            meta_config.blocks[page_index/config.pages_per_block].current_page_offset);
-#endif
-	spin_unlock_irqrestore(&list_lock, lflags);
-//
-exit:
-	/* if the flash partition is full, switch to read-only mode */
+
+	/* if the flash partition is full, switch to read-only mode: the page
+	 * we just wrote is still valid */
 	if (is_read_only())
 	{
 		printk(PRINT_PREF "no free block left... swtiching to read-only mode\n");
 		config.read_only = 1;
-		ret = -1;
-		//goto exit;
 	}
-
-	spin_unlock_irqrestore(&one_lock, flags);
+exit:
 	return ret;
 }
 
@@ -1502,21 +4279,18 @@ int read_page(int page_index, char *buf)
 	int ret;
 	uint64_t addr;
 	size_t retlen;
-	unsigned long flags;
-
-	spin_lock_irqsave(&one_lock, flags);
+	struct kv_part *p;
 
-	/* compute the flash target address in bytes */
-	addr = ((uint64_t) page_index) * ((uint64_t) config.page_size);
+	/* compute the flash target address in bytes, in its partition */
+	p = part_addr(page_index, &addr);
 	
 	/* call the NAND driver MTD to perform the read operation */
-	ret = config.mtd->_read(config.mtd, addr, config.page_size, &retlen, buf);
+	ret = p->mtd->_read(p->mtd, addr, config.page_size, &retlen, buf);
    
 #if 0 // self-check
     if( retlen != config.page_size)
         BUG();
 #endif	
-    spin_unlock_irqrestore(&one_lock, flags);
 	return ret;
 }
 
@@ -1532,19 +4306,13 @@ int read_meta_page(int page_index, char *buf)
 	int ret;
 	uint64_t addr;
 	size_t retlen;
-	unsigned long flags;
 
-	//Attempt to spin Lock
-	spin_lock_irqsave(&one_lock, flags);
 	/* compute the flash target address in bytes */
 	addr = ((uint64_t) page_index) * ((uint64_t) meta_config.page_size);
 	
 	/* call the NAND driver MTD to perform the read operation */
 	ret = meta_config.mtd->_read(meta_config.mtd, addr, meta_config.page_size, &retlen, buf);
 
-	//Unlock	
-	spin_unlock_irqrestore(&one_lock, flags);
-
 	return ret; 
 }
 
@@ -1610,14 +4378,9 @@ static enum hrtimer_restart flush_timer_callback( struct hrtimer *f_timer)
 
 	//check if new data has been written (flag)
 	if(atomic_read(&meta_config.recent_update)){
-		//Something new is in RAM (need to flush to Disk)
-		//Initiate Flushing
-		//printk(KERN_INFO ">>[%s] Need to flush!!\n",__func__);
-        //atomic_set(&meta_config.recent_update, 0);
-		flush_metadata(false);
-		//printk(KERN_INFO ">>[%s] FLUSH Complete!!\n",__func__);
-
-		//Clear recent_update flag
+		//Something new is journaled in RAM (need to commit it to Disk)
+		//writing sleeps, hand it over to the flush/GC workqueue
+		queue_work(kv_wq, &meta_flush_work);
 	}
 
 	//Return Flag to restart
@@ -1677,6 +4440,7 @@ static void clear_wear_timer(void)
 static enum hrtimer_restart wear_timer_callback( struct hrtimer *w_timer){
 	//DO NOT TOUCH
 	ktime_t currtime, interval;
+	int i;
 	currtime = ktime_get();
 	interval = ktime_set(0, w_delay);
 	hrtimer_forward(w_timer, currtime, interval);
@@ -1684,22 +4448,62 @@ static enum hrtimer_restart wear_timer_callback( struct hrtimer *w_timer){
 	//Do work below...
 
 	//Need to call Wear leveling functions here to shuffle data to 
-	// different blocks at each interval
-	gc();
+	// different blocks at each interval, GC sleeps so it runs from a work
+	for (i = 0; i < config.nb_parts; i++) {
+		queue_work(kv_wq, &parts[i].gc_work);
+		if (ACCESS_ONCE(WEAR_INTERVAL_MS) > 0)
+			queue_work(kv_wq, &parts[i].wl_work);
+	}
 	
 	//return flag to restart timer interrupt
 	return HRTIMER_RESTART;	
 }
+
+/* flush_work_fn / gc_work_fn
+ * Process context side of the flush and wear-leveling timers: the flush
+ * timer commits the journal, and checkpoints once it is full
+ */
+static void flush_work_fn(struct work_struct *work)
+{
+	atomic_set(&meta_config.recent_update, 0);
+	journal_commit();
+	flush_metadata(false);
+}
+
+static void gc_work_fn(struct work_struct *work)
+{
+	gc_part(container_of(work, struct kv_part, gc_work));
+}
+
+/* wl_work_fn
+ * Static wear leveling of a partition, from the wear-leveling timer: one
+ * cold block moved at most every WEAR_INTERVAL_MS. A work item does not run
+ * on two CPUs at once, wl_next needs no lock
+ */
+static void wl_work_fn(struct work_struct *work)
+{
+	struct kv_part *p = container_of(work, struct kv_part, wl_work);
+
+	if (time_before(jiffies, p->wl_next))
+		return;
+	p->wl_next = jiffies + msecs_to_jiffies(ACCESS_ONCE(WEAR_INTERVAL_MS));
+	__gc_part(p, 1);
+}
 ///////////////////////////////////////////////////////////////////////////////
 /*****************************************************************************/
 /* Print some statistics on the kernel log                                   */
 /*****************************************************************************/
 void print_config()
 {
+	int i;
+
 	printk(PRINT_PREF "Data partition's config : \n");
 	printk(PRINT_PREF "=========\n");
 
-	printk(PRINT_PREF "mtd_index: %d\n", config.mtd_index);
+	for (i = 0; i < config.nb_parts; i++)
+		printk(PRINT_PREF "part %d: mtd_index %d, blocks %d to %d\n", i,
+		       parts[i].mtd_index, parts[i].first_blk,
+		       parts[i].first_blk + parts[i].nb_blocks - 1);
 	printk(PRINT_PREF "nb_blocks: %d\n", config.nb_blocks);
 	printk(PRINT_PREF "block_size: %d\n", config.block_size);
 	printk(PRINT_PREF "page_size: %d\n", config.page_size);
@@ -1719,6 +4523,7 @@ void print_meta_config()
 	printk(PRINT_PREF "pages_per_block: %d\n", meta_config.pages_per_block);
 	printk(PRINT_PREF "read_only: %d\n", meta_config.read_only);
 	printk(PRINT_PREF "hashtable size: %d\n", meta_config.hashtable_size);
+	printk(PRINT_PREF "key arena size: %d\n", meta_config.key_arena_size);
 	printk(PRINT_PREF "Blocks table size: %d\n", meta_config.block_info_size);
 	printk(PRINT_PREF "metadata size: %d\n",meta_config.metadata_size);
 	//printk(PRINT_PREF "number of valid pages: %d\n", meta_config.number_of_valid_pages);
@@ -1856,77 +4661,314 @@ void gc_merge(void)
 }
 #endif 
 
-/* gc( void)
- * TODO shouldn't this be called gctest? Garbage Collection....
- * Action: ? TODO
+/* gc_pack( out, out_pgs, key, key_len, val, val_len)
+ * Pack a couple in the GC output pages out, in page *out_pgs or in the
+ * next one when it is full
+ *
+ * Return
+ * the location of the couple in out
+ * -1: out is full
+ */
+static int gc_pack(char *out, int *out_pgs, const char *key, int key_len,
+		   const char *val, int val_len)
+{
+	char *cur = out + *out_pgs * config.page_size;
+
+	if (!slot_page_room(cur, key_len, val_len)) {
+		if (*out_pgs + 1 == config.pages_per_block)
+			return -1;
+		(*out_pgs)++;
+		cur += config.page_size;
+		slot_page_init(cur, config.page_size);
+	}
+	return LOC(*out_pgs, slot_page_add(cur, key, key_len, val, val_len));
+}
+
+/* gc_owner_add( owner, nb, hash_idx)
+ * Add the bucket of a multi-page couple to the nb ones in owner, unless
+ * it is there already
+ *
+ * Return
+ * the new number of owners
+ */
+static int gc_owner_add(int *owner, int nb, int hash_idx)
+{
+	int i;
+
+	for (i = 0; i < nb; i++)
+		if (owner[i] == hash_idx)
+			return nb;
+	owner[nb] = hash_idx;
+	return nb + 1;
+}
+
+/* gc_disown( p, blk)
+ * blk, about to be erased, is not the block of a frontier of p anymore.
+ * Called with p->alloc_mutex and p->sem held for writing
  *
  * Return
  * VOID
  */
-void gc(void)
+static void gc_disown(struct kv_part *p, int blk)
+{
+	int i;
+
+	for (i = 0; i < p->nb_fr + GC_TIERS; i++)
+		if (p->fr[i].blk == blk)
+			frontier_disown(&p->fr[i]);
+}
+
+/* gc_seal( p, blk)
+ * Mark blk full, and not the block of a frontier of p anymore: the
+ * couples of blk were moved, it is erased once p->sem was released for a
+ * while
+ *
+ * Return
+ * VOID
+ */
+static void gc_seal(struct kv_part *p, int blk)
+{
+	mutex_lock(&p->alloc_mutex);
+	gc_disown(p, blk);
+	spin_lock(&blk_lock[blk]);
+	meta_config.blocks[blk].current_page_offset = config.pages_per_block;
+	inv_update(blk);
+	blk_class(blk);
+	spin_unlock(&blk_lock[blk]);
+	mutex_unlock(&p->alloc_mutex);
+	blk_dirty(blk);
+}
+
+/* gc_stream_blk( gfr, target, live)
+ * Block the relocation stream gfr writes the live pages of target to: its
+ * own if it has room for more than live pages, else the least worn free
+ * block of the partition, which becomes its own (what is left of the
+ * previous one goes to the writers). Called with the alloc_mutex of the
+ * partition and its sem held for writing
+ *
+ * Return
+ * the block
+ * -1: no free block
+ */
+static int gc_stream_blk(struct frontier *gfr, int target, int live)
+{
+	struct kv_part *p = gfr->part;
+	int blk = gfr->blk;
+
+	if (blk >= 0 && blk != target &&
+	    config.pages_per_block - config.blocks[blk].current_page_offset > live)
+		return blk;
+	spin_lock(&p->heap_lock);
+	blk = blk_heap_top(&p->free_heap);
+	spin_unlock(&p->heap_lock);
+	if (blk == -1)
+		return -1;
+	frontier_disown(gfr);
+	if (frontier_own(gfr, blk) != 0) {
+		printk(KERN_ERR "%s(): cannot open blk %d\n", __func__, blk);
+		BUG();
+	}
+	return blk;
+}
+
+/* wl_target( p)
+ * Cold block of partition p for the static wear leveler: the least worn of
+ * its blocks holding live couples that no frontier writes to, provided the
+ * most worn block of p was erased more than WEAR_DELTA times more. Called
+ * with p->sem held for writing
+ *
+ * Return
+ * the block
+ * -1: the wear of p is even enough
+ */
+static int wl_target(struct kv_part *p)
+{
+	int i, worn, cold = -1, max_worn = 0;
+	blk_info *b;
+
+	for (i = p->first_blk; i < p->first_blk + p->nb_blocks; i++) {
+		if (is_meta_blk(i))
+			continue;
+		b = &meta_config.blocks[i];
+		max_worn = max(max_worn, b->worn);
+		if ((blk_cls[i] == BLK_C_FULL || blk_cls[i] == BLK_C_OPEN) &&
+		    b->nb_records > b->nb_invalid &&
+		    (cold == -1 || b->worn < meta_config.blocks[cold].worn))
+			cold = i;
+	}
+	worn = ACCESS_ONCE(WEAR_DELTA);
+	if (cold == -1 || max_worn - meta_config.blocks[cold].worn <= worn)
+		return -1;
+	return cold;
+}
+
+/* wl_victim( p, cold)
+ * Block of partition p the couples of the cold block go to: its most worn
+ * free block, if it was erased more than cold. Called with the alloc_mutex
+ * of p held
+ *
+ * Return
+ * the block
+ * -1: none
+ */
+static int wl_victim(struct kv_part *p, int cold)
+{
+	int i, blk = -1;
+
+	for (i = p->first_blk; i < p->first_blk + p->nb_blocks; i++)
+		if (blk_cls[i] == BLK_C_FREE &&
+		    meta_config.blocks[i].worn > meta_config.blocks[cold].worn &&
+		    (blk == -1 ||
+		     meta_config.blocks[i].worn > meta_config.blocks[blk].worn))
+			blk = i;
+	return blk;
+}
+
+/* gc_part( p)
+ * Garbage Collection of partition p: pick its data block with the most
+ * dead pages, at least INVALID_THRESHOLD, pack its live couples into pages
+ * of a victim block of p and erase it. The victim is the block of the
+ * relocation stream of the next tier (blk_tier) if it has enough room,
+ * else the least worn free block, which becomes the block of the stream,
+ * else a block with enough room that no frontier owns when MERGE is set,
+ * else the block itself. A full block without live couples is erased
+ * straight away.
+ *
+ * The live couples are packed in the order they were written, so they
+ * never take more pages than the ones they come from: the block itself
+ * always has room for them. The extent pages of multi-page couples are
+ * copied as they are, and the heads of these couples are rewritten with the
+ * new extent list, from whatever block they are in: when that does not fit,
+ * the pass gives up before erasing anything.
+ *
+ * A single GC runs at a time in a partition (p->gc_mutex), the pass holds
+ * p->sem for writing since it erases a block: the writers of p wait, those
+ * of the other partitions and their GC passes go on. Only the keys of p
+ * live in p, and only they move the buckets of its hashtable segments.
+ * Lookups take no lock, so a couple is always published at its new location
+ * before its old copy is erased.
+ *
+ * Return
+ * VOID
+ */
+static void gc_part(struct kv_part *p)
+{
+	__gc_part(p, 0);
+}
+
+/* __gc_part( p, wear)
+ * Body of gc_part(), and of the static wear leveler when wear is set: the
+ * target is then the cold block of wl_target(), the victim the free block
+ * of wl_victim(), which the last relocation stream owns from then on: it
+ * holds cold couples (tier GC_TIERS), the writers do not get it.
+ * The wear leveler does not make the writers of p wait: it gives up when
+ * p->sem is taken
+ *
+ * Return
+ * VOID
+ */
+static void __gc_part(struct kv_part *p, int wear)
 {
-	unsigned long lflags;
-//	unsigned long eflags, lflags;
-	int pg_index, ret, ret2;
-	int hash_index;
-	int valid_cnt = 0, head = 1;
-	int i, target_blk1 = -1, victim_blk = -1;
+	int pg_index, ret, in_place = 0, loc, first, nb_locs, tworn;
+	int valid_cnt = 0, out_pgs = 0, head = 1, nb_owners = 0, n_copy = 0;
+	int i, j, target_blk1 = -1, victim_blk = -1;
 	int target_blk2 = -1; // target_blk2 == 
-	int target_blk1_valid_cnt = -1;
-	char *buffer;
-	bucket *current_page, *next;
-    int nb_pages = (meta_config.metadata_size / meta_config.page_size) + 1;
-    int nb_blocks = (nb_pages / config.pages_per_block) + 1;
-	int key_len[config.pages_per_block], val_len[config.pages_per_block];
-	char *cur_key[config.pages_per_block], *cur_val[config.pages_per_block];
+	int target_live_pgs = 0;
+	char *buffer, *page, *out, *copies, *true_key;
+	int *hash_idx, *new_loc, *owner;
+	struct slot_ext *e;
+	struct journal_rec r;
+	struct frontier *gfr;
+	ktime_t start;
+	int exclusive = 0;
+	int ckpt = 0;		/* target_blk1 was erased in place */
     if( config.pages_per_block <64) 
         return;
 
-    if(!atomic_cmpxchg(&is_gb, 0, 1)) // succ new 1, fail old 0
+    if(!mutex_trylock(&p->gc_mutex))
         return; 
-    if(!spin_trylock(&erase_lock))
-        return;
-
-	/* find target: Will be read from */
-    // find one target > invalid_threshold
-	for (i = 0; i < config.nb_blocks; i++) {
-        int y, is_metablk2 = 0;
-        for (y = 0 ; y < nb_blocks ; ++y)
-            if(i == meta_blkordr[y])
-                is_metablk2 = 1;
-        if (is_metablk2==1)
-            continue;
-		if(meta_config.blocks[i].nb_invalid >= INVALID_THRESHOLD) {
-			target_blk1 = i; // can be mered from
-	        target_blk1_valid_cnt = config.blocks[i].current_page_offset - meta_config.blocks[i].nb_invalid - head;
-			break;
-		}
+	down_read(&kv_sem);
+	if (!wear)
+		down_write(&p->sem);
+	else if (!down_write_trylock(&p->sem)) {
+		up_read(&kv_sem);
+		mutex_unlock(&p->gc_mutex);
+		return;
 	}
+	start = ktime_get();
+
+	/* the open pages may be in the target, or in the block the couples go
+	 * to: they are programmed first */
+	frontier_flush_part(p);
 
-	//No target found
-	if(target_blk1 == -1) {
+	/* find target: Will be read from. Log blocks have no dead pages */
+	if (wear)
+		target_blk1 = wl_target(p);
+	if (wear ? target_blk1 < 0 :
+	    inv_top(p, INVALID_THRESHOLD, &target_blk1) < 0) {
 		//JDBG("No need to do GC\n");
 		goto gcexit2;
 	}
+	/* pages of the target holding live couples */
+	for (pg_index = target_blk1 * config.pages_per_block;
+	     pg_index < (target_blk1 + 1) * config.pages_per_block; pg_index++)
+		if (find_next_bit(valid_map, LOC(pg_index + 1, 0), LOC(pg_index, 0)) <
+		    LOC(pg_index + 1, 0))
+			target_live_pgs++;
+
+	/* nothing to move */
+	if (target_live_pgs == 0 &&
+	    config.blocks[target_blk1].current_page_offset == config.pages_per_block) {
+		JDBG("GC: blk %d has no live couple, erasing it\n", target_blk1);
+		buffer = NULL;
+		in_place = 0;
+		goto gc_erase;
+	}
    
+	/* the victim is chosen and opened under alloc_mutex: the metadata log
+	 * takes its blocks from the free ones of any partition */
+	mutex_lock(&p->alloc_mutex);
+	if (wear) {
+		/* the cold couples go to a block that was erased more */
+		gfr = &p->fr[p->nb_fr + GC_TIERS - 1];
+		victim_blk = wl_victim(p, target_blk1);
+		if (victim_blk == -1) {
+			mutex_unlock(&p->alloc_mutex);
+			goto gcexit2;
+		}
+		/* the coldest stream owns it (tier GC_TIERS): the writers do
+		 * not get it, what is left of its previous block goes to them */
+		frontier_disown(gfr);
+		if (frontier_own(gfr, victim_blk) != 0) {
+			printk(KERN_ERR "%s(): cannot open blk %d\n", __func__,
+			       victim_blk);
+			BUG();
+		}
+	} else {
+		gfr = &p->fr[p->nb_fr + min(blk_tier[target_blk1], GC_TIERS - 1)];
+		if (ACCESS_ONCE(GC_STREAMS))
+			victim_blk = gc_stream_blk(gfr, target_blk1,
+						   target_live_pgs);
+	}
 #if MERGE
     // TODO: the order would harm performance
     // find one < invalid_threshold
-    for (i = 0; i < config.nb_blocks; i++) {
-        int x, is_metablk = 0;
+    for (i = p->first_blk; victim_blk == -1 &&
+         i < p->first_blk + p->nb_blocks; i++) {
 	    if(i == target_blk1)
             continue;
         
-        for (x = 0 ; x < nb_blocks ; ++x)
-            if(i == meta_blkordr[x])
-                is_metablk = 1;
-        if (is_metablk==1)
+        if (is_meta_blk(i))
             continue;
-        
-        //printk("%s(): blk %d free pgs %d >? target_valid_pg_cnt %d\n", __func__, 
-        //    i, config.pages_per_block - config.blocks[i].current_page_offset, target_blk1_valid_cnt);
+
+        /* with the streams, not the block of a frontier */
+        if (GC_STREAMS && blk_fr[i] >= 0)
+            continue;
+
+        //printk("%s(): blk %d free pgs %d >? target_live_pgs %d\n", __func__,
+        //    i, config.pages_per_block - config.blocks[i].current_page_offset, target_live_pgs);
 		if( config.pages_per_block - config.blocks[i].current_page_offset
-                                                    > target_blk1_valid_cnt) {
+                                                > target_live_pgs) {
 			if(target_blk2 == -1)
                 target_blk2 = i;    // can be mered to
 			else
@@ -1934,220 +4976,406 @@ void gc(void)
                     target_blk2 = i;
 		}
 	}
+    if (victim_blk == -1)
+        victim_blk = target_blk2;
 #endif
 
-    if(target_blk2 != -1) { // merge
-        victim_blk = target_blk2;
-    } else {
-        for (i = 0; i < config.nb_blocks; i++) {
-            if( meta_config.blocks[i].current_page_offset == 0 && meta_config.blocks[i].state == BLK_FREE) {
-                if (victim_blk == -1)
-                    victim_blk = i;
-                else if (meta_config.blocks[i].worn < 
-                        meta_config.blocks[victim_blk].worn)
-                    victim_blk = i;
-            }
-        }
-        
-        //No Free Block, we can still write back to ourself
-        if(victim_blk == -1) {
-            victim_blk = target_blk1;
-        }
+    if (victim_blk == -1) {
+        /* the least worn free block */
+        spin_lock(&p->heap_lock);
+        victim_blk = blk_heap_top(&p->free_heap);
+        spin_unlock(&p->heap_lock);
     }
-    meta_config.blocks[victim_blk].state = BLK_USED;
 
-	JDBG2("GCing......(%s) FROM target_blk1 %d (valid_cnt) --TO--> victim_blk %d (%d spots) valid %d\n",
-            target_blk2==-1?"ORIGINAL(ITSELF)":"MERGING", target_blk1, victim_blk, 
+    //No Free Block, we can still write back to ourself
+    if(victim_blk == -1) {
+        victim_blk = target_blk1;
+    }
+
+	/* the victim gets the data header if it is a fresh block, the target
+	 * once it is erased, the block of a stream has it already */
+	if (victim_blk != target_blk1 && victim_blk != gfr->blk &&
+	    open_block(victim_blk) != 0) {
+		printk(KERN_ERR "%s(): cannot open victim blk %d\n", __func__, victim_blk);
+		BUG();
+	}
+	mutex_unlock(&p->alloc_mutex);
+
+	JDBG2("GCing......(%s) FROM target_blk1 %d (live pages) --TO--> victim_blk %d (%d spots) live %d\n",
+            victim_blk==target_blk1?"ORIGINAL(ITSELF)":"MERGING", target_blk1, victim_blk, 
 #if MERGE
             config.pages_per_block - config.blocks[victim_blk].current_page_offset - head,
 #else
             -999,
 #endif
-            meta_config.blocks[target_blk1].current_page_offset - meta_config.blocks[target_blk1].nb_invalid - head);
-
+            target_live_pgs);
 
-    JDBG(PRINT_PREF "%d: state: %d, worn: %d, nb_invalid: %d, current_page_offset: %d\n",
+    JDBG(PRINT_PREF "%d: state: %d, worn: %d, nb_invalid: %d, nb_records: %d, current_page_offset: %d\n",
                                     target_blk1, config.blocks[target_blk1].state,
                                     config.blocks[target_blk1].worn,
                                     config.blocks[target_blk1].nb_invalid,
+                                    config.blocks[target_blk1].nb_records,
                                     config.blocks[target_blk1].current_page_offset);
-    JDBG(PRINT_PREF "%d: state: %d, worn: %d, nb_invalid: %d, current_page_offset: %d\n",
+    JDBG(PRINT_PREF "%d: state: %d, worn: %d, nb_invalid: %d, nb_records: %d, current_page_offset: %d\n",
                                     victim_blk, config.blocks[victim_blk].state,
                                     config.blocks[victim_blk].worn,
                                     config.blocks[victim_blk].nb_invalid,
+                                    config.blocks[victim_blk].nb_records,
                                     config.blocks[victim_blk].current_page_offset);
 
-
-    /* 1. read pages */
-	buffer = kzalloc(config.page_size * sizeof(char) * config.pages_per_block, GFP_ATOMIC);
+	/* the first page victim_blk has for the data */
+	in_place = (victim_blk == target_blk1);
+	first = in_place ? RESERVED_PG_CNT :
+		max(config.blocks[victim_blk].current_page_offset, RESERVED_PG_CNT);
+
+    /* 1. read the live couples and pack them in RAM: the packed pages, the
+     * extent pages to move, one page to read into, one for the NUL
+     * terminated key, an extent list, and for every couple its bucket and
+     * its location in the packed pages, and the heads of the multi-page
+     * couples to move */
+	nb_locs = LOC(config.pages_per_block, 0) + config.pages_per_block;
+	buffer = vzalloc(config.page_size * (2 * config.pages_per_block + 2) +
+			 slot_ext_size(EXT_MAX) + 3 * sizeof(int) * nb_locs);
     if(!buffer) {
-        printk(KERN_ERR "kmalloc failed\n");
-        BUG();
+        printk(KERN_ERR "vzalloc failed\n");
+        goto gcexit2;
     }
+	out = buffer;
+	copies = out + config.pages_per_block * config.page_size;
+	page = copies + config.pages_per_block * config.page_size;
+	true_key = page + config.page_size;
+	e = (struct slot_ext *)(true_key + config.page_size);
+	hash_idx = (int *)((char *)e + slot_ext_size(EXT_MAX));
+	new_loc = hash_idx + nb_locs;
+	owner = new_loc + nb_locs;
+	slot_page_init(out, config.page_size);
     
-    /* walk valid_list, store all target_blk data */
-    spin_lock_irqsave(&list_lock, lflags);
-    list_for_each_entry_safe(current_page, next, meta_config.blocks[target_blk1].list, p_list)
-    {
-        char* true_key;
-        if (!current_page) {
-            printk(KERN_WARNING "WARN: valid_list info is wrong\n");
-            break;
-        }
-        if ( current_page->index/config.pages_per_block != target_blk1 ) {
-            printk(KERN_WARNING "WARN: valid_list info is wrong\n");
-            break;
-        }
+    /* walk the live slots of target_blk1, page by page */
+	for (pg_index = target_blk1 * config.pages_per_block;
+	     pg_index < (target_blk1 + 1) * config.pages_per_block; pg_index++) {
+		const struct ext_page *ep = (const struct ext_page *)page;
+		int pg_end = LOC(pg_index + 1, 0);
+
+		loc = find_next_bit(valid_map, pg_end, LOC(pg_index, 0));
+		if (loc >= pg_end)
+			continue;
         JDBG(PRINT_PREF "iterating pg_idx %d (blk %d)\n", 
-                    current_page->index, current_page->index/config.pages_per_block);
+                    pg_index, pg_index/config.pages_per_block);
 
-        if (read_page(current_page->index, buffer+(valid_cnt*config.pages_per_block)) != 0) {
+        if (read_page(pg_index, page) != 0) {
             printk(KERN_ERR "%s(): read_page failed\n", __func__);
-            kfree(buffer);
-            BUG();
-        }
-        memcpy(&key_len[valid_cnt], buffer+(valid_cnt*config.pages_per_block), sizeof(int));
-        memcpy(&val_len[valid_cnt], buffer+(valid_cnt*config.pages_per_block) + sizeof(int), sizeof(int));
-        cur_key[valid_cnt] = buffer+(valid_cnt*config.pages_per_block) + 2 * sizeof(int);
-        cur_val[valid_cnt] = buffer+(valid_cnt*config.pages_per_block) + 2 * sizeof(int) + key_len[valid_cnt];
-
-        JDBG("(R) len: %d %d\n", key_len[valid_cnt], val_len[valid_cnt]);
-        JDBG("(R) data: %s \n", cur_key[valid_cnt]);
-
-        /* invalide in hashtable */
-        true_key = kmalloc(key_len[valid_cnt]+1, GFP_ATOMIC);
-        if(!true_key) {
-            printk(KERN_ERR "vallocation failed\n");
+            vfree(buffer);
             BUG();
         }
-        strncpy(true_key, cur_key[valid_cnt], key_len[valid_cnt]);
-        *(true_key+key_len[valid_cnt]) = '\0';
-        //for(j=0; j<key_len[valid_cnt] ;j++) {
-        //    JDBG("JACK: *true_key+%d \"%c\"\n", j, *(true_key+j));
-        //}
-        JDBG("(GB R) true len %lu, %s\n", strlen(true_key), true_key);
-        hash_index = hash_search(hashtable, true_key);
-
-        JDBG("(GB R) hash_idx %d\n", hash_index);
-        invalid_pg(hash_index); 
-
-        kfree(true_key);
-
-        /* record */
-        valid_cnt++;
-        JDBG("\n");
-    }
-    spin_unlock_irqrestore(&list_lock, lflags); 
 
-#if DEBUG_P6
-    /* double check */
-    /*
-    if ( meta_config.blocks[target_blk1].current_page_offset-valid_cnt == meta_config.blocks[target_blk1].nb_invalid) {
-        JDBG("GOOD cnt - valid_cnt %d invalided %d\n",
-                        valid_cnt, meta_config.blocks[target_blk1].nb_invalid);
-    } else {
-        JDBG("BAD cnt - valid_cnt %d cur_ofs %d invalided %d\n",
-                                    valid_cnt,
-                                    meta_config.blocks[target_blk1].current_page_offset,
-                                    meta_config.blocks[target_blk1].nb_invalid);
-    }
-    */
-#endif
+		/* an extent page moves with the head of its couple, below */
+		if (ep->magic == EXT_MAGIC) {
+			if (ep->key_len > config.page_size / 2)
+				i = -1;
+			else {
+				memcpy(true_key, ep->data, ep->key_len);
+				true_key[ep->key_len] = '\0';
+				i = hash_search(hashtable, true_key, hash(true_key));
+			}
+			if (i < 0 || !(hashtable[i].flags & BKT_EXT))
+				printk(KERN_WARNING "WARN: extent pg %d has no head\n",
+				       pg_index);
+			else
+				nb_owners = gc_owner_add(owner, nb_owners, i);
+			continue;
+		}
 
-    /* 2. erase victim_blk */
-    //if(target_blk2 == -1) // !merge
-    //    format_single(victim_blk);
-    //else
-        format_single(target_blk1);
-    pg_index = (victim_blk * config.pages_per_block)
-                        + meta_config.blocks[victim_blk].current_page_offset;
-	
-    JDBG("write_hdr(GC DATA) pg_idx %d blk %d (pg should \% 64 == 0)\n", 
-                            pg_index, pg_index/config.pages_per_block);
-    if(pg_index % config.pages_per_block == 0) {
-        JDBG("(ORIGINAL(ITSELF)) must be here\n");
-        write_hdr(pg_index, NAND_DATA, 0);
-    }
-    JDBG("valid_cnt: %d\n", valid_cnt);
+		for (; loc < pg_end; loc = find_next_bit(valid_map, pg_end, loc + 1)) {
+			const struct slot_rec *rec;
+			unsigned int h;
 
-    /* 3. write */
-    for (i=0; i<valid_cnt; i++) {
-        char* shown_key;
-        
-        memcpy(buffer+(i*config.pages_per_block), &key_len[i], sizeof(int));
-        memcpy(buffer+(i*config.pages_per_block) + sizeof(int), &val_len[i], sizeof(int));
-        strncpy(buffer+(i*config.pages_per_block) + 2 * sizeof(int), cur_key[i], key_len[i]);
-        strncpy(buffer+(i*config.pages_per_block) + 2 * sizeof(int) + key_len[i], cur_val[i], val_len[i]);
-        JDBG("(W) len: %d %d\n", key_len[i], val_len[i]);
-        JDBG("(W) data: %s \n", cur_key[i]);
-        JDBG("(Wbuf) len: %d %d\n", *(buffer+(i*config.pages_per_block)), *(buffer+(i*config.pages_per_block) + sizeof(int)));
-        JDBG("(Wbuf) data: %s \n", (buffer+(i*config.pages_per_block) + 2 * sizeof(int)));
-	    pg_index = (victim_blk * config.pages_per_block)
-                            + meta_config.blocks[victim_blk].current_page_offset;
-        
-        shown_key = kmalloc(key_len[i]+1, GFP_ATOMIC);
-        if(!shown_key) {
-            printk(KERN_ERR "vallocation failed\n");
-            BUG();
-        }
-        strncpy(shown_key, cur_key[i], key_len[i]);
-        *(shown_key+key_len[i]) = '\0';
-        JDBG("(SHOWN KEY): keylen %d key %s\n", key_len[i], shown_key);
-#if DEBUG_P6
-        int j;
-        for(j=0; j<key_len[i] ;j++) {
-            JDBG("JACK: *shown_key+%d \"%c\"\n", j, *(shown_key+j));
-        }
-#endif
-        JDBG("JACK: shown %lu\n", strlen(shown_key));
-        
-        /* write to disk and update metadata (blk info) on RAM */
-	    ret = write_page(pg_index, buffer+(i*config.pages_per_block));  // update .current_page_offset
-        spin_lock_irqsave(&list_lock, lflags);
-        ret2 = hash_add(hashtable, shown_key, pg_index);                // PG_VALID
-        if (ret<0 || ret2<0) {
+			rec = slot_page_rec(page, config.page_size, LOC_SLOT(loc));
+			if (!rec) {
+				printk(KERN_WARNING "WARN: bad slot %d in pg %d\n",
+				       LOC_SLOT(loc), pg_index);
+				continue;
+			}
+			memcpy(true_key, rec->data, rec->key_len);
+			true_key[rec->key_len] = '\0';
+			JDBG("(GB R) true len %lu, %s\n", strlen(true_key), true_key);
+
+			/* p->sem keeps the writers of its keys out */
+			h = hash(true_key);
+			hash_idx[valid_cnt] = hash_search(hashtable, true_key, h);
+			JDBG("(GB R) hash_idx %d\n", hash_idx[valid_cnt]);
+			if (hash_idx[valid_cnt] < 0 ||
+			    hashtable[hash_idx[valid_cnt]].index != loc) {
+				printk(KERN_WARNING "WARN: valid_map info is wrong\n");
+				continue;
+			}
+			if (hashtable[hash_idx[valid_cnt]].flags & BKT_EXT) {
+				nb_owners = gc_owner_add(owner, nb_owners,
+							 hash_idx[valid_cnt]);
+				continue;
+			}
+
+			new_loc[valid_cnt] = gc_pack(out, &out_pgs, rec->data,
+						     rec->key_len,
+						     rec->data + rec->key_len,
+						     rec->val_len);
+			if (new_loc[valid_cnt++] < 0)
+				goto gc_abort;
+		}
+	}
+
+	/* the multi-page couples: their extents in target_blk1 go to the
+	 * first pages given to victim_blk, in order, and their heads are packed
+	 * with the new extent list, wherever they were */
+	for (i = 0; i < nb_owners; i++) {
+		const struct slot_rec *rec = NULL;
+		loc = hashtable[owner[i]].index;
+
+		if (read_page(LOC_PAGE(loc), page) == 0)
+			rec = slot_page_rec(page, config.page_size, LOC_SLOT(loc));
+		if (!rec || slot_rec_ext(rec, e) != 0)
+			goto gc_abort;
+		for (j = 0; j < e->nb_ext; j++) {
+			if (e->ext[j].page / config.pages_per_block != target_blk1)
+				continue;
+			if (n_copy + e->ext[j].nb > config.pages_per_block ||
+			    read_pages(e->ext[j].page, e->ext[j].nb,
+				       copies + n_copy * config.page_size) != 0)
+				goto gc_abort;
+			e->ext[j].page = victim_blk * config.pages_per_block +
+					 first + n_copy;
+			n_copy += e->ext[j].nb;
+		}
+		hash_idx[valid_cnt] = owner[i];
+		new_loc[valid_cnt] = gc_pack(out, &out_pgs, rec->data,
+					     rec->key_len, (const char *)e,
+					     rec->val_len);
+		if (new_loc[valid_cnt++] < 0)
+			goto gc_abort;
+	}
+	if (valid_cnt)
+		out_pgs++;
+	/* heads from other blocks may not fit with the rest, nothing was
+	 * erased yet */
+	if (n_copy + out_pgs > config.pages_per_block - first) {
+gc_abort:
+		printk(KERN_WARNING "%s(): cannot move the couples of blk %d\n",
+		       __func__, target_blk1);
+		vfree(buffer);
+		goto gcexit2;
+	}
+
+	/* 2. when the data goes back to target_blk1 itself, it is erased
+	 * first and readers of it wait until it is rewritten. Otherwise the
+	 * data is moved before target_blk1 is erased. Readers of multi-page
+	 * couples with extents in it wait as well */
+	tworn = meta_config.blocks[target_blk1].worn;
+	if (in_place) {
+		/* erased and opened again before the log can take it */
+		mutex_lock(&p->alloc_mutex);
+		write_seqcount_begin(&blk_seq[target_blk1]);
+		write_seqcount_begin(&p->ext_seq);
+		gc_disown(p, target_blk1);
+		__format_single(target_blk1);
+		ckpt = 1;
+		ret = open_block(victim_blk);
+		blk_tier[target_blk1] = gfr->tier;
+		mutex_unlock(&p->alloc_mutex);
+		if (ret) {
+			printk(KERN_ERR "%s(): cannot open victim blk %d\n", __func__, victim_blk);
+			BUG();
+		}
+		journal_rec_init(&r, JREC_ERASE, 0, target_blk1, -1);
+		journal_append(&r);
+	}
+    JDBG("valid_cnt: %d in %d pages, %d extent pages\n", valid_cnt, out_pgs, n_copy);
+
+	/* 3. write the extent pages where the new heads expect them, then the
+	 * packed pages, and publish the couples of each */
+	for (i = 0; i < n_copy; i++) {
+		pg_index = reserve_page(victim_blk);
+		ret = (pg_index != victim_blk * config.pages_per_block + first + i) ?
+			-1 : __write_page(pg_index, copies + i * config.page_size);
+		if (ret < 0) {
+			printk("%s: failed to move extent pg to %d\n", __func__,
+			       pg_index);
+			BUG();
+		}
+		set_bit(LOC(pg_index, 0), valid_map);
+	}
+    for (i = 0, j = 0; i < out_pgs; i++) {
+		pg_index = reserve_page(victim_blk);
+		ret = (pg_index < 0) ? -1 :
+			__write_page(pg_index, out + i * config.page_size);
+        if (ret < 0) {
             printk("%s: failed to write back to ram/disk\n", __func__);
             BUG();
         }
-        list_add(&hashtable[ret2].p_list, meta_config.blocks[victim_blk].list);
-        spin_unlock_irqrestore(&list_lock, lflags);
-        
-        JDBG("GB: wrote hash_idx %d pg_idx %d again\n", ret2, pg_index);
 
-#if 0
-        //slef-checking
-        hash_index = hash_search(hashtable, shown_key);
-        printk("self-checking (hash): hash_idx %d\n", hash_index);
-        char* tmp_buf = kmalloc(config.page_size, GFP_ATOMIC);
-        if (read_page(hashtable[hash_index].index, tmp_buf) != 0) {
-            printk(KERN_ERR "%s(): read_page (checking) failed\n", __func__);
-            kfree(buffer);
-            BUG();
-        }
-        ret = memcpy(tmp_buf, buffer+(i*config.pages_per_block), config.page_size);
-        printk("self-checking (disk): pg_idx %d %s\n", hashtable[hash_index].index, ret==0?"GOOD":"BAD");
-        kfree(tmp_buf);
-#endif
-        kfree(shown_key);
-        JDBG("\n");
+		for (; j < valid_cnt && LOC_PAGE(new_loc[j]) == i; j++) {
+			bucket *b = &hashtable[hash_idx[j]];
+			unsigned int h = b->hash;
+			int old = b->index;
+
+			loc = LOC(pg_index, LOC_SLOT(new_loc[j]));
+			/* publish the new location */
+			hash_write_lock(h);
+			journal_rec_init(&r, (b->flags & BKT_EXT) ?
+					 JREC_SET_EXT : JREC_SET, h, loc, old);
+			b->index = loc;
+			meta_dirty(b, sizeof(*b));
+			hash_write_unlock(h);
+			journal_append(&r);
+			set_bit(loc, valid_map);
+			/* a head moved from another block */
+			if (loc_blk(old) != target_blk1)
+				invalid_page(old);
+			else
+				vcache_move(old, tworn, loc,
+					    meta_config.blocks[victim_blk].worn);
+
+			JDBG("GB: wrote hash_idx %d loc %d again\n", hash_idx[j], loc);
+		}
     }
-    
-    /* update blk info */
-    spin_lock_irqsave(&list_lock, lflags);
-    meta_config.blocks[victim_blk].state = BLK_USED;
-    spin_unlock_irqrestore(&list_lock, lflags);     
+	if (valid_cnt) {
+		/* the wear leveler has counters of its own: they are not the
+		 * write amplification of GC */
+		if (wear) {
+			p->nb_wl_recs += valid_cnt;
+			p->nb_wl_pgs += n_copy + out_pgs;
+		} else {
+			gfr->nb_recs += valid_cnt;
+			gfr->nb_data_pgs += n_copy + out_pgs;
+		}
+		blk_add_records(victim_blk, valid_cnt + n_copy);
+	}
 
-	kfree(buffer);
+	/* 4. erase target_blk1, the new locations must be on flash first:
+	 * the checkpoint may still point into it */
+gc_erase:
+	__journal_commit();
+	if (in_place) {
+		/* already erased, the checkpoint is taken below */
+		write_seqcount_end(&p->ext_seq);
+		write_seqcount_end(&blk_seq[target_blk1]);
+	} else {
+		if (ACCESS_ONCE(journal_lost)) {
+			/* the checkpoint needs every partition quiet: the
+			 * target is sealed so that the writers of p that get
+			 * in meanwhile do not use it */
+			gc_seal(p, target_blk1);
+			up_write(&p->sem);
+			up_read(&kv_sem);
+			down_write(&kv_sem);
+			exclusive = 1;
+			if (__flush_metadata() != 0)
+				printk(KERN_ERR "%s(): relocations of blk %d not on flash\n",
+				       __func__, target_blk1);
+		}
+		mutex_lock(&p->alloc_mutex);
+		gc_disown(p, target_blk1);
+		mutex_unlock(&p->alloc_mutex);
+		write_seqcount_begin(&p->ext_seq);
+		format_single(target_blk1);
+		write_seqcount_end(&p->ext_seq);
+		journal_rec_init(&r, JREC_ERASE, 0, target_blk1, -1);
+		journal_append(&r);
+	}
+
+	vfree(buffer);
+	atomic_set(&meta_config.recent_update, 1);
+	bg_account(wear ? &p->wl_time : &p->gc_time, start);
 
     JDBG("\n\n");
 gcexit2:
-    //spin_unlock_irqrestore(&erase_lock, eflags);
-    spin_unlock(&erase_lock);
-    atomic_set(&is_gb, 0);
+	if (exclusive)
+		up_write(&kv_sem);
+	else {
+		up_write(&p->sem);
+		up_read(&kv_sem);
+	}
+	mutex_unlock(&p->gc_mutex);
+	if (ckpt && ACCESS_ONCE(journal_lost))
+		flush_metadata(true);
     JDBG("\n\n");
     return;
 }
 
+/* gc( void)
+ * A GC pass in every partition, one after the other
+ *
+ * Return
+ * VOID
+ */
+void gc(void)
+{
+	int i;
+
+	for (i = 0; i < config.nb_parts; i++)
+		gc_part(&parts[i]);
+}
+
+/* get_core_stats( kv_core_stats *st)
+ * Fill the store-wide statistics returned by IOCTL_CORE_STATS
+ *
+ * Return
+ * VOID
+ */
+void get_core_stats(kv_core_stats *st)
+{
+	struct hash_probe_stats hs;
+	struct kv_part *p;
+	long nb, bytes;
+	int i, n;
+
+	memset(st, 0, sizeof(*st));
+	hash_stats(hashtable, &hs);
+	st->nb_lookups = hs.nb_lookups;
+	st->nb_probes = hs.nb_probes;
+	st->max_probe = hs.max_probe;
+	st->max_dist = hs.max_dist;
+
+	/* plain reads, a pass may be accounted meanwhile */
+	st->nb_parts = config.nb_parts;
+	for (i = 0; i < config.nb_parts; i++) {
+		p = &parts[i];
+		st->nb_gc += p->gc_time.nb;
+		st->gc_us += p->gc_time.us;
+		st->gc_max_us = max(st->gc_max_us, p->gc_time.max_us);
+		for (n = 0; n < p->nb_fr + GC_TIERS; n++) {
+			st->nb_recs += p->fr[n].nb_recs;
+			st->nb_coalesced += p->fr[n].nb_coalesced;
+			st->parts[i].nb_data_pgs += p->fr[n].nb_data_pgs;
+			if (n < p->nb_fr)
+				continue;
+			st->nb_gc_recs += p->fr[n].nb_recs;
+			st->nb_gc_pgs += p->fr[n].nb_data_pgs;
+		}
+		st->nb_data_pgs += st->parts[i].nb_data_pgs;
+		st->nb_wl += p->wl_time.nb;
+		st->wl_us += p->wl_time.us;
+		st->nb_wl_recs += p->nb_wl_recs;
+		st->nb_wl_pgs += p->nb_wl_pgs;
+		st->parts[i].nb_gc = p->gc_time.nb;
+		st->parts[i].nb_blocks = p->nb_blocks;
+		st->parts[i].nb_free_blks = p->nb_free_blks;
+	}
+	st->min_worn = INT_MAX;
+	for (i = 0; i < config.nb_blocks; i++) {
+		if (is_meta_blk(i))
+			continue;
+		st->min_worn = min(st->min_worn, meta_config.blocks[i].worn);
+		st->max_worn = max(st->max_worn, meta_config.blocks[i].worn);
+	}
+	st->nb_ckpt = ckpt_time.nb;
+	st->ckpt_us = ckpt_time.us;
+	st->ckpt_max_us = ckpt_time.max_us;
+	vcache_stats(&st->nb_vc_hits, &st->nb_vc_misses, &bytes);
+	st->vc_bytes = bytes;
+	oindex_stats(&nb, &bytes);
+	st->oi_keys = nb;
+	st->oi_bytes = bytes;
+}
+
 /* print_hash( void)
  * TODO
  * Return
@@ -2156,19 +5384,16 @@ gcexit2:
 void print_hash(void)
 {
 	int i;
-    int j, is_victim;
-    int nb_pages = (meta_config.metadata_size / meta_config.page_size) + 1;
-    int nb_blocks = (nb_pages / config.pages_per_block) + 1;
+    int is_victim;
     int valid_cnt = 0;
-	//bucket *current_page;
 
 	for (i = 0; i < HASH_SIZE; i++) {
 		if(hashtable[i].p_state == PG_VALID) {
-			printk(PRINT_PREF "%d: dirty: %d, p_state: %d, index: %d, key:%s in_pg:%lu \n", i, \
-				hashtable[i].dirty, \
+			printk(PRINT_PREF "%d: hash: %u, p_state: %d, index: %d, key:%.*s in_pg:%lu \n", i, \
+				hashtable[i].hash, \
 				hashtable[i].p_state, \
 				hashtable[i].index, \
-				hashtable[i].key, \
+				hashtable[i].key_len, bucket_key(&hashtable[i]), \
                 ((&hashtable[i] - hashtable)*sizeof(bucket))/2048);
             valid_cnt++;
         }
@@ -2184,32 +5409,28 @@ void print_hash(void)
 	}
 	
 #if 1
-	for (i=0, j=0; i < config.nb_blocks; i++) 
+	for (i=0; i < config.nb_blocks; i++) 
 	{
-        is_victim = 0;
-        for (j = 0 ; j < nb_blocks ; ++j) {
-            if(i == meta_blkordr[j]) {
-                is_victim = 1;
-                break; 
-            }
-        }
+        is_victim = is_meta_blk(i);
         printk(PRINT_PREF "%d: state: %d, worn: %d, nb_invalid: %d, current_page_offset: %d [%s]\n",
                                     i, config.blocks[i].state,
                                     config.blocks[i].worn,
                                     config.blocks[i].nb_invalid,
                                     config.blocks[i].current_page_offset,
                                     is_victim==1?"*":"");
-        
-#if 0
-		printk(PRINT_PREF "block %d's valid pages: \n", i);
-		list_for_each_entry(current_page, config.blocks[i].list, p_list)
-		{
-			if (current_page)
-				printk(PRINT_PREF "%d\n", current_page->index);
-		}
-#endif
+
     }
 #endif
+    {
+        struct hash_probe_stats hs;
+
+        hash_stats(hashtable, &hs);
+        printk(PRINT_PREF "lookups: %llu, mean probe: %llu.%02llu, max probe: %d, max dist: %d\n",
+               hs.nb_lookups,
+               hs.nb_lookups ? hs.nb_probes / hs.nb_lookups : 0,
+               hs.nb_lookups ? (hs.nb_probes * 100 / hs.nb_lookups) % 100 : 0,
+               hs.max_probe, hs.max_dist);
+    }
     JDBG2("Valid key cnt: %d\n", valid_cnt);
     JDBG2("sizeof(bucket) %d\n", sizeof(bucket));
 #if 0
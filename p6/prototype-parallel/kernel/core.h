@@ -7,7 +7,9 @@
 
 #include <linux/mtd/mtd.h>
 #include <linux/semaphore.h>
+#include <linux/completion.h>
 #include <linux/list.h>
+#include "device.h"
 
 /* state for a flash block: used or free */
 typedef enum {
@@ -21,29 +23,27 @@ typedef enum {
 	PG_VALID
 } page_state;
 
-/* data structure containing the state, wear level, and the number of invalid pages of a flash block */
+/* data structure containing the state, wear level, and the number of invalid pages of a flash block.
+ * The fields of blocks[i] are updated under blk_lock[i] */
 typedef struct {
-	struct list_head *list;
 	blk_state state;
 	int worn;        /* for wear leveling */
-	int nb_invalid;  /* for GC */
-	//int nb_valid;    /* for GC */
+	int nb_invalid;  /* for GC: couples of the block that are not current */
+	int nb_records;  /* for GC: couples written in the block */
 	int current_page_offset;
 } blk_info;
 
 /* global attributes for our system */
 typedef struct {
-	struct mtd_info *mtd;	/* pointer to the used flash partition mtd_info object */
-	int mtd_index;		/* the partition index */
+	int nb_parts;		/* data partitions the store is striped on,
+				 * their blocks numbered one after the other */
 	int nb_blocks;		/* amount of managed flash blocks */
 	int block_size;		/* flash bock size in bytes */
 	int page_size;		/* flash page size in bytes */
 	int pages_per_block;	/* number of flash pages per block */
 	//blk_info *blocks;	/* metadata : flash blocks/pages state */
 	blk_info *blocks; /*metadata: flash blocks state */
-	int format_done;	/* used during format operation */
 	int read_only;		/* are we in read-only mode? */
-	struct semaphore format_lock;	/* used during the format operation */
 } lkp_kv_cfg;
 
 //TODO NEED TO MERGE lkp_meta_cfg into lkp_kv_cfg!!!
@@ -57,34 +57,78 @@ typedef struct {
 	blk_info *blocks;	/* Block Info Structure */
 	int format_done;
 	int read_only;
-	struct semaphore format_lock;
+	struct completion erase_done;
 	int number_of_valid_pages;
 	int hashtable_size;	/* Total size of hash table in bytes */
+	int key_arena_size;	/* Total size of the key arena in bytes */
 	int block_info_size;	/* Total size of Flash in bytes */
-	int metadata_size;	/* Total size of hashtable_size + block_info_size */
+	int metadata_size;	/* Total size of hashtable_size + key_arena_size + block_info_size */
 	atomic_t recent_update;	/* flag for interrupt to check when flushing to disk */
 } lkp_meta_cfg;
     
+/* one operation of a batch (mset_keyval/mget_keyval/mdel_key) */
+struct kv_item {
+	const char *key;	/* NUL terminated key */
+	char *val;		/* set: value to write, get: value buffer */
+	int val_size;		/* get: capacity of val (including the NUL) */
+	int status;		/* return code of the single operation */
+	int part;		/* set/del: data partition of the key */
+	int page;		/* get: location of the key, LOC(page, slot) */
+	unsigned int seq;	/* get: erase sequence of the page's block */
+};
+
+/* a range of keys for scan_keyval(): the keys from from on (after set:
+ * from excluded, it is the last key of the previous batch), up to to
+ * excluded (NULL: no end), that start with prefix (NULL: any) */
+struct kv_scan {
+	const char *from;
+	int from_len;
+	int after;
+	const char *to;
+	int to_len;
+	const char *prefix;
+	int prefix_len;
+};
+
+/* buffers the reads and the deletion of multi-page couples need,
+ * preallocated by an opener of the device so that its operations do not
+ * allocate, see kv_scratch_init() */
+struct kv_scratch {
+	char *page;		/* a flash page */
+	char *bounce;		/* the pages of a multi-page read */
+	void *ext;		/* an extent list (struct slot_ext) */
+	struct kv_item **order;	/* KV_BATCH_MAX entries, see mget_keyval() */
+};
+
 /* export some prototypes for function used in the virtual device file */
-int set_keyval(const char *key, const char *val);
-int get_keyval(const char *key, char *val);
-int del_key(const char *key);
+int kv_scratch_init(struct kv_scratch *s);
+void kv_scratch_free(struct kv_scratch *s);
+int set_keyval(const char *key, const char *val, int noreplace,
+	       struct kv_scratch *s);
+/* consumer of a value read in chunks, see get_keyval_stream(): len bytes
+ * of the value at offset ofs, returns 0 or a negative error code */
+typedef int (*kv_chunk_fn)(void *arg, int ofs, const char *data, int len);
+int get_keyval_stream(const char *key, int val_size, kv_chunk_fn fn,
+		      void *arg, int *len, struct kv_scratch *s);
+int del_key(const char *key, struct kv_scratch *s);
+int mset_keyval(struct kv_item *items, int nr, int noreplace,
+		struct kv_scratch *s);
+int mget_keyval(struct kv_item *items, int nr, struct kv_scratch *s);
+int mdel_key(struct kv_item *items, int nr, struct kv_scratch *s);
+int scan_keyval(const struct kv_scan *sc, struct kv_item *items, int nr,
+		char *keys, int keys_size, int values, struct kv_scratch *s);
 int format(void);
 int format_single( int idx);
+int kv_sync(void);
 void print_hash(void);
 int my_gbtest(void);
 void gc(void);
 int write_hdr(int pg_idx, int data, int meta_blk_num);
+void get_core_stats(kv_core_stats *st);
+void meta_dirty(const void *p, size_t len);
 
-//spinlock_t one_lock;
-extern spinlock_t one_lock;
-/*
-unsigned long flags;
-spin_lock_irqsave(&one_lock, flags);
-spin_unlock_irqrestore(&one_lock, flags);
-*/
 /* prototypes */
-int init_config(int mtd_index, int meta_index);
+int init_config(const int *mtd_index, int nb_parts, int meta_index);
 
 extern lkp_kv_cfg config;
 extern lkp_meta_cfg meta_config;
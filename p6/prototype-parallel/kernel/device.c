@@ -4,15 +4,63 @@
 
 #include "device.h"
 
+#include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/ioctl.h>
 #include <asm/uaccess.h>
 #include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/workqueue.h>
 
 #include "core.h"
 
-/* global attributes for the virtual device */
-static atomic_t file_is_open;
+/* per-open attributes of the virtual device: every process (or thread) that
+ * opens /dev/lkp_kv gets its own transfer buffers, statistics and options, 
+ * so that several openers can issue ioctls at the same time, and so that
+ * single operations do not allocate. Threads sharing the same file
+ * descriptor are serialized on its lock */
+struct kv_file {
+	struct mutex lock;	/* protects the buffers and counters below */
+	char *key;		/* key transfer buffer, page_size + 1 bytes */
+	char *val;		/* value transfer buffer, KV_VAL_MAX + 1 bytes */
+	struct kv_scratch scratch;	/* page buffers of the module core */
+	kv_stats stats;		/* operation counters of this opener */
+	int flags;		/* KV_OPT_* options of this opener */
+	struct kv_ring *ring;	/* see IOCTL_RING_SETUP, set once */
+};
+
+/* the rings of an opener, see kv_ring_hdr. The kernel keeps its own copy
+ * of the indexes it moves, and only reads those the user moves. The worker
+ * has its own transfer buffers, it runs next to the ioctls of the opener */
+struct kv_ring {
+	struct kv_file *kvf;
+	void *mem;		/* the mapping, map_len bytes */
+	int map_len;
+	kv_ring_hdr *hdr;
+	kv_sqe *sq;
+	kv_cqe *cq;
+	char *data;
+	int data_len;
+	unsigned int sq_mask, cq_mask;
+	unsigned int sq_head, cq_tail;
+	char *key;		/* key of the running entry, page_size + 1 bytes */
+	char *val;		/* its value, KV_VAL_MAX + 1 bytes */
+	struct kv_scratch scratch;
+	struct eventfd_ctx *efd;	/* signalled on completions, or NULL */
+	wait_queue_head_t wait;	/* pollers of the device file */
+	struct work_struct work;	/* the worker, on ring_wq */
+};
+
+/* entries the worker runs before it posts their completions */
+#define RING_CHUNK 32
+
+static struct workqueue_struct *ring_wq;
+
+static void ring_free(struct kv_ring *ring);
 
 /**
  * called when a process opens the virtual device file 
@@ -20,13 +68,23 @@ static atomic_t file_is_open;
  */
 static int device_open(struct inode *inode, struct file *file)
 {
-	/* only a single process can open the device at a time */
-	int is_open = atomic_read(&file_is_open);
-	if (is_open)
-		return -EBUSY;
-
-	atomic_set(&file_is_open, 1);
+	struct kv_file *kvf;
+
+	kvf = kzalloc(sizeof(struct kv_file), GFP_KERNEL);
+	if (!kvf)
+		return -ENOMEM;
+
+	kvf->key = vmalloc(config.page_size + 1);
+	kvf->val = vmalloc(KV_VAL_MAX + 1);
+	if (!kvf->key || !kvf->val || kv_scratch_init(&kvf->scratch) != 0) {
+		vfree(kvf->key);
+		vfree(kvf->val);
+		kfree(kvf);
+		return -ENOMEM;
+	}
 
+	mutex_init(&kvf->lock);
+	file->private_data = kvf;
 	return 0;
 }
 
@@ -35,16 +93,552 @@ static int device_open(struct inode *inode, struct file *file)
  */
 static int device_release(struct inode *inode, struct file *file)
 {
-	atomic_set(&file_is_open, 0);
+	struct kv_file *kvf = file->private_data;
+
+	/* the mapping holds the file: nobody uses the rings anymore */
+	ring_free(kvf->ring);
+	vfree(kvf->key);
+	vfree(kvf->val);
+	kv_scratch_free(&kvf->scratch);
+	kfree(kvf);
+	file->private_data = NULL;
+	return 0;
+}
+
+/* op_key( kvf, kv)
+ * Key of a single operation, NUL terminated: inline in kv (its key is
+ * NULL), or copied from userspace to kvf->key. kv->key_len was checked
+ * against the page size
+ *
+ * Return
+ * the key
+ * NULL: user/kernelspace memory transfer error, or an inline key too long
+ */
+static const char *op_key(struct kv_file *kvf, keyval *kv)
+{
+	if (!kv->key) {
+		if (kv->key_len >= KV_KEY_INLINE)
+			return NULL;
+		kv->key_inline[kv->key_len] = '\0';
+		return kv->key_inline;
+	}
+	if (copy_from_user(kvf->key, kv->key, kv->key_len))
+		return NULL;
+	kvf->key[kv->key_len] = '\0';
+	return kvf->key;
+}
+
+/* chunk_to_user( arg, ofs, data, len)
+ * kv_chunk_fn of IOCTL_GET: copy a chunk of the value to the user buffer
+ * at arg
+ */
+static int chunk_to_user(void *arg, int ofs, const char *data, int len)
+{
+	return copy_to_user((char __user *)arg + ofs, data, len) ? -5 : 0;
+}
+
+/* device_batch( kvf, ioctl_num, ubatch)
+ * IOCTL_MSET/MGET/MDEL: copy the descriptors and the needed part of the
+ * arena in, run the whole batch in the module core, and copy the per-item 
+ * status codes (and the values of a get) back to userspace.
+ *
+ * Return
+ * the number of successful operations
+ * -1: malformed batch
+ * -2: allocation failure
+ * -5: user/kernelspace memory transfer error
+ */
+static int device_batch(struct kv_file *kvf, unsigned int ioctl_num,
+			keyval_batch *ubatch)
+{
+	keyval_batch b;
+	keyval_desc *descs = NULL;
+	struct kv_item *items = NULL;
+	char *arena = NULL, *vals = NULL;
+	int i, in_len = 0, vals_len = 0, ret;
+
+	if (copy_from_user(&b, ubatch, sizeof(keyval_batch)))
+		return -5;
+	if (b.nr <= 0 || b.nr > KV_BATCH_MAX || b.arena_len <= 0
+	    || b.arena_len > b.nr * 2 * (config.page_size + 2))
+		return -1;
+
+	descs = kmalloc(b.nr * sizeof(keyval_desc), GFP_KERNEL);
+	items = kzalloc(b.nr * sizeof(struct kv_item), GFP_KERNEL);
+	if (!descs || !items) {
+		ret = -2;
+		goto batch_exit;
+	}
+	if (copy_from_user(descs, b.descs, b.nr * sizeof(keyval_desc))) {
+		ret = -5;
+		goto batch_exit;
+	}
+
+	/* check the descriptors and find how much of the arena we need: keys
+	 * (and values for a set) must leave room for their terminating NUL.
+	 * The offsets come from userspace, they are checked without adding
+	 * them to the lengths, which could overflow */
+	for (i = 0; i < b.nr; i++) {
+		keyval_desc *d = &descs[i];
+
+		if (d->key_ofs < 0 || d->key_len < 0 || d->val_ofs < 0
+		    || d->val_len < 0 || d->key_len > config.page_size
+		    || d->key_ofs > b.arena_len - 1 - d->key_len) {
+			ret = -1;
+			goto batch_exit;
+		}
+		in_len = max(in_len, d->key_ofs + d->key_len + 1);
+
+		if (ioctl_num == IOCTL_MSET) {
+			if (d->val_len > config.page_size
+			    || d->val_ofs > b.arena_len - 1 - d->val_len) {
+				ret = -1;
+				goto batch_exit;
+			}
+			in_len = max(in_len, d->val_ofs + d->val_len + 1);
+		} else if (ioctl_num == IOCTL_MGET) {
+			if (d->val_len < 1 || d->val_ofs > b.arena_len - d->val_len) {
+				ret = -1;
+				goto batch_exit;
+			}
+			vals_len += min(d->val_len, config.page_size + 1);
+		}
+	}
+
+	arena = vmalloc(in_len);
+	if (ioctl_num == IOCTL_MGET)
+		vals = vmalloc(vals_len);
+	if (!arena || (ioctl_num == IOCTL_MGET && !vals)) {
+		ret = -2;
+		goto batch_exit;
+	}
+	if (copy_from_user(arena, b.arena, in_len)) {
+		ret = -5;
+		goto batch_exit;
+	}
+
+	for (i = 0, vals_len = 0; i < b.nr; i++) {
+		keyval_desc *d = &descs[i];
+
+		arena[d->key_ofs + d->key_len] = '\0';
+		items[i].key = arena + d->key_ofs;
+		if (ioctl_num == IOCTL_MSET) {
+			arena[d->val_ofs + d->val_len] = '\0';
+			items[i].val = arena + d->val_ofs;
+		} else if (ioctl_num == IOCTL_MGET) {
+			items[i].val = vals + vals_len;
+			items[i].val_size = min(d->val_len, config.page_size + 1);
+			vals_len += items[i].val_size;
+		}
+	}
+
+	/* call module core function */
+	if (ioctl_num == IOCTL_MSET)
+		ret = mset_keyval(items, b.nr, kvf->flags & KV_OPT_NOREPLACE,
+				  &kvf->scratch);
+	else if (ioctl_num == IOCTL_MGET)
+		ret = mget_keyval(items, b.nr, &kvf->scratch);
+	else
+		ret = mdel_key(items, b.nr, &kvf->scratch);
+	if (ret < 0)
+		goto batch_exit;
+
+	/* a sync session gets its updates on flash before the statuses: if
+	 * they cannot be written, none of them is reported done */
+	if (ret > 0 && ioctl_num != IOCTL_MGET && (kvf->flags & KV_OPT_SYNC)
+	    && kv_sync() != 0) {
+		for (i = 0; i < b.nr; i++)
+			if (items[i].status >= 0)
+				items[i].status = -4;
+		ret = 0;
+	}
+
+	for (i = 0; i < b.nr; i++) {
+		descs[i].status = items[i].status;
+		if (ioctl_num == IOCTL_MGET && items[i].status >= 0) {
+			int len = strlen(items[i].val);
+
+			/* write the value in its slot of the user arena */
+			if (copy_to_user(b.arena + descs[i].val_ofs,
+					 items[i].val, len + 1))
+				descs[i].status = -5;
+			descs[i].val_len = len;
+		}
+	}
+
+	if (copy_to_user(b.descs, descs, b.nr * sizeof(keyval_desc)))
+		ret = -5;
+
+batch_exit:
+	vfree(vals);
+	vfree(arena);
+	kfree(items);
+	kfree(descs);
+	return ret;
+}
+
+/* device_scan( kvf, uscan)
+ * IOCTL_SCAN: copy the bounds of the range in, gather the next keys (and
+ * values) in the module core, and pack them in the user arena, key then
+ * value, as long as they fit: the keys that do not are the first ones of
+ * the next batch.
+ *
+ * Return
+ * the number of keys in the batch (0: end of the range)
+ * -1: malformed scan
+ * -2: allocation failure
+ * -3: the arena cannot hold the first key (and its value)
+ * -5: user/kernelspace memory transfer error
+ */
+static int device_scan(struct kv_file *kvf, keyval_scan *uscan)
+{
+	keyval_scan sc;
+	struct kv_scan range;
+	keyval_desc *descs = NULL;
+	struct kv_item *items = NULL;
+	char *bounds = NULL, *keys = NULL, *vals = NULL;
+	int i, n, ret, ofs = 0, values, max = config.page_size;
+
+	if (copy_from_user(&sc, uscan, sizeof(keyval_scan)))
+		return -5;
+	if (sc.nr <= 0 || sc.nr > KV_BATCH_MAX || sc.arena_len <= 0
+	    || sc.arena_len > sc.nr * 2 * (config.page_size + 2)
+	    || sc.start_len < 0 || sc.start_len > max
+	    || sc.end_len < 0 || sc.end_len > max
+	    || sc.cursor_len < 0 || sc.cursor_len > max
+	    || (sc.flags & ~KV_SCAN_MASK))
+		return -1;
+	values = sc.flags & KV_SCAN_VALUES;
+
+	/* start, end and cursor, one after the other */
+	bounds = kmalloc(3 * (max + 1), GFP_KERNEL);
+	descs = kmalloc(sc.nr * sizeof(keyval_desc), GFP_KERNEL);
+	items = kzalloc(sc.nr * sizeof(struct kv_item), GFP_KERNEL);
+	keys = vmalloc(sc.arena_len);
+	if (values)
+		vals = vmalloc(sc.nr * (config.page_size + 1));
+	if (!bounds || !descs || !items || !keys || (values && !vals)) {
+		ret = -2;
+		goto scan_exit;
+	}
+	if (copy_from_user(bounds, sc.start, sc.start_len)
+	    || copy_from_user(bounds + max + 1, sc.end, sc.end_len)
+	    || copy_from_user(bounds + 2 * (max + 1), sc.cursor, sc.cursor_len)) {
+		ret = -5;
+		goto scan_exit;
+	}
+
+	memset(&range, 0, sizeof(range));
+	if (sc.cursor_len) {
+		range.from = bounds + 2 * (max + 1);
+		range.from_len = sc.cursor_len;
+		range.after = 1;
+	} else {
+		range.from = bounds;
+		range.from_len = sc.start_len;
+	}
+	if (sc.flags & KV_SCAN_PREFIX) {
+		range.prefix = bounds;
+		range.prefix_len = sc.start_len;
+	} else if (sc.end_len) {
+		range.to = bounds + max + 1;
+		range.to_len = sc.end_len;
+	}
+	for (i = 0; values && i < sc.nr; i++) {
+		items[i].val = vals + i * (config.page_size + 1);
+		items[i].val_size = config.page_size + 1;
+	}
+
+	/* call module core function, the keys alone are at most the arena */
+	ret = scan_keyval(&range, items, sc.nr, keys, sc.arena_len, values,
+			  &kvf->scratch);
+	if (ret < 0)
+		goto scan_exit;
+
+	for (n = 0; n < ret; n++) {
+		keyval_desc *d = &descs[n];
+		int key_len = strlen(items[n].key);
+		int val_len = values && items[n].status >= 0 ?
+			strlen(items[n].val) : -1;
+
+		if (ofs + key_len + 1 + val_len + 1 > sc.arena_len)
+			break;
+		d->key_ofs = ofs;
+		d->key_len = key_len;
+		d->val_ofs = 0;
+		d->val_len = 0;
+		d->status = values ? items[n].status : 0;
+		if (copy_to_user(sc.arena + ofs, items[n].key, key_len + 1)) {
+			ret = -5;
+			goto scan_exit;
+		}
+		ofs += key_len + 1;
+		if (val_len >= 0) {
+			d->val_ofs = ofs;
+			d->val_len = val_len;
+			if (copy_to_user(sc.arena + ofs, items[n].val, val_len + 1))
+				d->status = -5;
+			ofs += val_len + 1;
+		}
+	}
+	if (ret > 0 && n == 0) {
+		ret = -3;
+		goto scan_exit;
+	}
+	ret = n;
+
+	if (copy_to_user(sc.descs, descs, n * sizeof(keyval_desc)))
+		ret = -5;
+
+scan_exit:
+	vfree(vals);
+	vfree(keys);
+	kfree(items);
+	kfree(descs);
+	kfree(bounds);
+	return ret;
+}
+
+/* chunk_to_ring( arg, ofs, data, len)
+ * kv_chunk_fn of a get of the SQ: copy a chunk of the value to its slot of
+ * the data buffer at arg
+ */
+static int chunk_to_ring(void *arg, int ofs, const char *data, int len)
+{
+	memcpy((char *)arg + ofs, data, len);
+	return 0;
+}
+
+/* ring_op( ring, e, val_len)
+ * Run the SQ entry e (a copy, the user may change the SQ meanwhile). A get
+ * writes its value to the data buffer and its length to *val_len
+ *
+ * Return
+ * the status of the completion: see IOCTL_SET/GET/DEL, -7 (set) or -5
+ * (get, del) for an entry out of the data buffer, -8 for an unknown op
+ */
+static int ring_op(struct kv_ring *ring, const kv_sqe *e, int *val_len)
+{
+	int bad = (e->op == KV_RING_SET) ? -7 : -5, ret;
+
+	*val_len = 0;
+	if (e->op != KV_RING_SET && e->op != KV_RING_GET && e->op != KV_RING_DEL)
+		return -8;
+	if (e->key_ofs < 0 || e->key_len < 0 || e->key_len > config.page_size
+	    || e->key_ofs > ring->data_len - e->key_len)
+		return bad;
+	memcpy(ring->key, ring->data + e->key_ofs, e->key_len);
+	ring->key[e->key_len] = '\0';
+
+	if (e->op == KV_RING_DEL)
+		return del_key(ring->key, &ring->scratch);
+
+	if (e->val_ofs < 0 || e->val_len < 0 || e->val_ofs > ring->data_len - e->val_len)
+		return bad;
+	if (e->op == KV_RING_SET) {
+		if (e->val_len > KV_VAL_MAX)
+			return -1;
+		memcpy(ring->val, ring->data + e->val_ofs, e->val_len);
+		ring->val[e->val_len] = '\0';
+		return set_keyval(ring->key, ring->val,
+				  ACCESS_ONCE(ring->kvf->flags) & KV_OPT_NOREPLACE,
+				  &ring->scratch);
+	}
+
+	if (e->val_len < 1)
+		return bad;
+	ret = get_keyval_stream(ring->key, e->val_len, chunk_to_ring,
+				ring->data + e->val_ofs, val_len, &ring->scratch);
+	if (ret >= 0)
+		ring->data[e->val_ofs + *val_len] = '\0';
+	else if (ret != -3)
+		*val_len = 0;
+	return ret;
+}
+
+/* ring_drain( ring)
+ * Run the entries of the SQ, RING_CHUNK at a time, and post their
+ * completions. A sync session gets the updates of a chunk on flash before
+ * their completions are posted. Stops when the SQ is empty or the CQ full
+ */
+static void ring_drain(struct kv_ring *ring)
+{
+	kv_ring_hdr *hdr = ring->hdr;
+	struct kv_file *kvf = ring->kvf;
+	unsigned int cq_entries = ring->cq_mask + 1;
+	unsigned int n, used, i, nb_writes;
+	kv_cqe cqes[RING_CHUNK];
+	int ops[RING_CHUNK];
+	kv_sqe e;
+
+	for (;;) {
+		n = smp_load_acquire(&hdr->sq_tail) - ring->sq_head;
+		n = min(n, ring->sq_mask + 1);
+		used = ring->cq_tail - ACCESS_ONCE(hdr->cq_head);
+		n = min(n, used > cq_entries ? 0 : cq_entries - used);
+		n = min(n, (unsigned int)RING_CHUNK);
+		if (n == 0)
+			return;
+
+		for (i = 0, nb_writes = 0; i < n; i++) {
+			e = ring->sq[(ring->sq_head + i) & ring->sq_mask];
+			ops[i] = e.op;
+			cqes[i].user_data = e.user_data;
+			cqes[i].status = ring_op(ring, &e, &cqes[i].val_len);
+			if (e.op != KV_RING_GET && cqes[i].status >= 0)
+				nb_writes++;
+		}
+		/* the entries can be reused */
+		ring->sq_head += n;
+		smp_store_release(&hdr->sq_head, ring->sq_head);
+
+		if (nb_writes && (ACCESS_ONCE(kvf->flags) & KV_OPT_SYNC)
+		    && kv_sync() != 0)
+			for (i = 0; i < n; i++)
+				if (ops[i] != KV_RING_GET && cqes[i].status >= 0)
+					cqes[i].status = -4;
+
+		mutex_lock(&kvf->lock);
+		for (i = 0; i < n; i++) {
+			if (cqes[i].status < 0)
+				kvf->stats.nb_err++;
+			else if (ops[i] == KV_RING_SET)
+				kvf->stats.nb_set++;
+			else if (ops[i] == KV_RING_GET)
+				kvf->stats.nb_get++;
+			else
+				kvf->stats.nb_del++;
+		}
+		mutex_unlock(&kvf->lock);
+
+		for (i = 0; i < n; i++)
+			ring->cq[(ring->cq_tail + i) & ring->cq_mask] = cqes[i];
+		ring->cq_tail += n;
+		smp_store_release(&hdr->cq_tail, ring->cq_tail);
+		if (ring->efd)
+			eventfd_signal(ring->efd, n);
+		wake_up_interruptible(&ring->wait);
+	}
+}
+
+/* ring_work_fn( work)
+ * The worker of a ring, queued by IOCTL_RING_ENTER: drains the SQ with
+ * KV_RING_RUNNING set, so that submitters do not enter meanwhile
+ */
+static void ring_work_fn(struct work_struct *work)
+{
+	struct kv_ring *ring = container_of(work, struct kv_ring, work);
+	kv_ring_hdr *hdr = ring->hdr;
+	unsigned int used;
+
+	for (;;) {
+		ACCESS_ONCE(hdr->flags) = KV_RING_RUNNING;
+		smp_mb();
+		ring_drain(ring);
+		ACCESS_ONCE(hdr->flags) = 0;
+		/* pairs with the barrier of a submitter between its sq_tail
+		 * store and its flags load: if it saw the flag, its entries
+		 * are seen here */
+		smp_mb();
+		used = ring->cq_tail - ACCESS_ONCE(hdr->cq_head);
+		if (smp_load_acquire(&hdr->sq_tail) == ring->sq_head ||
+		    used >= ring->cq_mask + 1)
+			break;
+	}
+}
+
+/* ring_setup( kvf, rs)
+ * IOCTL_RING_SETUP: allocate the rings of kvf, see kv_ring_setup
+ *
+ * Return
+ * 0: success, rs->map_len is set
+ * -1: bad sizes, or kvf has its rings already
+ * -2: allocation failure
+ * -5: bad eventfd
+ */
+static int ring_setup(struct kv_file *kvf, kv_ring_setup *rs)
+{
+	struct kv_ring *ring;
+	unsigned int entries, sq_off, cq_off, data_off;
+	int ret = -2;
+
+	if (kvf->ring || rs->entries < 1 || rs->entries > KV_RING_MAX
+	    || rs->data_len < 1 || rs->data_len > KV_RING_DATA_MAX)
+		return -1;
+	entries = roundup_pow_of_two(rs->entries);
+	sq_off = PAGE_ALIGN(sizeof(kv_ring_hdr));
+	cq_off = sq_off + PAGE_ALIGN(entries * sizeof(kv_sqe));
+	data_off = cq_off + PAGE_ALIGN(2 * entries * sizeof(kv_cqe));
+
+	ring = kzalloc(sizeof(struct kv_ring), GFP_KERNEL);
+	if (!ring)
+		return -2;
+	INIT_WORK(&ring->work, ring_work_fn);
+	init_waitqueue_head(&ring->wait);
+	ring->kvf = kvf;
+	ring->map_len = data_off + PAGE_ALIGN(rs->data_len);
+	ring->mem = vmalloc_user(ring->map_len);
+	ring->key = vmalloc(config.page_size + 1);
+	ring->val = vmalloc(KV_VAL_MAX + 1);
+	if (!ring->mem || !ring->key || !ring->val
+	    || kv_scratch_init(&ring->scratch) != 0)
+		goto fail;
+	if (rs->efd >= 0) {
+		ring->efd = eventfd_ctx_fdget(rs->efd);
+		if (IS_ERR(ring->efd)) {
+			ring->efd = NULL;
+			ret = -5;
+			goto fail;
+		}
+	}
+
+	ring->hdr = ring->mem;
+	ring->sq = ring->mem + sq_off;
+	ring->cq = ring->mem + cq_off;
+	ring->data = ring->mem + data_off;
+	ring->data_len = rs->data_len;
+	ring->sq_mask = entries - 1;
+	ring->cq_mask = 2 * entries - 1;
+	ring->hdr->sq_entries = entries;
+	ring->hdr->cq_entries = 2 * entries;
+	ring->hdr->sq_off = sq_off;
+	ring->hdr->cq_off = cq_off;
+	ring->hdr->data_off = data_off;
+	ring->hdr->data_len = rs->data_len;
+
+	rs->map_len = ring->map_len;
+	/* mmap() and poll() look at it without the lock */
+	smp_store_release(&kvf->ring, ring);
 	return 0;
+
+fail:
+	ring_free(ring);
+	return ret;
+}
+
+/* ring_free( ring)
+ * Stop the worker of ring and free it, ring may be NULL
+ */
+static void ring_free(struct kv_ring *ring)
+{
+	if (!ring)
+		return;
+	cancel_work_sync(&ring->work);
+	if (ring->efd)
+		eventfd_ctx_put(ring->efd);
+	kv_scratch_free(&ring->scratch);
+	vfree(ring->val);
+	vfree(ring->key);
+	vfree(ring->mem);
+	kfree(ring);
 }
 
 /**
  * ioctl reception. In simplicity order, first study format, then get, 
  * then set
  */
-static long device_ioctl(struct file *file, unsigned int ioctl_num,
-			 unsigned long ioctl_param)
+static long __device_ioctl(struct kv_file *kvf, unsigned int ioctl_num,
+			   unsigned long ioctl_param)
 {
 	switch (ioctl_num) {
 		/* format operation */
@@ -64,7 +658,8 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num,
 		{
 			int ret = 0;
 			int err_bytes_copied = 0;
-			char *key, *val;
+			const char *key;
+			char *val = kvf->val;
 			keyval kv;
 
 			/* get the keyval structure from userspace
@@ -74,27 +669,42 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num,
 			    copy_from_user(&kv, (void *)ioctl_param,
 					   sizeof(keyval));
 
-			key = (char *)vmalloc((kv.key_len + 1) * sizeof(char));
-			val = (char *)vmalloc((kv.val_len + 1) * sizeof(char));
+			if (err_bytes_copied || kv.key_len < 0 || kv.val_len < 0
+			    || kv.key_len > config.page_size
+			    || kv.val_len > KV_VAL_MAX) {
+				kvf->stats.nb_err++;
+				put_user(kv.key_len < 0 || kv.val_len < 0 ? -7 : -1,
+					 (int *)&(((keyval *) (ioctl_param))->status));
+				break;
+			}
+
 			/* now that we have the character string sizes, we get get the
-			 * string themselves */
+			 * string themselves. Userspace strings are not necessarily
+			 * NUL terminated, the lengths are explicit */
+			key = op_key(kvf, &kv);
+			if (!key)
+				err_bytes_copied++;
 			err_bytes_copied +=
-			    copy_from_user(key, kv.key, kv.key_len + 1);
-			err_bytes_copied +=
-			    copy_from_user(val, kv.val, kv.val_len + 1);
+			    copy_from_user(val, kv.val, kv.val_len);
+			val[kv.val_len] = '\0';
 
 			if (!err_bytes_copied)
-				ret = set_keyval(key, val);	/* call module core function */
+				ret = set_keyval(key, val,
+						 kvf->flags & KV_OPT_NOREPLACE,
+						 &kvf->scratch);	/* call module core function */
 			else
 				ret = -7;
+			if (ret == 0 && (kvf->flags & KV_OPT_SYNC))
+				ret = kv_sync();
+
+			if (ret < 0)
+				kvf->stats.nb_err++;
+			else
+				kvf->stats.nb_set++;
 
 			/* copy return code to userspace */
 			put_user(ret,
 				 (int *)&(((keyval *) (ioctl_param))->status));
-
-			/* nettoyage */
-			vfree(val);
-			vfree(key);
 			break;
 		}
 
@@ -103,78 +713,197 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num,
 		{
 			int ret = 0;
 			int err_bytes_copied = 0;
-			char *key, *val;
+			const char *key;
 			keyval kv;
+			int len;
 
 			/* get the keyval struct */
 			err_bytes_copied +=
 			    copy_from_user(&kv, (void *)ioctl_param,
 					   sizeof(keyval));
 
-			key = (char *)vmalloc((kv.key_len + 1) * sizeof(char));
-			val =
-			    (char *)vmalloc((config.page_size) * sizeof(char));
+			if (err_bytes_copied || kv.key_len < 0
+			    || kv.key_len > config.page_size) {
+				kvf->stats.nb_err++;
+				put_user(-5,
+					 (int *)&(((keyval *) (ioctl_param))->status));
+				break;
+			}
 
 			/* get the key */
-			err_bytes_copied +=
-			    copy_from_user(key, kv.key, kv.key_len + 1);
+			key = op_key(kvf, &kv);
+			if (!key)
+				err_bytes_copied++;
 
+			/* val_len is the capacity of the user buffer, and gets
+			 * back the value length. The value is copied to it page
+			 * by page */
 			if (!err_bytes_copied) {
-				ret = get_keyval(key, val);	/* appel au coeur du module */
-				if (ret >= 0) {
-					/* write the result to userspace */
+				ret = get_keyval_stream(key, kv.val_len,
+							chunk_to_user, kv.val,
+							&len, &kvf->scratch);	/* appel au coeur du module */
+				if (ret >= 0)
 					err_bytes_copied +=
-					    copy_to_user(kv.val, val,
-							 strlen(val) + 1);
-				}
+					    put_user('\0', kv.val + len) ? 1 : 0;
+				if (ret >= 0 || ret == -3)
+					put_user(len,
+						 (int *)&(((keyval *) (ioctl_param))->val_len));
 			}
 
 			if (err_bytes_copied)
 				ret = -5;
 
+			if (ret < 0)
+				kvf->stats.nb_err++;
+			else
+				kvf->stats.nb_get++;
+
 			/* copy return code to userspace */
 			put_user(ret,
 				 (int *)&(((keyval *) (ioctl_param))->status));
-			vfree(val);
-			vfree(key);
-            //if(ret<0)
-            //    return ret;
-            //else
 		    break;
 		}
 
     case IOCTL_DEL:
         {
 			int ret = 0, err_bytes_copied = 0;
-			char *key;
+			const char *key;
 			keyval kv;
 
 			err_bytes_copied +=
 			    copy_from_user(&kv, (void *)ioctl_param, sizeof(keyval));
 
-			key = (char *)vmalloc((kv.key_len + 1) * sizeof(char));
+			if (err_bytes_copied || kv.key_len < 0
+			    || kv.key_len > config.page_size) {
+				kvf->stats.nb_err++;
+				put_user(-5,
+					 (int *)&(((keyval *) (ioctl_param))->status));
+				break;
+			}
 
 			/* get the key */
-			err_bytes_copied += copy_from_user(key, kv.key, kv.key_len + 1);
+			key = op_key(kvf, &kv);
+			if (!key)
+				err_bytes_copied++;
 
 			if (!err_bytes_copied) {
-				ret = del_key(key);	/* appel au coeur du module */
-                if (ret >= 0) { // good
-					/* write the result to userspace */
-					//err_bytes_copied += copy_to_user(kv.val, val, strlen(val) + 1);
-				}
+				ret = del_key(key, &kvf->scratch);	/* appel au coeur du module */
+				if (ret >= 0 && (kvf->flags & KV_OPT_SYNC)
+				    && kv_sync() != 0)
+					ret = -4;
 			}
             else { /* copy_from/to wrong */
 				ret = -5;
             }
 
+			if (ret < 0)
+				kvf->stats.nb_err++;
+			else
+				kvf->stats.nb_del++;
+
 			/* copy return code to userspace */
 			put_user(ret,
 				 (int *)&(((keyval *) (ioctl_param))->status));
-
-			vfree(key);
             break;
         }
+
+		/* batched operations */
+	case IOCTL_MSET:
+	case IOCTL_MGET:
+	case IOCTL_MDEL:
+		{
+			keyval_batch *ubatch = (keyval_batch *)ioctl_param;
+			int ret, nr = 0;
+
+			ret = device_batch(kvf, ioctl_num, ubatch);
+
+			get_user(nr, &ubatch->nr);
+			if (ret < 0) {
+				kvf->stats.nb_err += nr > 0 ? nr : 1;
+			} else {
+				if (ioctl_num == IOCTL_MSET)
+					kvf->stats.nb_set += ret;
+				else if (ioctl_num == IOCTL_MGET)
+					kvf->stats.nb_get += ret;
+				else
+					kvf->stats.nb_del += ret;
+				kvf->stats.nb_err += nr - ret;
+			}
+
+			put_user(ret, &ubatch->status);
+			break;
+		}
+
+		/* range scan */
+	case IOCTL_SCAN:
+		{
+			keyval_scan *uscan = (keyval_scan *)ioctl_param;
+			int ret;
+
+			ret = device_scan(kvf, uscan);
+			if (ret < 0)
+				kvf->stats.nb_err++;
+			put_user(ret, &uscan->status);
+			break;
+		}
+
+		/* asynchronous operations */
+	case IOCTL_RING_SETUP:
+		{
+			kv_ring_setup rs;
+
+			if (copy_from_user(&rs, (void *)ioctl_param,
+					   sizeof(kv_ring_setup)))
+				return -EFAULT;
+			rs.status = ring_setup(kvf, &rs);
+			if (copy_to_user((void *)ioctl_param, &rs,
+					 sizeof(kv_ring_setup)))
+				return -EFAULT;
+			break;
+		}
+
+		/* statistics of this opener */
+	case IOCTL_STATS:
+		{
+			if (copy_to_user((void *)ioctl_param, &kvf->stats,
+					 sizeof(kv_stats)))
+				return -EFAULT;
+			break;
+		}
+
+		/* statistics of the whole store */
+	case IOCTL_CORE_STATS:
+		{
+			kv_core_stats st;
+
+			get_core_stats(&st);
+			if (copy_to_user((void *)ioctl_param, &st,
+					 sizeof(kv_core_stats)))
+				return -EFAULT;
+			break;
+		}
+
+		/* write the buffered updates to flash */
+	case IOCTL_SYNC:
+		{
+			int ret = kv_sync();
+
+			put_user(ret, (int *)ioctl_param);
+			break;
+		}
+
+		/* options of this opener */
+	case IOCTL_SETOPT:
+		{
+			int flags;
+
+			if (get_user(flags, (int *)ioctl_param))
+				return -EFAULT;
+			if (flags & ~KV_OPT_MASK)
+				return -EINVAL;
+			kvf->flags = flags;
+			break;
+		}
 	case IOCTL_GC:
 		{
 			gc();
@@ -193,11 +922,67 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num,
 	return 0;
 }
 
+static long device_ioctl(struct file *file, unsigned int ioctl_num,
+			 unsigned long ioctl_param)
+{
+	struct kv_file *kvf = file->private_data;
+	struct kv_ring *ring;
+	long ret;
+
+	/* a submission only kicks the worker, it does not wait for the
+	 * operations of the opener that hold the lock */
+	if (ioctl_num == IOCTL_RING_ENTER) {
+		ring = smp_load_acquire(&kvf->ring);
+		if (ring)
+			queue_work(ring_wq, &ring->work);
+		return put_user(ring ? 0 : -1, (int *)ioctl_param) ? -EFAULT : 0;
+	}
+
+	mutex_lock(&kvf->lock);
+	ret = __device_ioctl(kvf, ioctl_num, ioctl_param);
+	mutex_unlock(&kvf->lock);
+
+	return ret;
+}
+
+/* device_mmap( file, vma)
+ * Map the rings of the opener, from offset 0, map_len bytes at most
+ */
+static int device_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct kv_file *kvf = file->private_data;
+	struct kv_ring *ring = smp_load_acquire(&kvf->ring);
+
+	if (!ring || vma->vm_pgoff != 0
+	    || vma->vm_end - vma->vm_start > ring->map_len)
+		return -EINVAL;
+	return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+/* device_poll( file, wait)
+ * The device file is readable while the CQ of the opener is not empty
+ */
+static unsigned int device_poll(struct file *file, poll_table *wait)
+{
+	struct kv_file *kvf = file->private_data;
+	struct kv_ring *ring = smp_load_acquire(&kvf->ring);
+
+	if (!ring)
+		return POLLERR;
+	poll_wait(file, &ring->wait, wait);
+	if (ACCESS_ONCE(ring->cq_tail) != ACCESS_ONCE(ring->hdr->cq_head))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
 /* functions to manipulate the virtual device file */
 struct file_operations Fops = {
+	.owner = THIS_MODULE,
 	.unlocked_ioctl = device_ioctl,
 	.open = device_open,
 	.release = device_release,
+	.mmap = device_mmap,
+	.poll = device_poll,
 };
 
 /* Virtual device initialization, called from the module init function
@@ -206,12 +991,17 @@ int device_init(void)
 {
 	int ret;
 
-	atomic_set(&file_is_open, 0);
+	/* the workers of the rings, they may wait for flash */
+	ring_wq = alloc_workqueue("lkp_kv_ring", WQ_UNBOUND, 0);
+	if (!ring_wq)
+		return -1;
 
 	/* virtual device creation */
 	ret = register_chrdev(MAJOR_NUM, DEVICE_NAME, &Fops);
-	if (ret < 0)
+	if (ret < 0) {
+		destroy_workqueue(ring_wq);
 		return -1;
+	}
 
 	return 0;
 }
@@ -222,4 +1012,5 @@ int device_init(void)
 void device_exit(void)
 {
 	unregister_chrdev(MAJOR_NUM, DEVICE_NAME);
+	destroy_workqueue(ring_wq);
 }
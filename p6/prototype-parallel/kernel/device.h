@@ -13,18 +13,239 @@
 /* virtual device name */
 #define DEVICE_NAME "/dev/lkp_kv"
 
+/* largest value of a couple: values that do not fit in a flash page span
+ * several pages */
+#define KV_VAL_MAX (64 * 1024)
+
 /* data structure representing a key/value couple as well as a return code
  * indicating the fact the a read/write operation has been successful or 
- * not
+ * not. key and val are not required to be NUL terminated: key_len and 
+ * val_len give their sizes. For a get, val_len is the capacity of the val
+ * buffer on input and the length of the value on output. A key shorter
+ * than KV_KEY_INLINE may be passed in key_inline instead, key being NULL:
+ * it then comes in with the keyval, in the same copy
  */
+#define KV_KEY_INLINE 48
 typedef struct {
 	char *key;
 	char *val;
 	int key_len;
 	int val_len;
 	int status;
+	char key_inline[KV_KEY_INLINE];
 } keyval;
 
+/* one operation of a batch: the key, and the value or value slot, live in
+ * the batch arena at the given offsets. Every key and value stored in the
+ * arena is followed by one spare byte (the kernel NUL terminates it there).
+ * For a get, val_len is the capacity of the slot on input and the length of
+ * the value on output. status receives the return code of the operation,
+ * with the same meaning as for the single IOCTL_SET/GET/DEL */
+typedef struct {
+	int key_ofs;
+	int key_len;
+	int val_ofs;
+	int val_len;
+	int status;
+} keyval_desc;
+
+/* a batch of operations: nr descriptors and their packed key/value arena.
+ * status receives the number of successful operations, or a negative 
+ * error code for the whole batch (-1 bad batch, -2 allocation failure, 
+ * -5 user/kernelspace memory transfer error) */
+typedef struct {
+	keyval_desc *descs;
+	int nr;
+	char *arena;
+	int arena_len;
+	int status;
+} keyval_batch;
+
+/* maximum number of operations in one batch */
+#define KV_BATCH_MAX 256
+
+/* a scan over a range of keys, in key order (bytes compared with memcmp, a
+ * key before the longer keys it is a prefix of): from start (included) up
+ * to end (excluded, end_len 0: up to the last key), or the keys that start
+ * with start when flags has KV_SCAN_PREFIX. A call returns the next batch
+ * of at most nr keys in descs and arena, as a keyval_batch does for a get:
+ * the key at key_ofs and, with KV_SCAN_VALUES, the value at val_ofs, both
+ * NUL terminated. A value longer than a flash page gets status -3 (read it
+ * with IOCTL_GET), a key deleted since it was listed -1.
+ * The batch starts after cursor, the last key of the previous batch
+ * (cursor_len 0 for the first one). status receives the number of keys in
+ * the batch, 0 at the end of the range, or a negative error code (those of
+ * keyval_batch, and -3 if the arena cannot hold a single key) */
+typedef struct {
+	char *start;
+	char *end;
+	char *cursor;
+	int start_len;
+	int end_len;
+	int cursor_len;
+	int flags;
+	keyval_desc *descs;
+	int nr;
+	char *arena;
+	int arena_len;
+	int status;
+} keyval_scan;
+
+#define KV_SCAN_PREFIX 0x1	/* the keys starting with start */
+#define KV_SCAN_VALUES 0x2	/* the values too, read in flash order */
+#define KV_SCAN_MASK (KV_SCAN_PREFIX | KV_SCAN_VALUES)
+
+/* per-session statistics, see IOCTL_STATS */
+typedef struct {
+	unsigned long long nb_set;	/* successful set operations */
+	unsigned long long nb_get;	/* successful get operations */
+	unsigned long long nb_del;	/* successful del operations */
+	unsigned long long nb_err;	/* operations that returned an error */
+} kv_stats;
+
+/* data partitions a store can be striped on (MTD_INDEX module parameter) */
+#define KV_PARTS_MAX 8
+
+/* statistics of a data partition, see kv_core_stats */
+typedef struct {
+	unsigned long long nb_data_pgs;	/* data pages programmed in it by
+					 * the sets and GC */
+	unsigned long long nb_gc;	/* GC passes that moved one of its
+					 * blocks */
+	int nb_blocks;			/* its blocks */
+	int nb_free_blks;		/* the erased ones */
+} kv_part_stats;
+
+/* store-wide statistics, see IOCTL_CORE_STATS. The mean probe length of
+ * the hashtable is nb_probes / nb_lookups */
+typedef struct {
+	unsigned long long nb_lookups;	/* hashtable lookups */
+	unsigned long long nb_probes;	/* buckets visited by the lookups */
+	int max_probe;			/* longest lookup, in buckets */
+	int max_dist;			/* longest distance of a key to its home
+					 * bucket currently in the table */
+	unsigned long long nb_gc;	/* GC passes that moved a block */
+	unsigned long long gc_us;	/* time their partition was held */
+	unsigned long long gc_max_us;	/* longest of them */
+	unsigned long long nb_ckpt;	/* metadata checkpoints */
+	unsigned long long ckpt_us;	/* time the store was held by them */
+	unsigned long long ckpt_max_us;	/* longest of them */
+	unsigned long long nb_recs;	/* couples written to data pages by
+					 * the sets and GC */
+	unsigned long long nb_data_pgs;	/* data pages programmed by the
+					 * sets and GC, the couples per
+					 * page are nb_recs / nb_data_pgs */
+	unsigned long long nb_coalesced;	/* sets that overwrote their
+						 * key in the open page */
+	unsigned long long nb_gc_recs;	/* of the couples, those GC moved */
+	unsigned long long nb_gc_pgs;	/* of the data pages, those GC wrote
+					 * them to: the write amplification
+					 * is nb_data_pgs /
+					 * (nb_data_pgs - nb_gc_pgs) */
+	unsigned long long nb_vc_hits;	/* gets served by the value cache */
+	unsigned long long nb_vc_misses;	/* gets that read flash */
+	long long vc_bytes;		/* DRAM taken by the value cache */
+	long long oi_keys;		/* keys in the ordered index */
+	long long oi_bytes;		/* DRAM taken by the ordered index */
+	unsigned long long nb_wl;	/* cold blocks moved by the wear
+					 * leveler */
+	unsigned long long wl_us;	/* time their partition was held */
+	unsigned long long nb_wl_recs;	/* couples it moved */
+	unsigned long long nb_wl_pgs;	/* data pages it wrote them to, not
+					 * in nb_data_pgs */
+	int min_worn;			/* erase counts of the data blocks,
+					 * kept across format and mount */
+	int max_worn;
+	int nb_parts;			/* data partitions */
+	int pad;
+	kv_part_stats parts[KV_PARTS_MAX];
+} kv_core_stats;
+
+/* per-session options, see IOCTL_SETOPT */
+#define KV_OPT_NOREPLACE 0x1	/* set fails (-2) if the key already exists */
+#define KV_OPT_SYNC 0x2		/* set/del are on flash when they return.
+				 * Otherwise they are buffered in RAM until
+				 * the open page fills, the flush timer fires
+				 * or IOCTL_SYNC: overwrites of a buffered key
+				 * cost no flash page */
+#define KV_OPT_MASK (KV_OPT_NOREPLACE | KV_OPT_SYNC)
+
+/* Asynchronous operations, io_uring style: after IOCTL_RING_SETUP, an
+ * opener mmap()s (offset 0, map_len bytes) a submission queue (SQ) and a
+ * completion queue (CQ) of fixed size entries, and a data buffer that holds
+ * the keys and values of the operations. The mapping starts with a
+ * kv_ring_hdr, the other parts are at its *_off offsets.
+ * Each queue has a single producer, which writes the entries and then moves
+ * the tail (a store-release), and a single consumer, which loads the tail
+ * (a load-acquire), reads the entries and then moves the head. The user
+ * produces the SQ and consumes the CQ, a kernel worker does the opposite.
+ * After moving sq_tail, the user must issue IOCTL_RING_ENTER unless flags
+ * has KV_RING_RUNNING (with a full barrier in between): the worker drains
+ * the SQ until it finds it empty, then clears KV_RING_RUNNING and looks
+ * again. Completions are signalled on the eventfd given at setup, and the
+ * device file polls readable while the CQ is not empty. The CQ has twice
+ * the entries of the SQ: with at most sq_entries operations in flight it
+ * never fills up. If it does, the worker stops until the next
+ * IOCTL_RING_ENTER. */
+typedef struct {
+	unsigned int sq_head;	/* moved by the kernel */
+	unsigned int sq_tail;	/* moved by the user */
+	unsigned int cq_head;	/* moved by the user */
+	unsigned int cq_tail;	/* moved by the kernel */
+	unsigned int sq_entries;	/* power of 2 */
+	unsigned int cq_entries;	/* 2 * sq_entries */
+	unsigned int sq_off;	/* kv_sqe array */
+	unsigned int cq_off;	/* kv_cqe array */
+	unsigned int data_off;	/* data buffer */
+	unsigned int data_len;
+	unsigned int flags;	/* KV_RING_RUNNING */
+} kv_ring_hdr;
+
+#define KV_RING_RUNNING 0x1	/* the worker is draining the SQ */
+
+/* an operation of the SQ. The key (and the value of a set) are in the data
+ * buffer, where a get writes its value too: val_len is the capacity of the
+ * slot at val_ofs. They need not be NUL terminated */
+typedef struct {
+	int op;			/* KV_RING_SET/GET/DEL */
+	int key_ofs;
+	int key_len;
+	int val_ofs;
+	int val_len;
+	int pad;
+	unsigned long long user_data;	/* given back in the completion */
+} kv_sqe;
+
+#define KV_RING_SET 1
+#define KV_RING_GET 2
+#define KV_RING_DEL 3
+
+/* a completion of the CQ: status is the return code of the operation, with
+ * the same meaning as for IOCTL_SET/GET/DEL (an entry out of the data
+ * buffer gets -7 for a set, -5 otherwise, an unknown op -8), and for a get
+ * val_len the length of the value, NUL terminated in its slot */
+typedef struct {
+	unsigned long long user_data;
+	int status;
+	int val_len;
+} kv_cqe;
+
+/* IOCTL_RING_SETUP argument: entries of the SQ (rounded up to a power of 2,
+ * KV_RING_MAX at most), bytes of the data buffer (KV_RING_DATA_MAX at most)
+ * and an eventfd to signal on completions (-1: none). map_len receives the
+ * length to mmap(), status 0 or -1 (bad sizes, or the opener has a ring
+ * already), -2 (allocation failure), -5 (bad eventfd) */
+typedef struct {
+	int entries;
+	int data_len;
+	int efd;
+	int map_len;
+	int status;
+} kv_ring_setup;
+
+#define KV_RING_MAX 4096
+#define KV_RING_DATA_MAX (64 << 20)
+
 /* The 3 ioctl commands that can be sent to the virtual device: read operation 
  * (get), write operation (set) and format operation. The 3rd parameter 
  * represents the parameter that is passed when the ioctl command is called: 
@@ -36,6 +257,25 @@ typedef struct {
 #define IOCTL_SET _IOR(MAJOR_NUM, 1, keyval *)
 #define IOCTL_DEL _IOR(MAJOR_NUM, 3, keyval *)
 #define IOCTL_FORMAT _IOR(MAJOR_NUM, 2, int *)
+/* batched set, get and del: the 3rd parameter is a keyval_batch */
+#define IOCTL_MSET _IOR(MAJOR_NUM, 6, keyval_batch *)
+#define IOCTL_MGET _IOR(MAJOR_NUM, 7, keyval_batch *)
+#define IOCTL_MDEL _IOR(MAJOR_NUM, 8, keyval_batch *)
+/* session statistics (kv_stats) and options (int, KV_OPT_* flags) of the 
+ * calling file descriptor */
+#define IOCTL_STATS _IOR(MAJOR_NUM, 4, kv_stats *)
+#define IOCTL_SETOPT _IOR(MAJOR_NUM, 5, int *)
+/* statistics of the whole store (kv_core_stats) */
+#define IOCTL_CORE_STATS _IOR(MAJOR_NUM, 9, kv_core_stats *)
+/* write everything buffered so far to flash, the int receives 0 or -4 */
+#define IOCTL_SYNC _IOR(MAJOR_NUM, 10, int *)
+/* the next batch of a range scan, the 3rd parameter is a keyval_scan */
+#define IOCTL_SCAN _IOR(MAJOR_NUM, 11, keyval_scan *)
+/* set up the rings of the calling file descriptor (a kv_ring_setup), and
+ * start the worker on what was submitted (the int receives 0, or -1 if
+ * there is no ring) */
+#define IOCTL_RING_SETUP _IOR(MAJOR_NUM, 12, kv_ring_setup *)
+#define IOCTL_RING_ENTER _IOR(MAJOR_NUM, 13, int *)
 #define IOCTL_PRINT 19901009
 #define IOCTL_GC 1990108
 int device_init(void);
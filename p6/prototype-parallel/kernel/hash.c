@@ -1,94 +1,521 @@
 #include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include "core.h"
 #include "hash.h"
+#include "hashfn.h"
 extern int HASH_SIZE;
+extern int HASH_SEG_SIZE;
+extern struct key_arena *key_arena;
+extern int KEY_ARENA_SIZE;
+
+/* one lock per hashtable segment, writers serialize on it. Each segment
+ * also has a seqcount so that lookups can run without taking the lock */
+static spinlock_t seg_locks[HASH_SEGS];
+static seqcount_t seg_seqs[HASH_SEGS];
+/* number of entries in each segment, and upper bound of the distance of
+ * an entry to its home bucket, under the segment lock */
+static int seg_used[HASH_SEGS];
+static int seg_maxd[HASH_SEGS];
+
+/* control bytes, HASH_SEG_SIZE per segment followed by a copy of the first
+ * CTRL_GROUP ones so that a group can be loaded from any slot without
+ * wrapping (see set_ctrl()) */
+static u8 *ctrl;
+
+/* allocation of key arena space (used, dead), writers of different segments
+ * append concurrently */
+static DEFINE_SPINLOCK(arena_lock);
+
+/* probe length counters, per cpu so that lockless lookups do not share a
+ * cache line */
+static DEFINE_PER_CPU(struct hash_probe_stats, probe_stats);
+
+/* full (not reduced) hash of a key, see hash_seg() */
 unsigned int hash(const char *str)
 {
-    unsigned int hash = 5381;
-    int c;
+    return kv_hash(str, strlen(str));
+}
+
+/* segment of a key from its hash */
+int hash_seg(unsigned int h)
+{
+    return h % HASH_SEGS;
+}
+
+/* hash_write_lock( h) / hash_write_unlock( h)
+ * Exclusive access to the segment of a key, to be held around hash_add(),
+ * hash_del() and any modification of the buckets of the segment
+ */
+void hash_write_lock(unsigned int h)
+{
+    spin_lock(&seg_locks[hash_seg(h)]);
+    write_seqcount_begin(&seg_seqs[hash_seg(h)]);
+}
+
+void hash_write_unlock(unsigned int h)
+{
+    write_seqcount_end(&seg_seqs[hash_seg(h)]);
+    spin_unlock(&seg_locks[hash_seg(h)]);
+}
+
+/* hash_read_begin( h) / hash_read_retry( h, seq)
+ * Lockless read section over the segment of a key:
+ *	do {
+ *		seq = hash_read_begin(h);
+ *		idx = hash_search(hashtable, key, h);
+ *		... copy what is needed out of hashtable[idx] ...
+ *	} while (hash_read_retry(h, seq));
+ * Anything read inside the section is only valid if it does not retry
+ */
+unsigned int hash_read_begin(unsigned int h)
+{
+    return read_seqcount_begin(&seg_seqs[hash_seg(h)]);
+}
+
+int hash_read_retry(unsigned int h, unsigned int seq)
+{
+    return read_seqcount_retry(&seg_seqs[hash_seg(h)], seq);
+}
+
+void hash_init(void)
+{
+    int i;
 
-    while ((c = *str++))
-    {
-        hash = ((hash << 5) + hash) + c;
+    for (i = 0; i < HASH_SEGS; i++) {
+        spin_lock_init(&seg_locks[i]);
+        seqcount_init(&seg_seqs[i]);
     }
+}
 
-    return hash % HASH_SIZE;
+/* hash_ctrl_init( void) / hash_ctrl_exit( void)
+ * Allocate/free the control bytes, once HASH_SEG_SIZE is known (a multiple
+ * of CTRL_GROUP)
+ *
+ * Return
+ * 0: Success
+ * -1: allocation failure
+ */
+int hash_ctrl_init(void)
+{
+    ctrl = kmalloc(HASH_SEGS * (HASH_SEG_SIZE + CTRL_GROUP), GFP_KERNEL);
+    if (!ctrl)
+        return -1;
+    memset(ctrl, CTRL_EMPTY, HASH_SEGS * (HASH_SEG_SIZE + CTRL_GROUP));
+    return 0;
 }
 
-int hash_add(bucket *hashtable, const char *key, int index)
+void hash_ctrl_exit(void)
 {
-    int ret;
-	int hash_index = 0;
-	int count = 0;
-	int blk_number;
-    //unsigned long flags;
-    //spin_lock_irqsave(&one_lock, flags);
+    kfree(ctrl);
+}
 
-	hash_index = hash(key);
-	while (hashtable[hash_index].p_state)
-	{
-		hashtable[hash_index].dirty = 1;
-		if (count == HASH_SIZE - 1){
-            ret = -1;
-            goto exit;
-        }
-		hash_index = (hash_index + 1) % HASH_SIZE;
-		count++;
-	}
-	
-	blk_number = index / config.pages_per_block;
-	hashtable[hash_index].p_state = PG_VALID;
-	strcpy(hashtable[hash_index].key, key);
-	hashtable[hash_index].index = index;
-    ret = hash_index;
+/* first bucket of the segment of h, and home bucket of h in it */
+static inline int seg_base(unsigned int h)
+{
+    return hash_seg(h) * HASH_SEG_SIZE;
+}
 
+static inline int seg_home(unsigned int h)
+{
+    return (h / HASH_SEGS) % HASH_SEG_SIZE;
+}
 
-exit:
-    //spin_unlock_irqrestore(&one_lock, flags);
-	return ret;
+/* distance of the bucket at slot (inside its segment) from its home */
+static inline int seg_dist(int slot, unsigned int h)
+{
+    return (slot - seg_home(h) + HASH_SEG_SIZE) % HASH_SEG_SIZE;
+}
+
+static inline u8 *seg_ctrl(int seg)
+{
+    return ctrl + seg * (HASH_SEG_SIZE + CTRL_GROUP);
+}
+
+static inline void set_ctrl(int seg, int slot, u8 v)
+{
+    u8 *c = seg_ctrl(seg);
+
+    c[slot] = v;
+    if (slot < CTRL_GROUP)
+        c[HASH_SEG_SIZE + slot] = v;
+}
+
+static inline void probe_account(int nb_probes)
+{
+    this_cpu_inc(probe_stats.nb_lookups);
+    this_cpu_add(probe_stats.nb_probes, nb_probes);
+    if (nb_probes > this_cpu_read(probe_stats.max_probe))
+        this_cpu_write(probe_stats.max_probe, nb_probes);
+}
+
+/* key of bucket b, key_len bytes in the key arena */
+const char *bucket_key(const bucket *b)
+{
+    return key_arena->keys + b->key_ofs;
+}
+
+/* does bucket b hold key (len bytes)? The bound check matters to lockless
+ * readers, which may see an entry being moved */
+static inline int key_match(const bucket *b, const char *key, int len)
+{
+    return b->key_len == len && b->key_ofs <= KEY_ARENA_SIZE - len &&
+           !memcmp(key_arena->keys + b->key_ofs, key, len);
 }
 
-int hash_search(bucket *hashtable, const char *key)
+/* key_arena_alloc( len)
+ * Reserve len bytes at the end of the key arena
+ *
+ * Return
+ * the offset of the reserved bytes
+ * -1: arena full
+ */
+static int key_arena_alloc(int len)
 {
-    int ret;
-	int hash_index = 0;
-	char *hash_key;
-	int counter = 0;
-    //unsigned long flags;
-    //spin_lock_irqsave(&one_lock, flags);
+    int ofs = -1;
+
+    spin_lock(&arena_lock);
+    if (key_arena->used + len <= KEY_ARENA_SIZE) {
+        ofs = key_arena->used;
+        key_arena->used += len;
+    }
+    spin_unlock(&arena_lock);
+    return ofs;
+}
+
+/* key_arena_room( len)
+ * Is there room left for a new key of len bytes? Only a hint, hash_add()
+ * may still find the arena full if other writers got there first
+ */
+int key_arena_room(int len)
+{
+    return ACCESS_ONCE(key_arena->used) + len <= KEY_ARENA_SIZE;
+}
+
+/* key_arena_compact( hashtable)
+ * Pack the keys of the live entries at the start of the key arena, dropping
+ * the bytes of the deleted ones. Called with every writer of the table kept
+ * out (kv_sem held for writing), lockless readers retry around it.
+ *
+ * Return
+ * the number of bytes reclaimed
+ * -1: allocation failure
+ */
+int key_arena_compact(bucket *hashtable)
+{
+    char *tmp;
+    unsigned int n = 0, dead;
+    int i;
+
+    dead = key_arena->dead;
+    if (!dead)
+        return 0;
+
+    tmp = vmalloc(key_arena->used);
+    if (!tmp)
+        return -1;
 
-	hash_index = hash(key) % HASH_SIZE;
-	while(1)
+    for (i = 0; i < HASH_SEGS; i++)
+        raw_write_seqcount_begin(&seg_seqs[i]);
+    for (i = 0; i < HASH_SIZE; i++) {
+        bucket *b = &hashtable[i];
+
+        if (b->p_state != PG_VALID)
+            continue;
+        memcpy(tmp + n, key_arena->keys + b->key_ofs, b->key_len);
+        b->key_ofs = n;
+        n += b->key_len;
+    }
+    memcpy(key_arena->keys, tmp, n);
+    key_arena->used = n;
+    key_arena->dead = 0;
+    meta_dirty(hashtable, HASH_SIZE * sizeof(bucket));
+    meta_dirty(key_arena, sizeof(*key_arena) + n);
+    for (i = 0; i < HASH_SEGS; i++)
+        raw_write_seqcount_end(&seg_seqs[i]);
+
+    vfree(tmp);
+    return dead;
+}
+
+/* hash_reset( hashtable)
+ * Empty the whole table and the key arena (module init, format)
+ */
+void hash_reset(bucket *hashtable)
+{
+    int i;
+
+    for (i = 0; i < HASH_SIZE; i++) {
+        hashtable[i].index = -1;
+        hashtable[i].p_state = PG_FREE;
+        hashtable[i].key_ofs = 0;
+        hashtable[i].key_len = 0;
+    }
+    key_arena->used = 0;
+    key_arena->dead = 0;
+    memset(ctrl, CTRL_EMPTY, HASH_SEGS * (HASH_SEG_SIZE + CTRL_GROUP));
+    memset(seg_used, 0, sizeof(seg_used));
+    memset(seg_maxd, 0, sizeof(seg_maxd));
+}
+
+/* hash_recount( hashtable)
+ * Rebuild the control bytes and the segment counters after the table was
+ * loaded from flash, checking that the entries fit in the key arena
+ *
+ * Return
+ * 0: Success
+ * -1: inconsistent table or key arena
+ */
+int hash_recount(bucket *hashtable)
+{
+    int i, seg, slot, d;
+
+    if (key_arena->used > KEY_ARENA_SIZE || key_arena->dead > key_arena->used)
+        return -1;
+
+    memset(ctrl, CTRL_EMPTY, HASH_SEGS * (HASH_SEG_SIZE + CTRL_GROUP));
+    memset(seg_used, 0, sizeof(seg_used));
+    memset(seg_maxd, 0, sizeof(seg_maxd));
+    for (i = 0; i < HASH_SIZE; i++) {
+        if (hashtable[i].p_state != PG_VALID)
+            continue;
+        if (hashtable[i].key_ofs + hashtable[i].key_len > key_arena->used)
+            return -1;
+        seg = i / HASH_SEG_SIZE;
+        slot = i % HASH_SEG_SIZE;
+        set_ctrl(seg, slot, ctrl_h7(hashtable[i].hash));
+        seg_used[seg]++;
+        d = seg_dist(slot, hashtable[i].hash);
+        if (d > seg_maxd[seg])
+            seg_maxd[seg] = d;
+    }
+    return 0;
+}
+
+/* hash_add( hashtable, key, h, index)
+ * Robin Hood insertion of a key that is not in the table yet: walking from
+ * the home bucket, the entry being placed takes the slot of any entry that
+ * is closer to its own home, and that entry goes on probing instead. The
+ * key is appended to the key arena. Called with hash_write_lock(h) held.
+ *
+ * Return
+ * the bucket index of key
+ * -1: segment full
+ * -2: key arena full
+ */
+int hash_add(bucket *hashtable, const char *key, unsigned int h, int index)
+{
+    bucket cur, tmp;
+	int seg = hash_seg(h);
+	int base = seg_base(h);
+	int slot = seg_home(h);
+	int dist = 0, d, ret = -1, ofs;
+	int len = strlen(key);
+
+	if (seg_used[seg] >= HASH_SEG_SIZE)
+		return -1;
+
+	ofs = key_arena_alloc(len);
+	if (ofs < 0)
+		return -2;
+	memcpy(key_arena->keys + ofs, key, len);
+	meta_dirty(key_arena->keys + ofs, len);
+	meta_dirty(key_arena, sizeof(*key_arena));
+
+	cur.p_state = PG_VALID;
+	cur.hash = h;
+	cur.index = index;
+	cur.key_ofs = ofs;
+	cur.key_len = len;
+	cur.flags = 0;
+
+	while (1)
 	{
-		if (counter == HASH_SIZE - 1)
-		{
-			//printk("probe the whole hashtable\n");
-			ret = -1;
-            goto exit2;
+		bucket *b = &hashtable[base + slot];
+
+		if (b->p_state != PG_VALID) {
+			*b = cur;
+			meta_dirty(b, sizeof(*b));
+			set_ctrl(seg, slot, ctrl_h7(cur.hash));
+			if (ret < 0)
+				ret = base + slot;
+			break;
 		}
-		
-		if (hashtable[hash_index].p_state)
-		{
-			hash_key = hashtable[hash_index].key;
-			if (!strcmp(hash_key, key))
-			{
-				//printk("key match! %d\n",counter);
-				break;
-			}
+
+		d = seg_dist(slot, b->hash);
+		if (d < dist) {
+			/* take from the rich */
+			tmp = *b;
+			*b = cur;
+			meta_dirty(b, sizeof(*b));
+			set_ctrl(seg, slot, ctrl_h7(cur.hash));
+			cur = tmp;
+			if (ret < 0)
+				ret = base + slot;
+			if (dist > seg_maxd[seg])
+				seg_maxd[seg] = dist;
+			dist = d;
 		}
+		slot = (slot + 1) % HASH_SEG_SIZE;
+		dist++;
+	}
+
+	if (dist > seg_maxd[seg])
+		seg_maxd[seg] = dist;
+	seg_used[seg]++;
+	return ret;
+}
+
+/* hash_probe( hashtable, h, key, len, index)
+ * Body of hash_search() and hash_search_index(): the control bytes of the
+ * segment are scanned 8 at a time from the home bucket, and only the buckets
+ * whose fingerprint matches are compared, on their key, or on their page
+ * index when key is NULL. The scan stops at the first empty bucket or past
+ * the largest distance to home of the segment.
+ */
+static int hash_probe(bucket *hashtable, unsigned int h, const char *key,
+		      int len, int index)
+{
+    int ret = -1;
+	int seg = hash_seg(h);
+	int base = seg_base(h);
+	int slot = seg_home(h);
+	int maxd = ACCESS_ONCE(seg_maxd[seg]);
+	u8 *c = seg_ctrl(seg), h7 = ctrl_h7(h);
+	int scanned = 0, i, stop;
+	u64 w, match, empty;
 
-		if (hashtable[hash_index].dirty == 0)
-		{
-			//printk("%s doesn't exist in the hashtable\n", key);
-			ret = -2;
-            goto exit2;
+	while (scanned <= maxd && scanned < HASH_SEG_SIZE)
+	{
+		w = kv_load64(c + slot);
+		match = ctrl_match(w, h7);
+		empty = ctrl_empty(w);
+		stop = empty ? ctrl_first(empty) : 8;
+		if (stop < 8)
+			match &= (1ULL << (stop * 8)) - 1;
+
+		while (match) {
+			bucket *b;
+
+			i = ctrl_first(match);
+			match &= match - 1;
+			b = &hashtable[base + (slot + i) % HASH_SEG_SIZE];
+			if (b->hash == h && (key ? key_match(b, key, len) :
+					     b->index == index)) {
+				ret = base + (slot + i) % HASH_SEG_SIZE;
+				scanned += i;
+				goto out;
+			}
 		}
 
-		hash_index = (hash_index + 1) % HASH_SIZE;
-		counter++;
+		scanned += stop;
+		if (stop < 8)
+			break;
+		slot = (slot + 8) % HASH_SEG_SIZE;
 	}
-    ret = hash_index;
-exit2:
-    //spin_unlock_irqrestore(&one_lock, flags);
+
+out:
+	probe_account(scanned + 1);
 	return ret;
 }
+
+/* hash_search( hashtable, key, h)
+ * Look key up. Called with hash_write_lock(h) held or inside a
+ * hash_read_begin() section.
+ *
+ * Return
+ * the bucket index of key
+ * -1: not found
+ */
+int hash_search(bucket *hashtable, const char *key, unsigned int h)
+{
+	return hash_probe(hashtable, h, key, strlen(key), -1);
+}
+
+/* hash_search_index( hashtable, h, index)
+ * Find the entry of hash h that points to location index, without knowing
+ * its key: a location holds a single live key, so the couple identifies
+ * it (journal replay)
+ *
+ * Return
+ * the bucket index
+ * -1: not found
+ */
+int hash_search_index(bucket *hashtable, unsigned int h, int index)
+{
+	return hash_probe(hashtable, h, NULL, 0, index);
+}
+
+/* hash_del( hashtable, hash_idx)
+ * Remove the entry at hash_idx with backward-shift deletion: the following
+ * entries that are not at their home move one slot back, so no tombstone is
+ * left behind. The key stays in the key arena as dead bytes until the next
+ * compaction. Called with hash_write_lock() held for the key.
+ */
+void hash_del(bucket *hashtable, int hash_idx)
+{
+	int seg = hash_idx / HASH_SEG_SIZE;
+	int base = seg * HASH_SEG_SIZE;
+	int slot = hash_idx - base;
+	int next;
+
+	spin_lock(&arena_lock);
+	key_arena->dead += hashtable[hash_idx].key_len;
+	spin_unlock(&arena_lock);
+	meta_dirty(key_arena, sizeof(*key_arena));
+
+	while (1)
+	{
+		bucket *nb;
+
+		next = (slot + 1) % HASH_SEG_SIZE;
+		nb = &hashtable[base + next];
+		if (nb->p_state != PG_VALID || seg_dist(next, nb->hash) == 0)
+			break;
+		hashtable[base + slot] = *nb;
+		meta_dirty(&hashtable[base + slot], sizeof(bucket));
+		set_ctrl(seg, slot, seg_ctrl(seg)[next]);
+		slot = next;
+	}
+
+	hashtable[base + slot].p_state = PG_FREE;
+	hashtable[base + slot].index = -1;
+	hashtable[base + slot].key_ofs = 0;
+	hashtable[base + slot].key_len = 0;
+	hashtable[base + slot].flags = 0;
+	meta_dirty(&hashtable[base + slot], sizeof(bucket));
+	set_ctrl(seg, slot, CTRL_EMPTY);
+	seg_used[seg]--;
+}
+
+/* hash_stats( hashtable, st)
+ * Probe length counters of the lookups since module load, and the largest
+ * distance to home currently found in the table
+ */
+void hash_stats(bucket *hashtable, struct hash_probe_stats *st)
+{
+	int cpu, i;
+
+	memset(st, 0, sizeof(*st));
+	for_each_possible_cpu(cpu) {
+		struct hash_probe_stats *c = per_cpu_ptr(&probe_stats, cpu);
+
+		st->nb_lookups += c->nb_lookups;
+		st->nb_probes += c->nb_probes;
+		if (c->max_probe > st->max_probe)
+			st->max_probe = c->max_probe;
+	}
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		int d;
+
+		if (hashtable[i].p_state != PG_VALID)
+			continue;
+		d = seg_dist(i % HASH_SEG_SIZE, hashtable[i].hash);
+		if (d > st->max_dist)
+			st->max_dist = d;
+	}
+}
@@ -1,21 +1,71 @@
 #include "core.h"
 
+/* Index entry, one per bucket. The key itself is kept out of line in the
+ * key arena, so an entry has the same small size whatever the key length */
 typedef struct {
-	struct list_head p_list;
-    int dirty;
-    int index;
-    page_state p_state;
-    blk_state *b_state;
-    char key[88];
+    unsigned int hash;		/* full hash of key, gives the home bucket */
+    int index;			/* location of the couple, LOC(page, slot) */
+    unsigned int key_ofs;	/* offset of the key in key_arena->keys */
+    unsigned short key_len;	/* length of the key, not NUL terminated */
+    unsigned char p_state;	/* page_state */
+    unsigned char flags;	/* BKT_EXT */
 } bucket;
 
+/* bucket flags: the location is the head of a multi-page couple, its value
+ * is in extent pages (slotpage.h) */
+#define BKT_EXT 0x1
+
 //#define HASH_SIZE 1024 
-#define BUCKET_INIT { .dirty = 0, .b_state = NULL, .p_state = PG_FREE, .index = -1, .key[0]='\0'}
+#define BUCKET_INIT { .hash = 0, .p_state = PG_FREE, .index = -1, .key_ofs = 0, .key_len = 0}
 
 #define HASH_TABLE(name, size)  \
 					bucket name[size] = \
 					{ [0 ... (size - 1)] = BUCKET_INIT }
 
+/* Key arena: keys are appended at used and only move when the arena is
+ * compacted (key_arena_compact()), dead counts the bytes of the keys that
+ * were deleted since. Allocated with KEY_ARENA_SIZE bytes of keys, and
+ * flushed to flash with the hashtable as part of the metadata */
+struct key_arena {
+    unsigned int used;
+    unsigned int dead;
+    char keys[];
+};
+
+/* The hashtable is split into HASH_SEGS segments of HASH_SEG_SIZE buckets.
+ * A key lives in the segment selected by its hash and is probed inside that
+ * segment only, so each segment is protected by its own lock. Lookups do
+ * not take it, they use the segment seqcount (hash_read_begin()).
+ * Segments use Robin Hood open addressing with backward-shift deletion, and
+ * a control byte per bucket holding a 7-bit fingerprint of its hash so that
+ * lookups only compare the keys of matching buckets (hashfn.h) */
+#define HASH_SEGS 64
+
 unsigned int hash(const char *str);
-int hash_add(bucket *hashtable, const char *key, int index);
-int hash_search(bucket *hashtable, const char *key);
+int hash_seg(unsigned int h);
+void hash_write_lock(unsigned int h);
+void hash_write_unlock(unsigned int h);
+unsigned int hash_read_begin(unsigned int h);
+int hash_read_retry(unsigned int h, unsigned int seq);
+void hash_init(void);
+int hash_ctrl_init(void);
+void hash_ctrl_exit(void);
+void hash_reset(bucket *hashtable);
+int hash_recount(bucket *hashtable);
+int hash_add(bucket *hashtable, const char *key, unsigned int h, int index);
+int hash_search(bucket *hashtable, const char *key, unsigned int h);
+int hash_search_index(bucket *hashtable, unsigned int h, int index);
+void hash_del(bucket *hashtable, int hash_idx);
+const char *bucket_key(const bucket *b);
+int key_arena_room(int len);
+int key_arena_compact(bucket *hashtable);
+
+/* probe length counters, see hash_stats() */
+struct hash_probe_stats {
+	unsigned long long nb_lookups;	/* hash_search() calls */
+	unsigned long long nb_probes;	/* buckets visited by them */
+	int max_probe;			/* longest hash_search() */
+	int max_dist;			/* longest distance to home in the table */
+};
+
+void hash_stats(bucket *hashtable, struct hash_probe_stats *st);
@@ -0,0 +1,106 @@
+/**
+ * Key hashing and control byte helpers of the in-RAM index. Plain C with no
+ * kernel dependency so that the user-space microbenchmark
+ * (user/testbench_hash.c) runs the very same code.
+ */
+
+#ifndef LKP_KV_HASHFN_H
+#define LKP_KV_HASHFN_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+#endif
+
+/* Every bucket has a control byte: CTRL_EMPTY, or the 7-bit fingerprint
+ * (ctrl_h7()) of the hash of its key. Control bytes are matched 8 at a time
+ * with SWAR arithmetic, a group of CTRL_GROUP bytes being two words */
+#define CTRL_EMPTY 0x80
+#define CTRL_GROUP 16
+#define CTRL_LSB 0x0101010101010101ULL
+#define CTRL_MSB 0x8080808080808080ULL
+
+static inline u64 kv_rotl64(u64 x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline u64 kv_load64(const void *p)
+{
+	u64 w;
+
+	memcpy(&w, p, sizeof(w));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	w = __builtin_bswap64(w);
+#endif
+	return w;
+}
+
+/* kv_hash( key, len)
+ * Hash len bytes of key, 8 bytes per step, with a final avalanche so that
+ * every output bit depends on every input bit (the segment, home bucket and
+ * fingerprint are all taken from the result)
+ */
+static inline u32 kv_hash(const char *key, size_t len)
+{
+	u64 h = 0x9E3779B97F4A7C15ULL ^ (len * 0xC2B2AE3D27D4EB4FULL);
+	u64 w;
+
+	for (; len >= 8; key += 8, len -= 8) {
+		w = kv_load64(key);
+		h ^= w * 0x87C37B91114253D5ULL;
+		h = kv_rotl64(h, 31) * 0x4CF5AD432745937FULL;
+	}
+	if (len) {
+		w = 0;
+		memcpy(&w, key, len);
+		h ^= w * 0x87C37B91114253D5ULL;
+		h = kv_rotl64(h, 31) * 0x4CF5AD432745937FULL;
+	}
+
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return (u32)h ^ (u32)(h >> 32);
+}
+
+/* fingerprint stored in the control byte, from the top bits of the hash */
+static inline u8 ctrl_h7(u32 h)
+{
+	return (h >> 25) & 0x7f;
+}
+
+/* ctrl_match( w, h7)
+ * Control bytes of w equal to h7 get their top bit set in the result. The
+ * byte right after a match may be flagged too, candidates are checked
+ * against the full hash anyway
+ */
+static inline u64 ctrl_match(u64 w, u8 h7)
+{
+	u64 x = w ^ (CTRL_LSB * h7);
+
+	return (x - CTRL_LSB) & ~x & CTRL_MSB;
+}
+
+/* top bit set for every empty control byte of w (exact) */
+static inline u64 ctrl_empty(u64 w)
+{
+	return w & CTRL_MSB;
+}
+
+/* index of the first flagged byte of a non null ctrl_match/ctrl_empty mask */
+static inline int ctrl_first(u64 m)
+{
+	return __builtin_ctzll(m) >> 3;
+}
+
+#endif /* LKP_KV_HASHFN_H */
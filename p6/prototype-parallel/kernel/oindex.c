@@ -0,0 +1,353 @@
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include "hash.h"
+#include "oindex.h"
+
+struct oi_node {
+	struct rb_node rb;
+	int shard;			/* tree it belongs to */
+	int len;
+	char key[];			/* the key, no NUL */
+};
+
+/* The index is split into OI_SHARDS trees, one per hash segment: a key is
+ * in the tree of its segment, so the writers of a tree are already
+ * serialized by the segment lock and its lock only keeps them from the
+ * scans. A shard: the tree, the number of keys in it and the bytes its
+ * nodes take. Scans take the locks for reading, one at a time, updates for
+ * writing, inside the segment lock of the key */
+#define OI_SHARDS HASH_SEGS
+
+struct oi_shard {
+	rwlock_t lock;
+	struct rb_root root;
+	long nb, bytes;
+};
+
+static struct oi_shard oi_shards[OI_SHARDS];
+
+static inline long oi_size(int len)
+{
+	return sizeof(struct oi_node) + len;
+}
+
+/* oindex_init( void)
+ * Set the shards up, before any other call
+ */
+void oindex_init(void)
+{
+	int i;
+
+	for (i = 0; i < OI_SHARDS; i++) {
+		rwlock_init(&oi_shards[i].lock);
+		oi_shards[i].root = RB_ROOT;
+	}
+}
+
+/* oindex_cmp( a, a_len, b, b_len)
+ * Key order of the index
+ *
+ * Return
+ * < 0, 0 or > 0 as a sorts before, with or after b
+ */
+int oindex_cmp(const char *a, int a_len, const char *b, int b_len)
+{
+	int ret = memcmp(a, b, min(a_len, b_len));
+
+	return ret ? ret : a_len - b_len;
+}
+
+/* oindex_node( key, len, h, gfp)
+ * A node for key (len bytes, full hash h), to be given to oindex_insert()
+ * or oindex_free(). Allocated before the segment lock is taken
+ * (GFP_KERNEL), or with GFP_ATOMIC under it
+ *
+ * Return
+ * the node
+ * NULL: allocation failure
+ */
+struct oi_node *oindex_node(const char *key, int len, unsigned int h,
+			    gfp_t gfp)
+{
+	struct oi_node *n = kmalloc(oi_size(len), gfp);
+
+	if (!n)
+		return NULL;
+	RB_CLEAR_NODE(&n->rb);
+	n->shard = hash_seg(h);
+	n->len = len;
+	memcpy(n->key, key, len);
+	return n;
+}
+
+void oindex_free(struct oi_node *n)
+{
+	kfree(n);
+}
+
+/* oindex_insert( n)
+ * Add the key of n to the index, n is freed if the key is there already
+ */
+void oindex_insert(struct oi_node *n)
+{
+	struct oi_shard *sh = &oi_shards[n->shard];
+	struct rb_node **p = &sh->root.rb_node, *parent = NULL;
+	struct oi_node *cur;
+	int cmp;
+
+	write_lock(&sh->lock);
+	while (*p) {
+		parent = *p;
+		cur = rb_entry(parent, struct oi_node, rb);
+		cmp = oindex_cmp(n->key, n->len, cur->key, cur->len);
+		if (cmp < 0)
+			p = &parent->rb_left;
+		else if (cmp > 0)
+			p = &parent->rb_right;
+		else
+			goto dup;
+	}
+	rb_link_node(&n->rb, parent, p);
+	rb_insert_color(&n->rb, &sh->root);
+	sh->nb++;
+	sh->bytes += oi_size(n->len);
+	write_unlock(&sh->lock);
+	return;
+
+dup:
+	write_unlock(&sh->lock);
+	kfree(n);
+}
+
+/* oindex_del( key, len, h)
+ * Remove key (full hash h) from the index, if it is there
+ */
+void oindex_del(const char *key, int len, unsigned int h)
+{
+	struct oi_shard *sh = &oi_shards[hash_seg(h)];
+	struct rb_node *p;
+	struct oi_node *cur;
+	int cmp;
+
+	write_lock(&sh->lock);
+	for (p = sh->root.rb_node; p; ) {
+		cur = rb_entry(p, struct oi_node, rb);
+		cmp = oindex_cmp(key, len, cur->key, cur->len);
+		if (cmp < 0)
+			p = p->rb_left;
+		else if (cmp > 0)
+			p = p->rb_right;
+		else {
+			rb_erase(p, &sh->root);
+			sh->nb--;
+			sh->bytes -= oi_size(cur->len);
+			kfree(cur);
+			break;
+		}
+	}
+	write_unlock(&sh->lock);
+}
+
+/* oindex_clear( void)
+ * Empty the index (format, mount, unmount)
+ */
+void oindex_clear(void)
+{
+	struct oi_shard *sh;
+	struct rb_node *p;
+
+	for (sh = oi_shards; sh < oi_shards + OI_SHARDS; sh++) {
+		write_lock(&sh->lock);
+		while ((p = rb_first(&sh->root))) {
+			rb_erase(p, &sh->root);
+			kfree(rb_entry(p, struct oi_node, rb));
+		}
+		sh->nb = 0;
+		sh->bytes = 0;
+		write_unlock(&sh->lock);
+	}
+}
+
+/* oi_first( root, from, from_len, after)
+ * The first node of a tree with a key >= from (> from with after set)
+ *
+ * Return
+ * the node
+ * NULL: none
+ */
+static struct rb_node *oi_first(struct rb_root *root, const char *from,
+				int from_len, int after)
+{
+	struct rb_node *p, *first = NULL;
+	struct oi_node *cur;
+	int cmp;
+
+	for (p = root->rb_node; p; ) {
+		cur = rb_entry(p, struct oi_node, rb);
+		cmp = oindex_cmp(from, from_len, cur->key, cur->len);
+		if (cmp < 0 || (cmp == 0 && !after)) {
+			first = p;
+			p = p->rb_left;
+		} else
+			p = p->rb_right;
+	}
+	return first;
+}
+
+/* oi_cut( cut, cut_len, key, len, gfp)
+ * Lower *cut to key if it sorts before it: a key left out of a scan for
+ * lack of room, those after it cannot be returned before it is
+ *
+ * Return
+ * 0: success
+ * -2: allocation failure
+ */
+static int oi_cut(char **cut, int *cut_len, const char *key, int len,
+		  gfp_t gfp)
+{
+	char *c;
+
+	if (*cut && oindex_cmp(key, len, *cut, *cut_len) >= 0)
+		return 0;
+	c = kmalloc(len + 1, gfp);
+	if (!c)
+		return -2;
+	memcpy(c, key, len);
+	c[len] = '\0';
+	kfree(*cut);
+	*cut = c;
+	*cut_len = len;
+	return 0;
+}
+
+/* oindex_scan( from, from_len, after, end, arg, nr, keys, size)
+ * The first keys from from on (after set: from excluded), in key order,
+ * until end returns non zero on one of them: at most nr of them, copied
+ * to keys one after the other, NUL terminated, in at most size bytes.
+ * The shards are read one at a time: the keys of a shard that can still be
+ * in the batch are copied under its lock, then merged with those gathered
+ * so far once it is released. The first key left out for lack of room
+ * ends the batch, whichever shard it came from. end runs under the lock
+ * and must not sleep
+ *
+ * Return
+ * the number of keys
+ * -2: allocation failure
+ */
+int oindex_scan(const char *from, int from_len, int after, oi_fn end,
+		void *arg, int nr, char *keys, int size)
+{
+	char *buf[2], *run, *last, *src, *cut = NULL;
+	int *ofs[2], *run_ofs, n[2] = { 0, 0 }, used[2] = { 0, 0 };
+	int i, j, m, len, cur = 0, nb_run, run_used, last_len, cut_len = 0;
+	int ret = 0;
+	struct oi_shard *sh;
+	struct rb_node *p;
+	struct oi_node *k;
+
+	buf[0] = keys;
+	buf[1] = vmalloc(size);
+	run = vmalloc(size);
+	ofs[0] = kmalloc(3 * nr * sizeof(int), GFP_KERNEL);
+	if (!buf[1] || !run || !ofs[0]) {
+		ret = -2;
+		goto out;
+	}
+	ofs[1] = ofs[0] + nr;
+	run_ofs = ofs[1] + nr;
+
+	for (sh = oi_shards; sh < oi_shards + OI_SHARDS; sh++) {
+		/* once the batch is full, only keys before its last one */
+		last = (n[cur] == nr) ? buf[cur] + ofs[cur][nr - 1] : NULL;
+		last_len = last ? strlen(last) : 0;
+		nb_run = 0;
+		run_used = 0;
+		read_lock(&sh->lock);
+		for (p = oi_first(&sh->root, from, from_len, after);
+		     p && nb_run < nr; p = rb_next(p)) {
+			k = rb_entry(p, struct oi_node, rb);
+			if ((end && end(arg, k->key, k->len)) ||
+			    (last && oindex_cmp(k->key, k->len, last,
+						last_len) > 0) ||
+			    (cut && oindex_cmp(k->key, k->len, cut,
+					       cut_len) >= 0))
+				break;
+			if (run_used + k->len + 1 > size) {
+				ret = oi_cut(&cut, &cut_len, k->key, k->len,
+					     GFP_ATOMIC);
+				break;
+			}
+			memcpy(run + run_used, k->key, k->len);
+			run[run_used + k->len] = '\0';
+			run_ofs[nb_run++] = run_used;
+			run_used += k->len + 1;
+		}
+		read_unlock(&sh->lock);
+		if (ret < 0)
+			goto out;
+		if (nb_run == 0)
+			continue;
+
+		/* merge into the other buffer what fits, the keys have no NUL
+		 * so strcmp() orders them as oindex_cmp() does */
+		for (i = 0, j = 0, m = 0, used[!cur] = 0; m < nr; m++) {
+			if (i < n[cur] && (j == nb_run ||
+					   strcmp(buf[cur] + ofs[cur][i],
+						  run + run_ofs[j]) < 0))
+				src = buf[cur] + ofs[cur][i++];
+			else if (j < nb_run)
+				src = run + run_ofs[j++];
+			else
+				break;
+			len = strlen(src);
+			if (used[!cur] + len + 1 > size) {
+				ret = oi_cut(&cut, &cut_len, src, len,
+					     GFP_KERNEL);
+				break;
+			}
+			memcpy(buf[!cur] + used[!cur], src, len + 1);
+			ofs[!cur][m] = used[!cur];
+			used[!cur] += len + 1;
+		}
+		if (ret < 0)
+			goto out;
+		n[!cur] = m;
+		cur = !cur;
+	}
+
+	/* a cut found after the batch was merged may come before its end */
+	while (cut && n[cur] > 0 &&
+	       strcmp(buf[cur] + ofs[cur][n[cur] - 1], cut) >= 0) {
+		n[cur]--;
+		used[cur] = ofs[cur][n[cur]];
+	}
+	if (buf[cur] != keys)
+		memcpy(keys, buf[cur], used[cur]);
+	ret = n[cur];
+out:
+	kfree(cut);
+	vfree(buf[1]);
+	vfree(run);
+	kfree(ofs[0]);
+	return ret;
+}
+
+/* oindex_stats( nb_keys, bytes)
+ * Keys in the index and the bytes its nodes take
+ */
+void oindex_stats(long *nb_keys, long *bytes)
+{
+	struct oi_shard *sh;
+
+	*nb_keys = 0;
+	*bytes = 0;
+	for (sh = oi_shards; sh < oi_shards + OI_SHARDS; sh++) {
+		read_lock(&sh->lock);
+		*nb_keys += sh->nb;
+		*bytes += sh->bytes;
+		read_unlock(&sh->lock);
+	}
+}
@@ -0,0 +1,35 @@
+#ifndef LKP_KV_OINDEX_H
+#define LKP_KV_OINDEX_H
+
+#include <linux/types.h>
+
+/* Ordered index: the keys of the store in key order, next to the hashtable,
+ * for the range and prefix scans (IOCTL_SCAN). Keys compare as bytes
+ * (memcmp), a key before the longer keys it is a prefix of.
+ * It is made of rbtrees of copies of the keys, one per hash segment, merged
+ * by the scans: buckets move on Robin Hood shifts and keys move when the
+ * key arena is compacted, the nodes do not. The hashtable stays the
+ * reference. A tree only changes where a key is added to or deleted from
+ * the hashtable, with the segment lock of the key held (hash_write_lock()),
+ * so both agree on every key whose set or del returned. It lives in RAM
+ * only and is rebuilt from the hashtable at mount. */
+
+struct oi_node;
+
+/* called on the keys of a scan, see oindex_scan(): returns 0 while the key
+ * is in the range, anything else past its end */
+typedef int (*oi_fn)(void *arg, const char *key, int len);
+
+int oindex_cmp(const char *a, int a_len, const char *b, int b_len);
+void oindex_init(void);
+struct oi_node *oindex_node(const char *key, int len, unsigned int h,
+			    gfp_t gfp);
+void oindex_free(struct oi_node *n);
+void oindex_insert(struct oi_node *n);
+void oindex_del(const char *key, int len, unsigned int h);
+void oindex_clear(void);
+int oindex_scan(const char *from, int from_len, int after, oi_fn end,
+		void *arg, int nr, char *keys, int size);
+void oindex_stats(long *nb_keys, long *bytes);
+
+#endif /* LKP_KV_OINDEX_H */
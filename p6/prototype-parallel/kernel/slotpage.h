@@ -0,0 +1,239 @@
+/**
+ * Slotted data page: a header, a slot directory growing from the start of
+ * the page and the records growing down from its end, so that many couples
+ * share one flash page. Plain C with no kernel dependency so that the
+ * user-space benchmark (user/testbench_slots.c) runs the very same code.
+ *
+ * A couple is located by (page, slot), packed in an int as
+ * page << SLOT_BITS | slot: that is what the index and the journal hold.
+ *
+ * A value too large for a page goes to extent pages, runs of whole pages
+ * that each start with a struct ext_page. Its slot record then holds the
+ * key and a struct slot_ext (the extent list) instead of the value, and its
+ * val_len has SLOT_EXT set.
+ */
+
+#ifndef LKP_KV_SLOTPAGE_H
+#define LKP_KV_SLOTPAGE_H
+
+#define SLOT_BITS 6
+#define MAX_SLOTS (1 << SLOT_BITS)	/* couples in a page at most */
+
+#define LOC(pg, slot) (((pg) << SLOT_BITS) | (slot))
+#define LOC_PAGE(loc) ((loc) >> SLOT_BITS)
+#define LOC_SLOT(loc) ((loc) & (MAX_SLOTS - 1))
+
+struct slot_page {
+	unsigned short nb_slots;	/* records in the page */
+	unsigned short free;		/* start of the record area */
+	unsigned short slot[];		/* offset of the record of each slot */
+};
+
+struct slot_rec {
+	unsigned short key_len;
+	unsigned short val_len;		/* SLOT_EXT: data holds a slot_ext */
+	char data[];			/* key then value, no NUL */
+};
+
+#define SLOT_EXT 0x8000
+#define SLOT_LEN(val_len) ((val_len) & ~SLOT_EXT)
+
+/* extent list of a multi-page value. An extent never crosses a block */
+#define EXT_MAX 64
+struct slot_extent {
+	int page;			/* first page of the run */
+	int nb;				/* pages in the run */
+};
+
+struct slot_ext {
+	int val_len;			/* length of the whole value */
+	int nb_ext;
+	struct slot_extent ext[];
+};
+
+/* header of an extent page: the key names the owner of the page for GC,
+ * the value bytes follow it */
+#define EXT_MAGIC 0xE7E7		/* above MAX_SLOTS: not a slotted page */
+struct ext_page {
+	unsigned short magic;
+	unsigned short key_len;
+	unsigned short data_len;	/* value bytes in this page */
+	unsigned short pad;
+	char data[];			/* key then value bytes */
+};
+
+/* slot_rec_size( key_len, val_len)
+ * Bytes a couple takes in a page, its slot included. Records stay 2 bytes
+ * aligned
+ */
+static inline int slot_rec_size(int key_len, int val_len)
+{
+	return sizeof(unsigned short) +
+	       ((sizeof(struct slot_rec) + key_len + SLOT_LEN(val_len) + 1) & ~1);
+}
+
+/* slot_max_data( page_size)
+ * Largest key_len + val_len a page can hold
+ */
+static inline int slot_max_data(int page_size)
+{
+	return (page_size - (int)sizeof(struct slot_page) -
+		slot_rec_size(0, 0)) & ~1;
+}
+
+/* ext_page_data( page_size, key_len)
+ * Value bytes an extent page holds
+ */
+static inline int ext_page_data(int page_size, int key_len)
+{
+	return page_size - (int)sizeof(struct ext_page) - key_len;
+}
+
+/* slot_ext_size( nb_ext)
+ * Bytes of an extent list of nb_ext extents
+ */
+static inline int slot_ext_size(int nb_ext)
+{
+	return sizeof(struct slot_ext) + nb_ext * sizeof(struct slot_extent);
+}
+
+/* slot_page_init( page, page_size)
+ * Empty page image
+ */
+static inline void slot_page_init(char *page, int page_size)
+{
+	struct slot_page *p = (struct slot_page *)page;
+
+	p->nb_slots = 0;
+	p->free = page_size;
+}
+
+/* slot_page_room( page, key_len, val_len)
+ * Tell whether the couple still fits in page
+ */
+static inline int slot_page_room(const char *page, int key_len, int val_len)
+{
+	const struct slot_page *p = (const struct slot_page *)page;
+
+	return p->nb_slots < MAX_SLOTS &&
+	       sizeof(*p) + p->nb_slots * sizeof(unsigned short) +
+	       slot_rec_size(key_len, val_len) <= p->free;
+}
+
+/* slot_page_add( page, key, key_len, val, val_len)
+ * Append a couple to page. The record and its slot are written before the
+ * slot count, a reader given the new slot never sees it half written.
+ * val_len may carry SLOT_EXT, val is then the extent list.
+ *
+ * Return
+ * the slot of the couple
+ * -1: the page is full
+ */
+static inline int slot_page_add(char *page, const char *key, int key_len,
+				const char *val, int val_len)
+{
+	struct slot_page *p = (struct slot_page *)page;
+	struct slot_rec *r;
+
+	if (!slot_page_room(page, key_len, val_len))
+		return -1;
+	p->free -= slot_rec_size(key_len, val_len) - sizeof(unsigned short);
+	r = (struct slot_rec *)(page + p->free);
+	r->key_len = key_len;
+	r->val_len = val_len;
+	memcpy(r->data, key, key_len);
+	memcpy(r->data + key_len, val, SLOT_LEN(val_len));
+	p->slot[p->nb_slots] = p->free;
+	return p->nb_slots++;
+}
+
+/* slot_page_rec( page, page_size, slot)
+ * Record of slot in page, checked against the page bounds (the page may be
+ * garbage: erased, or read while being erased)
+ *
+ * Return
+ * the record
+ * NULL: no such slot
+ */
+static inline const struct slot_rec *slot_page_rec(const char *page,
+						   int page_size, int slot)
+{
+	const struct slot_page *p = (const struct slot_page *)page;
+	const struct slot_rec *r;
+	int ofs;
+
+	if (p->nb_slots > MAX_SLOTS || slot < 0 || slot >= p->nb_slots)
+		return NULL;
+	ofs = p->slot[slot];
+	if (ofs < (int)(sizeof(*p) + p->nb_slots * sizeof(unsigned short)) ||
+	    ofs + (int)sizeof(*r) > page_size)
+		return NULL;
+	r = (const struct slot_rec *)(page + ofs);
+	if (ofs + (int)sizeof(*r) + r->key_len + SLOT_LEN(r->val_len) > page_size)
+		return NULL;
+	return r;
+}
+
+/* slot_page_replace( page, page_size, slot, key, key_len, val, val_len)
+ * Rewrite the couple of slot, which keeps its slot: in place if the new
+ * record is not larger, else at the start of the record area (the old
+ * record is then lost space until the page is reused)
+ *
+ * Return
+ * 0: Success
+ * -1: no such slot, or the page is full
+ */
+static inline int slot_page_replace(char *page, int page_size, int slot,
+				    const char *key, int key_len,
+				    const char *val, int val_len)
+{
+	struct slot_page *p = (struct slot_page *)page;
+	struct slot_rec *r;
+	int need = slot_rec_size(key_len, val_len) - sizeof(unsigned short);
+	int ofs;
+
+	r = (struct slot_rec *)slot_page_rec(page, page_size, slot);
+	if (!r)
+		return -1;
+	ofs = p->slot[slot];
+	if (need > slot_rec_size(r->key_len, r->val_len) -
+		   (int)sizeof(unsigned short)) {
+		if (sizeof(*p) + p->nb_slots * sizeof(unsigned short) + need >
+		    p->free)
+			return -1;
+		p->free -= need;
+		ofs = p->free;
+		r = (struct slot_rec *)(page + ofs);
+	}
+	r->key_len = key_len;
+	r->val_len = val_len;
+	memcpy(r->data, key, key_len);
+	memcpy(r->data + key_len, val, SLOT_LEN(val_len));
+	p->slot[slot] = ofs;
+	return 0;
+}
+
+/* slot_rec_ext( r, e)
+ * Copy the extent list of the multi-page couple r to e (slot_ext_size(
+ * EXT_MAX) bytes: the list in the page is not aligned), checked against the
+ * record size
+ *
+ * Return
+ * 0: Success
+ * -1: r holds its value, or a bad list
+ */
+static inline int slot_rec_ext(const struct slot_rec *r, struct slot_ext *e)
+{
+	int len = SLOT_LEN(r->val_len);
+
+	if (!(r->val_len & SLOT_EXT) || len < (int)sizeof(struct slot_ext) ||
+	    len > slot_ext_size(EXT_MAX))
+		return -1;
+	memcpy(e, r->data + r->key_len, len);
+	if (e->nb_ext < 1 || e->nb_ext > EXT_MAX || e->val_len < 0 ||
+	    slot_ext_size(e->nb_ext) != len)
+		return -1;
+	return 0;
+}
+
+#endif /* LKP_KV_SLOTPAGE_H */
@@ -0,0 +1,288 @@
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include "vcache.h"
+
+#define VC_BITS 10
+#define VC_BUCKETS (1 << VC_BITS)	/* buckets of the cache, by location */
+
+struct vc_entry {
+	struct hlist_node node;		/* in its bucket, unhashed once invalid */
+	struct list_head clock;		/* in the CLOCK ring */
+	int loc;			/* location of the couple */
+	int worn;			/* erase count of its block */
+	int bkt;			/* bucket of loc */
+	int ref;			/* CLOCK reference bit */
+	int len;
+	char val[];			/* the value, no NUL */
+};
+
+/* a bucket: its entries, a generation bumped by every invalidation of one
+ * of its locations, and the lookup counters, under its lock */
+struct vc_bucket {
+	spinlock_t lock;
+	struct hlist_head head;
+	unsigned int gen;
+	unsigned long long hits, misses;
+};
+
+static struct vc_bucket vc_bkt[VC_BUCKETS];
+
+/* the CLOCK ring (the hand is its head, new entries go behind it), the
+ * bytes the entries take and the budget, under vc_lock. vc_lock is taken
+ * before the bucket locks */
+static DEFINE_SPINLOCK(vc_lock);
+static LIST_HEAD(vc_ring);
+static long vc_bytes, vc_budget;
+static int vc_ready;
+
+static inline int vc_hash(int loc)
+{
+	return hash_32((u32)loc, VC_BITS);
+}
+
+static inline long vc_size(int len)
+{
+	return sizeof(struct vc_entry) + len;
+}
+
+/* vcache_init( void)
+ * Set the buckets up, before any other call but vcache_resize()
+ */
+void vcache_init(void)
+{
+	int i;
+
+	for (i = 0; i < VC_BUCKETS; i++) {
+		spin_lock_init(&vc_bkt[i].lock);
+		INIT_HLIST_HEAD(&vc_bkt[i].head);
+	}
+	vc_ready = 1;
+}
+
+/* vc_evict( budget)
+ * Run the CLOCK hand until the entries take budget bytes at most (-1:
+ * none left). Called with vc_lock held
+ */
+static void vc_evict(long budget)
+{
+	struct vc_entry *e;
+	struct vc_bucket *b;
+
+	while (vc_bytes > budget && !list_empty(&vc_ring)) {
+		e = list_first_entry(&vc_ring, struct vc_entry, clock);
+		b = &vc_bkt[e->bkt];
+		spin_lock(&b->lock);
+		if (e->ref && !hlist_unhashed(&e->node)) {
+			/* second chance */
+			e->ref = 0;
+			spin_unlock(&b->lock);
+			list_move_tail(&e->clock, &vc_ring);
+			continue;
+		}
+		if (!hlist_unhashed(&e->node))
+			hlist_del_init(&e->node);
+		spin_unlock(&b->lock);
+		list_del(&e->clock);
+		vc_bytes -= vc_size(e->len);
+		kfree(e);
+	}
+}
+
+/* vcache_resize( budget)
+ * Set the budget of the cache, in bytes (0: no cache), evicting what no
+ * longer fits
+ */
+void vcache_resize(long budget)
+{
+	spin_lock(&vc_lock);
+	vc_budget = budget;
+	if (vc_ready)
+		vc_evict(budget);
+	spin_unlock(&vc_lock);
+}
+
+/* vcache_clear( void)
+ * Drop every entry (format, unmount)
+ */
+void vcache_clear(void)
+{
+	spin_lock(&vc_lock);
+	vc_evict(-1);
+	spin_unlock(&vc_lock);
+}
+
+/* vcache_gen( loc)
+ * Generation of the bucket of loc, to be sampled before the value at loc
+ * is read for vcache_put()
+ */
+unsigned int vcache_gen(int loc)
+{
+	unsigned int gen = ACCESS_ONCE(vc_bkt[vc_hash(loc)].gen);
+
+	smp_rmb();
+	return gen;
+}
+
+/* vcache_get( loc, worn, buf, size)
+ * Copy the cached value of the couple at loc to buf (size bytes at most),
+ * worn being the current erase count of the block of loc
+ *
+ * Return
+ * the value length
+ * -1: miss
+ */
+int vcache_get(int loc, int worn, char *buf, int size)
+{
+	struct vc_bucket *b = &vc_bkt[vc_hash(loc)];
+	struct vc_entry *e;
+	int ret = -1;
+
+	if (!ACCESS_ONCE(vc_budget))
+		return -1;
+	spin_lock(&b->lock);
+	hlist_for_each_entry(e, &b->head, node) {
+		if (e->loc != loc)
+			continue;
+		if (e->worn != worn)
+			/* left behind by an erase of the block */
+			hlist_del_init(&e->node);
+		else if (e->len <= size) {
+			memcpy(buf, e->val, e->len);
+			e->ref = 1;
+			ret = e->len;
+		}
+		break;
+	}
+	if (ret >= 0)
+		b->hits++;
+	else
+		b->misses++;
+	spin_unlock(&b->lock);
+	return ret;
+}
+
+/* vcache_put( loc, worn, gen, val, len)
+ * Cache the value of the couple at loc, read from a block of erase count
+ * worn after vcache_gen() returned gen. Nothing is cached if loc was
+ * invalidated since
+ */
+void vcache_put(int loc, int worn, unsigned int gen, const char *val,
+		int len)
+{
+	int h = vc_hash(loc);
+	struct vc_bucket *b = &vc_bkt[h];
+	struct vc_entry *e, *cur;
+
+	if (vc_size(len) > ACCESS_ONCE(vc_budget))
+		return;
+	e = kmalloc(vc_size(len), GFP_KERNEL);
+	if (!e)
+		return;
+	e->loc = loc;
+	e->worn = worn;
+	e->bkt = h;
+	e->ref = 0;
+	e->len = len;
+	memcpy(e->val, val, len);
+
+	spin_lock(&vc_lock);
+	vc_evict(vc_budget - vc_size(len));
+	spin_lock(&b->lock);
+	if (b->gen != gen)
+		goto drop;
+	hlist_for_each_entry(cur, &b->head, node) {
+		if (cur->loc != loc)
+			continue;
+		if (cur->worn == worn)
+			goto drop;
+		hlist_del_init(&cur->node);
+		break;
+	}
+	hlist_add_head(&e->node, &b->head);
+	spin_unlock(&b->lock);
+	list_add_tail(&e->clock, &vc_ring);
+	vc_bytes += vc_size(len);
+	spin_unlock(&vc_lock);
+	return;
+
+drop:
+	spin_unlock(&b->lock);
+	spin_unlock(&vc_lock);
+	kfree(e);
+}
+
+/* vcache_inval( loc)
+ * The couple at loc is not current anymore, or its value changed in place:
+ * drop its entry, and the values of loc being read now
+ */
+void vcache_inval(int loc)
+{
+	struct vc_bucket *b = &vc_bkt[vc_hash(loc)];
+	struct vc_entry *e;
+
+	if (!vc_ready)
+		return;
+	spin_lock(&b->lock);
+	/* the new value is visible before the generation moves */
+	smp_wmb();
+	b->gen++;
+	hlist_for_each_entry(e, &b->head, node)
+		if (e->loc == loc) {
+			hlist_del_init(&e->node);
+			break;
+		}
+	spin_unlock(&b->lock);
+}
+
+/* vcache_move( old, old_worn, loc, worn)
+ * GC moved the couple at old (block of erase count old_worn) to loc (block
+ * of erase count worn): its entry follows it
+ */
+void vcache_move(int old, int old_worn, int loc, int worn)
+{
+	struct vc_bucket *b = &vc_bkt[vc_hash(old)];
+	struct vc_entry *e, *found = NULL;
+
+	if (!vc_ready)
+		return;
+	spin_lock(&vc_lock);
+	spin_lock(&b->lock);
+	hlist_for_each_entry(e, &b->head, node)
+		if (e->loc == old && e->worn == old_worn) {
+			hlist_del_init(&e->node);
+			found = e;
+			break;
+		}
+	spin_unlock(&b->lock);
+	if (found) {
+		found->loc = loc;
+		found->worn = worn;
+		found->bkt = vc_hash(loc);
+		b = &vc_bkt[found->bkt];
+		spin_lock(&b->lock);
+		hlist_add_head(&found->node, &b->head);
+		spin_unlock(&b->lock);
+	}
+	spin_unlock(&vc_lock);
+}
+
+/* vcache_stats( hits, misses, bytes)
+ * Lookup counters since module load, and the bytes the cache takes
+ */
+void vcache_stats(unsigned long long *hits, unsigned long long *misses,
+		  long *bytes)
+{
+	int i;
+
+	*hits = *misses = 0;
+	for (i = 0; vc_ready && i < VC_BUCKETS; i++) {
+		spin_lock(&vc_bkt[i].lock);
+		*hits += vc_bkt[i].hits;
+		*misses += vc_bkt[i].misses;
+		spin_unlock(&vc_bkt[i].lock);
+	}
+	*bytes = ACCESS_ONCE(vc_bytes);
+}
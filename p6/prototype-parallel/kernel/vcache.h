@@ -0,0 +1,32 @@
+#ifndef LKP_KV_VCACHE_H
+#define LKP_KV_VCACHE_H
+
+/* DRAM value cache: copies of the values recently read from flash, keyed
+ * by the location of their couple (LOC(page, slot)), within a budget of
+ * bytes. A location holds a single version of a single key until its block
+ * is erased, so an entry stays right as long as:
+ * - the couple is not invalidated (vcache_inval(), from invalid_page(), and
+ *   from an overwrite in the open page) nor moved (vcache_move(), GC),
+ * - its block was not erased since: every entry records the erase count
+ *   (worn) of its block, a lookup gives the current one.
+ * A lookup that misses reads the page and inserts the value, unless the
+ * location was invalidated meanwhile (vcache_gen()).
+ *
+ * Eviction is CLOCK: a hit sets the reference bit of the entry, the hand
+ * gives referenced entries a second chance and evicts the others.
+ * Invalidated entries are unhashed at once and freed when the hand reaches
+ * them. */
+
+void vcache_init(void);
+void vcache_resize(long budget);
+void vcache_clear(void);
+unsigned int vcache_gen(int loc);
+int vcache_get(int loc, int worn, char *buf, int size);
+void vcache_put(int loc, int worn, unsigned int gen, const char *val,
+		int len);
+void vcache_inval(int loc);
+void vcache_move(int old, int old_worn, int loc, int worn);
+void vcache_stats(unsigned long long *hits, unsigned long long *misses,
+		  long *bytes);
+
+#endif /* LKP_KV_VCACHE_H */
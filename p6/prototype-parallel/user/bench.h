@@ -0,0 +1,29 @@
+/**
+ * Helpers shared by the testbenches: time between two clock_gettime()
+ * samples, in seconds, microseconds or nanoseconds
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <time.h>
+
+static inline double elapsed_s(struct timespec *start, struct timespec *stop)
+{
+	return (stop->tv_sec - start->tv_sec) +
+	       (stop->tv_nsec - start->tv_nsec) / 1.0e9;
+}
+
+static inline double elapsed_us(struct timespec *start, struct timespec *stop)
+{
+	return (stop->tv_sec - start->tv_sec) * 1.0e6 +
+	       (stop->tv_nsec - start->tv_nsec) / 1.0e3;
+}
+
+static inline double elapsed_ns(struct timespec *start, struct timespec *stop)
+{
+	return (stop->tv_sec - start->tv_sec) * 1.0e9 +
+	       (stop->tv_nsec - start->tv_nsec);
+}
+
+#endif /* BENCH_H */
@@ -2,7 +2,8 @@
 set -euo pipefail
 
 MOD_NAME=prototype.ko
-FLASH_PARTITION_INDEX=0
+# data partition(s), e.g. FLASH_PARTITION_INDEX=0,2 to stripe the store on two
+FLASH_PARTITION_INDEX=${FLASH_PARTITION_INDEX:-0}
 META_PARTITION_INDEX=1
 DEV_NAME=/dev/lkp_kv
 DEV_MAJOR=100
@@ -12,11 +12,15 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <string.h>
 
 /* here we get some info from the virtual device header: device name, major 
  * number, ioctl commands identifiers, and the struct keyval definition */
 #include "../kernel/device.h"
+#include "kvlib.h"
 
 /**
  * Called by a process wanting to do a format operation.
@@ -48,140 +52,941 @@ int kvlib_format()
 	return ret;
 }
 
+/* session state, see kvlib_open() */
+struct kvlib_ctx {
+	int fd;			/* virtual device file, open for the whole session */
+	keyval kv;		/* ioctl argument, reused by every call */
+	char val_buf[KVLIB_VAL_MAX + 1];	/* landing buffer for kvlib_get() */
+	keyval_desc descs[KV_BATCH_MAX];	/* batch descriptors */
+	char *arena;		/* batch key/value arena, grown on demand */
+	size_t arena_size;
+};
+
+/* translate the kernel status of a set into the library return code */
+static int set_status(int status)
+{
+	if (status == -1)
+		return -3; /* size to write too big */
+	else if (status == -2)
+		return -4; /* key already exists */
+	else if (status == -3)
+		return -5; /* system in RO mode */
+	else if (status == -4)
+		return -6; /* MTD write error */
+	else if (status == -7)
+		return -7; /* user/kernelspace memory transfer error */
+	return 0;
+}
+
+/* translate the kernel status of a get into the library return code */
+static int get_status(int status)
+{
+	if (status == -1)
+		return -3; /* key not found */
+	else if (status == -2)
+		return -4; /* flash read error */
+	else if (status == -3)
+		return -6; /* value buffer too small */
+	else if (status == -5)
+		return -5; /* user/kernelspace memory transfer error */
+	return 0;
+}
+
+/* translate the kernel status of a del into the library return code */
+static int del_status(int status)
+{
+	if (status == -1)
+		return -3; /* key not found */
+	else if (status == -2)
+		return -4; /* flash read error */
+	return 0;
+}
+
+/**
+ * Open a session on the storage system. The virtual device file stays open
+ * until kvlib_close() is called.
+ * Returns the session handle, or NULL if the device cannot be opened
+ */
+kvlib_ctx *kvlib_open(void)
+{
+	kvlib_ctx *ctx;
+
+	ctx = (kvlib_ctx *)malloc(sizeof(kvlib_ctx));
+	if (!ctx)
+		return NULL;
+
+	/* open virtual device file */
+	ctx->fd = open(DEVICE_NAME, 0);
+	if (ctx->fd < 0) {
+		free(ctx);
+		return NULL;
+	}
+
+	memset(&ctx->kv, 0, sizeof(keyval));
+	ctx->arena = NULL;
+	ctx->arena_size = 0;
+	return ctx;
+}
+
+/**
+ * Close a session opened with kvlib_open()
+ */
+void kvlib_close(kvlib_ctx *ctx)
+{
+	if (!ctx)
+		return;
+
+	close(ctx->fd);
+	free(ctx->arena);
+	free(ctx);
+}
+
+/* hand key over to the kernel: a short key goes inline in the keyval, it
+ * then comes in with it instead of in a second copy */
+static void put_key(keyval *kv, const char *key, size_t key_len)
+{
+	kv->key_len = key_len;
+	if (key_len < KV_KEY_INLINE) {
+		memcpy(kv->key_inline, key, key_len);
+		kv->key = NULL;
+	} else
+		kv->key = (char *)key;
+}
+
 /**
- * Called by a process wanting to write a key/value couple (set)
+ * Write a key/value couple (set) within a session. key and value do not need
+ * to be NUL terminated, their length is given explicitly.
  * Returns:
  * 0 on success
- * -1 on error when opening the virtual device file
+ * -1 on invalid session
  * -2 on IOCTL error
- * -3 if size(key + value) > flash page size
+ * -3 if the key is larger than a flash page or the value than KV_VAL_MAX
  * -4 when trying to set an already existing key
  * -5 when the storage system is in read-only mode
  * -6 on MTD write error
  * -7 on userspace/kernel space memory transfer error
  */
-int kvlib_set(const char *key, const char *value)
+int kvlib_ctx_set(kvlib_ctx *ctx, const char *key, size_t key_len,
+		  const char *value, size_t val_len)
 {
-	int fd;
-	int ret = 0;
-	keyval kv;
+	keyval *kv;
 
-	/* open virtual device file */
-	fd = open(DEVICE_NAME, 0);
-	if (fd < 0)
+	if (!ctx)
 		return -1;
-	
-	/* prepare the keyval structure that will be sent through ioctl */
-	kv.key = (char *)malloc((strlen(key) + 1) * sizeof(char));
-	kv.val = (char *)malloc((strlen(value) + 1) * sizeof(char));
-	sprintf(kv.key, "%s", key);
-	sprintf(kv.val, "%s", value);
 
-	kv.key_len = strlen(key);
-	kv.val_len = strlen(value);
+	/* the kernel reads exactly key_len/val_len bytes from our pointers, 
+	 * so the caller's buffers are handed over without any copy */
+	kv = &ctx->kv;
+	put_key(kv, key, key_len);
+	kv->val = (char *)value;
+	kv->val_len = val_len;
 
 	/* send ioctl command */
-	if (ioctl(fd, IOCTL_SET, &kv) != 0) {
+	if (ioctl(ctx->fd, IOCTL_SET, kv) != 0)
 		return -2; /* ioctl error */
-	} else {
-		/* get the return code */
-		if (kv.status == -1) {
-			ret = -3; /* size to write too big */
-		} else if (kv.status == -2) {
-			ret = -4; /* key already exists */
-		} else if (kv.status == -3) {
-			ret = -5; /* system in RO mode */
-		} else if (kv.status == -4) {
-			ret = -6; /* MTD write error */
-		}
-	}
-
-	/* cleanup */
-	free(kv.key);
-	free(kv.val);
 
-	/* close virtual device file */
-	close(fd);
-	return ret;
+	/* get the return code */
+	return set_status(kv->status);
 }
 
 /**
- * Called by a process to get a value from a key
+ * Get a value from a key within a session. The value is written in the
+ * caller's buffer, which has a capacity of val_size bytes (including the
+ * terminating NUL).
  * Returns:
  * 0 when ok
- * -1 on virtual device file open error
+ * -1 on invalid session
  * -2 on IOCTL error
  * -3 if key not found
  * -4 on flash read error
  * -5 on user/kernelspace memory transfer error
+ * -6 if the value does not fit in val_size bytes
  */
-int kvlib_get(const char *key, char *value)
+int kvlib_ctx_get(kvlib_ctx *ctx, const char *key, size_t key_len,
+		  char *value, size_t val_size)
 {
-	int fd;
-	int ret = 0;
-	keyval kv;
+	keyval *kv;
 
-	/* open virtual device file */
-	fd = open(DEVICE_NAME, 0);
-	if (fd < 0)
+	if (!ctx)
 		return -1;
 
-	/* peprare the keyval structure we will send through IOCTL */
-	kv.key = (char *)malloc((strlen(key) + 1) * sizeof(char));
-	kv.val = (char *)malloc( ((1 << 11) + 1) * sizeof(char));
-	sprintf(kv.key, "%s", key);
-	kv.key_len = strlen(key);
+	/* prepare the keyval structure we will send through IOCTL, val_len
+	 * gives the kernel the capacity of the value buffer */
+	kv = &ctx->kv;
+	put_key(kv, key, key_len);
+	kv->val = value;
+	kv->val_len = val_size;
 
 	/* ioctl */
-	if (ioctl(fd, IOCTL_GET, &kv) != 0)
+	if (ioctl(ctx->fd, IOCTL_GET, kv) != 0)
 		return -2; /* ioctl error */
 
-	/* get the value... */
-	sprintf(value, "%s", kv.val);
+	/* the return code */
+	return get_status(kv->status);
+}
 
-	/* ... and the return code */
-	if (kv.status == -1)
-		ret = -3; /* key not found */
-	else if (kv.status == -2)
-		ret = -4; /* flash read error */
+/**
+ * Delete a key within a session.
+ * Returns:
+ * 0 when ok
+ * -1 on invalid session
+ * -2 on IOCTL error
+ * -3 if key not found
+ * -4 on flash read error
+ */
+int kvlib_ctx_del(kvlib_ctx *ctx, const char *key, size_t key_len)
+{
+	keyval *kv;
 
-	free(kv.key);
-	free(kv.val);
+	if (!ctx)
+		return -1;
 
-	close(fd);
+	kv = &ctx->kv;
+	put_key(kv, key, key_len);
+
+	if (ioctl(ctx->fd, IOCTL_DEL, kv) < 0)
+		return -2; /* ioctl error */
+
+	return del_status(kv->status);
+}
+
+/* reserve size bytes in the session arena, which is grown if needed.
+ * Returns 0 on success, -1 on allocation failure */
+static int arena_reserve(kvlib_ctx *ctx, size_t size)
+{
+	char *arena;
+
+	if (size <= ctx->arena_size)
+		return 0;
+
+	arena = (char *)realloc(ctx->arena, size);
+	if (!arena)
+		return -1;
+
+	ctx->arena = arena;
+	ctx->arena_size = size;
+	return 0;
+}
 
+/* send a batch of nr descriptors (and arena_len bytes of arena) to the
+ * kernel. Returns the number of successful operations or a negative code */
+static int send_batch(kvlib_ctx *ctx, unsigned long cmd, int nr,
+		      size_t arena_len)
+{
+	keyval_batch batch;
+
+	batch.descs = ctx->descs;
+	batch.nr = nr;
+	batch.arena = ctx->arena;
+	batch.arena_len = arena_len;
+
+	if (ioctl(ctx->fd, cmd, &batch) != 0)
+		return -2; /* ioctl error */
+
+	if (batch.status == -2)
+		return -8; /* kernel allocation failure */
+	else if (batch.status == -5)
+		return -7; /* user/kernelspace memory transfer error */
+	else if (batch.status < 0)
+		return -3; /* malformed batch */
+
+	return batch.status;
+}
+
+/* pack the keys of items (and their values when with_val is set) in the
+ * session arena. Returns the arena length used, or -1 */
+static long pack_batch(kvlib_ctx *ctx, kvlib_item *items, int nr, int with_val)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		len += items[i].key_len + 1;
+		if (with_val)
+			len += items[i].val_len + 1;
+	}
+	if (arena_reserve(ctx, len + 1) != 0)
+		return -1;
+
+	len = 0;
+	for (i = 0; i < nr; i++) {
+		keyval_desc *d = &ctx->descs[i];
+
+		d->key_ofs = len;
+		d->key_len = items[i].key_len;
+		memcpy(ctx->arena + len, items[i].key, items[i].key_len);
+		len += items[i].key_len + 1;
+
+		d->val_ofs = 0;
+		d->val_len = 0;
+		if (with_val) {
+			d->val_ofs = len;
+			d->val_len = items[i].val_len;
+			memcpy(ctx->arena + len, items[i].val, items[i].val_len);
+			len += items[i].val_len + 1;
+		}
+	}
+
+	/* keys and values must leave room for their NUL, see keyval_desc */
+	return len + 1;
+}
+
+/**
+ * Write nr key/value couples with a single ioctl. items[i].status receives
+ * the kvlib_ctx_set() return code of each couple.
+ * Returns the number of couples written, or:
+ * -1 on invalid session or nr out of [1, KV_BATCH_MAX]
+ * -2 on IOCTL error
+ * -3 on malformed batch
+ * -7 on userspace/kernel space memory transfer error
+ * -8 on allocation failure
+ */
+int kvlib_mset(kvlib_ctx *ctx, kvlib_item *items, int nr)
+{
+	long len;
+	int i, ret;
+
+	if (!ctx || nr <= 0 || nr > KV_BATCH_MAX)
+		return -1;
+
+	len = pack_batch(ctx, items, nr, 1);
+	if (len < 0)
+		return -8;
+
+	ret = send_batch(ctx, IOCTL_MSET, nr, len);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < nr; i++)
+		items[i].status = set_status(ctx->descs[i].status);
 	return ret;
 }
 
-int kvlib_del(const char *key)
+/**
+ * Get the values of nr keys with a single ioctl; the pages are read by the 
+ * kernel in flash order. items[i].val is a caller buffer of items[i].val_len
+ * bytes, on return items[i].val_len is the length of the value and 
+ * items[i].status the kvlib_ctx_get() return code.
+ * Returns the number of keys found, or the error codes of kvlib_mset()
+ */
+int kvlib_mget(kvlib_ctx *ctx, kvlib_item *items, int nr)
 {
-	int fd;
-	int ret = 0;
-	keyval kv;
+	size_t len = 0;
+	long keys_len;
+	int i, ret;
 
-	/* open virtual device file */
-	fd = open(DEVICE_NAME, 0);
-	if (fd < 0)
+	if (!ctx || nr <= 0 || nr > KV_BATCH_MAX)
 		return -1;
 
-	/* peprare the keyval structure we will send through IOCTL */
-	kv.key = (char *)malloc((strlen(key) + 1) * sizeof(char));
-	
-    sprintf(kv.key, "%s", key);
-	kv.key_len = strlen(key);
+	/* the keys first, then one value slot per item */
+	keys_len = pack_batch(ctx, items, nr, 0);
+	if (keys_len < 0)
+		return -8;
+	len = keys_len;
+	for (i = 0; i < nr; i++)
+		len += items[i].val_len;
+	if (arena_reserve(ctx, len) != 0)
+		return -8;
+
+	len = keys_len;
+	for (i = 0; i < nr; i++) {
+		ctx->descs[i].val_ofs = len;
+		ctx->descs[i].val_len = items[i].val_len;
+		len += items[i].val_len;
+	}
+
+	ret = send_batch(ctx, IOCTL_MGET, nr, len);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < nr; i++) {
+		keyval_desc *d = &ctx->descs[i];
+
+		items[i].status = get_status(d->status);
+		if (d->status >= 0) {
+			memcpy(items[i].val, ctx->arena + d->val_ofs, d->val_len + 1);
+			items[i].val_len = d->val_len;
+		}
+	}
+	return ret;
+}
 
-	if (ioctl(fd, IOCTL_DEL, &kv) < 0)
+/**
+ * Delete nr keys with a single ioctl. items[i].status receives the 
+ * kvlib_ctx_del() return code of each key.
+ * Returns the number of keys deleted, or the error codes of kvlib_mset()
+ */
+int kvlib_mdel(kvlib_ctx *ctx, kvlib_item *items, int nr)
+{
+	long len;
+	int i, ret;
+
+	if (!ctx || nr <= 0 || nr > KV_BATCH_MAX)
+		return -1;
+
+	len = pack_batch(ctx, items, nr, 0);
+	if (len < 0)
+		return -8;
+
+	ret = send_batch(ctx, IOCTL_MDEL, nr, len);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < nr; i++)
+		items[i].status = del_status(ctx->descs[i].status);
+	return ret;
+}
+
+/* state of a range scan: the bounds, the last key returned (the cursor of
+ * the next batch) and the arena the batches land in */
+struct kvlib_scan {
+	kvlib_ctx *ctx;
+	keyval_scan sc;		/* ioctl argument, bounds and cursor set */
+	char *start, *end;
+	char cursor[KVLIB_VAL_MAX + 1];
+	int done;		/* the kernel returned the last key */
+};
+
+/**
+ * Start a range scan within a session, see kvlib_scan_next().
+ * Returns the scan handle, or NULL on invalid session, bounds longer than
+ * KVLIB_VAL_MAX, bad flags or allocation failure
+ */
+kvlib_scan *kvlib_scan_open(kvlib_ctx *ctx, const char *start,
+			    size_t start_len, const char *end, size_t end_len,
+			    int flags)
+{
+	kvlib_scan *scan;
+
+	if (!ctx || start_len > KVLIB_VAL_MAX || end_len > KVLIB_VAL_MAX
+	    || (flags & ~KV_SCAN_MASK))
+		return NULL;
+
+	scan = (kvlib_scan *)calloc(1, sizeof(kvlib_scan));
+	if (!scan)
+		return NULL;
+	scan->start = (char *)malloc(start_len + 1);
+	scan->end = (char *)malloc(end_len + 1);
+	if (!scan->start || !scan->end) {
+		kvlib_scan_close(scan);
+		return NULL;
+	}
+	memcpy(scan->start, start, start_len);
+	if (end)
+		memcpy(scan->end, end, end_len);
+
+	scan->ctx = ctx;
+	scan->sc.start = scan->start;
+	scan->sc.start_len = start_len;
+	scan->sc.end = scan->end;
+	scan->sc.end_len = end ? end_len : 0;
+	scan->sc.cursor = scan->cursor;
+	scan->sc.cursor_len = 0;
+	scan->sc.flags = flags;
+	return scan;
+}
+
+/**
+ * Next batch of a range scan: at most nr (up to KV_BATCH_MAX) keys in key
+ * order. items[i].key and key_len give the key, and with KV_SCAN_VALUES
+ * items[i].val and val_len the value, items[i].status being the
+ * kvlib_ctx_get() return code (-6: the value is longer than a flash page,
+ * get it with kvlib_ctx_get()). Both are NUL terminated and stay valid
+ * until the next call.
+ * Returns the number of keys, 0 at the end of the range, or the error
+ * codes of kvlib_mset()
+ */
+int kvlib_scan_next(kvlib_scan *scan, kvlib_item *items, int nr)
+{
+	kvlib_ctx *ctx;
+	size_t len;
+	int i;
+
+	if (!scan || nr <= 0 || nr > KV_BATCH_MAX)
+		return -1;
+	if (scan->done)
+		return 0;
+
+	/* room for nr keys and values of a flash page each */
+	ctx = scan->ctx;
+	len = (size_t)nr * 2 * (KVLIB_VAL_MAX + 2);
+	if (arena_reserve(ctx, len) != 0)
+		return -8;
+	scan->sc.descs = ctx->descs;
+	scan->sc.nr = nr;
+	scan->sc.arena = ctx->arena;
+	scan->sc.arena_len = len;
+
+	if (ioctl(ctx->fd, IOCTL_SCAN, &scan->sc) != 0)
 		return -2; /* ioctl error */
 
-	if (kv.status == -1)
-		ret = -3; /* key not found */
-	else if (kv.status == -2)
-		ret = -4; /* flash read error */
+	if (scan->sc.status == -2)
+		return -8; /* kernel allocation failure */
+	else if (scan->sc.status == -5)
+		return -7; /* user/kernelspace memory transfer error */
+	else if (scan->sc.status < 0)
+		return -3; /* malformed scan */
+
+	for (i = 0; i < scan->sc.status; i++) {
+		keyval_desc *d = &ctx->descs[i];
+
+		items[i].key = ctx->arena + d->key_ofs;
+		items[i].key_len = d->key_len;
+		items[i].val = d->val_ofs ? ctx->arena + d->val_ofs : NULL;
+		items[i].val_len = d->val_len;
+		items[i].status = get_status(d->status);
+	}
 
-	free(kv.key);
+	/* the next batch starts after the last key of this one */
+	if (scan->sc.status == 0) {
+		scan->done = 1;
+	} else {
+		keyval_desc *d = &ctx->descs[scan->sc.status - 1];
 
-	close(fd);
+		memcpy(scan->cursor, ctx->arena + d->key_ofs, d->key_len);
+		scan->sc.cursor_len = d->key_len;
+	}
+	return scan->sc.status;
+}
+
+/**
+ * End a range scan started with kvlib_scan_open()
+ */
+void kvlib_scan_close(kvlib_scan *scan)
+{
+	if (!scan)
+		return;
+
+	free(scan->start);
+	free(scan->end);
+	free(scan);
+}
+
+/* an operation in flight, one per slot of the data buffer */
+struct kvlib_async_op {
+	int op;			/* KV_RING_SET/GET/DEL */
+	size_t val_ofs;		/* get: the value in the data buffer */
+	unsigned long long user_data;
+};
+
+/* the rings of a session, mapped, and the slots of the data buffer: free,
+ * in flight, or holding the value of a completion of the last reap */
+struct kvlib_async {
+	kvlib_ctx *ctx;
+	void *map;
+	size_t map_len;
+	kv_ring_hdr *hdr;
+	kv_sqe *sq;
+	kv_cqe *cq;
+	char *data;
+	unsigned int sq_tail;	/* entries queued, hdr->sq_tail once submitted */
+	int efd;		/* -1: poll() the device file */
+	int entries;		/* slots */
+	size_t slot_size;
+	struct kvlib_async_op *ops;	/* entries of them */
+	int *free_slots;	/* nb_free of them */
+	int nb_free;
+	int *reaped;		/* slots of the last reap, nb_reaped of them */
+	int nb_reaped;
+};
+
+/**
+ * Set up the rings of a session (a session has one at most): entries
+ * operations in flight at most, with slot_size bytes for the key and value
+ * of each (0: a key and a value of KVLIB_VAL_MAX bytes). flags may have
+ * KVLIB_ASYNC_EVENTFD.
+ * Returns the ring handle, or NULL on invalid session, bad sizes, a
+ * session that has a ring already, or allocation/mapping failure
+ */
+kvlib_async *kvlib_async_open(kvlib_ctx *ctx, int entries, size_t slot_size,
+			      int flags)
+{
+	kvlib_async *ring;
+	kv_ring_setup rs;
+	int i;
+
+	if (slot_size == 0)
+		slot_size = 2 * (KVLIB_VAL_MAX + 1);
+	if (!ctx || entries < 1 || entries > KV_RING_MAX
+	    || slot_size * entries > KV_RING_DATA_MAX)
+		return NULL;
+
+	ring = (kvlib_async *)calloc(1, sizeof(kvlib_async));
+	if (!ring)
+		return NULL;
+	ring->ctx = ctx;
+	ring->map = MAP_FAILED;
+	ring->efd = -1;
+	ring->entries = entries;
+	ring->slot_size = slot_size;
+	ring->ops = (struct kvlib_async_op *)calloc(entries, sizeof(struct kvlib_async_op));
+	ring->free_slots = (int *)malloc(entries * sizeof(int));
+	ring->reaped = (int *)malloc(entries * sizeof(int));
+	if (!ring->ops || !ring->free_slots || !ring->reaped)
+		goto fail;
+	for (i = 0; i < entries; i++)
+		ring->free_slots[i] = entries - 1 - i;
+	ring->nb_free = entries;
+
+	if (flags & KVLIB_ASYNC_EVENTFD) {
+		ring->efd = eventfd(0, EFD_CLOEXEC);
+		if (ring->efd < 0)
+			goto fail;
+	}
+
+	rs.entries = entries;
+	rs.data_len = slot_size * entries;
+	rs.efd = ring->efd;
+	if (ioctl(ctx->fd, IOCTL_RING_SETUP, &rs) != 0 || rs.status != 0)
+		goto fail;
+
+	ring->map_len = rs.map_len;
+	ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, ctx->fd, 0);
+	if (ring->map == MAP_FAILED)
+		goto fail;
+	ring->hdr = (kv_ring_hdr *)ring->map;
+	ring->sq = (kv_sqe *)((char *)ring->map + ring->hdr->sq_off);
+	ring->cq = (kv_cqe *)((char *)ring->map + ring->hdr->cq_off);
+	ring->data = (char *)ring->map + ring->hdr->data_off;
+	ring->sq_tail = ring->hdr->sq_tail;
+	return ring;
+
+fail:
+	kvlib_async_close(ring);
+	return NULL;
+}
+
+/**
+ * Unmap the rings of a session. The kernel keeps them (and runs what was
+ * submitted) until the session is closed
+ */
+void kvlib_async_close(kvlib_async *ring)
+{
+	if (!ring)
+		return;
+
+	if (ring->map != MAP_FAILED)
+		munmap(ring->map, ring->map_len);
+	if (ring->efd >= 0)
+		close(ring->efd);
+	free(ring->reaped);
+	free(ring->free_slots);
+	free(ring->ops);
+	free(ring);
+}
+
+/* queue_op( ring, op, key, key_len, val, val_len, user_data)
+ * Write an SQ entry in a free slot: the key, then the value of a set (val
+ * not NULL, and its NUL) or room for val_len bytes of the value of a get
+ * (NUL included).
+ * Returns 0, -1 if every slot is in flight, -3 if the slot is too small */
+static int queue_op(kvlib_async *ring, int op, const char *key,
+		    size_t key_len, const char *val, size_t val_len,
+		    unsigned long long user_data)
+{
+	kv_sqe *e;
+	size_t ofs;
+	int slot;
+
+	if (ring->nb_free == 0)
+		return -1;
+	if (key_len + 1 + val_len + (val ? 1 : 0) > ring->slot_size)
+		return -3;
+
+	slot = ring->free_slots[--ring->nb_free];
+	ofs = slot * ring->slot_size;
+	ring->ops[slot].op = op;
+	ring->ops[slot].val_ofs = ofs + key_len + 1;
+	ring->ops[slot].user_data = user_data;
+
+	e = &ring->sq[ring->sq_tail & (ring->hdr->sq_entries - 1)];
+	e->op = op;
+	e->key_ofs = ofs;
+	e->key_len = key_len;
+	memcpy(ring->data + ofs, key, key_len);
+	e->val_ofs = ofs + key_len + 1;
+	e->val_len = val_len;
+	if (val)
+		memcpy(ring->data + e->val_ofs, val, val_len);
+	e->user_data = slot;
+	ring->sq_tail++;
+	return 0;
+}
+
+/**
+ * Queue a set, a get (val_size is the capacity for the value, including
+ * its NUL) or a del; user_data comes back in the completion. Nothing is
+ * sent before kvlib_async_submit().
+ * Returns 0, or:
+ * -1 on invalid ring, or if entries operations are in flight already (reap)
+ * -3 if the key and value do not fit in a slot
+ */
+int kvlib_async_set(kvlib_async *ring, const char *key, size_t key_len,
+		    const char *value, size_t val_len,
+		    unsigned long long user_data)
+{
+	if (!ring)
+		return -1;
+	return queue_op(ring, KV_RING_SET, key, key_len, value, val_len,
+			user_data);
+}
+
+int kvlib_async_get(kvlib_async *ring, const char *key, size_t key_len,
+		    size_t val_size, unsigned long long user_data)
+{
+	if (!ring || val_size < 1)
+		return -1;
+	return queue_op(ring, KV_RING_GET, key, key_len, NULL, val_size,
+			user_data);
+}
+
+int kvlib_async_del(kvlib_async *ring, const char *key, size_t key_len,
+		    unsigned long long user_data)
+{
+	if (!ring)
+		return -1;
+	return queue_op(ring, KV_RING_DEL, key, key_len, NULL, 0, user_data);
+}
+
+/**
+ * Hand the queued operations to the kernel: publish the SQ tail, and wake
+ * the worker up unless it is draining the SQ already.
+ * Returns the number of operations submitted, or -1 on invalid ring, -2 on
+ * IOCTL error
+ */
+int kvlib_async_submit(kvlib_async *ring)
+{
+	int n, ret;
+
+	if (!ring)
+		return -1;
+	n = ring->sq_tail - ring->hdr->sq_tail;
+	if (n == 0)
+		return 0;
+
+	__atomic_store_n(&ring->hdr->sq_tail, ring->sq_tail, __ATOMIC_RELEASE);
+	/* the worker clears KV_RING_RUNNING, then looks at sq_tail */
+	__sync_synchronize();
+	if (!(__atomic_load_n(&ring->hdr->flags, __ATOMIC_RELAXED) & KV_RING_RUNNING)
+	    && ioctl(ring->ctx->fd, IOCTL_RING_ENTER, &ret) != 0)
+		return -2;
+	return n;
+}
+
+/* wait for the worker to post completions */
+static int async_wait(kvlib_async *ring)
+{
+	struct pollfd pfd;
+	uint64_t count;
+
+	if (ring->efd >= 0)
+		return read(ring->efd, &count, sizeof(count)) == sizeof(count) ? 0 : -2;
+	pfd.fd = ring->ctx->fd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, -1) < 0 ? -2 : 0;
+}
+
+/**
+ * Collect up to nr completions, waiting until there are min_nr of them
+ * (at most the number of operations in flight). Operations queued and not
+ * submitted yet are submitted first. The values of the completions of the
+ * previous call are released.
+ * Returns the number of completions, or -1 on invalid ring, -2 on
+ * IOCTL/wait error
+ */
+int kvlib_async_reap(kvlib_async *ring, kvlib_cqe *cqes, int nr, int min_nr)
+{
+	int i, n = 0, slot, in_flight;
+	unsigned int head, tail;
+	kv_cqe *c;
+
+	if (!ring || nr < 0)
+		return -1;
+
+	for (i = 0; i < ring->nb_reaped; i++)
+		ring->free_slots[ring->nb_free++] = ring->reaped[i];
+	ring->nb_reaped = 0;
+
+	if (kvlib_async_submit(ring) < 0)
+		return -2;
+	in_flight = ring->entries - ring->nb_free;
+	if (min_nr > nr)
+		min_nr = nr;
+
+	head = ring->hdr->cq_head;
+	while (n < nr) {
+		tail = __atomic_load_n(&ring->hdr->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (n >= min_nr || n >= in_flight)
+				break;
+			if (async_wait(ring) != 0)
+				return -2;
+			continue;
+		}
+		c = &ring->cq[head & (ring->hdr->cq_entries - 1)];
+		slot = c->user_data;
+		cqes[n].user_data = ring->ops[slot].user_data;
+		cqes[n].val = NULL;
+		cqes[n].val_len = 0;
+		if (ring->ops[slot].op == KV_RING_SET) {
+			cqes[n].status = set_status(c->status);
+		} else if (ring->ops[slot].op == KV_RING_DEL) {
+			cqes[n].status = del_status(c->status);
+		} else {
+			cqes[n].status = get_status(c->status);
+			if (c->status >= 0) {
+				cqes[n].val = ring->data + ring->ops[slot].val_ofs;
+				cqes[n].val_len = c->val_len;
+			}
+		}
+		ring->reaped[ring->nb_reaped++] = slot;
+		head++;
+		n++;
+		__atomic_store_n(&ring->hdr->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return n;
+}
+
+/**
+ * File descriptor that becomes readable when completions are posted: the
+ * eventfd of the ring, or the device file
+ */
+int kvlib_async_fd(kvlib_async *ring)
+{
+	if (!ring)
+		return -1;
+	return ring->efd >= 0 ? ring->efd : ring->ctx->fd;
+}
+
+/**
+ * Get the operation counters of a session (each open of the virtual device
+ * has its own counters).
+ * Returns 0 on success, -1 on invalid session, -2 on IOCTL error
+ */
+int kvlib_stats(kvlib_ctx *ctx, kv_stats *stats)
+{
+	if (!ctx)
+		return -1;
+
+	if (ioctl(ctx->fd, IOCTL_STATS, stats) != 0)
+		return -2;
+
+	return 0;
+}
+
+/**
+ * Get the statistics of the whole store (all sessions together), see
+ * kv_core_stats in device.h.
+ * Returns 0 on success, -1 on invalid session, -2 on IOCTL error
+ */
+int kvlib_core_stats(kvlib_ctx *ctx, kv_core_stats *stats)
+{
+	if (!ctx)
+		return -1;
+
+	if (ioctl(ctx->fd, IOCTL_CORE_STATS, stats) != 0)
+		return -2;
+
+	return 0;
+}
+
+/**
+ * Set the options (KV_OPT_* flags) of a session.
+ * Returns 0 on success, -1 on invalid session, -2 on IOCTL error (unknown
+ * flag)
+ */
+int kvlib_setopt(kvlib_ctx *ctx, int flags)
+{
+	if (!ctx)
+		return -1;
+
+	if (ioctl(ctx->fd, IOCTL_SETOPT, &flags) != 0)
+		return -2;
+
+	return 0;
+}
+
+/**
+ * Make the updates buffered so far durable: the open data page and the
+ * journal are written to flash.
+ * Returns 0 on success, -1 on invalid session, -2 on IOCTL error, -4 on
+ * flash write error
+ */
+int kvlib_sync(kvlib_ctx *ctx)
+{
+	int ret;
+
+	if (!ctx)
+		return -1;
+
+	if (ioctl(ctx->fd, IOCTL_SYNC, &ret) != 0)
+		return -2;
+
+	return ret;
+}
+
+/**
+ * Called by a process wanting to write a key/value couple (set).
+ * One-shot version of kvlib_ctx_set(): the device is opened and closed
+ * around the operation.
+ * Returns the same codes as kvlib_ctx_set(), -1 being an error when opening
+ * the virtual device file
+ */
+int kvlib_set(const char *key, const char *value)
+{
+	kvlib_ctx *ctx;
+	int ret;
+
+	ctx = kvlib_open();
+	if (!ctx)
+		return -1;
+
+	ret = kvlib_ctx_set(ctx, key, strlen(key), value, strlen(value));
+
+	kvlib_close(ctx);
+	return ret;
+}
+
+/**
+ * Called by a process to get a value from a key. One-shot version of
+ * kvlib_ctx_get(); value must be able to hold a full flash page.
+ * Returns the same codes as kvlib_ctx_get(), -1 being an error when opening
+ * the virtual device file
+ */
+int kvlib_get(const char *key, char *value)
+{
+	kvlib_ctx *ctx;
+	int ret;
+
+	ctx = kvlib_open();
+	if (!ctx)
+		return -1;
+
+	ret = kvlib_ctx_get(ctx, key, strlen(key), ctx->val_buf,
+			    sizeof(ctx->val_buf));
+	if (ret == 0)
+		strcpy(value, ctx->val_buf);
+
+	kvlib_close(ctx);
+	return ret;
+}
+
+/**
+ * Called by a process to delete a key. One-shot version of kvlib_ctx_del()
+ */
+int kvlib_del(const char *key)
+{
+	kvlib_ctx *ctx;
+	int ret;
+
+	ctx = kvlib_open();
+	if (!ctx)
+		return -1;
+
+	ret = kvlib_ctx_del(ctx, key, strlen(key));
 
+	kvlib_close(ctx);
 	return ret;
 }
 
@@ -6,6 +6,108 @@
 #ifndef KVLIB_H
 #define KVLIB_H
 
+#include <stddef.h>
+
+/* kv_stats, kv_core_stats and the KV_OPT_* session options */
+#include "../kernel/device.h"
+
+/* largest value kvlib_get() will receive (one flash page), kvlib_ctx_get()
+ * takes values up to KV_VAL_MAX */
+#define KVLIB_VAL_MAX (1 << 11)
+
+/* session handle: keeps the virtual device open between calls and owns the
+ * transfer buffers, so that a hot loop does not pay open/close and malloc
+ * for every operation */
+typedef struct kvlib_ctx kvlib_ctx;
+
+/* ouverture / fermeture d'une session */
+kvlib_ctx *kvlib_open(void);
+void kvlib_close(kvlib_ctx *ctx);
+
+/* session operations: keys and values are given with their length and do
+ * not need to be NUL terminated; the value buffer of a get is owned by the
+ * caller and val_size is its capacity */
+int kvlib_ctx_set(kvlib_ctx *ctx, const char *key, size_t key_len,
+		  const char *value, size_t val_len);
+int kvlib_ctx_get(kvlib_ctx *ctx, const char *key, size_t key_len,
+		  char *value, size_t val_size);
+int kvlib_ctx_del(kvlib_ctx *ctx, const char *key, size_t key_len);
+
+/* one operation of a batch. For a set, val/val_len is the value; for a get,
+ * val is a caller buffer of val_len bytes and val_len gets back the length
+ * of the value. status receives the return code of the single operation */
+typedef struct {
+	const char *key;
+	size_t key_len;
+	char *val;
+	size_t val_len;
+	int status;
+} kvlib_item;
+
+/* batched operations (at most KV_BATCH_MAX items), one ioctl per batch */
+int kvlib_mset(kvlib_ctx *ctx, kvlib_item *items, int nr);
+int kvlib_mget(kvlib_ctx *ctx, kvlib_item *items, int nr);
+int kvlib_mdel(kvlib_ctx *ctx, kvlib_item *items, int nr);
+
+/* range scan (see IOCTL_SCAN): the keys from start up to end excluded
+ * (end NULL: up to the last key), or the keys starting with start when
+ * flags has KV_SCAN_PREFIX, in key order. With KV_SCAN_VALUES the values
+ * come too, read by the kernel in flash page order. Every
+ * kvlib_scan_next() returns the next batch: items[i].key and val point
+ * into the scan buffer until the following call */
+typedef struct kvlib_scan kvlib_scan;
+
+kvlib_scan *kvlib_scan_open(kvlib_ctx *ctx, const char *start,
+			    size_t start_len, const char *end, size_t end_len,
+			    int flags);
+int kvlib_scan_next(kvlib_scan *scan, kvlib_item *items, int nr);
+void kvlib_scan_close(kvlib_scan *scan);
+
+/* asynchronous operations through the rings of a session (see
+ * kv_ring_hdr): up to entries operations in flight, each with a slot of
+ * slot_size bytes of the shared data buffer for its key and value. The
+ * queue functions only write the SQ, kvlib_async_submit() hands the queued
+ * entries to the kernel worker (one ioctl at most), kvlib_async_reap()
+ * collects completions, waiting on an eventfd (KVLIB_ASYNC_EVENTFD) or
+ * with poll() on the device file */
+typedef struct kvlib_async kvlib_async;
+
+#define KVLIB_ASYNC_EVENTFD 0x1
+
+/* a completion: status is the kvlib_ctx_set/get/del return code of the
+ * operation, and for a get val/val_len the value, NUL terminated, valid
+ * until the next kvlib_async_reap() */
+typedef struct {
+	unsigned long long user_data;
+	int status;
+	char *val;
+	size_t val_len;
+} kvlib_cqe;
+
+kvlib_async *kvlib_async_open(kvlib_ctx *ctx, int entries, size_t slot_size,
+			      int flags);
+void kvlib_async_close(kvlib_async *ring);
+int kvlib_async_set(kvlib_async *ring, const char *key, size_t key_len,
+		    const char *value, size_t val_len,
+		    unsigned long long user_data);
+int kvlib_async_get(kvlib_async *ring, const char *key, size_t key_len,
+		    size_t val_size, unsigned long long user_data);
+int kvlib_async_del(kvlib_async *ring, const char *key, size_t key_len,
+		    unsigned long long user_data);
+int kvlib_async_submit(kvlib_async *ring);
+int kvlib_async_reap(kvlib_async *ring, kvlib_cqe *cqes, int nr, int min_nr);
+int kvlib_async_fd(kvlib_async *ring);
+
+/* statistics and options (KV_OPT_* flags) of a session */
+int kvlib_stats(kvlib_ctx *ctx, kv_stats *stats);
+int kvlib_setopt(kvlib_ctx *ctx, int flags);
+
+/* write the updates buffered in RAM to flash (see KV_OPT_SYNC) */
+int kvlib_sync(kvlib_ctx *ctx);
+
+/* statistics of the whole store */
+int kvlib_core_stats(kvlib_ctx *ctx, kv_core_stats *stats);
+
 /* ecriture d'un couple cle valeur */
 int kvlib_set(const char *key, const char *value);
 
@@ -0,0 +1,61 @@
+/**
+ * Print the statistics of the whole store
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+/* Library header */
+#include "kvlib.h"
+
+int main(void)
+{
+	int i, ret;
+	kv_core_stats st;
+	kvlib_ctx *ctx;
+
+	ctx = kvlib_open();
+	if (!ctx) {
+		printf("kvlib_open failed\n");
+		return EXIT_FAILURE;
+	}
+
+	ret = kvlib_core_stats(ctx, &st);
+	kvlib_close(ctx);
+	if (ret != 0) {
+		printf("ret: %d\n", ret);
+		return EXIT_FAILURE;
+	}
+
+	printf("hashtable lookups: %llu\n", st.nb_lookups);
+	printf("mean probe length: %.2f\n",
+	       st.nb_lookups ? (double)st.nb_probes / st.nb_lookups : 0.0);
+	printf("max probe length: %d\n", st.max_probe);
+	printf("max distance to home: %d\n", st.max_dist);
+	printf("GC passes: %llu (total %llu us, max %llu us)\n",
+	       st.nb_gc, st.gc_us, st.gc_max_us);
+	printf("metadata checkpoints: %llu (total %llu us, max %llu us)\n",
+	       st.nb_ckpt, st.ckpt_us, st.ckpt_max_us);
+	printf("couples written: %llu in %llu data pages (%.2f per page)\n",
+	       st.nb_recs, st.nb_data_pgs,
+	       st.nb_data_pgs ? (double)st.nb_recs / st.nb_data_pgs : 0.0);
+	printf("overwrites coalesced in the open page: %llu\n", st.nb_coalesced);
+	printf("moved by GC: %llu couples in %llu data pages (write amplification %.2f)\n",
+	       st.nb_gc_recs, st.nb_gc_pgs, st.nb_data_pgs > st.nb_gc_pgs ?
+	       (double)st.nb_data_pgs / (st.nb_data_pgs - st.nb_gc_pgs) : 0.0);
+	printf("value cache: %llu hits, %llu misses (%.1f%% hits), %lld bytes\n",
+	       st.nb_vc_hits, st.nb_vc_misses,
+	       st.nb_vc_hits + st.nb_vc_misses ? 100.0 * st.nb_vc_hits /
+	       (st.nb_vc_hits + st.nb_vc_misses) : 0.0, st.vc_bytes);
+	printf("ordered index: %lld keys, %lld bytes\n", st.oi_keys,
+	       st.oi_bytes);
+	printf("erase counts: %d to %d, %llu cold blocks moved by the wear leveler\n",
+	       st.min_worn, st.max_worn, st.nb_wl);
+	printf("moved by the wear leveler: %llu couples in %llu data pages"
+	       " (total %llu us)\n", st.nb_wl_recs, st.nb_wl_pgs, st.wl_us);
+	for (i = 0; i < st.nb_parts && i < KV_PARTS_MAX; i++)
+		printf("data partition %d: %llu data pages, %llu GC passes,"
+		       " %d/%d blocks free\n", i, st.parts[i].nb_data_pgs,
+		       st.parts[i].nb_gc, st.parts[i].nb_free_blks,
+		       st.parts[i].nb_blocks);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,214 @@
+/**
+ * Microbenchmark of the flash block allocator, in user space: writes pages
+ * to a full partition of thousands of blocks, erasing a full block whenever
+ * it is read-only, with the old allocator (is_read_only()
+ * scanning every block on each page write, get_healthy_block() scanning
+ * every block and the metadata block list for each of them) and with the
+ * new one (free/open heaps by erase count and free/full block counters).
+ * The heap code is the kernel's, see kernel/blkheap.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../kernel/blkheap.h"
+#include "bench.h"
+
+#define PAGES_PER_BLOCK 64
+#define NB_META_BLKS 8
+#define NB_WRITES 65536
+
+typedef struct {
+	int free;
+	int worn;
+	int offset;
+} blk;
+
+static blk *blocks;
+static int nb_blocks;
+static int meta_blkordr[NB_META_BLKS];
+
+static void reset(void)
+{
+	int i;
+
+	memset(blocks, 0, nb_blocks * sizeof(blk));
+	for (i = 0; i < nb_blocks; i++)
+		blocks[i].free = 1;
+	/* log blocks spread over the partition */
+	for (i = 0; i < NB_META_BLKS; i++) {
+		meta_blkordr[i] = i * (nb_blocks / NB_META_BLKS);
+		blocks[meta_blkordr[i]].free = 0;
+		blocks[meta_blkordr[i]].offset = PAGES_PER_BLOCK;
+	}
+}
+
+static int is_meta(int b)
+{
+	int i;
+
+	for (i = 0; i < NB_META_BLKS; i++)
+		if (meta_blkordr[i] == b)
+			return 1;
+	return 0;
+}
+
+/* ---- old allocator (linear scans) ---- */
+
+static int old_read_only(void)
+{
+	int i, full = 0;
+
+	for (i = 0; i < nb_blocks; i++)
+		if (blocks[i].offset >= PAGES_PER_BLOCK && !is_meta(i))
+			full++;
+	return full >= nb_blocks - NB_META_BLKS - 1;
+}
+
+static int old_healthy_block(void)
+{
+	int i, ret = -1, minimum = 0x7FFFFFFF;
+
+	for (i = 0; i < nb_blocks; i++) {
+		if (is_meta(i))
+			continue;
+		if (blocks[i].offset < PAGES_PER_BLOCK && blocks[i].worn < minimum) {
+			minimum = blocks[i].worn;
+			ret = i;
+		}
+	}
+	return ret;
+}
+
+/* ---- new allocator (kernel/blkheap.h) ---- */
+
+static struct blk_heap free_heap, open_heap;
+static int nb_full;
+
+static void new_class(int b)
+{
+	blk_heap_remove(&free_heap, b);
+	blk_heap_remove(&open_heap, b);
+	if (is_meta(b))
+		return;
+	if (blocks[b].offset >= PAGES_PER_BLOCK)
+		nb_full++;
+	else if (blocks[b].free)
+		blk_heap_update(&free_heap, b, blocks[b].worn);
+	else
+		blk_heap_update(&open_heap, b, blocks[b].worn);
+}
+
+static int new_read_only(void)
+{
+	return nb_full >= nb_blocks - NB_META_BLKS - 1;
+}
+
+static int new_healthy_block(void)
+{
+	int ret = blk_heap_top(&open_heap);
+
+	if (free_heap.nb && (ret < 0 || free_heap.ent[0].key < open_heap.ent[0].key))
+		ret = blk_heap_top(&free_heap);
+	return ret;
+}
+
+/* nb_writes page writes, from a partition with all its pages written
+ * once: the GC is modelled by the erase of a pseudo-random full block when
+ * the partition is read-only */
+static int run(const char *name, int heaps, int nb_writes)
+{
+	int w;
+	int cur = -1, b, errors = 0;
+	unsigned int seed = 1;
+	struct timespec start, stop;
+	struct blk_heap_ent *ent = malloc(2 * nb_blocks * sizeof(*ent));
+	int *pos = malloc(2 * nb_blocks * sizeof(int));
+
+	if (!ent || !pos)
+		return 1;
+	reset();
+	blk_heap_init(&free_heap, ent, pos, 0, nb_blocks);
+	blk_heap_init(&open_heap, ent + nb_blocks, pos + nb_blocks, 0, nb_blocks);
+	for (b = 0; b < nb_blocks; b++)
+		if (!is_meta(b) && b != nb_blocks - 1) {
+			blocks[b].free = 0;
+			blocks[b].offset = PAGES_PER_BLOCK;
+		}
+	nb_full = 0;
+	for (b = 0; b < nb_blocks; b++)
+		new_class(b);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (w = 0; w < nb_writes; w++) {
+		if (cur < 0 || blocks[cur].offset >= PAGES_PER_BLOCK) {
+			cur = heaps ? new_healthy_block() : old_healthy_block();
+			if (cur < 0) {
+				errors++;
+				break;
+			}
+			blocks[cur].free = 0;
+			if (heaps)
+				new_class(cur);
+		}
+		if (++blocks[cur].offset == PAGES_PER_BLOCK && heaps)
+			new_class(cur);
+
+		if (heaps ? new_read_only() : old_read_only()) {
+			do {
+				seed = seed * 1103515245 + 12345;
+				b = (seed >> 8) % nb_blocks;
+			} while (b == cur || is_meta(b) || blocks[b].offset < PAGES_PER_BLOCK);
+			if (heaps)
+				nb_full--;
+			blocks[b].offset = 0;
+			blocks[b].free = 1;
+			blocks[b].worn++;
+			if (heaps)
+				new_class(b);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	printf("%s allocator, %d blocks: %.1f ns/page write\n", name, nb_blocks,
+	       elapsed_ns(&start, &stop) / nb_writes);
+
+	free(ent);
+	free(pos);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	int sizes[] = { 1024, 4096, 16384 };
+	int i, errors = 0, nb = sizeof(sizes) / sizeof(sizes[0]);
+	int nb_writes = NB_WRITES;
+
+	if (argc >= 2) {
+		sizes[0] = atoi(argv[1]);
+		nb = 1;
+	}
+	if (argc >= 3)
+		nb_writes = atoi(argv[2]);
+	if (nb_writes < 1)
+		nb_writes = 1;
+
+	printf("===========================\n");
+	printf("=== ALLOCATOR benchmark ===\n");
+	printf("===========================\n");
+	printf("%d pages per block, %d metadata blocks\n", PAGES_PER_BLOCK, NB_META_BLKS);
+
+	for (i = 0; i < nb; i++) {
+		nb_blocks = sizes[i];
+		if (nb_blocks < 2 * NB_META_BLKS)
+			nb_blocks = 2 * NB_META_BLKS;
+		blocks = malloc(nb_blocks * sizeof(blk));
+		if (!blocks)
+			return EXIT_FAILURE;
+		errors += run("old", 0, nb_writes);
+		errors += run("new", 1, nb_writes);
+		free(blocks);
+	}
+	printf("errors: %d (should be 0)\n", errors);
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,163 @@
+/**
+ * Asynchronous operations through the rings of a session: sets, then gets
+ * of the same keys, kept at a queue depth of 1 to 128 operations in flight
+ * by a single thread, against the blocking kvlib_ctx_set/get loop. Reports
+ * the operations/sec of each and checks the values read back. Completions
+ * are waited for on an eventfd, or with poll() on the device file when the
+ * second argument is "poll".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/* Library header */
+#include "kvlib.h"
+#include "bench.h"
+
+#define NB_OPS 20000
+#define VAL_LEN 100
+#define QD_MAX 128
+
+static int val_of(char *val, int i, int qd)
+{
+	int n = sprintf(val, "val%d_%d_", i, qd);
+
+	memset(val + n, 'a' + i % 26, VAL_LEN - n);
+	val[VAL_LEN] = '\0';
+	return VAL_LEN;
+}
+
+/* nb_ops sets (get 0) or gets (get 1) of keys 0..nb_ops-1 with qd of them
+ * in flight, returns the errors and the time taken in *secs */
+static int run_async(kvlib_async *ring, int get, int qd, int nb_ops,
+		     double *secs)
+{
+	kvlib_cqe cqes[QD_MAX];
+	char key[64], val[VAL_LEN + 1];
+	struct timespec start, stop;
+	int i, n, key_len, next = 0, done = 0, in_flight = 0, errors = 0;
+
+	*secs = 1.0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (done < nb_ops) {
+		/* fill the queue up, one submission for all of them */
+		while (in_flight < qd && next < nb_ops) {
+			key_len = sprintf(key, "key%d", next);
+			if (get)
+				n = kvlib_async_get(ring, key, key_len,
+						    VAL_LEN + 1, next);
+			else
+				n = kvlib_async_set(ring, key, key_len, val,
+						    val_of(val, next, qd), next);
+			if (n != 0)
+				return errors + 1;
+			next++;
+			in_flight++;
+		}
+		if (kvlib_async_submit(ring) < 0)
+			return errors + 1;
+
+		n = kvlib_async_reap(ring, cqes, QD_MAX, 1);
+		if (n < 0)
+			return errors + 1;
+		for (i = 0; i < n; i++) {
+			if (cqes[i].status != 0) {
+				errors++;
+				continue;
+			}
+			if (!get)
+				continue;
+			val_of(val, cqes[i].user_data, qd);
+			if (cqes[i].val_len != VAL_LEN ||
+			    strcmp(cqes[i].val, val) != 0)
+				errors++;
+		}
+		in_flight -= n;
+		done += n;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	*secs = elapsed_s(&start, &stop);
+	return errors;
+}
+
+/* the same with blocking calls */
+static int run_sync(kvlib_ctx *ctx, int get, int nb_ops, double *secs)
+{
+	char key[64], val[VAL_LEN + 1], buffer[KVLIB_VAL_MAX + 1];
+	struct timespec start, stop;
+	int i, key_len, errors = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_ops; i++) {
+		key_len = sprintf(key, "key%d", i);
+		val_of(val, i, 0);
+		if (get)
+			errors += kvlib_ctx_get(ctx, key, key_len, buffer,
+						sizeof(buffer)) != 0 ||
+				  strcmp(buffer, val) != 0;
+		else
+			errors += kvlib_ctx_set(ctx, key, key_len, val,
+						VAL_LEN) != 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	*secs = elapsed_s(&start, &stop);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	int qd, errors = 0, e, nb_ops = NB_OPS;
+	int flags = KVLIB_ASYNC_EVENTFD;
+	double set_s, get_s;
+	kvlib_async *ring;
+	kvlib_ctx *ctx, *actx;
+
+	if (argc >= 2)
+		nb_ops = atoi(argv[1]);
+	if (nb_ops < 1)
+		nb_ops = 1;
+	if (argc >= 3 && strcmp(argv[2], "poll") == 0)
+		flags = 0;
+
+	printf("=========================================\n");
+	printf("=== ASYNCHRONOUS OPERATIONS benchmark ===\n");
+	printf("=========================================\n");
+
+	if (kvlib_format() != 0) {
+		printf("format failed\n");
+		return EXIT_FAILURE;
+	}
+	ctx = kvlib_open();
+	actx = kvlib_open();
+	if (!ctx || !actx) {
+		printf("kvlib_open failed\n");
+		return EXIT_FAILURE;
+	}
+	ring = kvlib_async_open(actx, QD_MAX, 64 + VAL_LEN + 1, flags);
+	if (!ring) {
+		printf("kvlib_async_open failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%d sets then %d gets of %d bytes per run, completions by %s\n",
+	       nb_ops, nb_ops, VAL_LEN, flags ? "eventfd" : "poll");
+	printf("QD       sets/sec     gets/sec     errors (should be 0)\n");
+	e = run_sync(ctx, 0, nb_ops, &set_s);
+	e += run_sync(ctx, 1, nb_ops, &get_s);
+	printf("%-8s %-12.0f %-12.0f %d\n", "sync", nb_ops / set_s,
+	       nb_ops / get_s, e);
+	errors += e;
+	for (qd = 1; qd <= QD_MAX; qd *= 2) {
+		e = run_async(ring, 0, qd, nb_ops, &set_s);
+		e += run_async(ring, 1, qd, nb_ops, &get_s);
+		printf("%-8d %-12.0f %-12.0f %d\n", qd, nb_ops / set_s,
+		       nb_ops / get_s, e);
+		errors += e;
+	}
+
+	kvlib_async_close(ring);
+	kvlib_close(actx);
+	kvlib_close(ctx);
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
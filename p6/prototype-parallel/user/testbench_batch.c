@@ -0,0 +1,107 @@
+/**
+ * Test program for the batched operations: kvlib_mset/kvlib_mget/kvlib_mdel
+ * against the same number of single operations
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/* Library header */
+#include "kvlib.h"
+#include "bench.h"
+
+#define NB_KEYS 1024
+#define BATCH 64
+
+static char keys[NB_KEYS][32], vals[NB_KEYS][32], out[NB_KEYS][64];
+
+int main(void)
+{
+	int i, j, ret, bad;
+	kvlib_item items[BATCH];
+	struct timespec start, stop;
+	double t_single, t_batch;
+	kvlib_ctx *ctx;
+
+	printf("======================\n");
+	printf("=== BATCH test ===\n");
+	printf("======================\n");
+
+	ctx = kvlib_open();
+	if (!ctx) {
+		printf("kvlib_open failed\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < NB_KEYS; i++) {
+		sprintf(keys[i], "batch%d", i);
+		sprintf(vals[i], "bval%d", i);
+	}
+
+	/* single operations */
+	ret = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NB_KEYS; i++)
+		ret += kvlib_ctx_set(ctx, keys[i], strlen(keys[i]), vals[i],
+				     strlen(vals[i]));
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	t_single = elapsed_s(&start, &stop);
+	printf("single set x%d returns: %d (should be 0)\n", NB_KEYS, ret);
+
+	/* batches */
+	ret = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NB_KEYS; i += BATCH) {
+		for (j = 0; j < BATCH; j++) {
+			items[j].key = keys[i + j];
+			items[j].key_len = strlen(keys[i + j]);
+			items[j].val = vals[i + j];
+			items[j].val_len = strlen(vals[i + j]);
+		}
+		ret += kvlib_mset(ctx, items, BATCH);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	t_batch = elapsed_s(&start, &stop);
+	printf("kvlib_mset returns: %d (should be %d)\n", ret, NB_KEYS);
+
+	ret = 0;
+	bad = 0;
+	for (i = 0; i < NB_KEYS; i += BATCH) {
+		/* ask for the keys in reverse order, the kernel reads them in
+		 * page order anyway */
+		for (j = 0; j < BATCH; j++) {
+			int k = i + BATCH - 1 - j;
+
+			items[j].key = keys[k];
+			items[j].key_len = strlen(keys[k]);
+			items[j].val = out[k];
+			items[j].val_len = sizeof(out[k]);
+		}
+		ret += kvlib_mget(ctx, items, BATCH);
+		for (j = 0; j < BATCH; j++) {
+			int k = i + BATCH - 1 - j;
+
+			if (items[j].status != 0 || strcmp(out[k], vals[k]))
+				bad++;
+		}
+	}
+	printf("kvlib_mget returns: %d (should be %d), %d bad values (should be 0)\n",
+	       ret, NB_KEYS, bad);
+
+	ret = 0;
+	for (i = 0; i < NB_KEYS; i += BATCH) {
+		for (j = 0; j < BATCH; j++) {
+			items[j].key = keys[i + j];
+			items[j].key_len = strlen(keys[i + j]);
+		}
+		ret += kvlib_mdel(ctx, items, BATCH);
+	}
+	printf("kvlib_mdel returns: %d (should be %d)\n", ret, NB_KEYS);
+
+	printf("\nset: single %.0f op/s, batch of %d %.0f op/s\n",
+	       NB_KEYS / t_single, BATCH, NB_KEYS / t_batch);
+
+	kvlib_close(ctx);
+	return EXIT_SUCCESS;
+}
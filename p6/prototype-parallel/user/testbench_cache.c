@@ -0,0 +1,144 @@
+/**
+ * DRAM value cache: a skewed get workload (most gets go to a few hot keys)
+ * over a store of many keys, with the cache of the module off (VCACHE_KB=0)
+ * and at a few budgets. Reports gets/sec and the hit rate of the cache from
+ * the core statistics, and checks the values read back after the hot keys
+ * were overwritten (the cache must not return old values). Needs root to
+ * change /sys/module/prototype/parameters/VCACHE_KB.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/* Library header */
+#include "kvlib.h"
+#include "bench.h"
+
+#define NB_GETS 100000
+#define NB_KEYS 2000
+#define NB_HOT 16	/* keys getting 9 gets out of 10 */
+#define VAL_LEN 200
+#define VC_PARAM "/sys/module/prototype/parameters/VCACHE_KB"
+
+/* VCACHE_KB module parameter, returns -1 if it cannot be set */
+static int set_cache_kb(int kb)
+{
+	FILE *f = fopen(VC_PARAM, "w");
+
+	if (!f)
+		return -1;
+	fprintf(f, "%d\n", kb);
+	return fclose(f) ? -1 : 0;
+}
+
+static int val_of(char *val, int i, int ver)
+{
+	int n = sprintf(val, "val%d_%d_", i, ver);
+
+	memset(val + n, 'a' + i % 26, VAL_LEN - n);
+	val[VAL_LEN] = '\0';
+	return VAL_LEN;
+}
+
+/* value of key i, version ver, read back */
+static int check(kvlib_ctx *ctx, int i, int ver)
+{
+	char key[64], val[VAL_LEN + 1], buffer[KVLIB_VAL_MAX + 1];
+	int key_len = sprintf(key, "key%d", i);
+
+	val_of(val, i, ver);
+	return kvlib_ctx_get(ctx, key, key_len, buffer, sizeof(buffer)) != 0 ||
+	       strcmp(buffer, val) != 0;
+}
+
+static int run(kvlib_ctx *ctx, int kb, int nb_gets)
+{
+	int i, k, key_len, errors = 0;
+	char key[64], val[VAL_LEN + 1], buffer[KVLIB_VAL_MAX + 1];
+	struct timespec start, stop;
+	kv_core_stats before, after;
+	unsigned long long hits, misses;
+
+	if (set_cache_kb(kb) != 0) {
+		printf("%-8d cannot set %s\n", kb, VC_PARAM);
+		return 0;
+	}
+	if (kvlib_format() != 0)
+		return 1;
+	for (i = 0; i < NB_KEYS; i++) {
+		key_len = sprintf(key, "key%d", i);
+		val_of(val, i, 0);
+		if (kvlib_ctx_set(ctx, key, key_len, val, VAL_LEN) != 0)
+			errors++;
+	}
+	if (kvlib_sync(ctx) != 0)
+		errors++;
+
+	srand(1);
+	kvlib_core_stats(ctx, &before);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_gets; i++) {
+		k = (rand() % 10) ? rand() % NB_HOT : rand() % NB_KEYS;
+		key_len = sprintf(key, "key%d", k);
+		if (kvlib_ctx_get(ctx, key, key_len, buffer, sizeof(buffer)) != 0)
+			errors++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	kvlib_core_stats(ctx, &after);
+
+	/* the hot keys change, in the open page and on flash */
+	for (i = 0; i < NB_HOT; i++) {
+		key_len = sprintf(key, "key%d", i);
+		val_of(val, i, 1);
+		if (kvlib_ctx_set(ctx, key, key_len, val, VAL_LEN) != 0)
+			errors++;
+		errors += check(ctx, i, 1);
+	}
+	if (kvlib_sync(ctx) != 0)
+		errors++;
+	for (i = 0; i < NB_KEYS; i++)
+		errors += check(ctx, i, i < NB_HOT ? 1 : 0);
+
+	hits = after.nb_vc_hits - before.nb_vc_hits;
+	misses = after.nb_vc_misses - before.nb_vc_misses;
+	printf("%-8d %-12.0f %-8.1f %-10lld %d\n", kb,
+	       nb_gets / elapsed_s(&start, &stop),
+	       hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+	       after.vc_bytes, errors);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	int budgets[] = { 0, 16, 1024 };
+	int i, ret = 0, nb_gets = NB_GETS;
+	int nb = sizeof(budgets) / sizeof(budgets[0]);
+	kvlib_ctx *ctx;
+
+	if (argc >= 2)
+		nb_gets = atoi(argv[1]);
+	if (nb_gets < 1)
+		nb_gets = 1;
+
+	printf("=============================\n");
+	printf("=== VALUE CACHE benchmark ===\n");
+	printf("=============================\n");
+
+	ctx = kvlib_open();
+	if (!ctx) {
+		printf("kvlib_open failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%d keys of %d bytes, %d gets, 90%% on %d keys\n", NB_KEYS,
+	       VAL_LEN, nb_gets, NB_HOT);
+	printf("cache KB gets/sec     hit %%    bytes      errors (should be 0)\n");
+	for (i = 0; i < nb; i++)
+		ret += run(ctx, budgets[i], nb_gets);
+	/* back to the default budget */
+	set_cache_kb(1024);
+
+	kvlib_close(ctx);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
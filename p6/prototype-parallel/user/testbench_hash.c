@@ -0,0 +1,344 @@
+/**
+ * Microbenchmark of the in-RAM index, in user space: hashes and looks up 1M
+ * keys with the old path (byte-at-a-time djb2, linear probing with a sticky
+ * dirty flag and a strcmp on every probe) and with the new one (8 bytes at
+ * a time hashing, Robin Hood buckets with 7-bit fingerprint control bytes
+ * matched 8 at a time, compact entries with the keys in a separate arena).
+ * The hashing and control byte code is the kernel's, see kernel/hashfn.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../kernel/hashfn.h"
+#include "bench.h"
+
+#define NB_KEYS 1000000
+#define KEY_LEN 88
+
+/* old kernel bucket layout, hash is the dirty flag */
+typedef struct {
+	unsigned int hash;
+	int index;
+	int p_state;
+	void *b_state;
+	char key[KEY_LEN];
+} old_bucket;
+
+/* same layout as the kernel buckets */
+typedef struct {
+	unsigned int hash;
+	int index;
+	unsigned int key_ofs;
+	unsigned short key_len;
+	unsigned char p_state;
+	unsigned char pad;
+} bucket;
+
+static int table_size;
+static void *table;
+static char *keys;
+
+static const char *key_of(int i)
+{
+	return keys + (size_t)i * 32;
+}
+
+/* ---- old path (baseline hash.c) ---- */
+
+static unsigned int old_hash(const char *str)
+{
+	unsigned int hash = 5381;
+	int c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + c;
+
+	return hash % table_size;
+}
+
+static int old_add(const char *key, int index)
+{
+	old_bucket *t = table;
+	int i = old_hash(key), count = 0;
+
+	while (t[i].p_state) {
+		t[i].hash = 1;	/* dirty */
+		if (count == table_size - 1)
+			return -1;
+		i = (i + 1) % table_size;
+		count++;
+	}
+	t[i].p_state = 1;
+	strcpy(t[i].key, key);
+	t[i].index = index;
+	return i;
+}
+
+static int old_search(const char *key)
+{
+	old_bucket *t = table;
+	int i = old_hash(key), counter = 0;
+
+	while (1) {
+		if (counter == table_size - 1)
+			return -1;
+		if (t[i].p_state && !strcmp(t[i].key, key))
+			return i;
+		if (t[i].hash == 0)
+			return -2;
+		i = (i + 1) % table_size;
+		counter++;
+	}
+}
+
+/* ---- new path (kernel hash.c, one segment) ---- */
+
+static u8 *ctrl;
+static int maxd;
+static char *arena;
+static unsigned int arena_used;
+
+static int home(unsigned int h)
+{
+	return h % table_size;
+}
+
+static int dist(int slot, unsigned int h)
+{
+	return (slot - home(h) + table_size) % table_size;
+}
+
+static void set_ctrl(int slot, u8 v)
+{
+	ctrl[slot] = v;
+	if (slot < CTRL_GROUP)
+		ctrl[table_size + slot] = v;
+}
+
+static int new_add(const char *key, int index)
+{
+	bucket *t = table, cur, tmp;
+	int len = strlen(key);
+	unsigned int h = kv_hash(key, len);
+	int slot = home(h), d, dd = 0, ret = -1;
+
+	memcpy(arena + arena_used, key, len);
+	cur.p_state = 1;
+	cur.hash = h;
+	cur.index = index;
+	cur.key_ofs = arena_used;
+	cur.key_len = len;
+	arena_used += len;
+
+	while (1) {
+		if (!t[slot].p_state) {
+			t[slot] = cur;
+			set_ctrl(slot, ctrl_h7(cur.hash));
+			if (ret < 0)
+				ret = slot;
+			break;
+		}
+		d = dist(slot, t[slot].hash);
+		if (d < dd) {
+			tmp = t[slot];
+			t[slot] = cur;
+			set_ctrl(slot, ctrl_h7(cur.hash));
+			cur = tmp;
+			if (ret < 0)
+				ret = slot;
+			if (dd > maxd)
+				maxd = dd;
+			dd = d;
+		}
+		slot = (slot + 1) % table_size;
+		dd++;
+	}
+	if (dd > maxd)
+		maxd = dd;
+	return ret;
+}
+
+static int new_search(const char *key)
+{
+	bucket *t = table;
+	int len = strlen(key);
+	unsigned int h = kv_hash(key, len);
+	int slot = home(h), scanned = 0, i, stop;
+	u8 h7 = ctrl_h7(h);
+	u64 w, match, empty;
+
+	while (scanned <= maxd) {
+		w = kv_load64(ctrl + slot);
+		match = ctrl_match(w, h7);
+		empty = ctrl_empty(w);
+		stop = empty ? ctrl_first(empty) : 8;
+		if (stop < 8)
+			match &= (1ULL << (stop * 8)) - 1;
+		while (match) {
+			int s;
+
+			i = ctrl_first(match);
+			match &= match - 1;
+			s = (slot + i) % table_size;
+			if (t[s].hash == h && t[s].key_len == len &&
+			    !memcmp(arena + t[s].key_ofs, key, len))
+				return s;
+		}
+		if (stop < 8)
+			break;
+		scanned += 8;
+		slot = (slot + 8) % table_size;
+	}
+	return -1;
+}
+
+static void new_del(int slot)
+{
+	bucket *t = table;
+	int next;
+
+	while (1) {
+		next = (slot + 1) % table_size;
+		if (!t[next].p_state || dist(next, t[next].hash) == 0)
+			break;
+		t[slot] = t[next];
+		set_ctrl(slot, ctrl[next]);
+		slot = next;
+	}
+	t[slot].p_state = 0;
+	set_ctrl(slot, CTRL_EMPTY);
+}
+
+/* ---- driver ---- */
+
+static int new_index(int slot)
+{
+	return ((bucket *)table)[slot].index;
+}
+
+struct ops {
+	const char *name;
+	size_t entry_size;
+	int (*add)(const char *, int);
+	int (*search)(const char *);
+	void (*del)(int);
+	int (*index)(int);
+};
+
+static void old_del(int slot)
+{
+	/* what invalid_pg() used to do: the dirty flag stays */
+	((old_bucket *)table)[slot].p_state = 0;
+}
+
+static int old_index(int slot)
+{
+	return ((old_bucket *)table)[slot].index;
+}
+
+static int run(struct ops *o, int nb_keys)
+{
+	struct timespec start, stop;
+	int i, errors = 0;
+
+	table = calloc(table_size, o->entry_size);
+	if (!table)
+		return -1;
+	maxd = 0;
+	arena_used = 0;
+	memset(ctrl, CTRL_EMPTY, table_size + CTRL_GROUP);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_keys; i++)
+		if (o->add(key_of(i), i) < 0)
+			errors++;
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	printf("%s insert: %.1f ns/key\n", o->name,
+	       elapsed_ns(&start, &stop) / nb_keys);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_keys; i++) {
+		int s = o->search(key_of(i));
+
+		if (s < 0 || o->index(s) != i)
+			errors++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	printf("%s lookup (hit): %.1f ns/key\n", o->name,
+	       elapsed_ns(&start, &stop) / nb_keys);
+
+	/* delete every other key, then look the deleted ones up */
+	for (i = 0; i < nb_keys; i += 2)
+		o->del(o->search(key_of(i)));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_keys; i += 2)
+		if (o->search(key_of(i)) >= 0)
+			errors++;
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	printf("%s lookup (miss after deletes): %.1f ns/key\n", o->name,
+	       elapsed_ns(&start, &stop) / (nb_keys / 2));
+
+	if (o->entry_size == sizeof(bucket))
+		printf("%s RAM: %zu bytes per entry + %.1f bytes of key\n", o->name,
+		       o->entry_size, (double)arena_used / nb_keys);
+	else
+		printf("%s RAM: %zu bytes per entry\n", o->name, o->entry_size);
+
+	free(table);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, nb_keys = NB_KEYS, errors;
+	struct timespec start, stop;
+	unsigned int sum = 0;
+	struct ops old_ops = { "old", sizeof(old_bucket), old_add, old_search,
+			       old_del, old_index };
+	struct ops new_ops = { "new", sizeof(bucket), new_add, new_search,
+			       new_del, new_index };
+
+	if (argc == 2)
+		nb_keys = atoi(argv[1]);
+	table_size = nb_keys + nb_keys / 4;
+	if (table_size < CTRL_GROUP)
+		table_size = CTRL_GROUP;
+
+	printf("===========================\n");
+	printf("=== HASHTABLE benchmark ===\n");
+	printf("===========================\n");
+	printf("%d keys, %d buckets\n", nb_keys, table_size);
+
+	keys = malloc((size_t)nb_keys * 32);
+	ctrl = malloc(table_size + CTRL_GROUP);
+	arena = malloc((size_t)nb_keys * 32);
+	if (!keys || !ctrl || !arena)
+		return EXIT_FAILURE;
+	for (i = 0; i < nb_keys; i++)
+		snprintf(keys + (size_t)i * 32, 32, "user:%010d:profile", i);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_keys; i++)
+		sum += old_hash(key_of(i));
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	printf("old hash: %.1f ns/key\n", elapsed_ns(&start, &stop) / nb_keys);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_keys; i++)
+		sum += kv_hash(key_of(i), strlen(key_of(i)));
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	printf("new hash: %.1f ns/key (%u)\n", elapsed_ns(&start, &stop) / nb_keys,
+	       sum & 1);
+
+	errors = run(&old_ops, nb_keys);
+	errors += run(&new_ops, nb_keys);
+	printf("errors: %d (should be 0)\n", errors);
+
+	free(arena);
+	free(ctrl);
+	free(keys);
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+/**
+ * Large values: values of several flash pages are stored as single
+ * multi-page couples (extent pages, read back with one MTD read per run of
+ * pages) and, as before, sharded by the application into couples of at most
+ * a page, one key per shard. Reports the set and get throughput of both and
+ * checks the values read back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/* Library header */
+#include "kvlib.h"
+#include "bench.h"
+
+#define NB_VALS 32
+#define SHARD 1900	/* value bytes of a shard, a shard fits in a page */
+
+static void fill(char *val, int val_len, int i)
+{
+	int j;
+
+	for (j = 0; j < val_len; j++)
+		val[j] = 'a' + (i + j) % 26;
+}
+
+/* nb values of val_len bytes, whole or in shards of SHARD bytes */
+static int run(kvlib_ctx *ctx, int nb, int val_len, int sharded,
+	       char *val, char *buffer)
+{
+	int i, ofs, len, key_len, errors = 0;
+	char key[64];
+	struct timespec start, mid, stop;
+	double mb = (double)nb * val_len / (1024 * 1024);
+
+	if (kvlib_format() != 0)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb; i++) {
+		fill(val, val_len, i);
+		if (!sharded) {
+			key_len = sprintf(key, "key%d", i);
+			if (kvlib_ctx_set(ctx, key, key_len, val, val_len) != 0)
+				errors++;
+			continue;
+		}
+		for (ofs = 0; ofs < val_len; ofs += SHARD) {
+			key_len = sprintf(key, "key%d.%d", i, ofs / SHARD);
+			len = val_len - ofs < SHARD ? val_len - ofs : SHARD;
+			if (kvlib_ctx_set(ctx, key, key_len, val + ofs, len) != 0)
+				errors++;
+		}
+	}
+	if (kvlib_sync(ctx) != 0)
+		errors++;
+	clock_gettime(CLOCK_MONOTONIC, &mid);
+
+	for (i = 0; i < nb; i++) {
+		if (!sharded) {
+			key_len = sprintf(key, "key%d", i);
+			if (kvlib_ctx_get(ctx, key, key_len, buffer,
+					  KV_VAL_MAX + 1) != 0)
+				errors++;
+		}
+		for (ofs = 0; sharded && ofs < val_len; ofs += SHARD) {
+			key_len = sprintf(key, "key%d.%d", i, ofs / SHARD);
+			if (kvlib_ctx_get(ctx, key, key_len, buffer + ofs,
+					  KV_VAL_MAX + 1 - ofs) != 0)
+				errors++;
+		}
+		fill(val, val_len, i);
+		if (memcmp(buffer, val, val_len))
+			errors++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	printf("%-7d %-8s %-10.2f %-10.2f %d\n", val_len,
+	       sharded ? "sharded" : "whole", mb / elapsed_s(&start, &mid),
+	       mb / elapsed_s(&mid, &stop), errors);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	int sizes[] = { 4096, 16384, 61440 };
+	int i, ret = 0, nb_vals = NB_VALS;
+	int nb = sizeof(sizes) / sizeof(sizes[0]);
+	char *val, *buffer;
+	kvlib_ctx *ctx;
+
+	if (argc >= 2)
+		nb_vals = atoi(argv[1]);
+	if (nb_vals < 1)
+		nb_vals = 1;
+
+	printf("==============================\n");
+	printf("=== LARGE VALUES benchmark ===\n");
+	printf("==============================\n");
+
+	val = malloc(KV_VAL_MAX + 1);
+	buffer = malloc(KV_VAL_MAX + 1);
+	ctx = kvlib_open();
+	if (!val || !buffer || !ctx) {
+		printf("kvlib_open failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%d values per run, %d bytes shards\n", nb_vals, SHARD);
+	printf("value   layout   set MB/s   get MB/s   errors (should be 0)\n");
+	for (i = 0; i < nb; i++) {
+		ret += run(ctx, nb_vals, sizes[i], 0, val, buffer);
+		ret += run(ctx, nb_vals, sizes[i], 1, val, buffer);
+	}
+
+	kvlib_close(ctx);
+	free(val);
+	free(buffer);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+/**
+ * Foreground latency under GC: a small set of keys is overwritten over and
+ * over so that blocks keep filling up with invalid pages, and the latency of
+ * every set (and of a get after it) is recorded. The run is made with GC and
+ * checkpoints done by the writer that crosses their threshold
+ * (GC_FOREGROUND=1, the old behaviour) and by the flush/GC workqueue
+ * (GC_FOREGROUND=0), when the module parameter can be changed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/* Library header */
+#include "kvlib.h"
+#include "bench.h"
+
+#define NB_OPS 20000
+#define NB_KEYS 32
+#define GC_PARAM "/sys/module/prototype/parameters/GC_FOREGROUND"
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+static void print_lat(const char *label, double *lat, int nb)
+{
+	double sum = 0;
+	int i;
+
+	for (i = 0; i < nb; i++)
+		sum += lat[i];
+	qsort(lat, nb, sizeof(double), cmp_double);
+	printf("  %s latency (us): avg %.1f p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+	       label, sum / nb, lat[nb / 2], lat[nb * 99 / 100],
+	       lat[nb * 999 / 1000], lat[nb - 1]);
+}
+
+/* GC_FOREGROUND module parameter, returns -1 if it cannot be set */
+static int set_gc_mode(int foreground)
+{
+	FILE *f = fopen(GC_PARAM, "w");
+
+	if (!f)
+		return -1;
+	fprintf(f, "%d\n", foreground);
+	return fclose(f) ? -1 : 0;
+}
+
+/* nb_ops overwrites of NB_KEYS keys, each followed by a get of the key */
+static int run(kvlib_ctx *ctx, int nb_ops, const char *label)
+{
+	int i, len, val_len, errors = 0;
+	char key[64], val[64], buffer[KVLIB_VAL_MAX + 1];
+	struct timespec start, stop;
+	kv_core_stats before, after;
+	double *set_lat, *get_lat;
+
+	set_lat = malloc(nb_ops * sizeof(double));
+	get_lat = malloc(nb_ops * sizeof(double));
+	if (!set_lat || !get_lat)
+		return -1;
+
+	if (kvlib_format() != 0)
+		errors++;
+	kvlib_core_stats(ctx, &before);
+
+	for (i = 0; i < nb_ops; i++) {
+		len = sprintf(key, "lat_key%d", i % NB_KEYS);
+		val_len = sprintf(val, "lat_val%d", i);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (kvlib_ctx_set(ctx, key, len, val, val_len) != 0)
+			errors++;
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		set_lat[i] = elapsed_us(&start, &stop);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (kvlib_ctx_get(ctx, key, len, buffer, sizeof(buffer)) != 0 ||
+		    strcmp(buffer, val))
+			errors++;
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		get_lat[i] = elapsed_us(&start, &stop);
+	}
+
+	kvlib_core_stats(ctx, &after);
+	printf("%s\n", label);
+	print_lat("set", set_lat, nb_ops);
+	print_lat("get", get_lat, nb_ops);
+	printf("  %llu GC passes (max %llu us), %llu checkpoints (max %llu us),"
+	       " %d errors (should be 0)\n",
+	       after.nb_gc - before.nb_gc, after.gc_max_us,
+	       after.nb_ckpt - before.nb_ckpt, after.ckpt_max_us, errors);
+
+	free(set_lat);
+	free(get_lat);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = 0, nb_ops = NB_OPS;
+	kvlib_ctx *ctx;
+
+	if (argc >= 2)
+		nb_ops = atoi(argv[1]);
+	if (nb_ops < 1)
+		nb_ops = 1;
+
+	printf("================================\n");
+	printf("=== LATENCY UNDER GC benchmark ===\n");
+	printf("================================\n");
+
+	ctx = kvlib_open();
+	if (!ctx) {
+		printf("kvlib_open failed\n");
+		return EXIT_FAILURE;
+	}
+
+	if (set_gc_mode(1) == 0) {
+		ret += run(ctx, nb_ops, "GC in the writer's context:");
+		set_gc_mode(0);
+		ret += run(ctx, nb_ops, "GC on the workqueue:");
+	} else {
+		printf("cannot write %s, current mode only\n", GC_PARAM);
+		ret += run(ctx, nb_ops, "current GC mode:");
+	}
+
+	kvlib_close(ctx);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,99 @@
+/**
+ * Multi-process stress test: several processes open the virtual device at
+ * the same time and hammer it with sets and gets on their own keys. Reports
+ * the aggregate throughput.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+/* Library header */
+#include "kvlib.h"
+
+#define NB_PROCS 4
+#define NB_OPS 2000
+
+static int worker(int id, int nb_ops)
+{
+	int i, len, val_len, errors = 0;
+	char key[128], val[128], buffer[KVLIB_VAL_MAX + 1];
+	kv_stats stats;
+	kvlib_ctx *ctx;
+
+	ctx = kvlib_open();
+	if (!ctx) {
+		printf("[%d] kvlib_open failed\n", id);
+		return 1;
+	}
+
+	for (i = 0; i < nb_ops; i++) {
+		len = sprintf(key, "p%d_key%d", id, i);
+		val_len = sprintf(val, "p%d_val%d", id, i);
+		if (kvlib_ctx_set(ctx, key, len, val, val_len) != 0)
+			errors++;
+	}
+
+	for (i = 0; i < nb_ops; i++) {
+		len = sprintf(key, "p%d_key%d", id, i);
+		sprintf(val, "p%d_val%d", id, i);
+		if (kvlib_ctx_get(ctx, key, len, buffer, sizeof(buffer)) != 0
+		    || strcmp(buffer, val))
+			errors++;
+	}
+
+	kvlib_stats(ctx, &stats);
+	printf("[%d] set %llu get %llu err %llu, %d mismatches/errors\n", id,
+	       stats.nb_set, stats.nb_get, stats.nb_err, errors);
+
+	kvlib_close(ctx);
+	return errors ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, status, failed = 0;
+	int nb_procs = NB_PROCS, nb_ops = NB_OPS;
+	struct timespec start, stop;
+	double t;
+
+	if (argc >= 2)
+		nb_procs = atoi(argv[1]);
+	if (argc >= 3)
+		nb_ops = atoi(argv[2]);
+
+	printf("=============================\n");
+	printf("=== MULTI-PROCESS test ===\n");
+	printf("=============================\n");
+	printf("%d processes x %d sets + %d gets\n", nb_procs, nb_ops, nb_ops);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_procs; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror("fork");
+			return EXIT_FAILURE;
+		}
+		if (pid == 0)
+			exit(worker(i, nb_ops));
+	}
+
+	for (i = 0; i < nb_procs; i++) {
+		wait(&status);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	t = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1.0e9;
+	printf("%d/%d processes OK (should be %d)\n", nb_procs - failed,
+	       nb_procs, nb_procs);
+	printf("aggregate: %.0f ops/s (%d ops in %.3fs)\n",
+	       2.0 * nb_procs * nb_ops / t, 2 * nb_procs * nb_ops, t);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,108 @@
+/**
+ * Per-operation cost of the single set/get/del ioctls: the same short key
+ * is passed by pointer (the kernel copies the keyval, then the key) and
+ * inline in the keyval (a single copy). Reports the nanoseconds, and the
+ * TSC cycles on x86, per operation: a get hit, a get miss, a del miss and an
+ * overwrite. Run it on the previous module as well to see what the
+ * allocations of the old data path (a page buffer per get) cost.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles() __rdtsc()
+#else
+#define cycles() 0ULL
+#endif
+/* Library header */
+#include "kvlib.h"
+#include "bench.h"
+
+#define NB_OPS 100000
+
+enum { GET_HIT, GET_MISS, DEL_MISS, SET, NB_KINDS };
+static const char *kinds[] = { "get hit", "get miss", "del miss", "overwrite" };
+
+/* nb_ops operations of kind, returns the errors */
+static int run(int fd, int kind, int inline_key, int nb_ops)
+{
+	char key[] = "key1", miss[] = "nokey", val[] = "val1";
+	char buffer[64];
+	struct timespec start, stop;
+	unsigned long long c0, c1;
+	int i, errors = 0;
+	unsigned long cmd;
+	keyval kv;
+
+	memset(&kv, 0, sizeof(kv));
+	kv.key = (kind == GET_HIT || kind == SET) ? key : miss;
+	kv.key_len = strlen(kv.key);
+	if (inline_key) {
+		memcpy(kv.key_inline, kv.key, kv.key_len);
+		kv.key = NULL;
+	}
+	cmd = (kind == SET) ? IOCTL_SET : (kind == DEL_MISS) ? IOCTL_DEL : IOCTL_GET;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	c0 = cycles();
+	for (i = 0; i < nb_ops; i++) {
+		if (kind == SET) {
+			kv.val = val;
+			kv.val_len = strlen(val);
+		} else {
+			kv.val = buffer;
+			kv.val_len = sizeof(buffer);
+		}
+		if (ioctl(fd, cmd, &kv) != 0 ||
+		    (kind == GET_HIT || kind == SET ? kv.status < 0 : kv.status != -1))
+			errors++;
+	}
+	c1 = cycles();
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	printf("%-10s %-8s %-10.0f %.0f\n", kinds[kind],
+	       inline_key ? "inline" : "pointer",
+	       elapsed_ns(&start, &stop) / nb_ops, (double)(c1 - c0) / nb_ops);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	int fd, kind, errors = 0, nb_ops = NB_OPS;
+
+	if (argc >= 2)
+		nb_ops = atoi(argv[1]);
+	if (nb_ops < 1)
+		nb_ops = 1;
+
+	printf("================================\n");
+	printf("=== OPERATION COST benchmark ===\n");
+	printf("================================\n");
+
+	if (kvlib_format() != 0 || kvlib_set("key1", "val1") != 0) {
+		printf("format/set failed\n");
+		return EXIT_FAILURE;
+	}
+	fd = open(DEVICE_NAME, 0);
+	if (fd < 0) {
+		printf("cannot open %s\n", DEVICE_NAME);
+		return EXIT_FAILURE;
+	}
+
+	printf("%d operations per run\n", nb_ops);
+	printf("operation  key      ns/op      cycles/op\n");
+	for (kind = 0; kind < NB_KINDS; kind++) {
+		errors += run(fd, kind, 0, nb_ops);
+		errors += run(fd, kind, 1, nb_ops);
+	}
+	printf("errors: %d (should be 0)\n", errors);
+
+	close(fd);
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
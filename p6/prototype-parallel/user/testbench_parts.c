@@ -0,0 +1,177 @@
+/**
+ * Store striped on several data partitions (MTD_INDEX=a,b,...): batched sets
+ * from one process (split by partition in the kernel and written by the
+ * partition workers), then single sets from several processes, then gets
+ * of everything. Reports ops/sec and the data pages each partition
+ * programmed meanwhile. Run it once with the module loaded on a single
+ * partition and once on several ones of the same size, and compare.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+/* Library header */
+#include "kvlib.h"
+#include "bench.h"
+
+#define NB_PROCS 4
+#define NB_KEYS 1024
+#define BATCH 64
+#define VAL_LEN 512
+
+static void key_val(int id, int i, char *key, char *val)
+{
+	sprintf(key, "part%d_key%d", id, i);
+	memset(val, 'a' + (i + id) % 26, VAL_LEN);
+	sprintf(val, "part%d_val%d_", id, i);
+	val[strlen(val)] = '#';
+	val[VAL_LEN] = '\0';
+}
+
+/* single sets of its own keys, from a session of its own */
+static int worker(int id, int nb_keys)
+{
+	int i, errors = 0;
+	char key[64], val[VAL_LEN + 1];
+	kvlib_ctx *ctx;
+
+	ctx = kvlib_open();
+	if (!ctx) {
+		printf("[%d] kvlib_open failed\n", id);
+		return 1;
+	}
+	for (i = 0; i < nb_keys; i++) {
+		key_val(id, i, key, val);
+		if (kvlib_ctx_set(ctx, key, strlen(key), val, VAL_LEN) != 0)
+			errors++;
+	}
+	kvlib_close(ctx);
+	return errors ? 1 : 0;
+}
+
+/* gets of the keys of procs 0 (the batched sets) to nb_procs */
+static int check(kvlib_ctx *ctx, int nb_procs, int nb_keys)
+{
+	int id, i, bad = 0;
+	char key[64], val[VAL_LEN + 1], buffer[KVLIB_VAL_MAX + 1];
+
+	for (id = 0; id <= nb_procs; id++)
+		for (i = 0; i < nb_keys; i++) {
+			key_val(id, i, key, val);
+			if (kvlib_ctx_get(ctx, key, strlen(key), buffer,
+					  sizeof(buffer)) != 0 ||
+			    strcmp(buffer, val))
+				bad++;
+		}
+	return bad;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, j, id, ret, status, failed = 0, bad;
+	int nb_procs = NB_PROCS, nb_keys = NB_KEYS;
+	static char keys[BATCH][64], vals[BATCH][VAL_LEN + 1];
+	kvlib_item items[BATCH];
+	kv_core_stats before, after;
+	struct timespec start, stop;
+	double t_batch, t_multi, t_get;
+	kvlib_ctx *ctx;
+
+	if (argc >= 2)
+		nb_procs = atoi(argv[1]);
+	if (argc >= 3)
+		nb_keys = atoi(argv[2]) / BATCH * BATCH;
+	if (nb_procs < 1 || nb_keys < BATCH) {
+		printf("usage: %s [nb_procs] [nb_keys >= %d]\n", argv[0], BATCH);
+		return EXIT_FAILURE;
+	}
+
+	printf("=============================\n");
+	printf("=== PARTITIONS test ===\n");
+	printf("=============================\n");
+
+	ctx = kvlib_open();
+	if (!ctx) {
+		printf("kvlib_open failed\n");
+		return EXIT_FAILURE;
+	}
+	if (kvlib_core_stats(ctx, &before) != 0) {
+		printf("kvlib_core_stats failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("%d data partition(s), %d keys of %d bytes per writer\n",
+	       before.nb_parts, nb_keys, VAL_LEN);
+
+	/* 1. batched sets: every batch is written by the partitions at the
+	 * same time */
+	ret = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_keys; i += BATCH) {
+		for (j = 0; j < BATCH; j++) {
+			key_val(0, i + j, keys[j], vals[j]);
+			items[j].key = keys[j];
+			items[j].key_len = strlen(keys[j]);
+			items[j].val = vals[j];
+			items[j].val_len = VAL_LEN;
+		}
+		ret += kvlib_mset(ctx, items, BATCH);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	t_batch = elapsed_s(&start, &stop);
+	printf("kvlib_mset: %d sets OK (should be %d)\n", ret, nb_keys);
+
+	/* 2. single sets from nb_procs sessions */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (id = 1; id <= nb_procs; id++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror("fork");
+			return EXIT_FAILURE;
+		}
+		if (pid == 0)
+			exit(worker(id, nb_keys));
+	}
+	for (id = 1; id <= nb_procs; id++) {
+		wait(&status);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	t_multi = elapsed_s(&start, &stop);
+	printf("%d/%d writers OK (should be %d)\n", nb_procs - failed, nb_procs,
+	       nb_procs);
+
+	/* 3. every value read back */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bad = check(ctx, nb_procs, nb_keys);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	t_get = elapsed_s(&start, &stop);
+	printf("gets: %d bad values (should be 0)\n", bad);
+
+	kvlib_core_stats(ctx, &after);
+	printf("\nbatched sets: %.0f op/s\n", nb_keys / t_batch);
+	printf("single sets, %d writers: %.0f op/s\n", nb_procs,
+	       (double)nb_procs * nb_keys / t_multi);
+	printf("gets: %.0f op/s\n", (nb_procs + 1.0) * nb_keys / t_get);
+	for (i = 0; i < after.nb_parts && i < KV_PARTS_MAX; i++)
+		printf("partition %d: %llu data pages programmed, %llu GC passes,"
+		       " %d/%d blocks free\n", i,
+		       after.parts[i].nb_data_pgs - before.parts[i].nb_data_pgs,
+		       after.parts[i].nb_gc - before.parts[i].nb_gc,
+		       after.parts[i].nb_free_blks, after.parts[i].nb_blocks);
+
+	/* leave the store as it was */
+	for (id = 0; id <= nb_procs; id++)
+		for (i = 0; i < nb_keys; i++) {
+			key_val(id, i, keys[0], vals[0]);
+			kvlib_ctx_del(ctx, keys[0], strlen(keys[0]));
+		}
+
+	kvlib_close(ctx);
+	return (failed || bad || ret != nb_keys) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,146 @@
+/**
+ * Mixed read/write benchmark: measures the latency of gets on a set of
+ * preloaded keys, first alone and then while several processes keep
+ * overwriting their own keys (set storm).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+/* Library header */
+#include "kvlib.h"
+#include "bench.h"
+
+#define NB_WRITERS 4
+#define NB_READS 5000
+#define NB_KEYS 64
+/* small per-writer key set: the storm overwrites, GC keeps up with it */
+#define NB_WKEYS 16
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+/* keep overwriting NB_WKEYS keys of our own until killed */
+static void writer(int id)
+{
+	int i, len, val_len;
+	char key[128], val[128];
+	kvlib_ctx *ctx;
+
+	ctx = kvlib_open();
+	if (!ctx)
+		exit(1);
+
+	for (i = 0; ; i++) {
+		len = sprintf(key, "w%d_key%d", id, i % NB_WKEYS);
+		val_len = sprintf(val, "w%d_val%d", id, i);
+		kvlib_ctx_set(ctx, key, len, val, val_len);
+	}
+}
+
+/* nb_reads gets on the preloaded keys, prints the latency distribution */
+static int reader(kvlib_ctx *ctx, int nb_reads, const char *label)
+{
+	int i, len, errors = 0;
+	char key[128], val[128], buffer[KVLIB_VAL_MAX + 1];
+	struct timespec start, stop;
+	double *lat, sum = 0;
+
+	lat = malloc(nb_reads * sizeof(double));
+	if (!lat)
+		return -1;
+
+	for (i = 0; i < nb_reads; i++) {
+		len = sprintf(key, "r_key%d", i % NB_KEYS);
+		sprintf(val, "r_val%d", i % NB_KEYS);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (kvlib_ctx_get(ctx, key, len, buffer, sizeof(buffer)) != 0
+		    || strcmp(buffer, val))
+			errors++;
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		lat[i] = elapsed_us(&start, &stop);
+		sum += lat[i];
+	}
+
+	qsort(lat, nb_reads, sizeof(double), cmp_double);
+	printf("%-14s get latency (us): avg %.1f p50 %.1f p99 %.1f max %.1f,"
+	       " %d errors (should be 0)\n", label, sum / nb_reads,
+	       lat[nb_reads / 2], lat[nb_reads * 99 / 100], lat[nb_reads - 1],
+	       errors);
+
+	free(lat);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, ret, len, val_len;
+	int nb_writers = NB_WRITERS, nb_reads = NB_READS;
+	char key[128], val[128];
+	pid_t pids[64];
+	kvlib_ctx *ctx;
+
+	if (argc >= 2)
+		nb_writers = atoi(argv[1]);
+	if (argc >= 3)
+		nb_reads = atoi(argv[2]);
+	if (nb_writers > 64)
+		nb_writers = 64;
+
+	printf("==================================\n");
+	printf("=== MIXED READ/WRITE benchmark ===\n");
+	printf("==================================\n");
+
+	ret = kvlib_format();
+	printf("Formatting done:\n");
+	printf(" returns: %d (should be 0)\n", ret);
+
+	ctx = kvlib_open();
+	if (!ctx) {
+		printf("kvlib_open failed\n");
+		return EXIT_FAILURE;
+	}
+
+	ret = 0;
+	for (i = 0; i < NB_KEYS; i++) {
+		len = sprintf(key, "r_key%d", i);
+		val_len = sprintf(val, "r_val%d", i);
+		ret += kvlib_ctx_set(ctx, key, len, val, val_len);
+	}
+	printf("Preloading %d keys returns: %d (should be 0)\n", NB_KEYS, ret);
+
+	ret = reader(ctx, nb_reads, "reads alone:");
+
+	for (i = 0; i < nb_writers; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			perror("fork");
+			nb_writers = i;
+			break;
+		}
+		if (pids[i] == 0)
+			writer(i);
+	}
+
+	/* let the storm start */
+	usleep(100000);
+	printf("%d writer processes running\n", nb_writers);
+	ret += reader(ctx, nb_reads, "under sets:");
+
+	for (i = 0; i < nb_writers; i++) {
+		kill(pids[i], SIGKILL);
+		waitpid(pids[i], NULL, 0);
+	}
+
+	kvlib_close(ctx);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,174 @@
+/**
+ * Range scans over the ordered index: keys of two prefixes are written in
+ * random order (so that key order is not flash order), then read back with
+ * kvlib_scan_next() in batches: the whole store keys only, a key range with
+ * the values, and a prefix. Checks the order, the count and the values, and
+ * compares the keys/sec of a scan with values (the kernel reads the pages of
+ * a batch in page order) with single gets of the same keys in key order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/* Library header */
+#include "kvlib.h"
+#include "bench.h"
+
+#define NB_KEYS 4000	/* per prefix */
+#define VAL_LEN 100
+#define BATCH 64
+
+static int nb_keys = NB_KEYS;
+
+static int key_of(char *key, const char *prefix, int i)
+{
+	return sprintf(key, "%s%06d", prefix, i);
+}
+
+static int val_of(char *val, const char *key)
+{
+	int n = sprintf(val, "val_%s_", key);
+
+	memset(val + n, 'a' + n % 26, VAL_LEN - n);
+	val[VAL_LEN] = '\0';
+	return VAL_LEN;
+}
+
+/* scan [start, end), or the keys starting with start: they must be the
+ * keys of prefix numbered from first on, in order (and their values), or
+ * with prefix NULL every key of the store. Returns the errors, the number
+ * of keys goes to *nb */
+static int scan(kvlib_ctx *ctx, const char *prefix, int first, const char *start,
+		const char *end, int flags, int *nb)
+{
+	kvlib_item items[BATCH];
+	kvlib_scan *sc;
+	char key[64], val[VAL_LEN + 1];
+	int i, n, errors = 0, key_len;
+
+	*nb = 0;
+	sc = kvlib_scan_open(ctx, start, strlen(start), end,
+			     end ? strlen(end) : 0, flags);
+	if (!sc)
+		return 1;
+	while ((n = kvlib_scan_next(sc, items, BATCH)) > 0) {
+		for (i = 0; i < n; i++, (*nb)++) {
+			if (prefix)
+				key_len = key_of(key, prefix, first + *nb);
+			else
+				key_len = key_of(key, *nb < nb_keys ? "item" : "user",
+						 *nb % nb_keys);
+			if (items[i].key_len != key_len ||
+			    memcmp(items[i].key, key, key_len) != 0) {
+				if (errors++ < 5)
+					printf("scan %s: got %s want %s\n", start,
+					       items[i].key, key);
+				continue;
+			}
+			if (!(flags & KV_SCAN_VALUES))
+				continue;
+			val_of(val, key);
+			if (items[i].status != 0 || !items[i].val ||
+			    strcmp(items[i].val, val) != 0)
+				errors++;
+		}
+	}
+	if (n < 0) {
+		printf("kvlib_scan_next: %d\n", n);
+		errors++;
+	}
+	kvlib_scan_close(sc);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *prefixes[] = { "item", "user" };
+	char key[64], val[VAL_LEN + 1], buffer[KVLIB_VAL_MAX + 1];
+	int *order, i, j, t, nb, key_len, errors = 0;
+	struct timespec start, stop;
+	double scan_s, get_s;
+	kvlib_ctx *ctx;
+
+	if (argc >= 2)
+		nb_keys = atoi(argv[1]);
+	if (nb_keys < 200)
+		nb_keys = 200;
+
+	printf("============================\n");
+	printf("=== RANGE SCAN benchmark ===\n");
+	printf("============================\n");
+
+	ctx = kvlib_open();
+	order = malloc(2 * nb_keys * sizeof(int));
+	if (!ctx || !order) {
+		printf("kvlib_open failed\n");
+		return EXIT_FAILURE;
+	}
+	if (kvlib_format() != 0) {
+		printf("format failed\n");
+		return EXIT_FAILURE;
+	}
+
+	/* both prefixes, shuffled */
+	for (i = 0; i < 2 * nb_keys; i++)
+		order[i] = i;
+	srand(1);
+	for (i = 2 * nb_keys - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	for (i = 0; i < 2 * nb_keys; i++) {
+		key_len = key_of(key, prefixes[order[i] / nb_keys],
+				 order[i] % nb_keys);
+		val_of(val, key);
+		if (kvlib_ctx_set(ctx, key, key_len, val, VAL_LEN) != 0)
+			errors++;
+	}
+	if (kvlib_sync(ctx) != 0)
+		errors++;
+	printf("%d keys of %d bytes written in random order, batches of %d\n",
+	       2 * nb_keys, VAL_LEN, BATCH);
+
+	/* the whole store: "item..." then "user..." */
+	errors += scan(ctx, NULL, 0, "", NULL, 0, &nb);
+	printf("full scan, keys only: %d keys (want %d)\n", nb, 2 * nb_keys);
+	errors += nb != 2 * nb_keys;
+
+	/* a prefix */
+	errors += scan(ctx, "user", 0, "user", NULL, KV_SCAN_PREFIX, &nb);
+	printf("prefix \"user\": %d keys (want %d)\n", nb, nb_keys);
+	errors += nb != nb_keys;
+
+	/* a range with the values, against single gets of the same keys */
+	key_of(key, "user", 100);
+	key_of(buffer, "user", nb_keys - 100);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	errors += scan(ctx, "user", 100, key, buffer, KV_SCAN_VALUES, &nb);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	scan_s = elapsed_s(&start, &stop);
+	printf("range [%s, %s) with values: %d keys (want %d)\n", key, buffer,
+	       nb, nb_keys - 200);
+	errors += nb != nb_keys - 200;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 100; i < nb_keys - 100; i++) {
+		key_len = key_of(key, "user", i);
+		if (kvlib_ctx_get(ctx, key, key_len, buffer, sizeof(buffer)) != 0)
+			errors++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	get_s = elapsed_s(&start, &stop);
+
+	printf("mode           keys/sec\n");
+	printf("scan+values    %.0f\n", nb / scan_s);
+	printf("single gets    %.0f\n", nb / get_s);
+	printf("errors: %d (should be 0)\n", errors);
+
+	free(order);
+	kvlib_close(ctx);
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
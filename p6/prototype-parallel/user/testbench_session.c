@@ -0,0 +1,95 @@
+/**
+ * Benchmark comparing the one-shot library calls (open/close of the virtual
+ * device for every operation) with a kvlib_open() session
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/* Library header */
+#include "kvlib.h"
+#include "bench.h"
+
+#define NB_OPS 10000
+#define NB_KEYS 64
+
+int main(int argc, char *argv[])
+{
+	int i, ret, len;
+	int nb_ops = NB_OPS;
+	char key[128], val[128], buffer[KVLIB_VAL_MAX + 1];
+	struct timespec start, stop;
+	double t_set_old, t_get_old, t_set_new, t_get_new;
+	kvlib_ctx *ctx;
+
+	if (argc == 2)
+		nb_ops = atoi(argv[1]);
+
+	printf("========================\n");
+	printf("=== SESSION benchmark ===\n");
+	printf("========================\n");
+
+	/* one-shot calls */
+	ret = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_ops; i++) {
+		sprintf(key, "sess%d", i % NB_KEYS);
+		sprintf(val, "val%d", i);
+		ret += kvlib_set(key, val);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	t_set_old = elapsed_s(&start, &stop);
+	printf("kvlib_set x%d returns: %d (should be 0)\n", nb_ops, ret);
+
+	ret = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_ops; i++) {
+		sprintf(key, "sess%d", i % NB_KEYS);
+		ret += kvlib_get(key, buffer);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	t_get_old = elapsed_s(&start, &stop);
+	printf("kvlib_get x%d returns: %d (should be 0)\n", nb_ops, ret);
+
+	/* session calls */
+	ctx = kvlib_open();
+	if (!ctx) {
+		printf("kvlib_open failed\n");
+		return EXIT_FAILURE;
+	}
+
+	ret = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_ops; i++) {
+		int val_len;
+
+		len = sprintf(key, "sess%d", i % NB_KEYS);
+		val_len = sprintf(val, "val%d", i);
+		ret += kvlib_ctx_set(ctx, key, len, val, val_len);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	t_set_new = elapsed_s(&start, &stop);
+	printf("kvlib_ctx_set x%d returns: %d (should be 0)\n", nb_ops, ret);
+
+	ret = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_ops; i++) {
+		len = sprintf(key, "sess%d", i % NB_KEYS);
+		ret += kvlib_ctx_get(ctx, key, len, buffer, sizeof(buffer));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	t_get_new = elapsed_s(&start, &stop);
+	printf("kvlib_ctx_get x%d returns: %d (should be 0)\n", nb_ops, ret);
+
+	kvlib_close(ctx);
+
+	printf("\n%-10s %15s %15s %8s\n", "op", "one-shot op/s", "session op/s",
+	       "speedup");
+	printf("%-10s %15.0f %15.0f %7.2fx\n", "set", nb_ops / t_set_old,
+	       nb_ops / t_set_new, t_set_old / t_set_new);
+	printf("%-10s %15.0f %15.0f %7.2fx\n", "get", nb_ops / t_get_old,
+	       nb_ops / t_get_new, t_get_old / t_get_new);
+
+	return EXIT_SUCCESS;
+}
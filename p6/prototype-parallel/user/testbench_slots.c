@@ -0,0 +1,113 @@
+/**
+ * Data page format benchmark, in user space: sets of couples of several
+ * value sizes are laid out in flash pages with the old format (one couple
+ * per page, programmed by every set) and with slotted pages (couples packed
+ * in an open page kept in RAM, programmed once full). Reports the couples
+ * per page, the capacity gain and the sets per second, with a modelled
+ * page program time on top of the measured CPU time. The page code is the
+ * kernel's, see kernel/slotpage.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../kernel/slotpage.h"
+#include "bench.h"
+
+#define PAGE_SIZE 2048
+#define NB_SETS 100000
+#define PROG_US 200	/* typical SLC NAND page program time */
+
+static char *flash;	/* the pages programmed, reused circularly */
+static int flash_pages;
+
+static void program(long pg, const char *page)
+{
+	memcpy(flash + (pg % flash_pages) * PAGE_SIZE, page, PAGE_SIZE);
+}
+
+/* nb_sets couples of val_len bytes values, returns the pages programmed */
+static long run(int slotted, int nb_sets, int val_len, double *ns)
+{
+	char page[PAGE_SIZE], key[32], *val = malloc(val_len + 1);
+	struct timespec start, stop;
+	long pages = 0;
+	int i, key_len;
+
+	if (!val)
+		return -1;
+	memset(val, 'v', val_len);
+	slot_page_init(page, PAGE_SIZE);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_sets; i++) {
+		key_len = sprintf(key, "key%d", i);
+		if (!slotted) {
+			/* old format: key, NUL, value in a page of its own */
+			memset(page, 0xFF, PAGE_SIZE);
+			memcpy(page, key, key_len + 1);
+			memcpy(page + key_len + 1, val, val_len);
+			program(pages++, page);
+			continue;
+		}
+		if (slot_page_add(page, key, key_len, val, val_len) < 0) {
+			program(pages++, page);
+			slot_page_init(page, PAGE_SIZE);
+			slot_page_add(page, key, key_len, val, val_len);
+		}
+	}
+	if (slotted && ((struct slot_page *)page)->nb_slots)
+		program(pages++, page);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	*ns = elapsed_ns(&start, &stop);
+	free(val);
+	return pages;
+}
+
+int main(int argc, char *argv[])
+{
+	int sizes[] = { 8, 20, 100, 500, 1500 };
+	int i, nb = sizeof(sizes) / sizeof(sizes[0]);
+	int nb_sets = NB_SETS, prog_us = PROG_US;
+	long old_pgs, new_pgs;
+	double old_ns, new_ns, old_sps, new_sps;
+
+	if (argc >= 2)
+		nb_sets = atoi(argv[1]);
+	if (argc >= 3)
+		prog_us = atoi(argv[2]);
+	if (nb_sets < 1)
+		nb_sets = 1;
+	if (prog_us < 0)
+		prog_us = 0;
+
+	flash_pages = 1024;
+	flash = malloc((size_t)flash_pages * PAGE_SIZE);
+	if (!flash)
+		return EXIT_FAILURE;
+
+	printf("=============================\n");
+	printf("=== PAGE FORMAT benchmark ===\n");
+	printf("=============================\n");
+	printf("%d sets per run, %d bytes pages, %d us per page program\n",
+	       nb_sets, PAGE_SIZE, prog_us);
+	printf("value   couples/page     capacity   sets/sec (CPU + modelled program)\n");
+	printf("bytes   old    slotted   gain       old          slotted\n");
+
+	for (i = 0; i < nb; i++) {
+		old_pgs = run(0, nb_sets, sizes[i], &old_ns);
+		new_pgs = run(1, nb_sets, sizes[i], &new_ns);
+		if (old_pgs <= 0 || new_pgs <= 0)
+			return EXIT_FAILURE;
+		old_sps = nb_sets / ((old_ns + old_pgs * prog_us * 1000.0) / 1.0e9);
+		new_sps = nb_sets / ((new_ns + new_pgs * prog_us * 1000.0) / 1.0e9);
+		printf("%-7d %-6.2f %-9.2f x%-9.1f %-12.0f %.0f\n", sizes[i],
+		       (double)nb_sets / old_pgs, (double)nb_sets / new_pgs,
+		       (double)old_pgs / new_pgs, old_sps, new_sps);
+	}
+
+	free(flash);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,88 @@
+/**
+ * Buffered vs sync sessions: the testbench_wear workload (19 keys
+ * rewritten over and over) is run in a buffered session, where overwrites
+ * of a key still in the open data page are coalesced in RAM and only reach
+ * flash with the page, and in a KV_OPT_SYNC session, where every set is on
+ * flash when it returns. Reports the sets/sec and the data pages programmed
+ * per set, and checks that gets read the buffered writes back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/* Library header */
+#include "kvlib.h"
+#include "bench.h"
+
+#define ITER 1000
+#define NB_KEYS 19
+
+static int run(kvlib_ctx *ctx, int iter, int flags, const char *label)
+{
+	int i, j, len, val_len, errors = 0;
+	char key[64], val[64], buffer[KVLIB_VAL_MAX + 1];
+	struct timespec start, stop;
+	kv_core_stats before, after;
+	double s;
+
+	if (kvlib_format() != 0 || kvlib_setopt(ctx, flags) != 0)
+		return 1;
+	kvlib_core_stats(ctx, &before);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (j = 0; j < iter; j++) {
+		for (i = 1; i <= NB_KEYS; i++) {
+			len = sprintf(key, "key%d", i);
+			val_len = sprintf(val, "val%d_%d", i, j);
+			if (kvlib_ctx_set(ctx, key, len, val, val_len) != 0)
+				errors++;
+		}
+		/* read your own writes, buffered or not */
+		len = sprintf(key, "key%d", j % NB_KEYS + 1);
+		sprintf(val, "val%d_%d", j % NB_KEYS + 1, j);
+		if (kvlib_ctx_get(ctx, key, len, buffer, sizeof(buffer)) != 0 ||
+		    strcmp(buffer, val))
+			errors++;
+	}
+	if (kvlib_sync(ctx) != 0)
+		errors++;
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	kvlib_core_stats(ctx, &after);
+
+	s = elapsed_s(&start, &stop);
+	printf("%s\n", label);
+	printf("  %.0f sets/sec, %llu data pages programmed (%.4f per set),"
+	       " %llu overwrites coalesced, %d errors (should be 0)\n",
+	       iter * NB_KEYS / s, after.nb_data_pgs - before.nb_data_pgs,
+	       (double)(after.nb_data_pgs - before.nb_data_pgs) / (iter * NB_KEYS),
+	       after.nb_coalesced - before.nb_coalesced, errors);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = 0, iter = ITER;
+	kvlib_ctx *ctx;
+
+	if (argc >= 2)
+		iter = atoi(argv[1]);
+	if (iter < 1)
+		iter = 1;
+
+	printf("==================================\n");
+	printf("=== BUFFERED vs SYNC benchmark ===\n");
+	printf("==================================\n");
+
+	ctx = kvlib_open();
+	if (!ctx) {
+		printf("kvlib_open failed\n");
+		return EXIT_FAILURE;
+	}
+
+	ret += run(ctx, iter, 0, "buffered session:");
+	ret += run(ctx, iter, KV_OPT_SYNC, "sync session (KV_OPT_SYNC):");
+
+	kvlib_close(ctx);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
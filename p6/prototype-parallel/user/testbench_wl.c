@@ -0,0 +1,147 @@
+/**
+ * Static wear leveling: a store of cold keys written once, then a few hot
+ * keys overwritten again and again (synchronous sets, every one costs a
+ * flash page). Without static wear leveling the blocks of the cold keys
+ * are never erased while the others wear out. Reports, every round of
+ * sets, the erase counts of the data blocks (least and most worn) and the
+ * cold blocks the wear leveler moved, then checks every value. The erase
+ * counts must also survive the format at the start. Needs root to change
+ * /sys/module/prototype/parameters/WEAR_DELTA and WEAR_INTERVAL_MS.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/* Library header */
+#include "kvlib.h"
+#include "bench.h"
+
+#define NB_SETS 100000
+#define NB_ROUNDS 10
+#define NB_COLD 2000
+#define NB_HOT 8
+#define VAL_LEN 200
+#define WEAR_DELTA 16		/* erase count spread for the test */
+#define WEAR_INTERVAL_MS 100
+#define PARAM_DIR "/sys/module/prototype/parameters/"
+
+/* module parameter name, returns -1 if it cannot be set */
+static int set_param(const char *name, int v)
+{
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), PARAM_DIR "%s", name);
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	fprintf(f, "%d\n", v);
+	return fclose(f) ? -1 : 0;
+}
+
+static int val_of(char *val, int i, int ver)
+{
+	int n = sprintf(val, "val%d_%d_", i, ver);
+
+	memset(val + n, 'a' + i % 26, VAL_LEN - n);
+	val[VAL_LEN] = '\0';
+	return VAL_LEN;
+}
+
+/* value of key i, version ver, read back */
+static int check(kvlib_ctx *ctx, int i, int ver)
+{
+	char key[64], val[VAL_LEN + 1], buffer[KVLIB_VAL_MAX + 1];
+	int key_len = sprintf(key, "key%d", i);
+
+	val_of(val, i, ver);
+	return kvlib_ctx_get(ctx, key, key_len, buffer, sizeof(buffer)) != 0 ||
+	       strcmp(buffer, val) != 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, k, r, key_len, errors = 0, nb_sets = NB_SETS;
+	static int ver[NB_HOT];
+	char key[64], val[VAL_LEN + 1];
+	struct timespec start, stop;
+	kv_core_stats before, st;
+	kvlib_ctx *ctx;
+
+	if (argc >= 2)
+		nb_sets = atoi(argv[1]);
+	if (nb_sets < NB_ROUNDS)
+		nb_sets = NB_ROUNDS;
+
+	printf("=================================\n");
+	printf("=== STATIC WEAR LEVELING test ===\n");
+	printf("=================================\n");
+
+	ctx = kvlib_open();
+	if (!ctx) {
+		printf("kvlib_open failed\n");
+		return EXIT_FAILURE;
+	}
+	if (set_param("WEAR_DELTA", WEAR_DELTA) != 0 ||
+	    set_param("WEAR_INTERVAL_MS", WEAR_INTERVAL_MS) != 0)
+		printf("cannot set the wear leveling parameters, running with"
+		       " those of the module\n");
+
+	/* 1. the erase counts survive the format */
+	kvlib_core_stats(ctx, &before);
+	if (kvlib_format() != 0) {
+		printf("kvlib_format failed\n");
+		return EXIT_FAILURE;
+	}
+	kvlib_core_stats(ctx, &st);
+	printf("erase counts before format %d..%d, after %d..%d"
+	       " (should not be lower)\n", before.min_worn, before.max_worn,
+	       st.min_worn, st.max_worn);
+	if (st.min_worn < before.min_worn)
+		errors++;
+
+	/* 2. cold keys, then hot ones rewritten in rounds */
+	for (i = NB_HOT; i < NB_HOT + NB_COLD; i++) {
+		key_len = sprintf(key, "key%d", i);
+		val_of(val, i, 0);
+		if (kvlib_ctx_set(ctx, key, key_len, val, VAL_LEN) != 0)
+			errors++;
+	}
+	if (kvlib_sync(ctx) != 0 || kvlib_setopt(ctx, KV_OPT_SYNC) != 0)
+		errors++;
+
+	printf("%d cold keys, %d hot keys, %d sets of %d bytes\n", NB_COLD,
+	       NB_HOT, nb_sets, VAL_LEN);
+	printf("round  sets/sec   min worn max worn cold blocks moved\n");
+	kvlib_core_stats(ctx, &before);
+	for (r = 0; r < NB_ROUNDS; r++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < nb_sets / NB_ROUNDS; i++) {
+			k = i % NB_HOT;
+			key_len = sprintf(key, "key%d", k);
+			val_of(val, k, ver[k] + 1);
+			if (kvlib_ctx_set(ctx, key, key_len, val, VAL_LEN) != 0)
+				errors++;
+			else
+				ver[k]++;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		kvlib_core_stats(ctx, &st);
+		printf("%-6d %-10.0f %-8d %-8d %llu\n", r,
+		       nb_sets / NB_ROUNDS / elapsed_s(&start, &stop),
+		       st.min_worn, st.max_worn, st.nb_wl - before.nb_wl);
+	}
+
+	/* 3. every value read back */
+	for (i = 0; i < NB_HOT + NB_COLD; i++)
+		errors += check(ctx, i, i < NB_HOT ? ver[i] : 0);
+	printf("errors: %d (should be 0)\n", errors);
+
+	/* back to the defaults */
+	set_param("WEAR_DELTA", 64);
+	set_param("WEAR_INTERVAL_MS", 1000);
+
+	kvlib_close(ctx);
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
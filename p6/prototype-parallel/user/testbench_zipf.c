@@ -0,0 +1,168 @@
+/**
+ * Write amplification of GC under skewed updates: a store of many keys is
+ * loaded, then the keys are overwritten with a zipfian popularity (a few
+ * keys take most of the sets), with the couples GC moves mixed with user
+ * writes (GC_STREAMS=0) and with them in relocation streams of their own
+ * (GC_STREAMS=1). Reports the data pages written by the sets and by GC,
+ * the couples GC moved and the write amplification from the core
+ * statistics, and checks every value at the end. Needs root to change
+ * /sys/module/prototype/parameters/GC_STREAMS.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+/* Library header */
+#include "kvlib.h"
+#include "bench.h"
+
+#define NB_SETS 200000
+#define NB_KEYS 4000
+#define THETA 0.99	/* zipfian skew, 0: uniform */
+#define VAL_LEN 200
+#define GC_PARAM "/sys/module/prototype/parameters/GC_STREAMS"
+
+/* GC_STREAMS module parameter, returns -1 if it cannot be set */
+static int set_streams(int on)
+{
+	FILE *f = fopen(GC_PARAM, "w");
+
+	if (!f)
+		return -1;
+	fprintf(f, "%d\n", on);
+	return fclose(f) ? -1 : 0;
+}
+
+static int val_of(char *val, int i, int ver)
+{
+	int n = sprintf(val, "val%d_%d_", i, ver);
+
+	memset(val + n, 'a' + i % 26, VAL_LEN - n);
+	val[VAL_LEN] = '\0';
+	return VAL_LEN;
+}
+
+/* cdf[i]: probability of the keys of rank 0 to i */
+static void zipf_init(double *cdf, int n, double theta)
+{
+	double sum = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		sum += 1.0 / pow(i + 1, theta);
+	cdf[0] = 1.0 / sum;
+	for (i = 1; i < n; i++)
+		cdf[i] = cdf[i - 1] + 1.0 / pow(i + 1, theta) / sum;
+}
+
+static int zipf_next(const double *cdf, int n)
+{
+	double u = (double)rand() / RAND_MAX;
+	int lo = 0, hi = n - 1;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int run(kvlib_ctx *ctx, int streams, int nb_sets, const double *cdf,
+	       int *ver)
+{
+	int i, k, key_len, errors = 0;
+	char key[64], val[VAL_LEN + 1], buffer[KVLIB_VAL_MAX + 1];
+	struct timespec start, stop;
+	kv_core_stats before, after;
+	unsigned long long pgs, gc_pgs;
+
+	if (set_streams(streams) != 0) {
+		printf("%-8d cannot set %s\n", streams, GC_PARAM);
+		return 0;
+	}
+	if (kvlib_format() != 0)
+		return 1;
+	for (i = 0; i < NB_KEYS; i++) {
+		key_len = sprintf(key, "key%d", i);
+		ver[i] = 0;
+		val_of(val, i, 0);
+		if (kvlib_ctx_set(ctx, key, key_len, val, VAL_LEN) != 0)
+			errors++;
+	}
+	if (kvlib_sync(ctx) != 0)
+		errors++;
+
+	srand(1);
+	kvlib_core_stats(ctx, &before);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nb_sets; i++) {
+		k = zipf_next(cdf, NB_KEYS);
+		key_len = sprintf(key, "key%d", k);
+		val_of(val, k, ver[k] + 1);
+		if (kvlib_ctx_set(ctx, key, key_len, val, VAL_LEN) != 0)
+			errors++;
+		else
+			ver[k]++;
+	}
+	if (kvlib_sync(ctx) != 0)
+		errors++;
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	kvlib_core_stats(ctx, &after);
+
+	for (i = 0; i < NB_KEYS; i++) {
+		key_len = sprintf(key, "key%d", i);
+		val_of(val, i, ver[i]);
+		if (kvlib_ctx_get(ctx, key, key_len, buffer, sizeof(buffer)) != 0 ||
+		    strcmp(buffer, val) != 0)
+			errors++;
+	}
+
+	pgs = after.nb_data_pgs - before.nb_data_pgs;
+	gc_pgs = after.nb_gc_pgs - before.nb_gc_pgs;
+	printf("%-8d %-10llu %-10llu %-10llu %-6.2f %-10.0f %d\n", streams,
+	       pgs - gc_pgs, gc_pgs, after.nb_gc_recs - before.nb_gc_recs,
+	       pgs > gc_pgs ? (double)pgs / (pgs - gc_pgs) : 0.0,
+	       nb_sets / elapsed_s(&start, &stop), errors);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, ret = 0, nb_sets = NB_SETS;
+	static double cdf[NB_KEYS];
+	static int ver[NB_KEYS];
+	kvlib_ctx *ctx;
+
+	if (argc >= 2)
+		nb_sets = atoi(argv[1]);
+	if (nb_sets < 1)
+		nb_sets = 1;
+
+	printf("============================\n");
+	printf("=== ZIPFIAN GC benchmark ===\n");
+	printf("============================\n");
+
+	ctx = kvlib_open();
+	if (!ctx) {
+		printf("kvlib_open failed\n");
+		return EXIT_FAILURE;
+	}
+
+	zipf_init(cdf, NB_KEYS, THETA);
+	printf("%d keys of %d bytes, %d sets, zipfian %.2f\n", NB_KEYS,
+	       VAL_LEN, nb_sets, THETA);
+	printf("streams  user pgs   GC pgs     GC moved   WA     sets/sec   errors (should be 0)\n");
+	for (i = 0; i <= 1; i++)
+		ret += run(ctx, i, nb_sets, cdf, ver);
+	/* back to the default */
+	set_streams(1);
+
+	kvlib_close(ctx);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}